@@ -0,0 +1,161 @@
+#pragma once
+
+/*
+ * Shared declarations of the llvmlite ffi benchmarks.
+ *
+ * The benchmarks drive the exported LLVMPY_* functions of the shared library,
+ * as the Python binding does, so that they measure what a release actually
+ * ships.  The workloads are generated deterministically from their
+ * parameters, which makes the numbers of two builds comparable.
+ */
+
+#include "llvm-c/Core.h"
+#include "llvm-c/ExecutionEngine.h"
+#include "llvm-c/Target.h"
+#include "llvm-c/TargetMachine.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct LLVMPYNewPassManager;
+typedef LLVMPYNewPassManager *LLVMPYNewPassManagerRef;
+typedef void *LLVMPYRefPruneStatsRef;
+typedef void *LLVMPYMemoryPoolRef;
+typedef void *LLVMPYObjectCacheRef;
+typedef void *LLVMPYDiskObjectCacheRef;
+
+typedef void (*ObjectCacheReleaseFunc)(void *);
+
+// As in executionengine.cpp
+typedef struct {
+    LLVMModuleRef modref;
+    const char *buf_ptr;
+    size_t buf_len;
+    ObjectCacheReleaseFunc buf_release;
+    void *buf_owner;
+} ObjectCacheData;
+
+typedef void (*ObjectCacheNotifyFunc)(void *, const ObjectCacheData *);
+typedef void (*ObjectCacheGetObjectFunc)(void *, ObjectCacheData *);
+
+extern "C" {
+
+void LLVMPY_InitializeCore();
+void LLVMPY_InitializeNativeTarget();
+void LLVMPY_InitializeNativeAsmPrinter();
+void LLVMPY_InitializeNativeAsmParser();
+
+void LLVMPY_DisposeString(const char *msg);
+LLVMContextRef LLVMPY_ContextCreate();
+void LLVMPY_ContextDispose(LLVMContextRef context);
+
+LLVMModuleRef LLVMPY_ParseAssembly(LLVMContextRef context, const char *ir,
+                                   const char **outmsg);
+LLVMModuleRef LLVMPY_ParseBitcode(LLVMContextRef context, const char *bitcode,
+                                  size_t bitcodelen, char **outmsg);
+void LLVMPY_WriteBitcodeToString(LLVMModuleRef M, const char **outbuf,
+                                 size_t *outlen);
+LLVMModuleRef LLVMPY_CloneModule(LLVMModuleRef M);
+void LLVMPY_DisposeModule(LLVMModuleRef m);
+
+LLVMPassManagerRef LLVMPY_CreatePassManager();
+void LLVMPY_DisposePassManager(LLVMPassManagerRef PM);
+int LLVMPY_RunPassManager(LLVMPassManagerRef PM, LLVMModuleRef M);
+void LLVMPY_AddRefPrunePass(LLVMPassManagerRef PM, int subpasses,
+                            size_t subgraph_limit,
+                            LLVMPYRefPruneStatsRef Stats);
+
+LLVMPYNewPassManagerRef
+LLVMPY_CreateNewPassManager(LLVMTargetMachineRef TM, int FunctionLevel,
+                            LLVMPYRefPruneStatsRef Stats, int VecLib);
+void LLVMPY_DisposeNewPassManager(LLVMPYNewPassManagerRef PM);
+void LLVMPY_NewPassManagerAddDefaultPipeline(LLVMPYNewPassManagerRef PM,
+                                             int OptLevel, int SizeLevel);
+int LLVMPY_RunNewPassManager(LLVMPYNewPassManagerRef PM, LLVMModuleRef M);
+
+void LLVMPY_GetDefaultTargetTriple(const char **Out);
+LLVMTargetRef LLVMPY_GetTargetFromTriple(const char *Triple,
+                                         const char **ErrOut);
+LLVMTargetMachineRef
+LLVMPY_CreateTargetMachine(LLVMTargetRef T, const char *Triple, const char *CPU,
+                           const char *Features, int OptLevel,
+                           const char *RelocModel, const char *CodeModel,
+                           int PrintMC, int JIT, const char *ABIName);
+void LLVMPY_DisposeTargetMachine(LLVMTargetMachineRef TM);
+LLVMMemoryBufferRef LLVMPY_TargetMachineEmitToMemory(LLVMTargetMachineRef TM,
+                                                     LLVMModuleRef M,
+                                                     int use_object,
+                                                     const char **ErrOut);
+size_t LLVMPY_GetBufferSize(LLVMMemoryBufferRef MB);
+void LLVMPY_DisposeMemoryBuffer(LLVMMemoryBufferRef MB);
+
+LLVMExecutionEngineRef LLVMPY_CreateMCJITCompiler(LLVMModuleRef M,
+                                                  LLVMTargetMachineRef TM,
+                                                  LLVMPYMemoryPoolRef Pool,
+                                                  const char **OutError);
+void LLVMPY_DisposeExecutionEngine(LLVMExecutionEngineRef EE);
+void LLVMPY_FinalizeObject(LLVMExecutionEngineRef EE);
+uint64_t LLVMPY_GetFunctionAddress(LLVMExecutionEngineRef EE,
+                                   const char *Name);
+
+LLVMPYObjectCacheRef
+LLVMPY_CreateObjectCache(ObjectCacheNotifyFunc notify_func,
+                         ObjectCacheGetObjectFunc getobject_func,
+                         void *user_data);
+void LLVMPY_DisposeObjectCache(LLVMPYObjectCacheRef C);
+void LLVMPY_SetObjectCache(LLVMExecutionEngineRef EE, LLVMPYObjectCacheRef C);
+LLVMPYDiskObjectCacheRef LLVMPY_CreateDiskObjectCache(LLVMExecutionEngineRef EE,
+                                                      const char *Dir,
+                                                      uint64_t MaxSize,
+                                                      const char **OutError);
+void LLVMPY_DisposeDiskObjectCache(LLVMPYDiskObjectCacheRef C);
+void LLVMPY_GetDiskObjectCacheStats(LLVMPYDiskObjectCacheRef C, uint64_t *Hits,
+                                    uint64_t *Misses);
+
+} // end extern "C"
+
+namespace bench {
+
+/*
+ * Return the IR of a module of *NumFunctions* functions, each with a loop
+ * over a chain of *NumBranches* conditional blocks, which gives the
+ * optimizer and the code generator something to chew on.  Function "f<i>"
+ * takes and returns an i64.
+ */
+std::string arithmeticModule(int NumFunctions, int NumBranches = 4);
+
+/*
+ * Return the IR of a module with a single function "refops" whose CFG is a
+ * chain of *NumDiamonds* diamonds.  Each takes a reference before branching
+ * and releases it either in both branches (a fanout) or after they join (a
+ * diamond), next to a basic-block-local incref/decref pair: the patterns the
+ * RefPrunePass subpasses look for.
+ */
+std::string refopModule(int NumDiamonds);
+
+/* Parse *IR* into *Context*, aborting the benchmark run on error. */
+LLVMModuleRef parse(LLVMContextRef Context, const std::string &IR);
+
+/* Return the bitcode of *M*. */
+std::string bitcode(LLVMModuleRef M);
+
+/*
+ * Create a target machine for the host, as for MCJIT if *JIT* is true, with
+ * codegen optimization level *OptLevel*.
+ */
+LLVMTargetMachineRef hostTargetMachine(int OptLevel = 2, bool JIT = true);
+
+/* Set the "peak_rss" counter of *State* to the peak memory of the process. */
+void reportPeakMemory(benchmark::State &State);
+
+/*
+ * Abort the run, reporting that *What* failed with *Message*, which is freed
+ * if *Dispose* is true.
+ */
+[[noreturn]] void fail(const char *What, const char *Message,
+                       bool Dispose = true);
+
+} // namespace bench
@@ -0,0 +1,39 @@
+#include "bench.h"
+
+/*
+ * Cost of emitting an object file for a module of range(0) functions with a
+ * target machine at codegen level range(1).  Code generation modifies the
+ * module, so each iteration emits a fresh copy, made with the timer paused.
+ */
+
+static void BM_EmitObject(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(0)));
+    LLVMTargetMachineRef tm = bench::hostTargetMachine(state.range(1), false);
+    size_t size = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        LLVMModuleRef copy = LLVMPY_CloneModule(mod);
+        state.ResumeTiming();
+        const char *err = nullptr;
+        LLVMMemoryBufferRef obj =
+            LLVMPY_TargetMachineEmitToMemory(tm, copy, 1, &err);
+        if (!obj)
+            bench::fail("emitting an object", err);
+        size = LLVMPY_GetBufferSize(obj);
+        LLVMPY_DisposeMemoryBuffer(obj);
+        state.PauseTiming();
+        LLVMPY_DisposeModule(copy);
+        state.ResumeTiming();
+    }
+    LLVMPY_DisposeTargetMachine(tm);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    state.counters["object_size"] = double(size);
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_EmitObject)
+    ->ArgsProduct({{10, 100, 1000}, {0, 2, 3}})
+    ->ArgNames({"functions", "O"})
+    ->Unit(benchmark::kMillisecond);
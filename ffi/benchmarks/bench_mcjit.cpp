@@ -0,0 +1,184 @@
+#include "bench.h"
+
+#include <filesystem>
+#include <vector>
+
+/*
+ * Latency of MCJIT over modules of range(0) functions: creating an engine
+ * and finalizing it, looking up symbols, and the same with the object
+ * coming from an in-memory or on-disk object cache.  A fresh module and
+ * target machine, which the engine takes over, are made for each iteration
+ * with the timer paused, and the engine is destroyed with it paused.
+ */
+
+namespace {
+
+/*
+ * Create a MCJIT engine compiling a copy of *Mod*.  Unless *Setup*, the
+ * benchmark is running and the copy is made with its timer paused.
+ */
+LLVMExecutionEngineRef createEngine(benchmark::State &state, LLVMModuleRef Mod,
+                                    bool Setup = false) {
+    if (!Setup)
+        state.PauseTiming();
+    LLVMModuleRef copy = LLVMPY_CloneModule(Mod);
+    LLVMTargetMachineRef tm = bench::hostTargetMachine();
+    if (!Setup)
+        state.ResumeTiming();
+    const char *err = nullptr;
+    LLVMExecutionEngineRef ee =
+        LLVMPY_CreateMCJITCompiler(copy, tm, nullptr, &err);
+    if (!ee)
+        bench::fail("creating a MCJIT engine", err);
+    return ee;
+}
+
+void disposeEngine(benchmark::State &state, LLVMExecutionEngineRef EE,
+                   bool Setup = false) {
+    if (!Setup)
+        state.PauseTiming();
+    LLVMPY_DisposeExecutionEngine(EE);
+    if (!Setup)
+        state.ResumeTiming();
+}
+
+void lookup(LLVMExecutionEngineRef EE, const char *Name) {
+    uint64_t addr = LLVMPY_GetFunctionAddress(EE, Name);
+    if (!addr)
+        bench::fail("looking up", Name, false);
+    benchmark::DoNotOptimize(addr);
+}
+
+/* An object cache keeping the single object it is notified of. */
+struct SingleObjectCache {
+    std::string object;
+
+    static void notify(void *Self, const ObjectCacheData *Data) {
+        static_cast<SingleObjectCache *>(Self)->object.assign(Data->buf_ptr,
+                                                              Data->buf_len);
+    }
+
+    static void getObject(void *Self, ObjectCacheData *Data) {
+        auto cache = static_cast<SingleObjectCache *>(Self);
+        if (cache->object.empty())
+            return;
+        // Lend the object rather than copying it, as the Python binding does
+        Data->buf_ptr = cache->object.data();
+        Data->buf_len = cache->object.size();
+        Data->buf_release = [](void *) {};
+        Data->buf_owner = cache;
+    }
+};
+
+} // end anonymous namespace
+
+static void BM_MCJITFinalize(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(0)));
+    for (auto _ : state) {
+        LLVMExecutionEngineRef ee = createEngine(state, mod);
+        LLVMPY_FinalizeObject(ee);
+        lookup(ee, "f0");
+        disposeEngine(state, ee);
+    }
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_MCJITFinalize)
+    ->RangeMultiplier(10)
+    ->Range(1, 1000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_MCJITLookup(benchmark::State &state) {
+    int count = state.range(0);
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod = bench::parse(context, bench::arithmeticModule(count));
+    LLVMExecutionEngineRef ee = createEngine(state, mod, true);
+    LLVMPY_FinalizeObject(ee);
+    std::vector<std::string> names;
+    for (int i = 0; i < count; ++i)
+        names.push_back("f" + std::to_string(i));
+    size_t i = 0;
+    for (auto _ : state) {
+        lookup(ee, names[i].c_str());
+        i = (i + 1) % names.size();
+    }
+    LLVMPY_DisposeExecutionEngine(ee);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    state.SetItemsProcessed(state.iterations());
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_MCJITLookup)->RangeMultiplier(10)->Range(1, 1000);
+
+static void BM_ObjectCacheHit(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(0)));
+    SingleObjectCache objects;
+    LLVMPYObjectCacheRef cache =
+        LLVMPY_CreateObjectCache(&SingleObjectCache::notify,
+                                 &SingleObjectCache::getObject, &objects);
+    auto run = [&](bool Setup) {
+        LLVMExecutionEngineRef ee = createEngine(state, mod, Setup);
+        LLVMPY_SetObjectCache(ee, cache);
+        LLVMPY_FinalizeObject(ee);
+        lookup(ee, "f0");
+        disposeEngine(state, ee, Setup);
+    };
+    // Fill the cache
+    run(true);
+    for (auto _ : state)
+        run(false);
+    LLVMPY_DisposeObjectCache(cache);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_ObjectCacheHit)
+    ->RangeMultiplier(10)
+    ->Range(1, 1000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_DiskObjectCacheHit(benchmark::State &state) {
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() /
+                   ("llvmlite-bench-" + std::to_string(state.range(0)));
+    fs::remove_all(dir);
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(0)));
+    uint64_t hits = 0, misses = 0;
+    auto run = [&](bool Setup) {
+        LLVMExecutionEngineRef ee = createEngine(state, mod, Setup);
+        const char *err = nullptr;
+        LLVMPYDiskObjectCacheRef cache =
+            LLVMPY_CreateDiskObjectCache(ee, dir.string().c_str(), 0, &err);
+        if (!cache)
+            bench::fail("creating a disk object cache", err);
+        LLVMPY_FinalizeObject(ee);
+        lookup(ee, "f0");
+        uint64_t h, m;
+        LLVMPY_GetDiskObjectCacheStats(cache, &h, &m);
+        hits += h;
+        misses += m;
+        disposeEngine(state, ee, Setup);
+        LLVMPY_DisposeDiskObjectCache(cache);
+    };
+    // Fill the cache
+    run(true);
+    for (auto _ : state)
+        run(false);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    fs::remove_all(dir);
+    state.counters["hits"] = double(hits);
+    state.counters["misses"] = double(misses);
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_DiskObjectCacheHit)
+    ->RangeMultiplier(10)
+    ->Range(1, 1000)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,36 @@
+#include "bench.h"
+
+/*
+ * Parsing throughput of textual IR and bitcode, over modules of
+ * range(0) functions.
+ */
+
+static void BM_ParseAssembly(benchmark::State &state) {
+    std::string ir = bench::arithmeticModule(state.range(0));
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    for (auto _ : state)
+        LLVMPY_DisposeModule(bench::parse(context, ir));
+    LLVMPY_ContextDispose(context);
+    state.SetBytesProcessed(int64_t(state.iterations()) * ir.size());
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_ParseAssembly)->RangeMultiplier(10)->Range(1, 1000);
+
+static void BM_ParseBitcode(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(0)));
+    std::string bc = bench::bitcode(mod);
+    LLVMPY_DisposeModule(mod);
+    for (auto _ : state) {
+        char *err = nullptr;
+        mod = LLVMPY_ParseBitcode(context, bc.data(), bc.size(), &err);
+        if (!mod)
+            bench::fail("parsing bitcode", err);
+        LLVMPY_DisposeModule(mod);
+    }
+    LLVMPY_ContextDispose(context);
+    state.SetBytesProcessed(int64_t(state.iterations()) * bc.size());
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_ParseBitcode)->RangeMultiplier(10)->Range(1, 1000);
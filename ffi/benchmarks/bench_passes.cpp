@@ -0,0 +1,80 @@
+#include "bench.h"
+
+/*
+ * Cost of the RefPrunePass, on refop-dense CFGs of range(0) diamonds with
+ * the subpasses range(1), and of the default pipelines at -O<range(0)> over
+ * modules of range(1) functions.  Each iteration runs on a fresh copy of
+ * the module, which is made with the timer paused.
+ */
+
+// As RefPrunePass::Subpasses in custom_passes.cpp
+enum {
+    RefPrunePerBasicBlock = 0b0001,
+    RefPruneDiamond = 0b0010,
+    RefPruneFanout = 0b0100,
+    RefPruneFanoutRaise = 0b1000,
+    RefPruneAll = 0b1111,
+    RefPruneWorklist = 0b10000
+};
+
+static void BM_RefPrune(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::refopModule(state.range(0)));
+    LLVMPassManagerRef pm = LLVMPY_CreatePassManager();
+    LLVMPY_AddRefPrunePass(pm, state.range(1), size_t(-1), nullptr);
+    for (auto _ : state) {
+        state.PauseTiming();
+        LLVMModuleRef copy = LLVMPY_CloneModule(mod);
+        state.ResumeTiming();
+        LLVMPY_RunPassManager(pm, copy);
+        state.PauseTiming();
+        LLVMPY_DisposeModule(copy);
+        state.ResumeTiming();
+    }
+    LLVMPY_DisposePassManager(pm);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    bench::reportPeakMemory(state);
+}
+// The cost of the diamond subpass grows much faster than the size of the
+// function, so it runs on smaller sizes than the subpasses scaling linearly
+BENCHMARK(BM_RefPrune)
+    ->ArgsProduct({benchmark::CreateRange(16, 4096, 4),
+                   {RefPrunePerBasicBlock, RefPruneFanout, RefPruneFanoutRaise,
+                    RefPrunePerBasicBlock | RefPruneFanout |
+                        RefPruneFanoutRaise | RefPruneWorklist}})
+    ->ArgNames({"diamonds", "subpasses"})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_RefPrune)
+    ->ArgsProduct({benchmark::CreateRange(16, 256, 4),
+                   {RefPruneDiamond, RefPruneAll}})
+    ->ArgNames({"diamonds", "subpasses"})
+    ->Unit(benchmark::kMicrosecond);
+
+static void BM_DefaultPipeline(benchmark::State &state) {
+    LLVMContextRef context = LLVMPY_ContextCreate();
+    LLVMModuleRef mod =
+        bench::parse(context, bench::arithmeticModule(state.range(1)));
+    LLVMTargetMachineRef tm = bench::hostTargetMachine();
+    LLVMPYNewPassManagerRef pm = LLVMPY_CreateNewPassManager(tm, 0, nullptr, 0);
+    LLVMPY_NewPassManagerAddDefaultPipeline(pm, state.range(0), 0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        LLVMModuleRef copy = LLVMPY_CloneModule(mod);
+        state.ResumeTiming();
+        LLVMPY_RunNewPassManager(pm, copy);
+        state.PauseTiming();
+        LLVMPY_DisposeModule(copy);
+        state.ResumeTiming();
+    }
+    LLVMPY_DisposeNewPassManager(pm);
+    LLVMPY_DisposeTargetMachine(tm);
+    LLVMPY_DisposeModule(mod);
+    LLVMPY_ContextDispose(context);
+    bench::reportPeakMemory(state);
+}
+BENCHMARK(BM_DefaultPipeline)
+    ->ArgsProduct({{0, 1, 2, 3}, {10, 100}})
+    ->ArgNames({"O", "functions"})
+    ->Unit(benchmark::kMillisecond);
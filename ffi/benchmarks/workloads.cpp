@@ -0,0 +1,186 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+// windows.h must come first
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace bench {
+
+std::string arithmeticModule(int NumFunctions, int NumBranches) {
+    std::string ir;
+    auto emit = [&ir](const char *Format, auto... Args) {
+        char line[256];
+        std::snprintf(line, sizeof(line), Format, Args...);
+        ir += line;
+    };
+    for (int f = 0; f < NumFunctions; ++f) {
+        emit("define i64 @f%d(i64 %%n) {\n"
+             "entry:\n"
+             "  br label %%loop\n"
+             "loop:\n"
+             "  %%i = phi i64 [ 0, %%entry ], [ %%i.next, %%latch ]\n"
+             "  %%v = phi i64 [ %d, %%entry ], [ %%v%d, %%latch ]\n"
+             "  br label %%c0\n",
+             f, f, NumBranches - 1);
+        for (int b = 0; b < NumBranches; ++b) {
+            std::string prev = b ? "%v" + std::to_string(b - 1) : "%v";
+            emit("c%d:\n"
+                 "  %%m%d = and i64 %%i, %d\n"
+                 "  %%t%d = icmp eq i64 %%m%d, 0\n"
+                 "  br i1 %%t%d, label %%a%d, label %%b%d\n",
+                 b, b, 1 << (b % 8), b, b, b, b, b);
+            emit("a%d:\n"
+                 "  %%x%d = mul i64 %s, %d\n"
+                 "  br label %%d%d\n",
+                 b, b, prev.c_str(), b + 3, b);
+            emit("b%d:\n"
+                 "  %%y%d = xor i64 %s, %%i\n"
+                 "  %%z%d = add i64 %%y%d, %d\n"
+                 "  br label %%d%d\n",
+                 b, b, prev.c_str(), b, b, f + b, b);
+            emit("d%d:\n"
+                 "  %%v%d = phi i64 [ %%x%d, %%a%d ], [ %%z%d, %%b%d ]\n",
+                 b, b, b, b, b, b);
+            if (b + 1 < NumBranches)
+                emit("  br label %%c%d\n", b + 1);
+            else
+                emit("  br label %%latch\n");
+        }
+        emit("latch:\n"
+             "  %%i.next = add i64 %%i, 1\n"
+             "  %%done = icmp uge i64 %%i.next, %%n\n"
+             "  br i1 %%done, label %%exit, label %%loop\n"
+             "exit:\n");
+        // Calls between the functions give the inliner work
+        if (f > 0) {
+            emit("  %%r = call i64 @f%d(i64 %%v%d)\n"
+                 "  ret i64 %%r\n"
+                 "}\n\n",
+                 f - 1, NumBranches - 1);
+        } else {
+            emit("  ret i64 %%v%d\n"
+                 "}\n\n",
+                 NumBranches - 1);
+        }
+    }
+    return ir;
+}
+
+std::string refopModule(int NumDiamonds) {
+    std::string ir = "declare void @NRT_incref(i8*)\n"
+                     "declare void @NRT_decref(i8*)\n\n"
+                     "define void @refops(i8* %p, i32 %n) {\n"
+                     "entry:\n"
+                     "  br label %r0\n";
+    auto emit = [&ir](const char *Format, auto... Args) {
+        char line[256];
+        std::snprintf(line, sizeof(line), Format, Args...);
+        ir += line;
+    };
+    for (int d = 0; d < NumDiamonds; ++d) {
+        bool fanout = d % 2 == 0;
+        emit("r%d:\n"
+             "  call void @NRT_incref(i8* %%p)\n"
+             "  call void @NRT_incref(i8* %%p)\n"
+             "  call void @NRT_decref(i8* %%p)\n"
+             "  %%t%d = icmp eq i32 %%n, %d\n"
+             "  br i1 %%t%d, label %%l%d, label %%e%d\n",
+             d, d, d, d, d, d);
+        for (const char *side : {"l", "e"}) {
+            emit("%s%d:\n", side, d);
+            if (fanout)
+                emit("  call void @NRT_decref(i8* %%p)\n");
+            emit("  br label %%j%d\n", d);
+        }
+        emit("j%d:\n", d);
+        if (!fanout)
+            emit("  call void @NRT_decref(i8* %%p)\n");
+        emit("  br label %%r%d\n", d + 1);
+    }
+    emit("r%d:\n"
+         "  ret void\n"
+         "}\n",
+         NumDiamonds);
+    return ir;
+}
+
+LLVMModuleRef parse(LLVMContextRef Context, const std::string &IR) {
+    const char *err = nullptr;
+    LLVMModuleRef mod = LLVMPY_ParseAssembly(Context, IR.c_str(), &err);
+    if (!mod)
+        fail("parsing", err);
+    return mod;
+}
+
+std::string bitcode(LLVMModuleRef M) {
+    const char *buf;
+    size_t len;
+    LLVMPY_WriteBitcodeToString(M, &buf, &len);
+    std::string res(buf, len);
+    LLVMPY_DisposeString(buf);
+    return res;
+}
+
+LLVMTargetMachineRef hostTargetMachine(int OptLevel, bool JIT) {
+    const char *triple;
+    LLVMPY_GetDefaultTargetTriple(&triple);
+    const char *err = nullptr;
+    LLVMTargetRef target = LLVMPY_GetTargetFromTriple(triple, &err);
+    if (!target)
+        fail("target lookup", err);
+    LLVMTargetMachineRef tm = LLVMPY_CreateTargetMachine(
+        target, triple, "", "", OptLevel, "default",
+        JIT ? "jitdefault" : "default", 0, JIT, "");
+    LLVMPY_DisposeString(triple);
+    return tm;
+}
+
+void reportPeakMemory(benchmark::State &State) {
+    double peak;
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    peak = double(counters.PeakWorkingSetSize);
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    peak = double(usage.ru_maxrss);
+#else
+    peak = double(usage.ru_maxrss) * 1024;
+#endif
+#endif
+    State.counters["peak_rss"] =
+        benchmark::Counter(peak, benchmark::Counter::kDefaults,
+                           benchmark::Counter::kIs1024);
+}
+
+void fail(const char *What, const char *Message, bool Dispose) {
+    std::fprintf(stderr, "%s failed: %s\n", What,
+                 Message ? Message : "unknown error");
+    if (Dispose && Message)
+        LLVMPY_DisposeString(Message);
+    std::abort();
+}
+
+} // namespace bench
+
+int main(int argc, char **argv) {
+    LLVMPY_InitializeCore();
+    LLVMPY_InitializeNativeTarget();
+    LLVMPY_InitializeNativeAsmPrinter();
+    LLVMPY_InitializeNativeAsmParser();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
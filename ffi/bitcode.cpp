@@ -3,15 +3,128 @@
 
 #include "core.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#if LLVM_VERSION_MAJOR > 12
+#include "llvm/Support/SHA256.h"
+#endif
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/*
+ * Parse *Buffer*, LLVM bitcode or IR text, into *Ctx*.  IR text must be
+ * null-terminated.  On error, returns NULL and sets *Error*.
+ */
+static std::unique_ptr<Module> parseModule(StringRef Buffer, LLVMContext &Ctx,
+                                           std::string &Error) {
+    raw_string_ostream os(Error);
+    if (isBitcode(reinterpret_cast<const unsigned char *>(Buffer.begin()),
+                  reinterpret_cast<const unsigned char *>(Buffer.end()))) {
+        auto M = parseBitcodeFile(MemoryBufferRef(Buffer, ""), Ctx);
+        if (!M) {
+            os << "LLVM bitcode parsing error\n" << toString(M.takeError());
+            return nullptr;
+        }
+        return std::move(*M);
+    }
+    SMDiagnostic error;
+    auto M = parseAssemblyString(Buffer, error, Ctx);
+    if (!M) {
+        os << "LLVM IR parsing error\n";
+        error.print("", os);
+    }
+    return M;
+}
+
+#if LLVM_VERSION_MAJOR > 12
+namespace {
+
+/*
+ * An output stream feeding what is written to it to a SHA-256 hasher,
+ * rather than storing it.
+ */
+class HashingOStream : public raw_ostream {
+  public:
+    explicit HashingOStream(SHA256 &hasher) : hasher(hasher) {}
+
+    ~HashingOStream() override { flush(); }
+
+  private:
+    void write_impl(const char *Ptr, size_t Size) override {
+        hasher.update(StringRef(Ptr, Size));
+        pos += Size;
+    }
+
+    uint64_t current_pos() const override { return pos; }
+
+    SHA256 &hasher;
+    uint64_t pos = 0;
+};
+
+} // end anonymous namespace
+#endif
+
 extern "C" {
 
 API_EXPORT(void)
 LLVMPY_WriteBitcodeToString(LLVMModuleRef M, const char **outbuf,
                             size_t *outlen) {
-    LLVMMemoryBufferRef MB = LLVMWriteBitcodeToMemoryBuffer(M);
-    *outlen = LLVMGetBufferSize(MB);
-    *outbuf = LLVMPY_CreateByteString(LLVMGetBufferStart(MB), *outlen);
-    LLVMDisposeMemoryBuffer(MB);
+    SmallVector<char, 0> buf;
+    raw_svector_ostream os(buf);
+    WriteBitcodeToFile(*unwrap(M), os);
+    *outlen = buf.size();
+    *outbuf = LLVMPY_CreateByteString(buf.data(), buf.size());
+}
+
+/*
+ * Write the bitcode of *M* to a new memory buffer, which takes over the
+ * vector it was written to rather than copying it.
+ */
+API_EXPORT(LLVMMemoryBufferRef)
+LLVMPY_WriteBitcodeToMemoryBuffer(LLVMModuleRef M) {
+    SmallVector<char, 0> buf;
+    raw_svector_ostream os(buf);
+    WriteBitcodeToFile(*unwrap(M), os);
+#if LLVM_VERSION_MAJOR < 14
+    return wrap(new SmallVectorMemoryBuffer(std::move(buf)));
+#else
+    return wrap(new SmallVectorMemoryBuffer(std::move(buf), false));
+#endif
+}
+
+/*
+ * Store the SHA-256 of the bitcode of *M* in the 32 bytes of *Out*.  The
+ * bitcode is hashed as the writer outputs it, rather than being copied.
+ * Returns false if this LLVM has no SHA-256 implementation (before 13).
+ */
+API_EXPORT(bool)
+LLVMPY_GetModuleFingerprint(LLVMModuleRef M, uint8_t *Out) {
+#if LLVM_VERSION_MAJOR < 13
+    return false;
+#else
+    SHA256 hasher;
+    {
+        HashingOStream os(hasher);
+        WriteBitcodeToFile(*unwrap(M), os);
+    }
+    auto digest = hasher.final();
+    std::copy(digest.begin(), digest.end(), Out);
+    return true;
+#endif
 }
 
 API_EXPORT(LLVMModuleRef)
@@ -27,4 +140,110 @@ LLVMPY_ParseBitcode(LLVMContextRef context, const char *bitcode,
     return ref;
 }
 
+/*
+ * Parse the *bitcode* without deserializing function bodies, which are only
+ * materialized when needed, e.g. by the linker, or on request.  The module
+ * keeps a copy of the bitcode until it is fully materialized.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_ParseBitcodeLazy(LLVMContextRef context, const char *bitcode,
+                        size_t bitcodelen, const char **outmsg) {
+    auto M = getOwningLazyBitcodeModule(
+        MemoryBuffer::getMemBufferCopy(StringRef(bitcode, bitcodelen)),
+        *unwrap(context));
+    if (!M) {
+        *outmsg = LLVMPY_CreateString(toString(M.takeError()).c_str());
+        return NULL;
+    }
+    return wrap(M->release());
+}
+
+/*
+ * Materialize the remaining function bodies of a lazily parsed module.
+ * Returns non-zero and sets *outmsg* on error.
+ */
+API_EXPORT(int)
+LLVMPY_MaterializeAll(LLVMModuleRef M, const char **outmsg) {
+    if (Error err = unwrap(M)->materializeAll()) {
+        *outmsg = LLVMPY_CreateString(toString(std::move(err)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Materialize the body of the global value *GV*, if it was lazily parsed.
+ * Returns non-zero and sets *outmsg* on error.
+ */
+API_EXPORT(int)
+LLVMPY_MaterializeGlobal(LLVMValueRef GV, const char **outmsg) {
+    if (Error err = unwrap<GlobalValue>(GV)->materialize()) {
+        *outmsg = LLVMPY_CreateString(toString(std::move(err)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(bool)
+LLVMPY_IsMaterializable(LLVMValueRef GV) {
+    return unwrap<GlobalValue>(GV)->isMaterializable();
+}
+
+/*
+ * Parse the *Count* buffers of *Buffers*, of sizes *Sizes*, each holding
+ * LLVM bitcode or null-terminated IR text, into the matching context of
+ * *Contexts*, and store the modules in *OutModules*.
+ *
+ * LLVM contexts are not thread-safe, so the buffers of a given context are
+ * parsed one after the other.  Those of different contexts are parsed
+ * concurrently on up to *NumThreads* threads, or one per core if 0.
+ *
+ * Returns 0 on success.  Otherwise, no module is returned, *OutError* is set
+ * and the index of the first buffer that failed, plus one, is returned.
+ */
+API_EXPORT(size_t)
+LLVMPY_ParseModules(LLVMContextRef *Contexts, const char **Buffers,
+                    const size_t *Sizes, size_t Count, unsigned NumThreads,
+                    LLVMModuleRef *OutModules, const char **OutError) {
+    // The buffers of each context
+    DenseMap<LLVMContext *, std::vector<size_t>> groups;
+    std::vector<LLVMContext *> order;
+    for (size_t i = 0; i < Count; ++i) {
+        auto &group = groups[unwrap(Contexts[i])];
+        if (group.empty())
+            order.push_back(unwrap(Contexts[i]));
+        group.push_back(i);
+    }
+
+    std::vector<std::unique_ptr<Module>> modules(Count);
+    std::vector<std::string> errors(Count);
+    auto parseGroup = [&](const std::vector<size_t> &group) {
+        for (size_t i : group) {
+            modules[i] = parseModule(StringRef(Buffers[i], Sizes[i]),
+                                     *unwrap(Contexts[i]), errors[i]);
+            if (!modules[i])
+                return;
+        }
+    };
+    if (order.size() == 1 || NumThreads == 1) {
+        for (LLVMContext *ctx : order)
+            parseGroup(groups[ctx]);
+    } else {
+        ThreadPool pool(hardware_concurrency(NumThreads));
+        for (LLVMContext *ctx : order)
+            pool.async(parseGroup, std::cref(groups[ctx]));
+        pool.wait();
+    }
+
+    for (size_t i = 0; i < Count; ++i) {
+        if (!errors[i].empty()) {
+            *OutError = LLVMPY_CreateString(errors[i].c_str());
+            return i + 1;
+        }
+    }
+    for (size_t i = 0; i < Count; ++i)
+        OutModules[i] = wrap(modules[i].release());
+    return 0;
+}
+
 } // end extern "C"
@@ -6,6 +6,8 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/SmallSet.h"
 
 #include "llvm/Analysis/Passes.h"
@@ -13,10 +15,12 @@
 #include "llvm/Support/raw_ostream.h"
 
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassManager.h"
 
 #include "llvm/InitializePasses.h"
 #include "llvm/LinkAllPasses.h"
 
+#include <atomic>
 #include <iostream>
 #include <vector>
 
@@ -30,6 +34,56 @@ void initializeRefNormalizePassPass(PassRegistry &Registry);
 void initializeRefPrunePassPass(PassRegistry &Registry);
 } // namespace llvm
 
+/**
+ * Struct for holding statistics about the amount of pruning performed by
+ * each type of pruning algorithm.
+ */
+typedef struct PruneStats {
+    size_t basicblock;
+    size_t diamond;
+    size_t fanout;
+    size_t fanout_raise;
+} PRUNESTATS;
+
+/**
+ * Pruning statistics shared by the passes updating them.  The counters are
+ * atomic so that passes running concurrently, e.g. from several pass
+ * managers or from a parallel function pipeline, can share them.
+ */
+struct RefPruneStats {
+    std::atomic<size_t> basicblock{0};
+    std::atomic<size_t> diamond{0};
+    std::atomic<size_t> fanout{0};
+    std::atomic<size_t> fanout_raise{0};
+
+    void add(const PRUNESTATS &stats) {
+        basicblock += stats.basicblock;
+        diamond += stats.diamond;
+        fanout += stats.fanout;
+        fanout_raise += stats.fanout_raise;
+    }
+
+    /**
+     * Copy the counters to buf and, if reset is set, zero them.  Each
+     * counter is read and reset atomically, so no pruning is lost.
+     */
+    void read(PRUNESTATS *buf, bool reset) {
+        if (reset) {
+            buf->basicblock = basicblock.exchange(0);
+            buf->diamond = diamond.exchange(0);
+            buf->fanout = fanout.exchange(0);
+            buf->fanout_raise = fanout_raise.exchange(0);
+        } else {
+            buf->basicblock = basicblock;
+            buf->diamond = diamond;
+            buf->fanout = fanout;
+            buf->fanout_raise = fanout_raise;
+        }
+    }
+};
+
+typedef RefPruneStats *LLVMPYRefPruneStatsRef;
+
 /**
  * Checks if a call instruction is an incref
  *
@@ -78,26 +132,94 @@ CallInst *GetRefOpCall(Instruction *ii) {
 }
 
 /**
- * RAII push-pop of elements onto a stack.
- *
- * Template parameter <Tstack>:
- *  - the type of the stack
+ * An index of the decrefs of a function, by pointer operand and by basic
+ * block, kept up to date as refops are erased through it.  Used by the
+ * worklist pruner to answer the decref queries of the subpasses without
+ * rescanning blocks.
  */
-template <class Tstack> struct raiiStack {
-    Tstack &stack;
+struct RefOpIndex {
+    typedef std::pair<Value *, BasicBlock *> PtrBlock;
+
+    // Erased decrefs are set to NULL in the lists below, as in
+    // runDiamondPrune.  `first` skips the leading erased ones.
+    struct DecrefList {
+        std::vector<CallInst *> list;
+        size_t first = 0;
+    };
 
-    typedef typename Tstack::value_type value_type;
+    // Decrefs of each pointer, in function order.
+    DenseMap<Value *, DecrefList> decrefs;
+    // Decrefs of each pointer in each block, in block order.
+    DenseMap<PtrBlock, SmallVector<CallInst *, 2>> block_decrefs;
+    // Position of each live decref in the two lists above.
+    DenseMap<CallInst *, std::pair<size_t, size_t>> positions;
+    // Number of live decrefs in each block.
+    DenseMap<BasicBlock *, unsigned> block_decref_count;
+    // Erased increfs.
+    DenseSet<CallInst *> erased_increfs;
+    // Blocks whose decrefs made queries fail since this was last cleared.
+    SmallVector<BasicBlock *, 4> blockers;
+
+    void addDecref(CallInst *decref) {
+        Value *ptr = decref->getArgOperand(0);
+        BasicBlock *bb = decref->getParent();
+        auto &by_ptr = decrefs[ptr].list;
+        auto &by_block = block_decrefs[{ptr, bb}];
+        positions[decref] = {by_ptr.size(), by_block.size()};
+        by_ptr.push_back(decref);
+        by_block.push_back(decref);
+        ++block_decref_count[bb];
+    }
 
     /**
-     * ctor pushes `elem` onto `stack`
+     * Returns the decrefs of `ptr` in function order.  Erased ones are NULL.
      */
-    raiiStack(Tstack &stack, value_type &elem) : stack(stack) {
-        stack.push_back(elem);
+    ArrayRef<CallInst *> decrefsOf(Value *ptr) {
+        auto it = decrefs.find(ptr);
+        if (it == decrefs.end())
+            return {};
+        DecrefList &dl = it->second;
+        while (dl.first < dl.list.size() && !dl.list[dl.first])
+            ++dl.first;
+        return makeArrayRef(dl.list).drop_front(dl.first);
     }
+
     /**
-     * dtor pops back of `stack`
+     * Returns the first live decref of `ptr` in `bb`, or NULL.
      */
-    ~raiiStack() { stack.pop_back(); }
+    CallInst *firstDecref(Value *ptr, BasicBlock *bb) {
+        auto it = block_decrefs.find({ptr, bb});
+        if (it == block_decrefs.end())
+            return NULL;
+        for (CallInst *decref : it->second) {
+            if (decref)
+                return decref;
+        }
+        return NULL;
+    }
+
+    bool hasAnyDecref(BasicBlock *bb) {
+        auto it = block_decref_count.find(bb);
+        return it != block_decref_count.end() && it->second > 0;
+    }
+
+    bool isErased(CallInst *incref) { return erased_increfs.count(incref); }
+
+    void eraseIncref(CallInst *incref) {
+        erased_increfs.insert(incref);
+        incref->eraseFromParent();
+    }
+
+    void eraseDecref(CallInst *decref) {
+        Value *ptr = decref->getArgOperand(0);
+        BasicBlock *bb = decref->getParent();
+        auto pos = positions.find(decref);
+        decrefs[ptr].list[pos->second.first] = NULL;
+        block_decrefs[{ptr, bb}][pos->second.second] = NULL;
+        positions.erase(pos);
+        --block_decref_count[bb];
+        decref->eraseFromParent();
+    }
 };
 
 /**
@@ -160,20 +282,88 @@ struct RefNormalizePass : public FunctionPass {
 
 struct RefPrunePass : public FunctionPass {
     static char ID;
-    static size_t stats_per_bb;
-    static size_t stats_diamond;
-    static size_t stats_fanout;
-    static size_t stats_fanout_raise;
 
-    // Fixed size for how deep to recurse in the fanout case prior to giving up.
-    static const size_t FANOUT_RECURSE_DEPTH = 15;
-    typedef SmallSet<BasicBlock *, FANOUT_RECURSE_DEPTH> SmallBBSet;
+    // The statistics of all the RefPrunePass runs in the process.
+    static RefPruneStats global_stats;
+
+    // The statistics of the runs of this pass instance, if not NULL.
+    RefPruneStats *stats = nullptr;
+
+    // The pruning done by the current run, published to `global_stats` and
+    // `stats` when it ends.
+    size_t stats_per_bb = 0;
+    size_t stats_diamond = 0;
+    size_t stats_fanout = 0;
+    size_t stats_fanout_raise = 0;
+
+    typedef SmallSet<BasicBlock *, 16> SmallBBSet;
 
     // The maximum number of nodes that the fanout pruners will look at.
     size_t subgraph_limit;
 
+    /**
+     * The subgraph walked by the fanout subpasses from the block of an
+     * incref: the blocks reachable from it without going through a block
+     * containing a decref or, for the fanout-raise subpass, a raising block.
+     * It only depends on the CFG and on which blocks contain decrefs, so it
+     * is shared by all the increfs of the block, whatever their pointer.
+     */
+    struct FanoutRegion {
+        // Whether all the walks end in a block with decrefs or a raising
+        // block, without going back to the head block or looking at more
+        // than `subgraph_limit` blocks.  Once false, it stays false as
+        // decrefs are erased.
+        bool ok = false;
+        // The blocks with decrefs ending the walks.
+        SmallBBSet decref_blocks;
+        // The raising blocks ending the walks, for the fanout-raise subpass.
+        SmallBBSet raising_blocks;
+        // Whether the tail-node condition holds for the above blocks, see
+        // verifyFanoutBackward.
+        bool backward_ok = false;
+    };
+
+    /**
+     * The fanout regions computed for the function being pruned.  A region
+     * is dropped when one of the blocks ending it loses its last decref, as
+     * the walks then continue past that block.
+     */
+    struct FanoutRegionCache {
+        // Regions by head block, without and with raising blocks ending the
+        // walks.
+        DenseMap<BasicBlock *, FanoutRegion> regions[2];
+        // The head blocks of the cached regions ending at each block.
+        DenseMap<BasicBlock *, SmallVector<BasicBlock *, 4>> heads_by_tail;
+
+        void invalidate(BasicBlock *bb) {
+            auto it = heads_by_tail.find(bb);
+            if (it == heads_by_tail.end())
+                return;
+            for (BasicBlock *head : it->second) {
+                regions[false].erase(head);
+                regions[true].erase(head);
+            }
+            heads_by_tail.erase(it);
+        }
+    };
+
+    // The fanout regions of the function being pruned, during fanout sweeps
+    // and in worklist mode.
+    FanoutRegionCache *regions = nullptr;
+
+    // The dominator trees of the function being pruned, as provided by the
+    // legacy or the new pass manager.
+    DominatorTree *domtree = nullptr;
+    PostDominatorTree *postdomtree = nullptr;
+
+    // The decref index of the function being pruned, in worklist mode.
+    RefOpIndex *index = nullptr;
+
     /**
      * Enum for setting which subpasses to run, there is no interdependence.
+     *
+     * Worklist is a mode rather than a subpass: the enabled subpasses are
+     * run by the worklist pruner instead of being iterated to a fixed point.
      */
     enum Subpasses {
         None = 0b0000,
@@ -181,11 +371,14 @@ struct RefPrunePass : public FunctionPass {
         Diamond = 0b0010,
         Fanout = 0b0100,
         FanoutRaise = 0b1000,
-        All = PerBasicBlock | Diamond | Fanout | FanoutRaise
+        All = PerBasicBlock | Diamond | Fanout | FanoutRaise,
+        Worklist = 0b10000
     } flags;
 
-    RefPrunePass(Subpasses flags = Subpasses::All, size_t subgraph_limit = -1)
-        : FunctionPass(ID), flags(flags), subgraph_limit(subgraph_limit) {
+    RefPrunePass(Subpasses flags = Subpasses::All, size_t subgraph_limit = -1,
+                 RefPruneStats *stats = nullptr)
+        : FunctionPass(ID), stats(stats), flags(flags),
+          subgraph_limit(subgraph_limit) {
         initializeRefPrunePassPass(*PassRegistry::getPassRegistry());
     }
 
@@ -194,6 +387,33 @@ struct RefPrunePass : public FunctionPass {
     }
 
     bool runOnFunction(Function &F) override {
+        domtree = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+        postdomtree =
+            &getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+        return runPrune(F);
+    }
+
+    /**
+     * Run the enabled subpasses on F until none of them makes progress.
+     * `domtree` and `postdomtree` must be set for F.
+     */
+    bool runPrune(Function &F) {
+        stats_per_bb = stats_diamond = stats_fanout = stats_fanout_raise = 0;
+        bool mutated = isSubpassEnabledFor(Subpasses::Worklist)
+                           ? runWorklistPrune(F)
+                           : runFixedPointPrune(F);
+        PRUNESTATS run = {stats_per_bb, stats_diamond, stats_fanout,
+                          stats_fanout_raise};
+        global_stats.add(run);
+        if (stats)
+            stats->add(run);
+        return mutated;
+    }
+
+    /**
+     * Iterate the enabled subpasses over the whole of F to a fixed point.
+     */
+    bool runFixedPointPrune(Function &F) {
         // state for LLVM function pass mutated IR
         bool mutated = false;
 
@@ -216,6 +436,191 @@ struct RefPrunePass : public FunctionPass {
         return mutated;
     }
 
+    /**
+     * Worklist pruner, with the same effect as iterating the enabled subpasses
+     * to a fixed point, in time roughly linear in the number of refops.
+     *
+     * The refops are scanned once: refops on NULL are erased, and the decrefs
+     * are indexed by pointer and block (see RefOpIndex).  Per-BB pairs are
+     * then matched through the index; erasing refops can't create new ones.
+     * Finally, each remaining incref is tried against the diamond and fanout
+     * subpasses.  An incref that fails waits on the blocks whose decrefs made
+     * it fail and on its pointer, and is only retried after a decref in one
+     * of those blocks or of that pointer is erased.
+     *
+     * Parameters:
+     *  - F a Function
+     *
+     * Returns:
+     *  - true if pruning took place, false otherwise
+     */
+    bool runWorklistPrune(Function &F) {
+        bool mutated = false;
+        RefOpIndex idx;
+        index = &idx;
+
+        // Scan the refops.  Refops on NULL are only special to the per-BB
+        // subpass.
+        bool per_bb = isSubpassEnabledFor(Subpasses::PerBasicBlock);
+        SmallVector<CallInst *, 10> null_list;
+        std::vector<CallInst *> incref_list;
+        DenseMap<RefOpIndex::PtrBlock, SmallVector<CallInst *, 2>>
+            block_increfs;
+        for (BasicBlock &bb : F) {
+            for (Instruction &ii : bb) {
+                CallInst *ci;
+                if (!(ci = GetRefOpCall(&ii)))
+                    continue;
+                if (per_bb && !isNonNullFirstArg(ci)) {
+                    null_list.push_back(ci);
+                } else if (IsIncRef(ci)) {
+                    incref_list.push_back(ci);
+                    block_increfs[{ci->getArgOperand(0), &bb}].push_back(ci);
+                } else {
+                    idx.addDecref(ci);
+                }
+            }
+        }
+
+        if (per_bb) {
+            for (CallInst *ci : null_list) {
+                ci->eraseFromParent();
+                mutated = true;
+                stats_per_bb += 1;
+            }
+            // Pair the increfs of each block with its related decrefs, last
+            // incref first as runPerBasicBlockPrune does.
+            for (auto &entry : block_increfs) {
+                SmallVector<CallInst *, 2> &increfs = entry.second;
+                Value *ptr = entry.first.first;
+                BasicBlock *bb = entry.first.second;
+                while (!increfs.empty()) {
+                    CallInst *decref = idx.firstDecref(ptr, bb);
+                    if (!decref)
+                        break;
+                    idx.eraseIncref(increfs.pop_back_val());
+                    idx.eraseDecref(decref);
+                    mutated = true;
+                    stats_per_bb += 2;
+                }
+            }
+        }
+
+        bool diamond = isSubpassEnabledFor(Subpasses::Diamond);
+        bool fanout = isSubpassEnabledFor(Subpasses::Fanout);
+        bool fanout_raise = isSubpassEnabledFor(Subpasses::FanoutRaise);
+        if (!diamond && !fanout && !fanout_raise) {
+            index = nullptr;
+            return mutated;
+        }
+
+        // Increfs waiting for a decref to be erased in a block or for a
+        // pointer, and increfs skipped because their block is known to fail
+        // the fanout condition.
+        DenseMap<BasicBlock *, SmallVector<CallInst *, 4>> waiting_on_block;
+        DenseMap<Value *, SmallVector<CallInst *, 4>> waiting_on_ptr;
+        std::vector<CallInst *> waiting_on_bad_blocks;
+        SmallBBSet bad_blocks, bad_blocks_raise;
+
+        FanoutRegionCache region_cache;
+        regions = &region_cache;
+
+        std::vector<CallInst *> worklist;
+        DenseSet<CallInst *> queued;
+        for (auto it = incref_list.rbegin(); it != incref_list.rend(); ++it) {
+            if (!idx.isErased(*it)) {
+                worklist.push_back(*it);
+                queued.insert(*it);
+            }
+        }
+        auto requeue = [&](SmallVectorImpl<CallInst *> &waiting) {
+            for (CallInst *incref : waiting) {
+                if (!idx.isErased(incref) && queued.insert(incref).second)
+                    worklist.push_back(incref);
+            }
+            waiting.clear();
+        };
+
+        while (!worklist.empty()) {
+            CallInst *incref = worklist.back();
+            worklist.pop_back();
+            queued.erase(incref);
+            if (idx.isErased(incref))
+                continue;
+
+            idx.blockers.clear();
+            // Note the decrefs that get erased, to wake up dependents.
+            SmallVector<std::pair<Value *, BasicBlock *>, 4> erased_decrefs;
+            bool was_bad = bad_blocks.count(incref->getParent()) ||
+                           bad_blocks_raise.count(incref->getParent());
+            bool pruned = false;
+            if (diamond)
+                pruned = pruneDiamond(incref, erased_decrefs);
+            if (!pruned && fanout)
+                pruned = pruneFanout(incref, bad_blocks, false,
+                                     erased_decrefs);
+            if (!pruned && fanout_raise)
+                pruned = pruneFanout(incref, bad_blocks_raise, true,
+                                     erased_decrefs);
+
+            if (!pruned) {
+                Value *ptr = incref->getArgOperand(0);
+                waiting_on_ptr[ptr].push_back(incref);
+                for (BasicBlock *bb : idx.blockers)
+                    waiting_on_block[bb].push_back(incref);
+                if (was_bad || bad_blocks.count(incref->getParent()) ||
+                    bad_blocks_raise.count(incref->getParent()))
+                    waiting_on_bad_blocks.push_back(incref);
+                continue;
+            }
+
+            mutated = true;
+            // Failures of the fanout subpasses are only remembered until the
+            // next erasure, as in a sweep of runFanoutPrune.
+            bad_blocks.clear();
+            bad_blocks_raise.clear();
+            for (CallInst *waiting : waiting_on_bad_blocks) {
+                if (!idx.isErased(waiting) && queued.insert(waiting).second)
+                    worklist.push_back(waiting);
+            }
+            waiting_on_bad_blocks.clear();
+            for (auto &erased : erased_decrefs) {
+                auto by_ptr = waiting_on_ptr.find(erased.first);
+                if (by_ptr != waiting_on_ptr.end())
+                    requeue(by_ptr->second);
+                auto by_block = waiting_on_block.find(erased.second);
+                if (by_block != waiting_on_block.end())
+                    requeue(by_block->second);
+            }
+        }
+
+        regions = nullptr;
+        index = nullptr;
+        return mutated;
+    }
+
+    /**
+     * Try to prune `incref` with a related decref in a diamond, as in
+     * runDiamondPrune.  Used in worklist mode.  The pointer and block of the
+     * erased decref are appended to `erased_decrefs`.
+     */
+    bool pruneDiamond(CallInst *incref,
+                      SmallVectorImpl<std::pair<Value *, BasicBlock *>>
+                          &erased_decrefs) {
+        Value *ptr = incref->getArgOperand(0);
+        for (CallInst *decref : index->decrefsOf(ptr)) {
+            if (decref == NULL || !isDiamond(incref, decref))
+                continue;
+            BasicBlock *bb = decref->getParent();
+            index->eraseIncref(incref);
+            eraseDecref(decref);
+            erased_decrefs.push_back({ptr, bb});
+            stats_diamond += 2;
+            return true;
+        }
+        return false;
+    }
+
     /**
      * Per BasicBlock pruning pass.
      *
@@ -361,11 +766,6 @@ struct RefPrunePass : public FunctionPass {
      */
     bool runDiamondPrune(Function &F) {
         bool mutated = false;
-        // gets the dominator tree
-        auto &domtree = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-        // gets the post-dominator tree
-        auto &postdomtree =
-            getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
 
         // Find all increfs and decrefs in the Function and store them in
         // incref_list and decref_list respectively.
@@ -385,57 +785,68 @@ struct RefPrunePass : public FunctionPass {
                 if (decref == NULL)
                     continue;
 
-                // Diamond prune is for refops not in the same BB
-                if (incref->getParent() == decref->getParent())
+                if (!isDiamond(incref, decref))
                     continue;
 
-                // If the refops are unrelated, skip
-                if (!isRelatedDecref(incref, decref))
-                    continue;
-
-                // incref DOM decref && decref POSTDOM incref
-                if (domtree.dominates(incref, decref) &&
-                    postdomtree.dominates(decref, incref)) {
-                    // check that the decref cannot be executed multiple times
-                    SmallBBSet tail_nodes;
-                    tail_nodes.insert(decref->getParent());
-                    if (!verifyFanoutBackward(incref, incref->getParent(),
-                                              &tail_nodes))
-                        continue;
-
-                    // scan the CFG between the incref and decref BBs, if
-                    // there's a decref present then skip, this is conservative.
-                    if (hasDecrefBetweenGraph(incref->getParent(),
-                                              decref->getParent())) {
-                        continue;
-                    } else {
-
-                        if (DEBUG_PRINT) {
-                            errs() << F.getName() << "-------------\n";
-                            errs() << incref->getParent()->getName() << "\n";
-                            incref->dump();
-                            errs() << decref->getParent()->getName() << "\n";
-                            decref->dump();
-                        }
+                if (DEBUG_PRINT) {
+                    errs() << F.getName() << "-------------\n";
+                    errs() << incref->getParent()->getName() << "\n";
+                    incref->dump();
+                    errs() << decref->getParent()->getName() << "\n";
+                    decref->dump();
+                }
 
-                        // erase instruction from block and set NULL marker for
-                        // bookkeeping purposes
-                        incref->eraseFromParent();
-                        decref->eraseFromParent();
-                        incref = NULL;
-                        decref = NULL;
+                // erase instruction from block and set NULL marker for
+                // bookkeeping purposes
+                incref->eraseFromParent();
+                decref->eraseFromParent();
+                incref = NULL;
+                decref = NULL;
 
-                        stats_diamond += 2;
-                    }
-                    // mark mutated
-                    mutated = true;
-                    break;
-                }
+                stats_diamond += 2;
+                // mark mutated
+                mutated = true;
+                break;
             }
         }
         return mutated;
     }
 
+    /**
+     * Checks the diamond condition of runDiamondPrune for a pair of refops.
+     *
+     * Parameters:
+     *  - incref, an incref
+     *  - decref, a decref
+     *
+     * Returns:
+     *  - true if the pair can be pruned, false otherwise
+     */
+    bool isDiamond(CallInst *incref, CallInst *decref) {
+        // Diamond prune is for refops not in the same BB
+        if (incref->getParent() == decref->getParent())
+            return false;
+
+        // If the refops are unrelated, skip
+        if (!isRelatedDecref(incref, decref))
+            return false;
+
+        // incref DOM decref && decref POSTDOM incref
+        if (!domtree->dominates(incref, decref) ||
+            !postdomtree->dominates(decref, incref))
+            return false;
+
+        // check that the decref cannot be executed multiple times
+        SmallBBSet tail_nodes;
+        tail_nodes.insert(decref->getParent());
+        if (!verifyFanoutBackward(incref->getParent(), &tail_nodes))
+            return false;
+
+        // scan the CFG between the incref and decref BBs, if there's a decref
+        // present then skip, this is conservative.
+        return !hasDecrefBetweenGraph(incref->getParent(), decref->getParent());
+    }
+
     /**
      * "Fan-out" pruning passes.
      *
@@ -512,79 +923,117 @@ struct RefPrunePass : public FunctionPass {
 
         // Remember incref-blocks that will always fail.
         SmallBBSet bad_blocks;
+        // Share the walks of the increfs of a block.
+        FanoutRegionCache region_cache;
+        regions = &region_cache;
         // walk the incref_list
         for (CallInst *incref : incref_list) {
-            // Skip blocks that will always fail.
-            if (bad_blocks.count(incref->getParent())) {
-                continue; // skip
-            }
+            SmallVector<std::pair<Value *, BasicBlock *>, 4> erased_decrefs;
+            mutated |= pruneFanout(incref, bad_blocks, prune_raise_exit,
+                                   erased_decrefs);
+        }
+        regions = nullptr;
+        return mutated;
+    }
 
-            // Is there *any* decref in the parent node of the incref?
-            // If so skip this incref (considering that aliases may exist).
-            if (hasAnyDecrefInNode(incref->getParent())) {
-                // be careful of potential alias
-                continue; // skip
-            }
+    /**
+     * Try to prune `incref` with its related decrefs in a fan-out, as in
+     * runFanoutPrune.
+     *
+     * Parameters:
+     *  - incref, an incref
+     *  - bad_blocks, incref-blocks known to fail; mutated by this function.
+     *  - prune_raise_exit, as for runFanoutPrune.
+     *  - erased_decrefs, the pointer and block of each erased decref are
+     *    appended to it.
+     *
+     * Returns:
+     *  - true if pruning took place, false otherwise
+     */
+    bool pruneFanout(
+        CallInst *incref, SmallBBSet &bad_blocks, bool prune_raise_exit,
+        SmallVectorImpl<std::pair<Value *, BasicBlock *>> &erased_decrefs) {
+        // Skip blocks that will always fail.
+        if (bad_blocks.count(incref->getParent())) {
+            return false; // skip
+        }
 
-            SmallBBSet decref_blocks;
-            // Check for the chosen "fan out" condition
-            if (findFanout(incref, bad_blocks, &decref_blocks,
-                           prune_raise_exit)) {
-                if (DEBUG_PRINT) {
-                    F.viewCFG();
-                    errs() << "------------\n";
-                    errs() << "incref " << incref->getParent()->getName()
-                           << "\n";
-                    errs() << "  decref_blocks.size()" << decref_blocks.size()
-                           << "\n";
-                    incref->dump();
-                }
-                // Remove first related decref in each block
-                // for each block
-                for (BasicBlock *each : decref_blocks) {
-                    // for each instruction
-                    for (Instruction &ii : *each) {
-                        CallInst *decref;
-                        // walrus:
-                        // is the current instruction the decref associated with
-                        // the incref under consideration, if so assign to
-                        // decref and continue.
-                        if ((decref = isRelatedDecref(incref, &ii))) {
-                            if (DEBUG_PRINT) {
-                                errs()
-                                    << decref->getParent()->getName() << "\n";
-                                decref->dump();
-                            }
-                            // Remove this decref from its block
-                            decref->eraseFromParent();
-
-                            // update counters based on decref removal
-                            if (prune_raise_exit)
-                                stats_fanout_raise += 1;
-                            else
-                                stats_fanout += 1;
-                            break;
-                        }
-                    }
-                }
-                // remove the incref from its block
-                incref->eraseFromParent();
+        // Is there *any* decref in the parent node of the incref?
+        // If so skip this incref (considering that aliases may exist).
+        if (hasAnyDecrefInNode(incref->getParent())) {
+            // be careful of potential alias
+            return false; // skip
+        }
 
-                // update counters based on incref removal
-                if (prune_raise_exit)
-                    stats_fanout_raise += 1;
-                else
-                    stats_fanout += 1;
-                mutated = true;
+        SmallBBSet decref_blocks;
+        // Check for the chosen "fan out" condition
+        if (!findFanout(incref, bad_blocks, &decref_blocks, prune_raise_exit))
+            return false;
+
+        if (DEBUG_PRINT) {
+            incref->getFunction()->viewCFG();
+            errs() << "------------\n";
+            errs() << "incref " << incref->getParent()->getName() << "\n";
+            errs() << "  decref_blocks.size()" << decref_blocks.size() << "\n";
+            incref->dump();
+        }
+        Value *ptr = incref->getArgOperand(0);
+        // Remove first related decref in each block
+        // for each block
+        for (BasicBlock *each : decref_blocks) {
+            CallInst *decref = NULL;
+            if (index) {
+                decref = index->firstDecref(ptr, each);
+            } else {
+                // for each instruction
+                for (Instruction &ii : *each) {
+                    // walrus:
+                    // is the current instruction the decref associated with
+                    // the incref under consideration, if so assign to
+                    // decref and stop.
+                    if ((decref = isRelatedDecref(incref, &ii)))
+                        break;
+                }
+            }
+            if (!decref)
+                continue;
+            if (DEBUG_PRINT) {
+                errs() << decref->getParent()->getName() << "\n";
+                decref->dump();
             }
+            // Remove this decref from its block
+            eraseDecref(decref);
+            erased_decrefs.push_back({ptr, each});
+
+            // update counters based on decref removal
+            if (prune_raise_exit)
+                stats_fanout_raise += 1;
+            else
+                stats_fanout += 1;
         }
-        return mutated;
+        // remove the incref from its block
+        if (index)
+            index->eraseIncref(incref);
+        else
+            incref->eraseFromParent();
+
+        // update counters based on incref removal
+        if (prune_raise_exit)
+            stats_fanout_raise += 1;
+        else
+            stats_fanout += 1;
+        return true;
     }
 
     /**
      * This searches for the "fan-out" condition and returns true if it is
      * found.
      *
+     * The walks from the incref block are shared by all its increfs, see
+     * FanoutRegion: the condition holds if they all end in a block with a
+     * decref related to the incref or, if `prune_raise_exit` is set, in a
+     * raising block, and if the tail-node condition holds for those blocks.
+     *
      * Parameters:
      * - incref: the incref from which fan-out should be checked.
      * - bad_blocks: a set of blocks that are known to not satisfy the
@@ -607,223 +1056,129 @@ struct RefPrunePass : public FunctionPass {
         // get the basic block of the incref instruction
         BasicBlock *head_node = incref->getParent();
 
-        // work space, a set of basic blocks to hold the block which contain
-        // raises, only used in the case of prune_raise_exit
-        SmallBBSet raising_blocks, *p_raising_blocks = NULL;
-        // Set up pointer to raising_blocks
-        if (prune_raise_exit)
-            p_raising_blocks = &raising_blocks;
+        const FanoutRegion &region =
+            getFanoutRegion(head_node, prune_raise_exit);
+        if (!region.ok) {
+            // mark head-node as always fail, whatever the incref.
+            bad_blocks.insert(head_node);
+            return false;
+        }
+        if (DEBUG_PRINT) {
+            errs() << "forward pass candids.size() = "
+                   << region.decref_blocks.size() << "\n";
+            errs() << "    " << head_node->getName() << "\n";
+            incref->dump();
+        }
+        if (region.decref_blocks.size() == 0) {
+            // no decref blocks
+            return false;
+        }
+        if (prune_raise_exit && region.raising_blocks.size() == 0) {
+            // no raising blocks
+            return false;
+        }
 
-        if (findFanoutDecrefCandidates(incref, head_node, bad_blocks,
-                                       decref_blocks, p_raising_blocks)) {
-            if (DEBUG_PRINT) {
-                errs() << "forward pass candids.size() = "
-                       << decref_blocks->size() << "\n";
-                errs() << "    " << head_node->getName() << "\n";
-                incref->dump();
-            }
-            if (decref_blocks->size() == 0) {
-                // no decref blocks
-                if (DEBUG_PRINT) {
-                    errs() << "missing decref blocks = "
-                           << raising_blocks.size() << "\n";
-                }
+        // Each walk must end at a decref related to the incref, as aliases
+        // may exist.
+        for (BasicBlock *bb : region.decref_blocks) {
+            if (!hasDecrefInNode(incref, bb)) {
+                // Remember why the query failed
+                if (index)
+                    index->blockers.push_back(bb);
                 return false;
             }
-            if (prune_raise_exit) {
-                if (raising_blocks.size() == 0) {
-                    // no raising blocks
-                    if (DEBUG_PRINT) {
-                        errs() << "missing raising blocks = "
-                               << raising_blocks.size() << "\n";
-                        for (auto bb : *decref_blocks) {
-                            errs() << "   " << bb->getName() << "\n";
-                        }
-                    }
-                    return false;
-                }
-
-                // combine decref_blocks into raising blocks for checking the
-                // exit node condition
-                for (BasicBlock *bb : *decref_blocks) {
-                    raising_blocks.insert(bb);
-                }
-                if (verifyFanoutBackward(incref, head_node, p_raising_blocks))
-                    return true;
-
-            } else if (verifyFanoutBackward(incref, head_node, decref_blocks)) {
-                return true;
-            }
         }
-        return false;
+        if (!region.backward_ok)
+            return false;
+
+        // Copy, as erasing the decrefs drops the region.
+        *decref_blocks = region.decref_blocks;
+        return true;
     }
 
     /**
-     * Forward pass.
-     *
-     * Walk the successors of the incref node recursively until a decref
-     * or an exit node is found.
-     *
-     * In the case of a decref node, the node is added to decref_blocks only if
-     * it contains a decref associated with the incref and there is no interior
-     * back-edge to a predecessor in the current sub-graph.
-     *
-     * In the case of an exit, it must be a raise for it to be added to
-     * raising_blocks.
-     *
-     * Parameters:
-     *  - incref: The incref under consideration.
-     *  - cur_node: The basic block in which incref is found.
-     *  - bad_blocks: a set of blocks that are known to not satisfy the
-     *    the fanout condition. Mutated by this function.
-     *  - decref_blocks: pointer to a set of basic blocks, it is mutated by this
-     *    function and on successful return contains the basic blocks which have
-     *    a decref related to the supplied incref in them.
-     *  - raising_blocks: point to a set of basic blocks OR NULL. If not-NULL
-     *    it is mutated by this function and on successful return contains the
-     *    basic blocks which have a raise in them that is reachable from the
-     *    incref.
-     *
-     * Return condition:
-     *   depends on the value of raising_blocks:
-     *      == NULL -> return true iff all paths from the incref have led to a
-     *                 decref.
-     *      != NULL -> return true iff all paths from the incref have led to
-     *                 either a decref or a raising exit.
+     * Returns the fanout region of `head_node`, computing it if it isn't
+     * cached.  The reference is invalidated by the next erasure or query.
      */
-    bool findFanoutDecrefCandidates(CallInst *incref, BasicBlock *cur_node,
-                                    SmallBBSet &bad_blocks,
-                                    SmallBBSet *decref_blocks,
-                                    SmallBBSet *raising_blocks) {
-        // stack of basic blocks for the walked path(s)
-        SmallVector<BasicBlock *, FANOUT_RECURSE_DEPTH> path_stack;
-        bool found = false;
-        // Get the terminator of the basic block containing the incref, the
-        // search starts from here.
-        auto term = cur_node->getTerminator();
-
-        // RAII push cur_node onto the work stack
-        raiiStack<SmallVectorImpl<BasicBlock *>> raii_path_stack(path_stack,
-                                                                 cur_node);
-
-        // This is a pass-by-ref accumulator.
-        unsigned subgraph_size = 0;
-
-        // Walk the successors of the terminator.
-        for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-            // Get the successor
-            BasicBlock *child = term->getSuccessor(i);
-            // Walk the successor looking for decrefs
-            found =
-                walkChildForDecref(incref, child, path_stack, subgraph_size,
-                                   bad_blocks, decref_blocks, raising_blocks);
-            // if not found, return false
-            if (!found)
-                return found; // found must be false
+    const FanoutRegion &getFanoutRegion(BasicBlock *head_node,
+                                        bool prune_raise_exit) {
+        auto &cached = regions->regions[prune_raise_exit];
+        auto it = cached.find(head_node);
+        if (it != cached.end())
+            return it->second;
+        FanoutRegion region = walkFanoutRegion(head_node, prune_raise_exit);
+        if (region.ok) {
+            for (BasicBlock *bb : region.decref_blocks)
+                regions->heads_by_tail[bb].push_back(head_node);
         }
-        return found;
+        return cached[head_node] = std::move(region);
     }
 
     /**
-     * "Walk" a child node looking for blocks containing decrefs or raises that
-     *  meet the conditions described in findFanoutDecrefCandidates.
+     * Forward pass.
      *
-     * Parameters:
-     * - incref: The incref under consideration
-     * - cur_node: The current basic block being assessed
-     * - path_stack: A stack of basic blocks representing unsearched paths
-     * - bad_blocks: a set of blocks that are known to not satisfy the
-     *   the fanout condition. Mutated by this function.
-     * - subgraph_size: accumulator to count the subgraph size (node count).
-     * - decref_blocks: a set that stores references to accepted blocks that
-     *   contain decrefs associated with the incref.
-     * - raising_blocks: a set that stores references to accepted blocks that
-     *   contain raises.
+     * Walk the successors of `head_node` until a block with decrefs or,
+     * if `prune_raise_exit` is set, a raising exit is found, visiting each
+     * block once.  A block reached again ends the walk: either it was on the
+     * current path, which is a legal back-edge, or its successors were
+     * already walked.  The walk fails if it reaches `head_node` again, which
+     * means that the incref can be executed multiple times before reaching
+     * the decref, an exit that isn't accepted, or more than `subgraph_limit`
+     * blocks.
+     *
+     * The tail-node condition is then checked for the blocks ending the
+     * walk, see verifyFanoutBackward.
      *
      * Returns:
-     *  - true if the conditions above hold, false otherwise.
+     *  - the region of `head_node`, see FanoutRegion.
      */
-    bool walkChildForDecref(CallInst *incref, BasicBlock *cur_node,
-                            SmallVectorImpl<BasicBlock *> &path_stack,
-                            unsigned &subgraph_size, SmallBBSet &bad_blocks,
-                            SmallBBSet *decref_blocks,
-                            SmallBBSet *raising_blocks) {
-        // If the current path stack exceeds the recursion depth, stop, return
-        // false.
-        if (path_stack.size() >= FANOUT_RECURSE_DEPTH)
-            return false;
-
-        // Reject subgraph that is bigger than the subgraph_limit
-        if (++subgraph_size > subgraph_limit) {
-            // mark head-node as always fail because that subgraph is too big
-            // to analyze.
-            bad_blocks.insert(incref->getParent());
-            return false;
-        }
-
-        // Check for the back-edge condition...
-        // If the current block is in the path stack
-        if (basicBlockInList(cur_node, path_stack)) {
-            // If the current node is TOS
-            if (cur_node == path_stack[0]) {
-                // Reject interior node back-edge to start of sub-graph.
-                // This means that the incref can be executed multiple times
-                // before reaching the decref.
-
-                // mark head-node as always fail.
-                bad_blocks.insert(incref->getParent());
-                return false;
+    FanoutRegion walkFanoutRegion(BasicBlock *head_node,
+                                  bool prune_raise_exit) {
+        FanoutRegion region;
+        SmallPtrSet<BasicBlock *, 16> visited;
+        SmallVector<BasicBlock *, 16> workstack(successors(head_node));
+        size_t subgraph_size = 0;
+        while (!workstack.empty()) {
+            BasicBlock *cur_node = workstack.pop_back_val();
+            // Reject interior node back-edge to start of sub-graph.
+            if (cur_node == head_node)
+                return region;
+            if (!visited.insert(cur_node).second)
+                continue;
+            // Reject subgraph that is bigger than the subgraph_limit
+            if (++subgraph_size > subgraph_limit)
+                return region;
+            // The decrefs of the block end this path; whether they are
+            // related to the incref is checked by findFanout.
+            if (blockHasDecref(cur_node)) {
+                region.decref_blocks.insert(cur_node);
+                continue;
             }
-            // it is a legal backedge; skip
-            return true;
-        }
-
-        // Does the current block have a related decref?
-        if (hasDecrefInNode(incref, cur_node)) {
-            // Add to the list of decref_blocks
-            decref_blocks->insert(cur_node);
-            return true; // done for this path
-        }
-
-        // Are there any decrefs in the current node?
-        if (hasAnyDecrefInNode(cur_node)) {
-            // Because we don't know about aliasing
-
-            // mark head-node as always fail.
-            bad_blocks.insert(incref->getParent());
-            return false;
-        }
-
-        // If raising_blocks is non-NULL, see if the current node is a block
-        // which raises, if so add to the raising_blocks list, this path is now
-        // finished.
-        if (raising_blocks && isRaising(cur_node)) {
-            raising_blocks->insert(cur_node);
-            return true; // done for this path
+            if (prune_raise_exit && isRaising(cur_node)) {
+                region.raising_blocks.insert(cur_node);
+                continue;
+            }
+            // Reject an exit that is not a raise, or a leaf
+            if (succ_empty(cur_node))
+                return region;
+            workstack.append(succ_begin(cur_node), succ_end(cur_node));
         }
-
-        // Continue searching by recursing into successors of the current
-        // block.
-
-        // First RAII push cur_node as TOS
-        raiiStack<SmallVectorImpl<BasicBlock *>> raii_push_pop(path_stack,
-                                                               cur_node);
-        bool found = false;
-        // get cur_node terminator
-        auto term = cur_node->getTerminator();
-        // walk successors of the current node
-        for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-            // get a successor
-            BasicBlock *child = term->getSuccessor(i);
-            // recurse
-            found =
-                walkChildForDecref(incref, child, path_stack, subgraph_size,
-                                   bad_blocks, decref_blocks, raising_blocks);
-            if (!found)
-                return false;
+        region.ok = true;
+
+        if (region.decref_blocks.empty())
+            return region;
+        if (!prune_raise_exit) {
+            region.backward_ok =
+                verifyFanoutBackward(head_node, &region.decref_blocks);
+        } else if (!region.raising_blocks.empty()) {
+            // combine decref_blocks into raising blocks for checking the
+            // exit node condition
+            SmallBBSet tail_nodes = region.raising_blocks;
+            for (BasicBlock *bb : region.decref_blocks)
+                tail_nodes.insert(bb);
+            region.backward_ok = verifyFanoutBackward(head_node, &tail_nodes);
         }
-        // If this is a leaf node, returns false.
-        return found;
+        return region;
     }
 
     /**
@@ -833,17 +1188,16 @@ struct RefPrunePass : public FunctionPass {
      * and the tail-nodes cannot be executed multiple times.
      *
      * Parameters:
-     * - incref: the incref instruction
-     * - head_node: the basic block containing the arg incref
+     * - head_node: the basic block containing the incref
      * - tail_nodes: a set containing the basic block(s) in which decrefs
-     *   corresponding to the arg incref instruction exist.
+     *   corresponding to the incref exist.
      *
      * Returns:
      * - true if it could be verified that there's no loop structure
      *   surrounding the use of the decrefs, false else.
      *
      */
-    bool verifyFanoutBackward(CallInst *incref, BasicBlock *head_node,
+    bool verifyFanoutBackward(BasicBlock *head_node,
                               const SmallBBSet *tail_nodes) {
         // push the tail nodes into a work list
         SmallVector<BasicBlock *, 10> todo;
@@ -856,7 +1210,7 @@ struct RefPrunePass : public FunctionPass {
         SmallBBSet visited;
         // while there is work...
         while (todo.size() > 0) {
-            SmallVector<BasicBlock *, FANOUT_RECURSE_DEPTH> workstack;
+            SmallVector<BasicBlock *, 16> workstack;
             // pop an element from the work list into the work stack
             workstack.push_back(todo.pop_back_val());
 
@@ -930,28 +1284,6 @@ struct RefPrunePass : public FunctionPass {
         return false;
     }
 
-    /**
-     * Does "Is a basic block in a given list"
-     *
-     * Template parameter <T>:
-     *  - the type of list
-     *
-     * Parameters:
-     *  - bb  a basic block
-     *  - list a list-like container in which to search
-     *
-     * Returns:
-     *  - true if bb is in list, false else.
-     */
-    template <class T>
-    bool basicBlockInList(const BasicBlock *bb, const T &list) {
-        for (BasicBlock *each : list) {
-            if (bb == each)
-                return true;
-        }
-        return false;
-    }
-
     /**
      * Check to see if a basic block contains a decref related to a given incref
      *
@@ -964,6 +1296,8 @@ struct RefPrunePass : public FunctionPass {
      *    otherwise.
      */
     bool hasDecrefInNode(CallInst *incref, BasicBlock *bb) {
+        if (index)
+            return index->firstDecref(incref->getArgOperand(0), bb) != NULL;
         for (Instruction &ii : *bb) {
             if (isRelatedDecref(incref, &ii) != NULL) {
                 return true;
@@ -1032,6 +1366,13 @@ struct RefPrunePass : public FunctionPass {
      *  - true if there is a decref in the basic block, false otherwise.
      */
     bool hasAnyDecrefInNode(BasicBlock *bb) {
+        if (index) {
+            if (!index->hasAnyDecref(bb))
+                return false;
+            // Remember why the query failed
+            index->blockers.push_back(bb);
+            return true;
+        }
         for (Instruction &ii : *bb) {
             CallInst *refop = GetRefOpCall(&ii);
             if (refop != NULL && IsDecRef(refop)) {
@@ -1041,6 +1382,34 @@ struct RefPrunePass : public FunctionPass {
         return false;
     }
 
+    /**
+     * As hasAnyDecrefInNode, without recording bb as a blocker.
+     */
+    bool blockHasDecref(BasicBlock *bb) {
+        if (index)
+            return index->hasAnyDecref(bb);
+        for (Instruction &ii : *bb) {
+            CallInst *refop = GetRefOpCall(&ii);
+            if (refop != NULL && IsDecRef(refop))
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Erase a decref, through the index if there is one, dropping the fanout
+     * regions that end at its block if it was the last decref there.
+     */
+    void eraseDecref(CallInst *decref) {
+        BasicBlock *bb = decref->getParent();
+        if (index)
+            index->eraseDecref(decref);
+        else
+            decref->eraseFromParent();
+        if (regions && !blockHasDecref(bb))
+            regions->invalidate(bb);
+    }
+
     /**
      * Determines if there is a decref between two nodes in a graph.
      *
@@ -1137,10 +1506,7 @@ struct RefPrunePass : public FunctionPass {
 char RefNormalizePass::ID = 0;
 char RefPrunePass::ID = 0;
 
-size_t RefPrunePass::stats_per_bb = 0;
-size_t RefPrunePass::stats_diamond = 0;
-size_t RefPrunePass::stats_fanout = 0;
-size_t RefPrunePass::stats_fanout_raise = 0;
+RefPruneStats RefPrunePass::global_stats;
 
 INITIALIZE_PASS(RefNormalizePass, "nrtrefnormalizepass", "Normalize NRT refops",
                 false, false)
@@ -1152,48 +1518,106 @@ INITIALIZE_PASS_DEPENDENCY(PostDominatorTreeWrapperPass)
 
 INITIALIZE_PASS_END(RefPrunePass, "refprunepass", "Prune NRT refops", false,
                     false)
+/**
+ * New pass manager adaptors for the passes above.  Each run constructs the
+ * legacy pass and feeds it the analyses from the FunctionAnalysisManager.
+ */
+struct RefNormalizeNewPass : public PassInfoMixin<RefNormalizeNewPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        if (!RefNormalizePass().runOnFunction(F))
+            return PreservedAnalyses::all();
+        // Refops are only moved within their block.
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+
+struct RefPruneNewPass : public PassInfoMixin<RefPruneNewPass> {
+    RefPrunePass::Subpasses flags;
+    size_t subgraph_limit;
+    RefPruneStats *stats;
+
+    RefPruneNewPass(RefPrunePass::Subpasses flags, size_t subgraph_limit,
+                    RefPruneStats *stats)
+        : flags(flags), subgraph_limit(subgraph_limit), stats(stats) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        RefPrunePass pass(flags, subgraph_limit, stats);
+        pass.domtree = &FAM.getResult<DominatorTreeAnalysis>(F);
+        pass.postdomtree = &FAM.getResult<PostDominatorTreeAnalysis>(F);
+        if (!pass.runPrune(F))
+            return PreservedAnalyses::all();
+        // Pruning only erases calls and leaves the CFG alone.
+        PreservedAnalyses PA;
+        PA.preserveSet<CFGAnalyses>();
+        return PA;
+    }
+};
+
+namespace llvm {
+
+/**
+ * Add the reference count pruning passes to a new pass manager pipeline.
+ * If stats is not NULL, the pruning is also counted there.
+ */
+void addRefPruneNewPasses(FunctionPassManager &FPM, int subpasses,
+                          size_t subgraph_limit, RefPruneStats *stats) {
+    FPM.addPass(RefNormalizeNewPass());
+    FPM.addPass(RefPruneNewPass((RefPrunePass::Subpasses)subpasses,
+                                subgraph_limit, stats));
+}
+
+} // namespace llvm
+
 extern "C" {
 
+/**
+ * Add the reference count pruning passes to PM.  If Stats is not NULL, the
+ * pruning is also counted there; it must outlive PM.
+ */
 API_EXPORT(void)
 LLVMPY_AddRefPrunePass(LLVMPassManagerRef PM, int subpasses,
-                       size_t subgraph_limit) {
+                       size_t subgraph_limit, LLVMPYRefPruneStatsRef Stats) {
     unwrap(PM)->add(new RefNormalizePass());
-    unwrap(PM)->add(
-        new RefPrunePass((RefPrunePass::Subpasses)subpasses, subgraph_limit));
+    unwrap(PM)->add(new RefPrunePass((RefPrunePass::Subpasses)subpasses,
+                                     subgraph_limit, Stats));
 }
 
-/**
- * Struct for holding statistics about the amount of pruning performed by
- * each type of pruning algorithm.
- */
-typedef struct PruneStats {
-    size_t basicblock;
-    size_t diamond;
-    size_t fanout;
-    size_t fanout_raise;
-} PRUNESTATS;
+API_EXPORT(LLVMPYRefPruneStatsRef)
+LLVMPY_CreateRefPruneStats() { return new RefPruneStats(); }
+
+API_EXPORT(void)
+LLVMPY_DisposeRefPruneStats(LLVMPYRefPruneStatsRef Stats) { delete Stats; }
+
+API_EXPORT(void)
+LLVMPY_GetRefPruneStats(LLVMPYRefPruneStatsRef Stats, PRUNESTATS *buf,
+                        bool reset) {
+    Stats->read(buf, reset);
+}
 
 API_EXPORT(void)
 LLVMPY_DumpRefPruneStats(PRUNESTATS *buf, bool do_print) {
-    /* PRUNESTATS is updated with the statistics about what has been pruned from
-     * the RefPrunePass static state vars. This isn't threadsafe but neither is
-     * the LLVM pass infrastructure so it's all done under a python thread lock.
+    /* PRUNESTATS is updated with the statistics about what has been pruned by
+     * all the RefPrunePass runs so far.
      *
      * do_print if set will print the stats to stderr.
      */
+    RefPrunePass::global_stats.read(buf, false);
     if (do_print) {
         errs() << "refprune stats "
-               << "per-BB " << RefPrunePass::stats_per_bb << " "
-               << "diamond " << RefPrunePass::stats_diamond << " "
-               << "fanout " << RefPrunePass::stats_fanout << " "
-               << "fanout+raise " << RefPrunePass::stats_fanout_raise << " "
+               << "per-BB " << buf->basicblock << " "
+               << "diamond " << buf->diamond << " "
+               << "fanout " << buf->fanout << " "
+               << "fanout+raise " << buf->fanout_raise << " "
                << "\n";
     };
+}
 
-    buf->basicblock = RefPrunePass::stats_per_bb;
-    buf->diamond = RefPrunePass::stats_diamond;
-    buf->fanout = RefPrunePass::stats_fanout;
-    buf->fanout_raise = RefPrunePass::stats_fanout_raise;
+API_EXPORT(void)
+LLVMPY_ResetRefPruneStats() {
+    PRUNESTATS buf;
+    RefPrunePass::global_stats.read(&buf, true);
 }
 
 } // extern "C"
@@ -1,7 +1,54 @@
 #include "core.h"
+#include "memorymanager.h"
+
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/DynamicLibrary.h"
 
+#include <mutex>
+
+namespace {
+
+/*
+ * The addresses of the symbols resolved in the process for JIT code, by
+ * linker name.  Symbols not found aren't cached, as a library loaded later
+ * may define them; the cache is cleared when symbols are added or libraries
+ * loaded, which may change what a name resolves to.
+ */
+struct SymbolCache {
+    std::mutex lock;
+    llvm::StringMap<uint64_t> addresses;
+
+    static SymbolCache &get() {
+        // Leaked, as engines may resolve symbols during exit
+        static SymbolCache *cache = new SymbolCache();
+        return *cache;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        addresses.clear();
+    }
+};
+
+} // end anonymous namespace
+
+uint64_t getCachedSymbolAddress(const std::string &Name) {
+    SymbolCache &cache = SymbolCache::get();
+    {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        auto it = cache.addresses.find(Name);
+        if (it != cache.addresses.end())
+            return it->second;
+    }
+    uint64_t addr = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(Name);
+    if (addr) {
+        std::lock_guard<std::mutex> guard(cache.lock);
+        cache.addresses[Name] = addr;
+    }
+    return addr;
+}
+
 extern "C" {
 
 API_EXPORT(void *)
@@ -12,6 +59,15 @@ LLVMPY_SearchAddressOfSymbol(const char *name) {
 API_EXPORT(void)
 LLVMPY_AddSymbol(const char *name, void *addr) {
     llvm::sys::DynamicLibrary::AddSymbol(name, addr);
+    SymbolCache::get().clear();
+}
+
+/* Register the *Count* symbols *Names* at *Addresses*. */
+API_EXPORT(void)
+LLVMPY_AddSymbols(const char **Names, void **Addresses, size_t Count) {
+    for (size_t i = 0; i < Count; ++i)
+        llvm::sys::DynamicLibrary::AddSymbol(Names[i], Addresses[i]);
+    SymbolCache::get().clear();
 }
 
 API_EXPORT(bool)
@@ -22,6 +78,7 @@ LLVMPY_LoadLibraryPermanently(const char *filename, const char **OutError) {
     if (failed) {
         *OutError = LLVMPY_CreateString(error.c_str());
     }
+    SymbolCache::get().clear();
     return failed;
 }
 
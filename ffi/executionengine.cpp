@@ -1,18 +1,40 @@
 #include "core.h"
+#include "memorymanager.h"
 
 #include "llvm-c/ExecutionEngine.h"
 #include "llvm-c/Object.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Memory.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#if LLVM_VERSION_MAJOR > 12
+#include "llvm/Support/SHA256.h"
+#else
+#include "llvm/Support/SHA1.h"
+#endif
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
 
+#include <chrono>
 #include <cstdio>
 #include <memory>
+#include <mutex>
+#include <string>
 
 namespace llvm {
 
@@ -65,6 +87,7 @@ LLVMPY_FinalizeObject(LLVMExecutionEngineRef EE) {
 
 static LLVMExecutionEngineRef create_execution_engine(LLVMModuleRef M,
                                                       LLVMTargetMachineRef TM,
+                                                      LLVMPYMemoryPoolRef Pool,
                                                       const char **OutError) {
     LLVMExecutionEngineRef ee = nullptr;
 
@@ -72,6 +95,8 @@ static LLVMExecutionEngineRef create_execution_engine(LLVMModuleRef M,
     std::string err;
     eb.setErrorStr(&err);
     eb.setEngineKind(llvm::EngineKind::JIT);
+    eb.setMCJITMemoryManager(Pool ? createPooledMemoryManager(Pool)
+                                  : createSectionMemoryManager());
 
     /* EngineBuilder::create loads the current process symbols */
     llvm::ExecutionEngine *engine = eb.create(llvm::unwrap(TM));
@@ -83,10 +108,14 @@ static LLVMExecutionEngineRef create_execution_engine(LLVMModuleRef M,
     return ee;
 }
 
+/*
+ * Create an MCJIT engine for *M*, allocating code and data from *Pool* if
+ * not NULL, or with LLVM's default memory manager otherwise.
+ */
 API_EXPORT(LLVMExecutionEngineRef)
 LLVMPY_CreateMCJITCompiler(LLVMModuleRef M, LLVMTargetMachineRef TM,
-                           const char **OutError) {
-    return create_execution_engine(M, TM, OutError);
+                           LLVMPYMemoryPoolRef Pool, const char **OutError) {
+    return create_execution_engine(M, TM, Pool, OutError);
 }
 
 API_EXPORT(uint64_t)
@@ -115,6 +144,24 @@ LLVMPY_AddGlobalMapping(LLVMExecutionEngineRef EE, LLVMValueRef Global,
     LLVMAddGlobalMapping(EE, Global, Addr);
 }
 
+/*
+ * Define the *Count* symbols *Names* at *Addresses* for the code of *EE*
+ * only.  They are resolved before the symbols of the process.
+ */
+API_EXPORT(void)
+LLVMPY_AddGlobalMappings(LLVMExecutionEngineRef EE, const char **Names,
+                         void **Addresses, size_t Count) {
+    llvm::ExecutionEngine *engine = llvm::unwrap(EE);
+    const llvm::DataLayout &DL = engine->getDataLayout();
+    llvm::SmallString<64> mangled;
+    for (size_t i = 0; i < Count; ++i) {
+        mangled.clear();
+        llvm::Mangler::getNameWithPrefix(mangled, Names[i], DL);
+        engine->addGlobalMapping(mangled,
+                                 reinterpret_cast<uint64_t>(Addresses[i]));
+    }
+}
+
 API_EXPORT(LLVMTargetDataRef)
 LLVMPY_GetExecutionEngineTargetData(LLVMExecutionEngineRef EE) {
     return LLVMGetExecutionEngineTargetData(EE);
@@ -155,6 +202,106 @@ LLVMPY_EnableJITEvents(LLVMExecutionEngineRef EE) {
     return result;
 }
 
+} // end extern "C"
+
+namespace {
+
+/*
+ * A listener appending the address, size and name of each function of the
+ * objects loaded by an engine to /tmp/perf-<pid>.map, where perf looks for
+ * the symbols of JIT code.  All engines share the listener, and the file.
+ * Only registered on Linux, the platform of perf.
+ */
+class PerfMapListener : public llvm::JITEventListener {
+  public:
+    static PerfMapListener &get() {
+        // Never destroyed, as engines may outlive static destructors
+        static PerfMapListener *listener = new PerfMapListener();
+        return *listener;
+    }
+
+    void notifyObjectLoaded(
+        ObjectKey K, const llvm::object::ObjectFile &Obj,
+        const llvm::RuntimeDyld::LoadedObjectInfo &L) override {
+        using namespace llvm::object;
+        // The object for debugging has its sections at their load addresses
+        OwningBinary<ObjectFile> debugObj = L.getObjectForDebug(Obj);
+        if (!debugObj.getBinary())
+            return;
+        std::string entries;
+        llvm::raw_string_ostream os(entries);
+        for (const auto &symSize : computeSymbolSizes(*debugObj.getBinary())) {
+            const SymbolRef &sym = symSize.first;
+            auto type = sym.getType();
+            auto name = sym.getName();
+            auto addr = sym.getAddress();
+            if (!type || !name || !addr || *type != SymbolRef::ST_Function ||
+                !symSize.second) {
+                llvm::consumeError(type.takeError());
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(addr.takeError());
+                continue;
+            }
+            os << llvm::format_hex_no_prefix(*addr, 1) << " "
+               << llvm::format_hex_no_prefix(symSize.second, 1) << " "
+               << *name << "\n";
+        }
+        os.flush();
+        if (entries.empty())
+            return;
+
+        // Opened for each object, so that a forked child writes the map of
+        // its own pid, and a removed map is created again
+        std::lock_guard<std::mutex> guard(lock);
+        std::error_code ec;
+        llvm::raw_fd_ostream file(
+            "/tmp/perf-" + std::to_string(llvm::sys::Process::getProcessId()) +
+                ".map",
+            ec, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text);
+        if (ec)
+            return;
+        file << entries;
+        file.close();
+        // A failed write is not worth aborting for
+        file.clear_error();
+    }
+
+  private:
+    std::mutex lock;
+};
+
+} // end anonymous namespace
+
+extern "C" {
+
+/*
+ * Register the perf listeners of *EE*: the perf map listener if *PerfMap*,
+ * and LLVM's jitdump listener, which also records the code, if *JITDump*.
+ * Returns false if a listener was requested but is unavailable: the perf
+ * map listener outside of Linux, or the jitdump listener if LLVM was built
+ * without it.
+ */
+API_EXPORT(bool)
+LLVMPY_EnablePerfEvents(LLVMExecutionEngineRef EE, bool PerfMap,
+                        bool JITDump) {
+    bool result = true;
+    if (PerfMap) {
+#ifdef __linux__
+        llvm::unwrap(EE)->RegisterJITEventListener(&PerfMapListener::get());
+#else
+        result = false;
+#endif
+    }
+    if (JITDump) {
+        llvm::JITEventListener *listener =
+            llvm::JITEventListener::createPerfJITEventListener();
+        if (!listener)
+            return false;
+        llvm::unwrap(EE)->RegisterJITEventListener(listener);
+    }
+    return result;
+}
+
 API_EXPORT(void)
 LLVMPY_MCJITAddObjectFile(LLVMExecutionEngineRef EE, LLVMObjectFileRef ObjF) {
     using namespace llvm;
@@ -171,15 +318,46 @@ LLVMPY_MCJITAddObjectFile(LLVMExecutionEngineRef EE, LLVMObjectFileRef ObjF) {
 // Object cache
 //
 
+typedef void (*ObjectCacheReleaseFunc)(void *);
+
+/*
+ * When returned by the getobject callback, a buffer with a NULL buf_release
+ * must have been allocated with LLVMPY_CreateByteString; it is copied and
+ * freed.  Otherwise the buffer is used in place and buf_release(buf_owner)
+ * is called once MCJIT is done with it, which is no earlier than the
+ * destruction of the engine.
+ */
 typedef struct {
     LLVMModuleRef modref;
     const char *buf_ptr;
     size_t buf_len;
+    ObjectCacheReleaseFunc buf_release;
+    void *buf_owner;
 } ObjectCacheData;
 
 typedef void (*ObjectCacheNotifyFunc)(void *, const ObjectCacheData *);
 typedef void (*ObjectCacheGetObjectFunc)(void *, ObjectCacheData *);
 
+/*
+ * A MemoryBuffer over memory owned by the object cache's client.
+ */
+class BorrowedMemoryBuffer : public llvm::MemoryBuffer {
+  public:
+    BorrowedMemoryBuffer(const ObjectCacheData &data)
+        : release(data.buf_release), owner(data.buf_owner) {
+        init(data.buf_ptr, data.buf_ptr + data.buf_len,
+             /*RequiresNullTerminator=*/false);
+    }
+
+    ~BorrowedMemoryBuffer() override { release(owner); }
+
+    BufferKind getBufferKind() const override { return MemoryBuffer_Malloc; }
+
+  private:
+    ObjectCacheReleaseFunc release;
+    void *owner;
+};
+
 class LLVMPYObjectCache : public llvm::ObjectCache {
   public:
     LLVMPYObjectCache(ObjectCacheNotifyFunc notify_func,
@@ -187,11 +365,13 @@ class LLVMPYObjectCache : public llvm::ObjectCache {
         : notify_func(notify_func), getobject_func(getobject_func),
           user_data(user_data) {}
 
+    // The buffer passed to the notify callback is owned by MCJIT; it must
+    // be copied to be kept beyond the callback.
     virtual void notifyObjectCompiled(const llvm::Module *M,
                                       llvm::MemoryBufferRef MBR) {
         if (notify_func) {
             ObjectCacheData data = {llvm::wrap(M), MBR.getBufferStart(),
-                                    MBR.getBufferSize()};
+                                    MBR.getBufferSize(), nullptr, nullptr};
             notify_func(user_data, &data);
         }
     }
@@ -204,15 +384,22 @@ class LLVMPYObjectCache : public llvm::ObjectCache {
         std::unique_ptr<llvm::MemoryBuffer> res = nullptr;
 
         if (getobject_func) {
-            ObjectCacheData data = {llvm::wrap(M), nullptr, 0};
+            ObjectCacheData data = {llvm::wrap(M), nullptr, 0, nullptr,
+                                    nullptr};
 
             getobject_func(user_data, &data);
             if (data.buf_ptr && data.buf_len > 0) {
-                // Assume the returned string was allocated
-                // with LLVMPY_CreateByteString
-                res = llvm::MemoryBuffer::getMemBufferCopy(
-                    llvm::StringRef(data.buf_ptr, data.buf_len));
-                LLVMPY_DisposeString(data.buf_ptr);
+                if (data.buf_release) {
+                    res = std::make_unique<BorrowedMemoryBuffer>(data);
+                } else {
+                    // Assume the returned string was allocated
+                    // with LLVMPY_CreateByteString
+                    res = llvm::MemoryBuffer::getMemBufferCopy(
+                        llvm::StringRef(data.buf_ptr, data.buf_len));
+                    LLVMPY_DisposeString(data.buf_ptr);
+                }
+            } else if (data.buf_release) {
+                data.buf_release(data.buf_owner);
             }
         }
         return res;
@@ -241,4 +428,174 @@ LLVMPY_SetObjectCache(LLVMExecutionEngineRef EE, LLVMPYObjectCacheRef C) {
     llvm::unwrap(EE)->setObjectCache(C);
 }
 
+//
+// On-disk object cache
+//
+
+// The minimum time between two scans of an on-disk object cache after
+// writes.  pruneCache() records the time of the last scan in the directory.
+static const std::chrono::seconds DiskCachePruneInterval(60);
+
+/*
+ * An object cache storing one file per module in a directory, which can be
+ * shared by any number of processes.  Files are named after a hash of the
+ * module's bitcode and of the code generation settings, are written to a
+ * temporary file and atomically renamed into place, and are mapped into
+ * memory on a hit.  The directory is pruned by least recent use once it
+ * grows beyond its size budget: when the cache is opened, and after writes
+ * at most once per pruning interval, as pruning scans the whole directory.
+ */
+class LLVMPYDiskObjectCache : public llvm::ObjectCache {
+  public:
+    LLVMPYDiskObjectCache(llvm::StringRef dir, uint64_t max_size,
+                          const llvm::TargetMachine &tm)
+        : dir(dir.str()), max_size(max_size) {
+        llvm::raw_string_ostream os(settings);
+        os << LLVM_VERSION_STRING << '\0' << tm.getTargetTriple().str()
+           << '\0' << tm.getTargetCPU() << '\0' << tm.getTargetFeatureString()
+           << '\0' << static_cast<int>(tm.getOptLevel()) << '\0'
+           << static_cast<int>(tm.getRelocationModel()) << '\0'
+           << static_cast<int>(tm.getCodeModel());
+        prune(std::chrono::seconds(0));
+    }
+
+    virtual void notifyObjectCompiled(const llvm::Module *M,
+                                      llvm::MemoryBufferRef MBR) {
+        auto it = keys.find(M);
+        if (it == keys.end())
+            return;
+        std::string path = pathFor(it->second);
+        keys.erase(it);
+
+        // Write to a unique file first, so that other processes never see
+        // a partial object.  Failures only cost a cache miss.  The name
+        // matches the pruned files, so that those left by a crash are too.
+        int fd;
+        llvm::SmallString<128> tmp;
+        if (llvm::sys::fs::createUniqueFile(dir + "/llvmcache-%%%%%%%%.tmp",
+                                            fd, tmp))
+            return;
+        {
+            llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+            os << MBR.getBuffer();
+            os.close();
+            if (os.has_error()) {
+                os.clear_error();
+                llvm::sys::fs::remove(tmp);
+                return;
+            }
+        }
+        if (llvm::sys::fs::rename(tmp, path)) {
+            llvm::sys::fs::remove(tmp);
+            return;
+        }
+        prune(DiskCachePruneInterval);
+    }
+
+    virtual std::unique_ptr<llvm::MemoryBuffer>
+    getObject(const llvm::Module *M) {
+        std::string key = hashModule(*M);
+        std::string path = pathFor(key);
+
+        llvm::Expected<llvm::sys::fs::file_t> fd =
+            llvm::sys::fs::openNativeFileForRead(path);
+        if (!fd) {
+            llvm::consumeError(fd.takeError());
+            keys[M] = key;
+            ++misses;
+            return nullptr;
+        }
+        // Files larger than a few pages are mmapped.
+        auto buf = llvm::MemoryBuffer::getOpenFile(
+            *fd, path, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+        if (buf) {
+            // Record the use for LRU pruning; atime alone may not be updated.
+            llvm::sys::fs::setLastAccessAndModificationTime(
+                *fd, std::chrono::system_clock::now());
+        }
+        llvm::sys::fs::closeFile(*fd);
+        if (!buf) {
+            keys[M] = key;
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        return std::move(*buf);
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+  private:
+    std::string hashModule(const llvm::Module &M) {
+        llvm::SmallVector<char, 0> bitcode;
+        llvm::raw_svector_ostream os(bitcode);
+        llvm::WriteBitcodeToFile(M, os);
+
+#if LLVM_VERSION_MAJOR > 12
+        llvm::SHA256 hasher;
+#else
+        llvm::SHA1 hasher;
+#endif
+        hasher.update(settings);
+        hasher.update(llvm::StringRef(bitcode.data(), bitcode.size()));
+        return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+    }
+
+    std::string pathFor(const std::string &key) {
+        // pruneCache() only considers files matching "llvmcache-*".
+        llvm::SmallString<128> path(dir);
+        llvm::sys::path::append(path, "llvmcache-" + key);
+        return std::string(path.str());
+    }
+
+    void prune(std::chrono::seconds interval) {
+        if (!max_size)
+            return;
+        llvm::CachePruningPolicy policy;
+        policy.Interval = interval;
+        policy.Expiration = std::chrono::seconds(0);
+        policy.MaxSizeBytes = max_size;
+        llvm::pruneCache(dir, policy);
+    }
+
+    std::string dir;
+    uint64_t max_size;
+    std::string settings;
+    // Keys of the modules being compiled after a miss
+    llvm::DenseMap<const llvm::Module *, std::string> keys;
+};
+
+typedef LLVMPYDiskObjectCache *LLVMPYDiskObjectCacheRef;
+
+/*
+ * Create an on-disk object cache in directory *Dir*, which is created if
+ * needed, and set it on *EE*.  Objects are keyed on the settings of the
+ * engine's target machine.  If *MaxSize* is non-zero, least recently used
+ * objects are removed to keep the directory under *MaxSize* bytes.
+ */
+API_EXPORT(LLVMPYDiskObjectCacheRef)
+LLVMPY_CreateDiskObjectCache(LLVMExecutionEngineRef EE, const char *Dir,
+                             uint64_t MaxSize, const char **OutError) {
+    if (std::error_code ec = llvm::sys::fs::create_directories(Dir)) {
+        *OutError = LLVMPY_CreateString(ec.message().c_str());
+        return nullptr;
+    }
+    llvm::ExecutionEngine *engine = llvm::unwrap(EE);
+    auto cache = new LLVMPYDiskObjectCache(Dir, MaxSize,
+                                           *engine->getTargetMachine());
+    engine->setObjectCache(cache);
+    return cache;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeDiskObjectCache(LLVMPYDiskObjectCacheRef C) { delete C; }
+
+API_EXPORT(void)
+LLVMPY_GetDiskObjectCacheStats(LLVMPYDiskObjectCacheRef C, uint64_t *Hits,
+                               uint64_t *Misses) {
+    *Hits = C->hits;
+    *Misses = C->misses;
+}
+
 } // end extern "C"
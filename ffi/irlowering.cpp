@@ -0,0 +1,1744 @@
+#include "core.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/AsmParser/SlotMapping.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/AutoUpgrade.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/*
+ * The commands of the op stream written by llvmlite.binding.irlowering,
+ * which must be kept in sync.  Each command is followed by its operands:
+ *
+ * - type, constant and metadata ids index the entities defined so far by
+ *   the corresponding commands, in order;
+ * - string ids index the string table, -1 standing for no string;
+ * - value references are tagged with the kind of value in their low bits.
+ *
+ * Module-level entities are defined before their first use, which may be
+ * inside a function body.
+ */
+enum Command {
+    // Types
+    CMD_TYPE_VOID = 1,
+    CMD_TYPE_LABEL,
+    CMD_TYPE_METADATA,
+    CMD_TYPE_INT,          // width
+    CMD_TYPE_HALF,
+    CMD_TYPE_FLOAT,
+    CMD_TYPE_DOUBLE,
+    CMD_TYPE_POINTER,      // pointee, addrspace
+    CMD_TYPE_FUNCTION,     // return, vararg, n, params...
+    CMD_TYPE_VECTOR,       // element, count
+    CMD_TYPE_ARRAY,        // element, count
+    CMD_TYPE_STRUCT,       // packed, n, elements...
+    CMD_TYPE_NAMED_STRUCT, // name; opaque until given a body
+    CMD_STRUCT_BODY,       // type, packed, n, elements...
+
+    // Constants
+    CMD_CONST_INT = 20, // type, value, signed
+    CMD_CONST_FP,       // type, IEEE double bits
+    CMD_CONST_NULL,     // type
+    CMD_CONST_UNDEF,    // type
+    CMD_CONST_STRING,   // type, string
+    CMD_CONST_AGGREGATE, // type, n, elements...
+    CMD_CONST_TEXT,     // type, string holding "<type> <value>"
+    CMD_CONST_METADATA, // metadata operand, see readMetadataOperand()
+    CMD_CONST_INLINE_ASM, // function type, asm, constraints, side effects
+
+    // Metadata
+    CMD_MD_NODE = 40,  // n, operands...
+    CMD_NAMED_MD,      // name, n, nodes...
+
+    // Module structure
+    CMD_MODULE = 50,     // triple, data layout
+    CMD_GLOBAL_VAR,      // name, type, addrspace, constant, linkage,
+                         // dllstorage, unnamed_addr, align, section
+    CMD_FUNCTION,        // name, type, linkage, cconv, section
+    CMD_GLOBAL_INIT,     // global, value
+    CMD_GLOBAL_MD,       // global, kind, node
+    CMD_FUNCTION_ATTRS,  // function, fn attrs, alignstack, personality,
+                         // return attrs, n, (arg, attrs)...
+    CMD_FUNCTION_BODY,   // function, n, arg names..., n, block names...
+    CMD_BLOCK,           // block
+    CMD_FORWARD,         // local, type: declare a value used before defined
+    CMD_END_BODY,
+
+    // Instructions; the first operand is the name of the result
+    CMD_INST_BINOP = 70, // opcode, flags, lhs, rhs
+    CMD_INST_FNEG,       // flags, value
+    CMD_INST_CAST,       // opcode, value, type
+    CMD_INST_ICMP,       // predicate, lhs, rhs
+    CMD_INST_FCMP,       // predicate, flags, lhs, rhs
+    CMD_INST_SELECT,     // flags, cond, lhs, rhs
+    CMD_INST_LOAD,       // type, pointer, align, ordering
+    CMD_INST_STORE,      // value, pointer, align, ordering
+    CMD_INST_ALLOCA,     // type, count or -1, align
+    CMD_INST_GEP,        // inbounds, source type, pointer, n, indices...
+    CMD_INST_PHI,        // type, flags, n, (value, block)...
+    CMD_INST_CALL,       // call operands, tail kind
+    CMD_INST_INVOKE,     // call operands, normal block, unwind block
+    CMD_INST_RET,        // n, value
+    CMD_INST_BR,         // block
+    CMD_INST_CONDBR,     // cond, true block, false block
+    CMD_INST_SWITCH,     // value, default, n, (value, block)...
+    CMD_INST_INDIRECTBR, // address, n, blocks...
+    CMD_INST_UNREACHABLE,
+    CMD_INST_RESUME,       // value
+    CMD_INST_EXTRACTELEMENT, // vector, index
+    CMD_INST_INSERTELEMENT,  // vector, value, index
+    CMD_INST_SHUFFLEVECTOR,  // vector, vector, mask
+    CMD_INST_EXTRACTVALUE,   // aggregate, n, indices...
+    CMD_INST_INSERTVALUE,    // aggregate, value, n, indices...
+    CMD_INST_ATOMICRMW,      // operation, pointer, value, ordering
+    CMD_INST_CMPXCHG,        // pointer, cmp, value, ordering, fail ordering
+    CMD_INST_FENCE,          // ordering, sync scope
+    CMD_INST_LANDINGPAD,     // type, cleanup, n, (filter, value)...
+    CMD_INST_MD,             // kind, node: attach to the last instruction
+};
+
+// Kinds of value references, in their low bits
+enum ValueTag { TAG_LOCAL = 0, TAG_GLOBAL = 1, TAG_CONST = 2 };
+const int TAG_BITS = 2;
+
+// Instruction flags: fast-math flags as in FastMathFlags, then wrap flags
+const int64_t FLAG_FMF_MASK = 0x7f;
+const int64_t FLAG_NUW = 0x100;
+const int64_t FLAG_NSW = 0x200;
+const int64_t FLAG_EXACT = 0x400;
+
+/*
+ * Decodes an op stream into a new module.  Decoding stops at the first
+ * error; the operands of the failing command are checked before any
+ * LLVM object is created from them.
+ */
+class IRDecoder {
+    LLVMContext &ctx;
+    const int64_t *pos;
+    const int64_t *end;
+    const char *strData;
+    const int64_t *strOffsets;
+    size_t numStrings;
+    bool failed = false;
+    std::string error;
+
+    // Placeholders for forward references; they must outlive the module
+    // while it still refers to them.
+    std::vector<std::unique_ptr<Argument>> placeholders;
+    std::unique_ptr<Module> module;
+
+    std::vector<Type *> types;
+    std::vector<Value *> consts;
+    std::vector<GlobalValue *> globals;
+    std::vector<Metadata *> mds;
+    SlotMapping slots;
+
+    // The function being defined
+    Function *fn = nullptr;
+    std::vector<Value *> locals;
+    DenseMap<int64_t, Argument *> forwards;
+    std::vector<BasicBlock *> blocks;
+    BasicBlock *block = nullptr;
+    Instruction *lastInst = nullptr;
+
+    std::vector<Instruction *> instsWithTBAA;
+
+  public:
+    IRDecoder(LLVMContext &ctx, const int64_t *ops, size_t numOps,
+              const char *strData, const int64_t *strOffsets,
+              size_t numStrings)
+        : ctx(ctx), pos(ops), end(ops + numOps), strData(strData),
+          strOffsets(strOffsets), numStrings(numStrings) {}
+
+    std::unique_ptr<Module> run(StringRef name);
+
+    const std::string &getError() const { return error; }
+
+  private:
+    bool fail(const Twine &msg) {
+        if (!failed) {
+            failed = true;
+            error = msg.str();
+        }
+        return false;
+    }
+
+    int64_t next() {
+        if (pos == end) {
+            fail("truncated op stream");
+            return 0;
+        }
+        return *pos++;
+    }
+
+    bool readString(StringRef &out);
+    Type *readType();
+    Value *readValue();
+    Constant *readConstant();
+    BasicBlock *readBlock();
+    Metadata *readMetadataOperand();
+    MDNode *readNode();
+    bool readAlign(MaybeAlign &out);
+    bool readOrdering(AtomicOrdering &out);
+    bool readBinaryOp(Instruction::BinaryOps &out);
+    bool readCastOp(Instruction::CastOps &out);
+    bool readPredicate(bool fp, CmpInst::Predicate &out);
+    bool readRMWOp(AtomicRMWInst::BinOp &out);
+    bool readLinkage(GlobalValue::LinkageTypes &out);
+    bool readCallingConv(unsigned &out);
+    bool readAttrs(AttrBuilder &builder);
+    bool setFlags(Instruction *inst, int64_t flags);
+
+    bool decodeCommand(int64_t cmd);
+    void upgrade();
+    bool decodeType(int64_t cmd);
+    bool decodeConstant(int64_t cmd);
+    bool decodeInstruction(int64_t cmd);
+    bool decodeCall(StringRef name, bool invoke);
+    bool decodeFunctionAttrs();
+    bool beginBody();
+    bool endBody();
+    bool insert(Instruction *inst, StringRef name);
+};
+
+/*
+ * Whether pointers of type *ptrTy* may point to values of type *ty*.
+ */
+static bool pointsTo(PointerType *ptrTy, Type *ty) {
+#if LLVM_VERSION_MAJOR < 14
+    return ptrTy->getElementType() == ty;
+#else
+    return ptrTy->isOpaqueOrPointeeTypeMatches(ty);
+#endif
+}
+
+/*
+ * Whether *ptr* is a pointer to values of type *ty*.
+ */
+static bool isPointerTo(Value *ptr, Type *ty) {
+    auto *ptrTy = dyn_cast<PointerType>(ptr->getType());
+    return ptrTy && pointsTo(ptrTy, ty);
+}
+
+/*
+ * An empty attribute builder.  Builders only know their context from
+ * LLVM 14.
+ */
+static AttrBuilder makeAttrBuilder(LLVMContext &ctx) {
+#if LLVM_VERSION_MAJOR < 14
+    return AttrBuilder();
+#else
+    return AttrBuilder(ctx);
+#endif
+}
+
+bool IRDecoder::readString(StringRef &out) {
+    int64_t id = next();
+    if (id == -1) {
+        out = StringRef();
+        return !failed;
+    }
+    if (id < 0 || (size_t)id >= numStrings)
+        return fail("invalid string id");
+    out = StringRef(strData + strOffsets[id],
+                    strOffsets[id + 1] - strOffsets[id]);
+    return !failed;
+}
+
+Type *IRDecoder::readType() {
+    int64_t id = next();
+    if (failed)
+        return nullptr;
+    if (id < 0 || (size_t)id >= types.size()) {
+        fail("invalid type id");
+        return nullptr;
+    }
+    return types[id];
+}
+
+Value *IRDecoder::readValue() {
+    int64_t ref = next();
+    if (failed)
+        return nullptr;
+    int64_t index = ref >> TAG_BITS;
+    Value *val = nullptr;
+    switch (ref & ((1 << TAG_BITS) - 1)) {
+    case TAG_LOCAL:
+        if (index >= 0 && (size_t)index < locals.size())
+            val = locals[index];
+        else if (forwards.count(index))
+            val = forwards[index];
+        break;
+    case TAG_GLOBAL:
+        if (index >= 0 && (size_t)index < globals.size())
+            val = globals[index];
+        break;
+    case TAG_CONST:
+        if (index >= 0 && (size_t)index < consts.size())
+            val = consts[index];
+        break;
+    }
+    if (!val)
+        fail("invalid value reference");
+    return val;
+}
+
+Constant *IRDecoder::readConstant() {
+    Value *val = readValue();
+    if (!val)
+        return nullptr;
+    auto *c = dyn_cast<Constant>(val);
+    if (!c)
+        fail("expected a constant");
+    return c;
+}
+
+BasicBlock *IRDecoder::readBlock() {
+    int64_t id = next();
+    if (failed)
+        return nullptr;
+    if (id < 0 || (size_t)id >= blocks.size()) {
+        fail("invalid block id");
+        return nullptr;
+    }
+    return blocks[id];
+}
+
+/*
+ * A metadata operand is a kind followed by its payload: 0 for null, 1 and
+ * a node id, 2 and a string id, or 3 and a value reference.
+ */
+Metadata *IRDecoder::readMetadataOperand() {
+    int64_t kind = next();
+    switch (kind) {
+    case 0:
+        return nullptr;
+    case 1: {
+        int64_t id = next();
+        if (failed || id < 0 || (size_t)id >= mds.size()) {
+            fail("invalid metadata id");
+            return nullptr;
+        }
+        return mds[id];
+    }
+    case 2: {
+        StringRef str;
+        if (!readString(str))
+            return nullptr;
+        return MDString::get(ctx, str);
+    }
+    case 3: {
+        Value *val = readValue();
+        if (!val)
+            return nullptr;
+        if (auto *mdv = dyn_cast<MetadataAsValue>(val))
+            return mdv->getMetadata();
+        return ValueAsMetadata::get(val);
+    }
+    default:
+        fail("invalid metadata operand");
+        return nullptr;
+    }
+}
+
+MDNode *IRDecoder::readNode() {
+    int64_t id = next();
+    if (failed || id < 0 || (size_t)id >= mds.size()) {
+        fail("invalid metadata id");
+        return nullptr;
+    }
+    auto *node = dyn_cast<MDNode>(mds[id]);
+    if (!node)
+        fail("expected a metadata node");
+    return node;
+}
+
+/*
+ * 0 stands for the default alignment.
+ */
+bool IRDecoder::readAlign(MaybeAlign &out) {
+    int64_t align = next();
+    if (failed)
+        return false;
+    if (align < 0 || (align && !isPowerOf2_64(align)))
+        return fail("alignment is not a power of two");
+    out = MaybeAlign(align);
+    return true;
+}
+
+/*
+ * Orderings, operations, predicates, linkages and calling conventions are
+ * given by their names in the textual IR; no string stands for the default.
+ */
+bool IRDecoder::readOrdering(AtomicOrdering &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    Optional<AtomicOrdering> ordering =
+        StringSwitch<Optional<AtomicOrdering>>(name)
+            .Case("", AtomicOrdering::NotAtomic)
+            .Case("unordered", AtomicOrdering::Unordered)
+            .Case("monotonic", AtomicOrdering::Monotonic)
+            .Case("acquire", AtomicOrdering::Acquire)
+            .Case("release", AtomicOrdering::Release)
+            .Case("acq_rel", AtomicOrdering::AcquireRelease)
+            .Case("seq_cst", AtomicOrdering::SequentiallyConsistent)
+            .Default(None);
+    if (!ordering)
+        return fail("invalid atomic ordering " + name);
+    out = *ordering;
+    return true;
+}
+
+bool IRDecoder::readBinaryOp(Instruction::BinaryOps &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    unsigned opcode = StringSwitch<unsigned>(name)
+                          .Case("add", Instruction::Add)
+                          .Case("fadd", Instruction::FAdd)
+                          .Case("sub", Instruction::Sub)
+                          .Case("fsub", Instruction::FSub)
+                          .Case("mul", Instruction::Mul)
+                          .Case("fmul", Instruction::FMul)
+                          .Case("udiv", Instruction::UDiv)
+                          .Case("sdiv", Instruction::SDiv)
+                          .Case("fdiv", Instruction::FDiv)
+                          .Case("urem", Instruction::URem)
+                          .Case("srem", Instruction::SRem)
+                          .Case("frem", Instruction::FRem)
+                          .Case("shl", Instruction::Shl)
+                          .Case("lshr", Instruction::LShr)
+                          .Case("ashr", Instruction::AShr)
+                          .Case("and", Instruction::And)
+                          .Case("or", Instruction::Or)
+                          .Case("xor", Instruction::Xor)
+                          .Default(0);
+    if (!opcode)
+        return fail("invalid binary operation " + name);
+    out = (Instruction::BinaryOps)opcode;
+    return true;
+}
+
+bool IRDecoder::readCastOp(Instruction::CastOps &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    unsigned opcode = StringSwitch<unsigned>(name)
+                          .Case("trunc", Instruction::Trunc)
+                          .Case("zext", Instruction::ZExt)
+                          .Case("sext", Instruction::SExt)
+                          .Case("fptoui", Instruction::FPToUI)
+                          .Case("fptosi", Instruction::FPToSI)
+                          .Case("uitofp", Instruction::UIToFP)
+                          .Case("sitofp", Instruction::SIToFP)
+                          .Case("fptrunc", Instruction::FPTrunc)
+                          .Case("fpext", Instruction::FPExt)
+                          .Case("ptrtoint", Instruction::PtrToInt)
+                          .Case("inttoptr", Instruction::IntToPtr)
+                          .Case("bitcast", Instruction::BitCast)
+                          .Case("addrspacecast", Instruction::AddrSpaceCast)
+                          .Default(0);
+    if (!opcode)
+        return fail("invalid cast " + name);
+    out = (Instruction::CastOps)opcode;
+    return true;
+}
+
+bool IRDecoder::readPredicate(bool fp, CmpInst::Predicate &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    CmpInst::Predicate invalid = CmpInst::BAD_ICMP_PREDICATE;
+    CmpInst::Predicate pred;
+    if (fp)
+        pred = StringSwitch<CmpInst::Predicate>(name)
+                   .Case("false", CmpInst::FCMP_FALSE)
+                   .Case("oeq", CmpInst::FCMP_OEQ)
+                   .Case("ogt", CmpInst::FCMP_OGT)
+                   .Case("oge", CmpInst::FCMP_OGE)
+                   .Case("olt", CmpInst::FCMP_OLT)
+                   .Case("ole", CmpInst::FCMP_OLE)
+                   .Case("one", CmpInst::FCMP_ONE)
+                   .Case("ord", CmpInst::FCMP_ORD)
+                   .Case("uno", CmpInst::FCMP_UNO)
+                   .Case("ueq", CmpInst::FCMP_UEQ)
+                   .Case("ugt", CmpInst::FCMP_UGT)
+                   .Case("uge", CmpInst::FCMP_UGE)
+                   .Case("ult", CmpInst::FCMP_ULT)
+                   .Case("ule", CmpInst::FCMP_ULE)
+                   .Case("une", CmpInst::FCMP_UNE)
+                   .Case("true", CmpInst::FCMP_TRUE)
+                   .Default(invalid);
+    else
+        pred = StringSwitch<CmpInst::Predicate>(name)
+                   .Case("eq", CmpInst::ICMP_EQ)
+                   .Case("ne", CmpInst::ICMP_NE)
+                   .Case("ugt", CmpInst::ICMP_UGT)
+                   .Case("uge", CmpInst::ICMP_UGE)
+                   .Case("ult", CmpInst::ICMP_ULT)
+                   .Case("ule", CmpInst::ICMP_ULE)
+                   .Case("sgt", CmpInst::ICMP_SGT)
+                   .Case("sge", CmpInst::ICMP_SGE)
+                   .Case("slt", CmpInst::ICMP_SLT)
+                   .Case("sle", CmpInst::ICMP_SLE)
+                   .Default(invalid);
+    if (pred == invalid)
+        return fail("invalid comparison " + name);
+    out = pred;
+    return true;
+}
+
+bool IRDecoder::readRMWOp(AtomicRMWInst::BinOp &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    AtomicRMWInst::BinOp invalid = AtomicRMWInst::BAD_BINOP;
+    AtomicRMWInst::BinOp op = StringSwitch<AtomicRMWInst::BinOp>(name)
+                                  .Case("xchg", AtomicRMWInst::Xchg)
+                                  .Case("add", AtomicRMWInst::Add)
+                                  .Case("sub", AtomicRMWInst::Sub)
+                                  .Case("and", AtomicRMWInst::And)
+                                  .Case("nand", AtomicRMWInst::Nand)
+                                  .Case("or", AtomicRMWInst::Or)
+                                  .Case("xor", AtomicRMWInst::Xor)
+                                  .Case("max", AtomicRMWInst::Max)
+                                  .Case("min", AtomicRMWInst::Min)
+                                  .Case("umax", AtomicRMWInst::UMax)
+                                  .Case("umin", AtomicRMWInst::UMin)
+                                  .Case("fadd", AtomicRMWInst::FAdd)
+                                  .Case("fsub", AtomicRMWInst::FSub)
+                                  .Default(invalid);
+    if (op == invalid)
+        return fail("invalid atomicrmw operation " + name);
+    out = op;
+    return true;
+}
+
+bool IRDecoder::readLinkage(GlobalValue::LinkageTypes &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    Optional<GlobalValue::LinkageTypes> linkage =
+        StringSwitch<Optional<GlobalValue::LinkageTypes>>(name)
+            .Cases("", "external", GlobalValue::ExternalLinkage)
+            .Case("available_externally",
+                  GlobalValue::AvailableExternallyLinkage)
+            .Case("linkonce", GlobalValue::LinkOnceAnyLinkage)
+            .Case("linkonce_odr", GlobalValue::LinkOnceODRLinkage)
+            .Case("weak", GlobalValue::WeakAnyLinkage)
+            .Case("weak_odr", GlobalValue::WeakODRLinkage)
+            .Case("appending", GlobalValue::AppendingLinkage)
+            .Case("internal", GlobalValue::InternalLinkage)
+            .Case("private", GlobalValue::PrivateLinkage)
+            .Case("extern_weak", GlobalValue::ExternalWeakLinkage)
+            .Case("common", GlobalValue::CommonLinkage)
+            .Default(None);
+    if (!linkage)
+        return fail("invalid linkage " + name);
+    out = *linkage;
+    return true;
+}
+
+bool IRDecoder::readCallingConv(unsigned &out) {
+    StringRef name;
+    if (!readString(name))
+        return false;
+    Optional<unsigned> cconv = StringSwitch<Optional<unsigned>>(name)
+                                   .Cases("", "ccc", CallingConv::C)
+                                   .Case("fastcc", CallingConv::Fast)
+                                   .Case("coldcc", CallingConv::Cold)
+                                   .Case("ghccc", CallingConv::GHC)
+                                   .Default(None);
+    unsigned number;
+    if (!cconv && name.consume_front("cc ") && !name.getAsInteger(10, number))
+        cconv = number;
+    if (!cconv || *cconv > CallingConv::MaxID)
+        return fail("unsupported calling convention " + name);
+    out = *cconv;
+    return true;
+}
+
+/*
+ * Read a set of attributes: n, attribute names..., align, dereferenceable,
+ * dereferenceable_or_null.  Like the assembly parser, this doesn't check
+ * that they suit the value they apply to.
+ */
+bool IRDecoder::readAttrs(AttrBuilder &builder) {
+    int64_t n = next();
+    for (int64_t i = 0; i < n && !failed; ++i) {
+        StringRef name;
+        if (!readString(name))
+            return false;
+        Attribute::AttrKind kind = Attribute::getAttrKindFromName(name);
+#if LLVM_VERSION_MAJOR < 13
+        if (kind == Attribute::None ||
+            Attribute::doesAttrKindHaveArgument(kind))
+#else
+        if (kind == Attribute::None || !Attribute::isEnumAttrKind(kind))
+#endif
+            return fail("unsupported attribute " + name);
+        builder.addAttribute(kind);
+    }
+    int64_t align = next();
+    int64_t deref = next();
+    int64_t derefOrNull = next();
+    if (failed)
+        return false;
+    if (align) {
+        if (align < 0 || !isPowerOf2_64(align))
+            return fail("alignment is not a power of two");
+        builder.addAlignmentAttr(Align(align));
+    }
+    if (deref)
+        builder.addDereferenceableAttr(deref);
+    if (derefOrNull)
+        builder.addDereferenceableOrNullAttr(derefOrNull);
+    return true;
+}
+
+bool IRDecoder::setFlags(Instruction *inst, int64_t flags) {
+    if (flags & FLAG_FMF_MASK) {
+        if (!isa<FPMathOperator>(inst))
+            return fail("fast-math flags on a non floating point operation");
+        FastMathFlags fmf;
+        // Bits of FastMathFlags in the order of LLVM's enumeration
+        fmf.setAllowReassoc(flags & 0x1);
+        fmf.setNoNaNs(flags & 0x2);
+        fmf.setNoInfs(flags & 0x4);
+        fmf.setNoSignedZeros(flags & 0x8);
+        fmf.setAllowReciprocal(flags & 0x10);
+        fmf.setAllowContract(flags & 0x20);
+        fmf.setApproxFunc(flags & 0x40);
+        inst->setFastMathFlags(fmf);
+    }
+    if (flags & (FLAG_NUW | FLAG_NSW)) {
+        if (!isa<OverflowingBinaryOperator>(inst))
+            return fail("wrap flags on an operation that can't overflow");
+        inst->setHasNoUnsignedWrap(flags & FLAG_NUW);
+        inst->setHasNoSignedWrap(flags & FLAG_NSW);
+    }
+    if (flags & FLAG_EXACT) {
+        if (!isa<PossiblyExactOperator>(inst))
+            return fail("exact flag on an operation that can't be exact");
+        inst->setIsExact(true);
+    }
+    return true;
+}
+
+std::unique_ptr<Module> IRDecoder::run(StringRef name) {
+    module = std::make_unique<Module>(name, ctx);
+    while (pos != end && !failed) {
+        int64_t cmd = next();
+        if (!decodeCommand(cmd))
+            break;
+    }
+    if (!failed && fn)
+        fail("unterminated function body");
+    if (failed) {
+        module.reset();
+        return nullptr;
+    }
+    upgrade();
+    return std::move(module);
+}
+
+// Apply the upgrades the assembly parser applies once a module is parsed.
+void IRDecoder::upgrade() {
+    for (Instruction *inst : instsWithTBAA) {
+        MDNode *node = inst->getMetadata(LLVMContext::MD_tbaa);
+        inst->setMetadata(LLVMContext::MD_tbaa, UpgradeTBAANode(*node));
+    }
+    for (Function &f : make_early_inc_range(*module))
+        UpgradeCallsToIntrinsic(&f);
+    UpgradeDebugInfo(*module);
+    UpgradeModuleFlags(*module);
+    UpgradeSectionAttributes(*module);
+}
+
+bool IRDecoder::decodeCommand(int64_t cmd) {
+    if (cmd >= CMD_TYPE_VOID && cmd <= CMD_STRUCT_BODY)
+        return decodeType(cmd);
+    if (cmd >= CMD_CONST_INT && cmd <= CMD_CONST_INLINE_ASM)
+        return decodeConstant(cmd);
+    if (cmd >= CMD_INST_BINOP && cmd <= CMD_INST_MD) {
+        if (!block)
+            return fail("instruction outside of a block");
+        return decodeInstruction(cmd);
+    }
+
+    switch (cmd) {
+    case CMD_MD_NODE: {
+        int64_t n = next();
+        SmallVector<Metadata *, 8> ops;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            Metadata *md = readMetadataOperand();
+            if (isa_and_nonnull<LocalAsMetadata>(md))
+                return fail("function-local value in a metadata node");
+            ops.push_back(md);
+        }
+        if (failed)
+            return false;
+        mds.push_back(MDTuple::get(ctx, ops));
+        return true;
+    }
+    case CMD_NAMED_MD: {
+        StringRef name;
+        if (!readString(name))
+            return false;
+        NamedMDNode *nmd = module->getOrInsertNamedMetadata(name);
+        int64_t n = next();
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            if (MDNode *node = readNode())
+                nmd->addOperand(node);
+        }
+        return !failed;
+    }
+    case CMD_MODULE: {
+        StringRef triple, layout;
+        if (!readString(triple) || !readString(layout))
+            return false;
+        module->setTargetTriple(triple);
+        auto dl = DataLayout::parse(layout);
+        if (!dl)
+            return fail(toString(dl.takeError()));
+        module->setDataLayout(*dl);
+        return true;
+    }
+    case CMD_GLOBAL_VAR: {
+        StringRef name, section;
+        if (!readString(name))
+            return false;
+        Type *ty = readType();
+        int64_t addrspace = next();
+        bool isConst = next();
+        GlobalValue::LinkageTypes linkage;
+        StringRef storage;
+        if (!readLinkage(linkage) || !readString(storage))
+            return false;
+        bool unnamedAddr = next();
+        MaybeAlign align;
+        if (!readAlign(align) || !readString(section))
+            return false;
+        if (!ty || !PointerType::isValidElementType(ty) ||
+            isa<FunctionType>(ty) || addrspace < 0 || addrspace > UINT32_MAX)
+            return fail("invalid global variable type");
+        Optional<GlobalValue::DLLStorageClassTypes> storageClass =
+            StringSwitch<Optional<GlobalValue::DLLStorageClassTypes>>(storage)
+                .Case("", GlobalValue::DefaultStorageClass)
+                .Case("dllimport", GlobalValue::DLLImportStorageClass)
+                .Case("dllexport", GlobalValue::DLLExportStorageClass)
+                .Default(None);
+        if (!storageClass)
+            return fail("invalid storage class " + storage);
+        auto *gv = new GlobalVariable(*module, ty, isConst, linkage, nullptr,
+                                      name, nullptr,
+                                      GlobalVariable::NotThreadLocal,
+                                      addrspace);
+        gv->setDLLStorageClass(*storageClass);
+        if (unnamedAddr)
+            gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+        gv->setAlignment(align);
+        if (!section.empty())
+            gv->setSection(section);
+        globals.push_back(gv);
+        return true;
+    }
+    case CMD_FUNCTION: {
+        StringRef name, section;
+        if (!readString(name))
+            return false;
+        Type *ty = readType();
+        GlobalValue::LinkageTypes linkage;
+        unsigned cconv;
+        if (!readLinkage(linkage) || !readCallingConv(cconv) ||
+            !readString(section))
+            return false;
+        auto *fnty = dyn_cast_or_null<FunctionType>(ty);
+        if (!fnty)
+            return fail("invalid function type");
+        Function *f = Function::Create(fnty, linkage, name, module.get());
+        f->setCallingConv(cconv);
+        if (!section.empty())
+            f->setSection(section);
+        globals.push_back(f);
+        return true;
+    }
+    case CMD_GLOBAL_INIT: {
+        int64_t id = next();
+        Constant *init = readConstant();
+        if (!init)
+            return false;
+        GlobalVariable *gv = nullptr;
+        if (id >= 0 && (size_t)id < globals.size())
+            gv = dyn_cast<GlobalVariable>(globals[id]);
+        if (!gv)
+            return fail("invalid global variable id");
+        if (init->getType() != gv->getValueType())
+            return fail("initializer type mismatch");
+        gv->setInitializer(init);
+        return true;
+    }
+    case CMD_GLOBAL_MD: {
+        int64_t id = next();
+        StringRef kind;
+        if (!readString(kind))
+            return false;
+        MDNode *node = readNode();
+        if (!node)
+            return false;
+        GlobalObject *go = nullptr;
+        if (id >= 0 && (size_t)id < globals.size())
+            go = dyn_cast<GlobalObject>(globals[id]);
+        if (!go)
+            return fail("invalid global id");
+        go->addMetadata(kind, *node);
+        return true;
+    }
+    case CMD_FUNCTION_ATTRS:
+        return decodeFunctionAttrs();
+    case CMD_FUNCTION_BODY:
+        return beginBody();
+    case CMD_BLOCK:
+        if (!fn)
+            return fail("block outside of a function body");
+        block = readBlock();
+        return block != nullptr;
+    case CMD_FORWARD: {
+        int64_t index = next();
+        Type *ty = readType();
+        if (!ty)
+            return false;
+        if (!fn || index < (int64_t)locals.size())
+            return fail("invalid forward reference");
+        if (!ty->isFirstClassType() || ty->isLabelTy())
+            return fail("invalid type for a forward reference");
+        if (!forwards.count(index)) {
+            placeholders.push_back(std::make_unique<Argument>(ty));
+            forwards[index] = placeholders.back().get();
+        }
+        return true;
+    }
+    case CMD_END_BODY:
+        return endBody();
+    }
+    return fail("invalid command");
+}
+
+bool IRDecoder::decodeType(int64_t cmd) {
+    Type *ty = nullptr;
+    switch (cmd) {
+    case CMD_TYPE_VOID:
+        ty = Type::getVoidTy(ctx);
+        break;
+    case CMD_TYPE_LABEL:
+        ty = Type::getLabelTy(ctx);
+        break;
+    case CMD_TYPE_METADATA:
+        ty = Type::getMetadataTy(ctx);
+        break;
+    case CMD_TYPE_INT: {
+        int64_t width = next();
+        if (width < IntegerType::MIN_INT_BITS ||
+            width > IntegerType::MAX_INT_BITS)
+            return fail("invalid integer width");
+        ty = IntegerType::get(ctx, width);
+        break;
+    }
+    case CMD_TYPE_HALF:
+        ty = Type::getHalfTy(ctx);
+        break;
+    case CMD_TYPE_FLOAT:
+        ty = Type::getFloatTy(ctx);
+        break;
+    case CMD_TYPE_DOUBLE:
+        ty = Type::getDoubleTy(ctx);
+        break;
+    case CMD_TYPE_POINTER: {
+        Type *pointee = readType();
+        int64_t addrspace = next();
+        if (!pointee || !PointerType::isValidElementType(pointee) ||
+            addrspace < 0)
+            return fail("invalid pointer type");
+        ty = PointerType::get(pointee, addrspace);
+        break;
+    }
+    case CMD_TYPE_FUNCTION: {
+        Type *ret = readType();
+        bool vararg = next();
+        int64_t n = next();
+        SmallVector<Type *, 8> params;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            Type *param = readType();
+            if (param && !FunctionType::isValidArgumentType(param))
+                return fail("invalid function argument type");
+            params.push_back(param);
+        }
+        if (failed || !ret || !FunctionType::isValidReturnType(ret))
+            return fail("invalid function type");
+        ty = FunctionType::get(ret, params, vararg);
+        break;
+    }
+    case CMD_TYPE_VECTOR:
+    case CMD_TYPE_ARRAY: {
+        Type *elem = readType();
+        int64_t count = next();
+        if (!elem || count < 0 || count > UINT32_MAX)
+            return fail("invalid sequential type");
+        if (cmd == CMD_TYPE_VECTOR) {
+            if (!count || !VectorType::isValidElementType(elem))
+                return fail("invalid vector type");
+            ty = FixedVectorType::get(elem, count);
+        } else {
+            if (!ArrayType::isValidElementType(elem))
+                return fail("invalid array type");
+            ty = ArrayType::get(elem, count);
+        }
+        break;
+    }
+    case CMD_TYPE_STRUCT:
+    case CMD_STRUCT_BODY: {
+        StructType *named = nullptr;
+        if (cmd == CMD_STRUCT_BODY) {
+            named = dyn_cast_or_null<StructType>(readType());
+            if (!named || !named->isOpaque())
+                return fail("invalid struct body");
+        }
+        bool packed = next();
+        int64_t n = next();
+        SmallVector<Type *, 8> elems;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            Type *elem = readType();
+            if (elem && !StructType::isValidElementType(elem))
+                return fail("invalid struct element type");
+            elems.push_back(elem);
+        }
+        if (failed)
+            return false;
+        if (named) {
+            named->setBody(elems, packed);
+            return true;
+        }
+        ty = StructType::get(ctx, elems, packed);
+        break;
+    }
+    case CMD_TYPE_NAMED_STRUCT: {
+        StringRef name;
+        if (!readString(name))
+            return false;
+        ty = StructType::create(ctx, name);
+        // Renamed if the name is taken in the context, but the constant
+        // parser must resolve it by the name used in the op stream
+        slots.NamedTypes[name] = ty;
+        break;
+    }
+    }
+    if (failed)
+        return false;
+    types.push_back(ty);
+    return true;
+}
+
+bool IRDecoder::decodeConstant(int64_t cmd) {
+    Value *val = nullptr;
+    switch (cmd) {
+    case CMD_CONST_INT: {
+        auto *ty = dyn_cast_or_null<IntegerType>(readType());
+        int64_t value = next();
+        bool isSigned = next();
+        if (!ty)
+            return fail("invalid integer constant");
+        val = ConstantInt::get(ctx, APInt(ty->getBitWidth(), value, isSigned));
+        break;
+    }
+    case CMD_CONST_FP: {
+        Type *ty = readType();
+        int64_t bits = next();
+        if (!ty || !ty->isFloatingPointTy())
+            return fail("invalid floating point constant");
+        val = ConstantFP::get(ty, BitsToDouble(bits));
+        break;
+    }
+    case CMD_CONST_NULL: {
+        Type *ty = readType();
+        if (!ty || !ty->isSized())
+            return fail("invalid null constant");
+        val = Constant::getNullValue(ty);
+        break;
+    }
+    case CMD_CONST_UNDEF: {
+        Type *ty = readType();
+        if (!ty || !ty->isFirstClassType() || ty->isLabelTy() ||
+            ty->isMetadataTy())
+            return fail("invalid undef constant");
+        val = UndefValue::get(ty);
+        break;
+    }
+    case CMD_CONST_STRING: {
+        Type *ty = readType();
+        StringRef str;
+        if (!ty || !readString(str))
+            return false;
+        Constant *c = ConstantDataArray::getString(ctx, str, false);
+        if (c->getType() != ty)
+            return fail("string constant type mismatch");
+        val = c;
+        break;
+    }
+    case CMD_CONST_AGGREGATE: {
+        Type *ty = readType();
+        int64_t n = next();
+        SmallVector<Constant *, 16> elems;
+        for (int64_t i = 0; i < n && !failed; ++i)
+            elems.push_back(readConstant());
+        if (failed || !ty)
+            return false;
+        for (int64_t i = 0; i < n; ++i) {
+            Type *expected = nullptr;
+            if (auto *st = dyn_cast<StructType>(ty)) {
+                if (!st->isOpaque() && (unsigned)n == st->getNumElements())
+                    expected = st->getElementType(i);
+            } else if (auto *at = dyn_cast<ArrayType>(ty)) {
+                if ((uint64_t)n == at->getNumElements())
+                    expected = at->getElementType();
+            } else if (auto *vt = dyn_cast<FixedVectorType>(ty)) {
+                if ((unsigned)n == vt->getNumElements())
+                    expected = vt->getElementType();
+            }
+            if (!expected || elems[i]->getType() != expected)
+                return fail("aggregate constant type mismatch");
+        }
+        if (auto *st = dyn_cast<StructType>(ty))
+            val = ConstantStruct::get(st, elems);
+        else if (auto *at = dyn_cast<ArrayType>(ty))
+            val = ConstantArray::get(at, elems);
+        else
+            val = ConstantVector::get(elems);
+        break;
+    }
+    case CMD_CONST_TEXT: {
+        Type *ty = readType();
+        StringRef text;
+        if (!ty || !readString(text))
+            return false;
+        // The parser needs a NUL-terminated buffer
+        std::string source(text);
+        SMDiagnostic err;
+        Constant *c = parseConstantValue(source, err, *module, &slots);
+        if (!c)
+            return fail("invalid constant: " + err.getMessage());
+        if (c->getType() != ty)
+            return fail("constant type mismatch");
+        val = c;
+        break;
+    }
+    case CMD_CONST_METADATA: {
+        Metadata *md = readMetadataOperand();
+        if (failed)
+            return false;
+        if (!md)
+            return fail("invalid metadata value");
+        val = MetadataAsValue::get(ctx, md);
+        break;
+    }
+    case CMD_CONST_INLINE_ASM: {
+        auto *fnty = dyn_cast_or_null<FunctionType>(readType());
+        StringRef asmStr, constraints;
+        if (!readString(asmStr) || !readString(constraints))
+            return false;
+        bool sideEffects = next();
+        if (!fnty)
+            return fail("invalid inline asm type");
+        if (!InlineAsm::Verify(fnty, constraints))
+            return fail("invalid inline asm constraints");
+        val = InlineAsm::get(fnty, asmStr, constraints, sideEffects);
+        break;
+    }
+    }
+    if (failed)
+        return false;
+    consts.push_back(val);
+    return true;
+}
+
+bool IRDecoder::decodeFunctionAttrs() {
+    int64_t id = next();
+    Function *f = nullptr;
+    if (id >= 0 && (size_t)id < globals.size())
+        f = dyn_cast<Function>(globals[id]);
+    if (failed || !f)
+        return fail("invalid function id");
+
+    AttrBuilder fnAttrs = makeAttrBuilder(ctx);
+    if (!readAttrs(fnAttrs))
+        return false;
+    int64_t alignstack = next();
+    if (alignstack) {
+        if (alignstack < 0 || !isPowerOf2_64(alignstack))
+            return fail("alignment is not a power of two");
+        fnAttrs.addStackAlignmentAttr(alignstack);
+    }
+    int64_t hasPersonality = next();
+    Constant *personality = hasPersonality ? readConstant() : nullptr;
+    AttrBuilder retAttrs = makeAttrBuilder(ctx);
+    if (!readAttrs(retAttrs))
+        return false;
+    int64_t n = next();
+    for (int64_t i = 0; i < n && !failed; ++i) {
+        int64_t arg = next();
+        if (arg < 0 || (size_t)arg >= f->arg_size())
+            return fail("invalid argument index");
+        AttrBuilder argAttrs = makeAttrBuilder(ctx);
+        if (!readAttrs(argAttrs))
+            return false;
+        f->addParamAttrs(arg, argAttrs);
+    }
+    if (failed || (hasPersonality && !personality))
+        return false;
+#if LLVM_VERSION_MAJOR < 14
+    f->addAttributes(AttributeList::FunctionIndex, fnAttrs);
+    f->addAttributes(AttributeList::ReturnIndex, retAttrs);
+#else
+    f->addFnAttrs(fnAttrs);
+    f->addRetAttrs(retAttrs);
+#endif
+    if (personality)
+        f->setPersonalityFn(personality);
+    return true;
+}
+
+bool IRDecoder::beginBody() {
+    int64_t id = next();
+    if (fn)
+        return fail("nested function body");
+    if (id >= 0 && (size_t)id < globals.size())
+        fn = dyn_cast<Function>(globals[id]);
+    if (failed || !fn || !fn->empty())
+        return fail("invalid function id");
+
+    int64_t nargs = next();
+    if (nargs < 0 || (size_t)nargs != fn->arg_size())
+        return fail("argument count mismatch");
+    for (Argument &arg : fn->args()) {
+        StringRef name;
+        if (!readString(name))
+            return false;
+        arg.setName(name);
+        locals.push_back(&arg);
+    }
+    int64_t nblocks = next();
+    if (nblocks <= 0)
+        return fail("function body without blocks");
+    for (int64_t i = 0; i < nblocks && !failed; ++i) {
+        StringRef name;
+        if (!readString(name))
+            return false;
+        blocks.push_back(BasicBlock::Create(ctx, name, fn));
+    }
+    return !failed;
+}
+
+bool IRDecoder::endBody() {
+    if (!fn)
+        return fail("unexpected end of function body");
+    if (!forwards.empty())
+        return fail("use of an undefined value");
+    for (BasicBlock *bb : blocks)
+        if (!bb->getTerminator())
+            return fail("block without a terminator");
+    fn = nullptr;
+    locals.clear();
+    blocks.clear();
+    block = nullptr;
+    lastInst = nullptr;
+    return true;
+}
+
+/*
+ * Append *inst* to the current block as the next local value.
+ */
+bool IRDecoder::insert(Instruction *inst, StringRef name) {
+    if (block->getTerminator()) {
+        inst->deleteValue();
+        return fail("instruction after the terminator of a block");
+    }
+    block->getInstList().push_back(inst);
+    if (!inst->getType()->isVoidTy())
+        inst->setName(name);
+    int64_t index = locals.size();
+    auto it = forwards.find(index);
+    if (it != forwards.end()) {
+        Argument *placeholder = it->second;
+        forwards.erase(it);
+        if (placeholder->getType() != inst->getType())
+            return fail("forward reference type mismatch");
+        placeholder->replaceAllUsesWith(inst);
+    }
+    locals.push_back(inst);
+    lastInst = inst;
+    return true;
+}
+
+bool IRDecoder::decodeCall(StringRef name, bool invoke) {
+    auto *fnty = dyn_cast_or_null<FunctionType>(readType());
+    Value *callee = readValue();
+    int64_t nargs = next();
+    SmallVector<Value *, 8> args;
+    for (int64_t i = 0; i < nargs && !failed; ++i)
+        args.push_back(readValue());
+    unsigned cconv;
+    if (!readCallingConv(cconv))
+        return false;
+    int64_t flags = next();
+    AttrBuilder fnAttrs = makeAttrBuilder(ctx);
+    if (!readAttrs(fnAttrs))
+        return false;
+    int64_t nattrs = next();
+    SmallVector<std::pair<int64_t, AttrBuilder>, 4> argAttrs;
+    for (int64_t i = 0; i < nattrs && !failed; ++i) {
+        int64_t arg = next();
+        if (arg < 0 || arg >= nargs)
+            return fail("invalid argument index");
+        argAttrs.emplace_back(arg, makeAttrBuilder(ctx));
+        if (!readAttrs(argAttrs.back().second))
+            return false;
+    }
+    int64_t tail = 0;
+    BasicBlock *normal = nullptr, *unwind = nullptr;
+    if (invoke) {
+        normal = readBlock();
+        unwind = readBlock();
+    } else {
+        tail = next();
+    }
+    if (failed || !fnty || !callee)
+        return fail("invalid call");
+
+    if (!isPointerTo(callee, fnty))
+        return fail("callee type mismatch");
+    if (nargs < fnty->getNumParams() ||
+        (nargs > fnty->getNumParams() && !fnty->isVarArg()))
+        return fail("call argument count mismatch");
+    for (unsigned i = 0; i < fnty->getNumParams(); ++i)
+        if (args[i]->getType() != fnty->getParamType(i))
+            return fail("call argument type mismatch");
+    if (tail < 0 || tail > CallInst::TCK_NoTail)
+        return fail("invalid tail call kind");
+
+    CallBase *call;
+    if (invoke)
+        call = InvokeInst::Create(fnty, callee, normal, unwind, args);
+    else
+        call = CallInst::Create(fnty, callee, args);
+    call->setCallingConv(cconv);
+#if LLVM_VERSION_MAJOR < 14
+    AttributeList attrs =
+        AttributeList::get(ctx, AttributeList::FunctionIndex, fnAttrs);
+#else
+    AttributeList attrs = AttributeList().addFnAttributes(ctx, fnAttrs);
+#endif
+    for (auto &it : argAttrs)
+        attrs = attrs.addParamAttributes(ctx, it.first, it.second);
+    call->setAttributes(attrs);
+    if (!invoke)
+        cast<CallInst>(call)->setTailCallKind((CallInst::TailCallKind)tail);
+    if (!setFlags(call, flags)) {
+        call->deleteValue();
+        return false;
+    }
+    return insert(call, name);
+}
+
+bool IRDecoder::decodeInstruction(int64_t cmd) {
+    if (cmd == CMD_INST_MD) {
+        StringRef kind;
+        if (!readString(kind))
+            return false;
+        MDNode *node = readNode();
+        if (!node)
+            return false;
+        if (!lastInst)
+            return fail("metadata without an instruction");
+        lastInst->setMetadata(kind, node);
+        if (kind == "tbaa")
+            instsWithTBAA.push_back(lastInst);
+        return true;
+    }
+
+    StringRef name;
+    if (!readString(name))
+        return false;
+
+    switch (cmd) {
+    case CMD_INST_BINOP: {
+        Instruction::BinaryOps opcode;
+        if (!readBinaryOp(opcode))
+            return false;
+        int64_t flags = next();
+        Value *lhs = readValue();
+        Value *rhs = readValue();
+        if (!lhs || !rhs)
+            return false;
+        if (lhs->getType() != rhs->getType())
+            return fail("binary operation operand type mismatch");
+        bool fp = opcode == Instruction::FAdd || opcode == Instruction::FSub ||
+                  opcode == Instruction::FMul || opcode == Instruction::FDiv ||
+                  opcode == Instruction::FRem;
+        if (fp ? !lhs->getType()->isFPOrFPVectorTy()
+               : !lhs->getType()->isIntOrIntVectorTy())
+            return fail("invalid operand type for binary operation");
+        Instruction *inst = BinaryOperator::Create(opcode, lhs, rhs);
+        if (!setFlags(inst, flags)) {
+            inst->deleteValue();
+            return false;
+        }
+        return insert(inst, name);
+    }
+    case CMD_INST_FNEG: {
+        int64_t flags = next();
+        Value *val = readValue();
+        if (!val)
+            return false;
+        if (!val->getType()->isFPOrFPVectorTy())
+            return fail("invalid operand type for fneg");
+        Instruction *inst = UnaryOperator::CreateFNeg(val);
+        if (!setFlags(inst, flags)) {
+            inst->deleteValue();
+            return false;
+        }
+        return insert(inst, name);
+    }
+    case CMD_INST_CAST: {
+        Instruction::CastOps opcode;
+        if (!readCastOp(opcode))
+            return false;
+        Value *val = readValue();
+        Type *ty = readType();
+        if (!val || !ty)
+            return false;
+        if (!CastInst::castIsValid(opcode, val, ty))
+            return fail("invalid cast");
+        return insert(CastInst::Create(opcode, val, ty), name);
+    }
+    case CMD_INST_ICMP:
+    case CMD_INST_FCMP: {
+        CmpInst::Predicate pred;
+        if (!readPredicate(cmd == CMD_INST_FCMP, pred))
+            return false;
+        int64_t flags = cmd == CMD_INST_FCMP ? next() : 0;
+        Value *lhs = readValue();
+        Value *rhs = readValue();
+        if (!lhs || !rhs)
+            return false;
+        Type *ty = lhs->getType();
+        if (ty != rhs->getType())
+            return fail("comparison operand type mismatch");
+        Instruction *inst;
+        if (cmd == CMD_INST_ICMP) {
+            if (!ty->isIntOrIntVectorTy() && !ty->isPtrOrPtrVectorTy())
+                return fail("invalid operand type for icmp");
+            inst = new ICmpInst(pred, lhs, rhs);
+        } else {
+            if (!ty->isFPOrFPVectorTy())
+                return fail("invalid operand type for fcmp");
+            inst = new FCmpInst(pred, lhs, rhs);
+        }
+        if (!setFlags(inst, flags)) {
+            inst->deleteValue();
+            return false;
+        }
+        return insert(inst, name);
+    }
+    case CMD_INST_SELECT: {
+        int64_t flags = next();
+        Value *cond = readValue();
+        Value *lhs = readValue();
+        Value *rhs = readValue();
+        if (!cond || !lhs || !rhs)
+            return false;
+        if (const char *err = SelectInst::areInvalidOperands(cond, lhs, rhs))
+            return fail(err);
+        Instruction *inst = SelectInst::Create(cond, lhs, rhs);
+        if (!setFlags(inst, flags)) {
+            inst->deleteValue();
+            return false;
+        }
+        return insert(inst, name);
+    }
+    case CMD_INST_LOAD: {
+        Type *ty = readType();
+        Value *ptr = readValue();
+        MaybeAlign align;
+        AtomicOrdering ordering;
+        if (!ty || !ptr || !readAlign(align) || !readOrdering(ordering))
+            return false;
+        if (!isPointerTo(ptr, ty) || !ty->isFirstClassType() ||
+            !ty->isSized() ||
+            (ordering != AtomicOrdering::NotAtomic && !align) ||
+            ordering == AtomicOrdering::Release ||
+            ordering == AtomicOrdering::AcquireRelease)
+            return fail("invalid load");
+        if (!align)
+            align = module->getDataLayout().getABITypeAlign(ty);
+        return insert(new LoadInst(ty, ptr, "", false, *align, ordering),
+                      name);
+    }
+    case CMD_INST_STORE: {
+        Value *val = readValue();
+        Value *ptr = readValue();
+        MaybeAlign align;
+        AtomicOrdering ordering;
+        if (!val || !ptr || !readAlign(align) || !readOrdering(ordering))
+            return false;
+        Type *ty = val->getType();
+        if (!isPointerTo(ptr, ty) || !ty->isFirstClassType() ||
+            !ty->isSized() ||
+            (ordering != AtomicOrdering::NotAtomic && !align) ||
+            ordering == AtomicOrdering::Acquire ||
+            ordering == AtomicOrdering::AcquireRelease)
+            return fail("invalid store");
+        if (!align)
+            align = module->getDataLayout().getABITypeAlign(ty);
+        return insert(new StoreInst(val, ptr, false, *align, ordering), name);
+    }
+    case CMD_INST_ALLOCA: {
+        Type *ty = readType();
+        int64_t countRef = next();
+        Value *count = nullptr;
+        if (countRef != -1) {
+            --pos;
+            count = readValue();
+            if (!count)
+                return false;
+            if (!count->getType()->isIntegerTy())
+                return fail("invalid alloca count");
+        }
+        MaybeAlign align;
+        if (!ty || !readAlign(align))
+            return false;
+        if (!ty->isSized() || !PointerType::isValidElementType(ty))
+            return fail("invalid alloca type");
+        const DataLayout &DL = module->getDataLayout();
+        if (!align)
+            align = DL.getPrefTypeAlign(ty);
+        return insert(
+            new AllocaInst(ty, DL.getAllocaAddrSpace(), count, *align), name);
+    }
+    case CMD_INST_GEP: {
+        bool inbounds = next();
+        Type *srcTy = readType();
+        Value *ptr = readValue();
+        int64_t n = next();
+        SmallVector<Value *, 8> indices;
+        for (int64_t i = 0; i < n && !failed; ++i)
+            indices.push_back(readValue());
+        if (failed || !srcTy || !ptr)
+            return false;
+        auto *ptrTy = dyn_cast<PointerType>(ptr->getType()->getScalarType());
+        if (!ptrTy || !pointsTo(ptrTy, srcTy))
+            return fail("invalid getelementptr");
+        for (Value *idx : indices)
+            if (!idx->getType()->isIntOrIntVectorTy())
+                return fail("invalid getelementptr index");
+        if (!GetElementPtrInst::getIndexedType(srcTy, indices))
+            return fail("invalid getelementptr indices");
+        auto *inst = GetElementPtrInst::Create(srcTy, ptr, indices);
+        inst->setIsInBounds(inbounds);
+        return insert(inst, name);
+    }
+    case CMD_INST_PHI: {
+        Type *ty = readType();
+        int64_t flags = next();
+        int64_t n = next();
+        if (!ty || !ty->isFirstClassType() || ty->isLabelTy())
+            return fail("invalid phi type");
+        SmallVector<std::pair<Value *, BasicBlock *>, 4> incomings;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            Value *val = readValue();
+            BasicBlock *bb = readBlock();
+            if (val && val->getType() != ty)
+                return fail("phi incoming type mismatch");
+            incomings.emplace_back(val, bb);
+        }
+        if (failed)
+            return false;
+        PHINode *phi = PHINode::Create(ty, n);
+        for (auto &it : incomings)
+            phi->addIncoming(it.first, it.second);
+        if (!setFlags(phi, flags)) {
+            phi->deleteValue();
+            return false;
+        }
+        return insert(phi, name);
+    }
+    case CMD_INST_CALL:
+    case CMD_INST_INVOKE:
+        return decodeCall(name, cmd == CMD_INST_INVOKE);
+    case CMD_INST_RET: {
+        int64_t n = next();
+        Value *val = n ? readValue() : nullptr;
+        if (failed)
+            return false;
+        Type *retTy = fn->getReturnType();
+        if (val ? val->getType() != retTy : !retTy->isVoidTy())
+            return fail("return type mismatch");
+        return insert(ReturnInst::Create(ctx, val), name);
+    }
+    case CMD_INST_BR: {
+        BasicBlock *dest = readBlock();
+        if (!dest)
+            return false;
+        return insert(BranchInst::Create(dest), name);
+    }
+    case CMD_INST_CONDBR: {
+        Value *cond = readValue();
+        BasicBlock *ifTrue = readBlock();
+        BasicBlock *ifFalse = readBlock();
+        if (!cond || !ifTrue || !ifFalse)
+            return false;
+        if (!cond->getType()->isIntegerTy(1))
+            return fail("branch condition is not an i1");
+        return insert(BranchInst::Create(ifTrue, ifFalse, cond), name);
+    }
+    case CMD_INST_SWITCH: {
+        Value *val = readValue();
+        BasicBlock *dflt = readBlock();
+        int64_t n = next();
+        SmallVector<std::pair<ConstantInt *, BasicBlock *>, 8> cases;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            Value *caseVal = readValue();
+            BasicBlock *bb = readBlock();
+            auto *c = dyn_cast_or_null<ConstantInt>(caseVal);
+            if (caseVal && (!c || !val || c->getType() != val->getType()))
+                return fail("invalid switch case");
+            cases.emplace_back(c, bb);
+        }
+        if (failed || !val || !dflt)
+            return false;
+        if (!val->getType()->isIntegerTy())
+            return fail("invalid switch value");
+        SwitchInst *sw = SwitchInst::Create(val, dflt, n);
+        for (auto &it : cases)
+            sw->addCase(it.first, it.second);
+        return insert(sw, name);
+    }
+    case CMD_INST_INDIRECTBR: {
+        Value *addr = readValue();
+        int64_t n = next();
+        SmallVector<BasicBlock *, 8> dests;
+        for (int64_t i = 0; i < n && !failed; ++i)
+            dests.push_back(readBlock());
+        if (failed || !addr)
+            return false;
+        if (!addr->getType()->isPointerTy())
+            return fail("invalid indirectbr address");
+        IndirectBrInst *br = IndirectBrInst::Create(addr, n);
+        for (BasicBlock *bb : dests)
+            br->addDestination(bb);
+        return insert(br, name);
+    }
+    case CMD_INST_UNREACHABLE:
+        return insert(new UnreachableInst(ctx), name);
+    case CMD_INST_RESUME: {
+        Value *val = readValue();
+        if (!val)
+            return false;
+        return insert(ResumeInst::Create(val), name);
+    }
+    case CMD_INST_EXTRACTELEMENT: {
+        Value *vec = readValue();
+        Value *idx = readValue();
+        if (!vec || !idx)
+            return false;
+        if (!ExtractElementInst::isValidOperands(vec, idx))
+            return fail("invalid extractelement");
+        return insert(ExtractElementInst::Create(vec, idx), name);
+    }
+    case CMD_INST_INSERTELEMENT: {
+        Value *vec = readValue();
+        Value *elt = readValue();
+        Value *idx = readValue();
+        if (!vec || !elt || !idx)
+            return false;
+        if (!InsertElementInst::isValidOperands(vec, elt, idx))
+            return fail("invalid insertelement");
+        return insert(InsertElementInst::Create(vec, elt, idx), name);
+    }
+    case CMD_INST_SHUFFLEVECTOR: {
+        Value *v1 = readValue();
+        Value *v2 = readValue();
+        Value *mask = readValue();
+        if (!v1 || !v2 || !mask)
+            return false;
+        if (!ShuffleVectorInst::isValidOperands(v1, v2, mask))
+            return fail("invalid shufflevector");
+        return insert(new ShuffleVectorInst(v1, v2, mask), name);
+    }
+    case CMD_INST_EXTRACTVALUE:
+    case CMD_INST_INSERTVALUE: {
+        Value *agg = readValue();
+        Value *val = cmd == CMD_INST_INSERTVALUE ? readValue() : nullptr;
+        int64_t n = next();
+        SmallVector<unsigned, 4> indices;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            int64_t idx = next();
+            if (idx < 0 || idx > UINT32_MAX)
+                return fail("invalid aggregate index");
+            indices.push_back(idx);
+        }
+        if (failed || !agg || (cmd == CMD_INST_INSERTVALUE && !val))
+            return false;
+        Type *ty = indices.empty() ? nullptr
+                                   : ExtractValueInst::getIndexedType(
+                                         agg->getType(), indices);
+        if (!ty || (val && val->getType() != ty))
+            return fail("invalid aggregate indices");
+        if (val)
+            return insert(InsertValueInst::Create(agg, val, indices), name);
+        return insert(ExtractValueInst::Create(agg, indices), name);
+    }
+    case CMD_INST_ATOMICRMW: {
+        AtomicRMWInst::BinOp op;
+        if (!readRMWOp(op))
+            return false;
+        Value *ptr = readValue();
+        Value *val = readValue();
+        AtomicOrdering ordering;
+        if (!ptr || !val || !readOrdering(ordering))
+            return false;
+        Type *ty = val->getType();
+        if (!isPointerTo(ptr, ty) || ordering == AtomicOrdering::Unordered ||
+            ordering == AtomicOrdering::NotAtomic)
+            return fail("invalid atomicrmw");
+        bool validType;
+        if (op == AtomicRMWInst::Xchg)
+            validType = ty->isIntegerTy() || ty->isFloatingPointTy();
+        else if (AtomicRMWInst::isFPOperation(op))
+            validType = ty->isFloatingPointTy();
+        else
+            validType = ty->isIntegerTy();
+        unsigned size = ty->getPrimitiveSizeInBits();
+        if (!validType || size < 8 || !isPowerOf2_32(size))
+            return fail("invalid operand type for atomicrmw");
+        Align align(module->getDataLayout().getTypeStoreSize(ty));
+        return insert(new AtomicRMWInst(op, ptr, val, align, ordering,
+                                        SyncScope::System),
+                      name);
+    }
+    case CMD_INST_CMPXCHG: {
+        Value *ptr = readValue();
+        Value *cmp = readValue();
+        Value *val = readValue();
+        AtomicOrdering success, failure;
+        if (!ptr || !cmp || !val || !readOrdering(success) ||
+            !readOrdering(failure))
+            return false;
+        if (!isPointerTo(ptr, cmp->getType()) ||
+            cmp->getType() != val->getType() ||
+            !cmp->getType()->isIntOrPtrTy() ||
+#if LLVM_VERSION_MAJOR < 13
+            // LLVM 12 also forbids failure orderings stronger than the
+            // success one.
+            success == AtomicOrdering::NotAtomic ||
+            success == AtomicOrdering::Unordered ||
+            failure == AtomicOrdering::NotAtomic ||
+            failure == AtomicOrdering::Unordered ||
+            failure == AtomicOrdering::Release ||
+            failure == AtomicOrdering::AcquireRelease ||
+            isStrongerThan(failure, success))
+#else
+            !AtomicCmpXchgInst::isValidSuccessOrdering(success) ||
+            !AtomicCmpXchgInst::isValidFailureOrdering(failure))
+#endif
+            return fail("invalid cmpxchg");
+        Align align(
+            module->getDataLayout().getTypeStoreSize(cmp->getType()));
+        return insert(new AtomicCmpXchgInst(ptr, cmp, val, align, success,
+                                            failure, SyncScope::System),
+                      name);
+    }
+    case CMD_INST_FENCE: {
+        AtomicOrdering ordering;
+        StringRef scope;
+        if (!readOrdering(ordering) || !readString(scope))
+            return false;
+        if (!isAcquireOrStronger(ordering) && !isReleaseOrStronger(ordering))
+            return fail("invalid fence ordering");
+        SyncScope::ID ssid = SyncScope::System;
+        if (scope.data())
+            ssid = ctx.getOrInsertSyncScopeID(scope);
+        return insert(new FenceInst(ctx, ordering, ssid), name);
+    }
+    case CMD_INST_LANDINGPAD: {
+        Type *ty = readType();
+        bool cleanup = next();
+        int64_t n = next();
+        SmallVector<Constant *, 4> clauses;
+        for (int64_t i = 0; i < n && !failed; ++i) {
+            bool filter = next();
+            Constant *c = readConstant();
+            if (c && filter != isa<ArrayType>(c->getType()))
+                return fail("invalid landingpad clause");
+            clauses.push_back(c);
+        }
+        if (failed || !ty)
+            return false;
+        LandingPadInst *pad = LandingPadInst::Create(ty, n);
+        pad->setCleanup(cleanup);
+        for (Constant *c : clauses)
+            pad->addClause(c);
+        return insert(pad, name);
+    }
+    }
+    return fail("invalid instruction");
+}
+
+} // end anonymous namespace
+
+extern "C" {
+
+/*
+ * Build a module named *Name* in *Context* from the op stream *Ops* and the
+ * *NumStrings* strings of *StrData*, the i-th of which spans offsets
+ * *StrOffsets*[i] to *StrOffsets*[i + 1].  Like the assembly parser, this
+ * checks the operands of each instruction but doesn't verify the module.
+ * Returns NULL and sets *OutError* on failure.
+ */
+API_EXPORT(LLVMModuleRef)
+LLVMPY_LowerModule(LLVMContextRef Context, const int64_t *Ops, size_t NumOps,
+                   const char *StrData, const int64_t *StrOffsets,
+                   size_t NumStrings, const char *Name,
+                   const char **OutError) {
+    IRDecoder decoder(*unwrap(Context), Ops, NumOps, StrData, StrOffsets,
+                      NumStrings);
+    std::unique_ptr<Module> M = decoder.run(Name);
+    if (!M) {
+        *OutError = LLVMPY_CreateString(decoder.getError().c_str());
+        return nullptr;
+    }
+    return wrap(M.release());
+}
+
+} // end extern "C"
@@ -5,12 +5,21 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include "llvm-c/Linker.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 
-extern "C" {
-
-API_EXPORT(int)
-LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err) {
+/*
+ * Link the *Count* modules of *Srcs* into *Dest* in order, consuming them,
+ * with a single Linker so that the types of *Dest* are only indexed once.
+ * With *OnlyNeeded*, only the definitions used so far are linked in, and
+ * with *Internalize*, those linked in are then made internal.  Returns 0,
+ * or one plus the index of the module that failed, having set *Err* and
+ * disposed of the remaining modules.
+ */
+static size_t linkModules(LLVMModuleRef Dest, LLVMModuleRef *Srcs,
+                          size_t Count, bool OnlyNeeded, bool Internalize,
+                          const char **Err) {
     using namespace llvm;
     std::string errorstring;
     llvm::raw_string_ostream errstream(errorstring);
@@ -43,7 +52,30 @@ LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err) {
         std::make_unique<ReportNotAbortDiagnosticHandler>(errstream));
 
     // link
-    bool failed = LLVMLinkModules2(Dest, Src);
+    Linker L(*D);
+    size_t failed = 0;
+    // Internalizing after each module would keep the following ones from
+    // resolving to its symbols, so only collect their names until the end
+    StringSet<> linked;
+    auto collect = [&linked](Module &, const StringSet<> &Names) {
+        for (const auto &name : Names)
+            linked.insert(name.getKey());
+    };
+    for (size_t i = 0; i < Count; ++i) {
+        std::unique_ptr<Module> src(unwrap(Srcs[i]));
+        unsigned flags = OnlyNeeded ? Linker::LinkOnlyNeeded : Linker::None;
+        if (failed)
+            continue;
+        bool err = Internalize ? L.linkInModule(std::move(src), flags, collect)
+                               : L.linkInModule(std::move(src), flags);
+        if (err)
+            failed = i + 1;
+    }
+    if (!failed && Internalize && !linked.empty()) {
+        internalizeModule(*D, [&linked](const GlobalValue &GV) {
+            return !GV.hasName() || !linked.count(GV.getName());
+        });
+    }
 
     // put old handler back
     Ctx.setDiagnosticHandler(std::move(OldDiagnosticHandler));
@@ -57,4 +89,27 @@ LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, const char **Err) {
     return failed;
 }
 
+extern "C" {
+
+/*
+ * Link *Src* into *Dest*, consuming it.  With *OnlyNeeded*, only the
+ * definitions used by *Dest* are linked in; if *Src* was parsed lazily, the
+ * other function bodies aren't even materialized.
+ */
+API_EXPORT(int)
+LLVMPY_LinkModules(LLVMModuleRef Dest, LLVMModuleRef Src, bool OnlyNeeded,
+                   const char **Err) {
+    return linkModules(Dest, &Src, 1, OnlyNeeded, false, Err) != 0;
+}
+
+/*
+ * Link the *Count* modules of *Srcs* into *Dest* with a single diagnostic
+ * handler installation.  See linkModules.
+ */
+API_EXPORT(size_t)
+LLVMPY_LinkModulesBatch(LLVMModuleRef Dest, LLVMModuleRef *Srcs, size_t Count,
+                        bool OnlyNeeded, bool Internalize, const char **Err) {
+    return linkModules(Dest, Srcs, Count, OnlyNeeded, Internalize, Err);
+}
+
 } // end extern "C"
@@ -0,0 +1,312 @@
+#include "memorymanager.h"
+
+#include "core.h"
+
+#include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace llvm;
+
+namespace {
+
+const size_t HugePageSize = 2 * 1024 * 1024;
+
+struct Slab {
+    // The mapping, which may extend past the slab to align it
+    sys::MemoryBlock mapping;
+    uint8_t *base;
+    size_t size;
+};
+
+} // end anonymous namespace
+
+/*
+ * A pool of large read-write slabs, from which the memory managers of
+ * execution engines allocate.  Slabs given back by a manager are kept for
+ * reuse, with their pages released to the system where possible, and only
+ * unmapped by trim() or when the pool is destroyed.
+ */
+class LLVMPYMemoryPool : public ThreadSafeRefCountedBase<LLVMPYMemoryPool> {
+  public:
+    LLVMPYMemoryPool(size_t SlabSize, bool HugePages)
+        : align(HugePages ? HugePageSize
+                          : sys::Process::getPageSizeEstimate()),
+          slabSize(alignTo(std::max<size_t>(SlabSize, 1), align)),
+          hugePages(HugePages) {}
+
+    ~LLVMPYMemoryPool() { trim(); }
+
+    /*
+     * The granularity at which protections of slab memory are changed:
+     * whole huge pages when they are used, as protecting part of one
+     * splits it back into small pages.
+     */
+    size_t protectionGranularity() const { return align; }
+
+    /*
+     * Return a slab of at least *MinSize* bytes, or one with a null base
+     * and *ec* set.
+     */
+    Slab acquire(size_t MinSize, std::error_code &ec) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (MinSize <= slabSize && !freeSlabs.empty()) {
+                Slab slab = freeSlabs.back();
+                freeSlabs.pop_back();
+                inUse += slab.size;
+                return slab;
+            }
+        }
+        size_t size = std::max(slabSize, size_t(alignTo(MinSize, align)));
+        // Over-allocate so that huge-page slabs can be aligned; the extra
+        // pages are never touched
+        size_t extra = hugePages ? align : 0;
+        Slab slab;
+        slab.mapping = sys::Memory::allocateMappedMemory(
+            size + extra, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE,
+            ec);
+        if (ec) {
+            slab.base = nullptr;
+            return slab;
+        }
+        slab.base = reinterpret_cast<uint8_t *>(
+            alignAddr(slab.mapping.base(), Align(align)));
+        slab.size = size;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (hugePages)
+            (void)madvise(slab.base, slab.size, MADV_HUGEPAGE);
+#endif
+        std::lock_guard<std::mutex> guard(lock);
+        reserved += size;
+        inUse += size;
+        return slab;
+    }
+
+    /* Take back a slab returned by acquire(). */
+    void release(Slab &slab) {
+        if (slab.size != slabSize) {
+            // Oversized slabs are not worth keeping
+            (void)sys::Memory::releaseMappedMemory(slab.mapping);
+            std::lock_guard<std::mutex> guard(lock);
+            reserved -= slab.size;
+            inUse -= slab.size;
+            return;
+        }
+        (void)sys::Memory::protectMappedMemory(
+            sys::MemoryBlock(slab.base, slab.size),
+            sys::Memory::MF_READ | sys::Memory::MF_WRITE);
+#if defined(__linux__) && defined(MADV_DONTNEED)
+        (void)madvise(slab.base, slab.size, MADV_DONTNEED);
+#endif
+        std::lock_guard<std::mutex> guard(lock);
+        inUse -= slab.size;
+        freeSlabs.push_back(slab);
+    }
+
+    /* Unmap the slabs not in use. */
+    void trim() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (Slab &slab : freeSlabs) {
+            (void)sys::Memory::releaseMappedMemory(slab.mapping);
+            reserved -= slab.size;
+        }
+        freeSlabs.clear();
+    }
+
+    // Total size of the slabs mapped and of those in use
+    uint64_t reserved = 0;
+    uint64_t inUse = 0;
+    std::mutex lock;
+
+  private:
+    const size_t align;
+    const size_t slabSize;
+    const bool hugePages;
+    std::vector<Slab> freeSlabs;
+};
+
+namespace {
+
+/*
+ * An MCJIT memory manager packing sections of each kind one after the other
+ * into slabs of a LLVMPYMemoryPool, rather than mapping pages for each.  Code
+ * and read-only data are made read-only when finalized, after which the
+ * following sections start on a new page, or a new huge page if the pool
+ * uses them.  The slabs go back to the pool when
+ * the manager, and so its execution engine, is destroyed.
+ */
+class PooledMemoryManager : public RTDyldMemoryManager {
+  public:
+    explicit PooledMemoryManager(LLVMPYMemoryPoolRef Pool) : pool(Pool) {}
+
+    PooledMemoryManager(const PooledMemoryManager &) = delete;
+    void operator=(const PooledMemoryManager &) = delete;
+
+    ~PooledMemoryManager() override {
+        for (Arena *arena : {&code, &rodata, &rwdata}) {
+            for (Slab &slab : arena->slabs)
+                pool->release(slab);
+        }
+    }
+
+    uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID,
+                                 StringRef SectionName) override {
+        return allocate(code, Size, Alignment);
+    }
+
+    uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned SectionID, StringRef SectionName,
+                                 bool IsReadOnly) override {
+        return allocate(IsReadOnly ? rodata : rwdata, Size, Alignment);
+    }
+
+    bool finalizeMemory(std::string *ErrMsg) override {
+        std::error_code ec =
+            protect(code, sys::Memory::MF_READ | sys::Memory::MF_EXEC);
+        if (!ec)
+            ec = protect(rodata, sys::Memory::MF_READ);
+        if (ec) {
+            if (ErrMsg)
+                *ErrMsg = ec.message();
+            return true;
+        }
+        return false;
+    }
+
+    uint64_t getSymbolAddress(const std::string &Name) override {
+        return getCachedSymbolAddress(Name);
+    }
+
+  private:
+    struct Arena {
+        std::vector<Slab> slabs;
+        // Free space of the last slab
+        uint8_t *cur = nullptr;
+        uint8_t *end = nullptr;
+        // Sections allocated since the last finalization
+        std::vector<sys::MemoryBlock> pending;
+        uint8_t *pendingStart = nullptr;
+    };
+
+    uint8_t *allocate(Arena &arena, uintptr_t Size, unsigned Alignment) {
+        if (!Alignment)
+            Alignment = 16;
+        uint8_t *addr = reinterpret_cast<uint8_t *>(
+            alignAddr(arena.cur, Align(Alignment)));
+        if (!arena.cur || addr > arena.end ||
+            Size > size_t(arena.end - addr)) {
+            std::error_code ec;
+            Slab slab = pool->acquire(Size + Alignment, ec);
+            if (!slab.base)
+                return nullptr;
+            if (arena.cur != arena.pendingStart)
+                arena.pending.emplace_back(arena.pendingStart,
+                                           arena.cur - arena.pendingStart);
+            arena.slabs.push_back(slab);
+            arena.cur = arena.pendingStart = slab.base;
+            arena.end = slab.base + slab.size;
+            addr = reinterpret_cast<uint8_t *>(
+                alignAddr(arena.cur, Align(Alignment)));
+        }
+        arena.cur = addr + Size;
+        return addr;
+    }
+
+    std::error_code protect(Arena &arena, unsigned Flags) {
+        if (arena.cur != arena.pendingStart)
+            arena.pending.emplace_back(arena.pendingStart,
+                                       arena.cur - arena.pendingStart);
+        // Blocks start on a boundary of the granularity, and slabs are a
+        // multiple of it, so rounding the sizes up stays within the slabs
+        size_t granularity = pool->protectionGranularity();
+        for (const sys::MemoryBlock &block : arena.pending) {
+            sys::MemoryBlock whole(block.base(),
+                                   alignTo(block.allocatedSize(), granularity));
+            if (std::error_code ec =
+                    sys::Memory::protectMappedMemory(whole, Flags))
+                return ec;
+        }
+        arena.pending.clear();
+        // The rest of the last (huge) page now has the same protection
+        if (arena.cur) {
+            arena.cur = std::min(arena.end,
+                                 reinterpret_cast<uint8_t *>(alignAddr(
+                                     arena.cur, Align(granularity))));
+        }
+        arena.pendingStart = arena.cur;
+        return std::error_code();
+    }
+
+    IntrusiveRefCntPtr<LLVMPYMemoryPool> pool;
+    Arena code, rodata, rwdata;
+};
+
+/*
+ * The default MCJIT memory manager, resolving process symbols through the
+ * cache of dylib.cpp.
+ */
+class CachingSectionMemoryManager : public SectionMemoryManager {
+  public:
+    uint64_t getSymbolAddress(const std::string &Name) override {
+        return getCachedSymbolAddress(Name);
+    }
+};
+
+} // end anonymous namespace
+
+std::unique_ptr<RTDyldMemoryManager>
+createPooledMemoryManager(LLVMPYMemoryPoolRef Pool) {
+    return std::make_unique<PooledMemoryManager>(Pool);
+}
+
+std::unique_ptr<RTDyldMemoryManager> createSectionMemoryManager() {
+    return std::make_unique<CachingSectionMemoryManager>();
+}
+
+extern "C" {
+
+/*
+ * Create a pool of slabs of *SlabSize* bytes, rounded up to the page size
+ * or, if *HugePages* is true, to the 2 MiB of a huge page.  On Linux, such
+ * slabs are aligned and advised to be backed by transparent huge pages.
+ */
+API_EXPORT(LLVMPYMemoryPoolRef)
+LLVMPY_CreateMemoryPool(size_t SlabSize, bool HugePages) {
+    auto pool = new LLVMPYMemoryPool(SlabSize, HugePages);
+    pool->Retain();
+    return pool;
+}
+
+/*
+ * Release the caller's reference to *Pool*, which lives on until the engines
+ * using it are disposed.
+ */
+API_EXPORT(void)
+LLVMPY_DisposeMemoryPool(LLVMPYMemoryPoolRef Pool) { Pool->Release(); }
+
+API_EXPORT(void)
+LLVMPY_TrimMemoryPool(LLVMPYMemoryPoolRef Pool) { Pool->trim(); }
+
+API_EXPORT(void)
+LLVMPY_GetMemoryPoolStats(LLVMPYMemoryPoolRef Pool, uint64_t *Reserved,
+                          uint64_t *InUse) {
+    std::lock_guard<std::mutex> guard(Pool->lock);
+    *Reserved = Pool->reserved;
+    *InUse = Pool->inUse;
+}
+
+} // end extern "C"
@@ -0,0 +1,33 @@
+#ifndef LLVMPY_MEMORYMANAGER_H_
+#define LLVMPY_MEMORYMANAGER_H_
+
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class LLVMPYMemoryPool;
+typedef LLVMPYMemoryPool *LLVMPYMemoryPoolRef;
+
+/*
+ * Create a memory manager for MCJIT allocating sections from the slabs of
+ * *Pool*, to which they are returned when the manager is destroyed.
+ */
+std::unique_ptr<llvm::RTDyldMemoryManager>
+createPooledMemoryManager(LLVMPYMemoryPoolRef Pool);
+
+/*
+ * Create LLVM's default memory manager for MCJIT, resolving symbols through
+ * getCachedSymbolAddress() like those of createPooledMemoryManager().
+ */
+std::unique_ptr<llvm::RTDyldMemoryManager> createSectionMemoryManager();
+
+/*
+ * Return the address of the symbol of linker name *Name* in the process, as
+ * RTDyldMemoryManager::getSymbolAddressInProcess() does, or 0.  Defined in
+ * dylib.cpp.
+ */
+uint64_t getCachedSymbolAddress(const std::string &Name);
+
+#endif /* LLVMPY_MEMORYMANAGER_H_ */
@@ -2,7 +2,11 @@
 #include "core.h"
 #include "llvm-c/Analysis.h"
 #include "llvm-c/Core.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <clocale>
 #include <string>
 
@@ -90,6 +94,60 @@ static TypesIterator *unwrap(LLVMTypesIteratorRef TyI) {
 // Exported API
 //
 
+/*
+ * Receives the IR printed to a raw_callback_ostream in chunks.  A non-zero
+ * return stops further calls.
+ */
+typedef int (*LLVMPYWriteCallback)(void *opaque, const char *data,
+                                   size_t size);
+
+/*
+ * A stream passing its output to a callback, one buffer-full at a time.
+ */
+class raw_callback_ostream : public llvm::raw_ostream {
+    LLVMPYWriteCallback callback;
+    void *opaque;
+    uint64_t pos = 0;
+    bool failed = false;
+
+    void write_impl(const char *ptr, size_t size) override {
+        pos += size;
+        if (!failed && callback(opaque, ptr, size))
+            failed = true;
+    }
+
+    uint64_t current_pos() const override { return pos; }
+
+  public:
+    static const size_t ChunkSize = 64 * 1024;
+
+    raw_callback_ostream(LLVMPYWriteCallback callback, void *opaque)
+        : callback(callback), opaque(opaque) {
+        SetBufferSize(ChunkSize);
+    }
+
+    ~raw_callback_ostream() override { flush(); }
+
+    bool hasFailed() {
+        flush();
+        return failed;
+    }
+};
+
+/*
+ * Flush *os*, returning non-zero and setting *OutError* if any write to
+ * its file descriptor failed.
+ */
+static int finishFDStream(llvm::raw_fd_ostream &os, const char **OutError) {
+    os.flush();
+    if (!os.has_error())
+        return 0;
+    *OutError = LLVMPY_CreateString(os.error().message().c_str());
+    // An unchecked error is fatal when the stream is destroyed.
+    os.clear_error();
+    return 1;
+}
+
 extern "C" {
 
 API_EXPORT(void)
@@ -109,6 +167,78 @@ LLVMPY_PrintModuleToString(LLVMModuleRef M, const char **outstr) {
     free(old_locale);
 }
 
+/*
+ * Print *M* to the file descriptor *FD*, which is left open, without holding
+ * the IR in memory.  Returns non-zero and sets *OutError* on a write error.
+ *
+ * Unlike LLVMPY_PrintModuleToString, the process-wide locale is not changed,
+ * so this can run concurrently with other threads: the AsmWriter formats
+ * floating-point constants with APFloat, which ignores the C locale.
+ */
+API_EXPORT(int)
+LLVMPY_PrintModuleToFD(LLVMModuleRef M, int FD, const char **OutError) {
+    llvm::raw_fd_ostream os(FD, /*shouldClose=*/false);
+    llvm::unwrap(M)->print(os, nullptr);
+    return finishFDStream(os, OutError);
+}
+
+/*
+ * Print *M* through *Callback*, in chunks.  Returns non-zero if the callback
+ * failed.
+ */
+API_EXPORT(int)
+LLVMPY_PrintModuleToCallback(LLVMModuleRef M, LLVMPYWriteCallback Callback,
+                             void *Opaque) {
+    raw_callback_ostream os(Callback, Opaque);
+    llvm::unwrap(M)->print(os, nullptr);
+    return os.hasFailed();
+}
+
+/*
+ * Like LLVMPY_PrintModuleToFD and LLVMPY_PrintModuleToCallback, for a single
+ * value such as a function.
+ */
+API_EXPORT(int)
+LLVMPY_PrintValueToFD(LLVMValueRef V, int FD, const char **OutError) {
+    llvm::raw_fd_ostream os(FD, /*shouldClose=*/false);
+    llvm::unwrap(V)->print(os);
+    return finishFDStream(os, OutError);
+}
+
+API_EXPORT(int)
+LLVMPY_PrintValueToCallback(LLVMValueRef V, LLVMPYWriteCallback Callback,
+                            void *Opaque) {
+    raw_callback_ostream os(Callback, Opaque);
+    llvm::unwrap(V)->print(os);
+    return os.hasFailed();
+}
+
+/*
+ * Print *M* to a new memory buffer, which takes over the vector the IR was
+ * printed to rather than copying it.
+ */
+API_EXPORT(LLVMMemoryBufferRef)
+LLVMPY_PrintModuleToMemoryBuffer(LLVMModuleRef M) {
+    // See LLVMPY_PrintModuleToString
+    char *old_locale = strdup(setlocale(LC_ALL, NULL));
+    setlocale(LC_ALL, "C");
+
+    llvm::SmallVector<char, 0> buf;
+    {
+        llvm::raw_svector_ostream os(buf);
+        llvm::unwrap(M)->print(os, nullptr);
+    }
+
+    setlocale(LC_ALL, old_locale);
+    free(old_locale);
+#if LLVM_VERSION_MAJOR < 14
+    return llvm::wrap(new llvm::SmallVectorMemoryBuffer(std::move(buf)));
+#else
+    return llvm::wrap(
+        new llvm::SmallVectorMemoryBuffer(std::move(buf), false));
+#endif
+}
+
 API_EXPORT(const char *)
 LLVMPY_GetModuleSourceFileName(LLVMModuleRef M) {
     return llvm::unwrap(M)->getSourceFileName().c_str();
@@ -231,6 +361,119 @@ LLVMPY_DisposeFunctionsIter(LLVMFunctionsIteratorRef GI) {
 API_EXPORT(void)
 LLVMPY_DisposeTypesIter(LLVMTypesIteratorRef TyI) { delete llvm::unwrap(TyI); }
 
+// Bulk APIs, filling caller-provided arrays sized with the matching count
+
+API_EXPORT(size_t)
+LLVMPY_CountFunctions(LLVMModuleRef M) { return llvm::unwrap(M)->size(); }
+
+API_EXPORT(void)
+LLVMPY_GetFunctions(LLVMModuleRef M, LLVMValueRef *Functions) {
+    using namespace llvm;
+    for (Function &func : *unwrap(M))
+        *Functions++ = wrap(&func);
+}
+
+API_EXPORT(size_t)
+LLVMPY_CountGlobalVariables(LLVMModuleRef M) {
+    return llvm::unwrap(M)->global_size();
+}
+
+API_EXPORT(void)
+LLVMPY_GetGlobalVariables(LLVMModuleRef M, LLVMValueRef *Globals) {
+    using namespace llvm;
+    for (GlobalVariable &gv : unwrap(M)->globals())
+        *Globals++ = wrap(&gv);
+}
+
+API_EXPORT(unsigned)
+LLVMPY_GetNumOpcodes() { return llvm::Instruction::OtherOpsEnd; }
+
+/*
+ * Summarize module *M* in a single walk:
+ * - *Stats* receives the number of blocks, instructions and calls of each
+ *   function, in order, 3 entries per function;
+ * - *OpcodeCounts* receives the number of instructions of each opcode, with
+ *   LLVMPY_GetNumOpcodes() entries;
+ * - *Edges* receives the direct calls between the functions, as (caller
+ *   index, callee index, number of calls) triples ordered by caller then
+ *   first call, up to *MaxEdges* triples.
+ * Returns the number of edges, which may exceed *MaxEdges*.
+ */
+API_EXPORT(size_t)
+LLVMPY_GetModuleSummary(LLVMModuleRef M, int64_t *Stats,
+                        int64_t *OpcodeCounts, int64_t *Edges,
+                        size_t MaxEdges) {
+    using namespace llvm;
+    Module *mod = unwrap(M);
+    DenseMap<const Function *, int64_t> indices;
+    for (const Function &func : *mod)
+        indices.try_emplace(&func, indices.size());
+    std::fill_n(OpcodeCounts, Instruction::OtherOpsEnd, 0);
+
+    size_t numEdges = 0;
+    // Edge number of each callee of the current caller
+    DenseMap<const Function *, size_t> callees;
+    int64_t caller = 0;
+    for (const Function &func : *mod) {
+        int64_t numInsts = 0, numCalls = 0;
+        callees.clear();
+        for (const BasicBlock &block : func) {
+            for (const Instruction &inst : block) {
+                ++numInsts;
+                ++OpcodeCounts[inst.getOpcode()];
+                const auto *call = dyn_cast<CallBase>(&inst);
+                if (!call)
+                    continue;
+                ++numCalls;
+                const Function *callee = call->getCalledFunction();
+                if (!callee)
+                    continue;
+                auto inserted = callees.try_emplace(callee, numEdges);
+                size_t edge = inserted.first->second;
+                if (inserted.second) {
+                    if (numEdges < MaxEdges) {
+                        Edges[3 * edge] = caller;
+                        Edges[3 * edge + 1] = indices.lookup(callee);
+                        Edges[3 * edge + 2] = 0;
+                    }
+                    ++numEdges;
+                }
+                if (edge < MaxEdges)
+                    ++Edges[3 * edge + 2];
+            }
+        }
+        Stats[3 * caller] = func.size();
+        Stats[3 * caller + 1] = numInsts;
+        Stats[3 * caller + 2] = numCalls;
+        ++caller;
+    }
+    return numEdges;
+}
+
+/*
+ * Store the numbers of function definitions, function declarations, global
+ * variables, basic blocks and instructions of *M* in the 5 items of *Stats*.
+ */
+API_EXPORT(void)
+LLVMPY_GetModuleStats(LLVMModuleRef M, int64_t *Stats) {
+    using namespace llvm;
+    Module *mod = unwrap(M);
+    int64_t numDefs = 0, numBlocks = 0, numInsts = 0;
+    for (const Function &func : *mod) {
+        if (func.isDeclaration())
+            continue;
+        ++numDefs;
+        numBlocks += func.size();
+        for (const BasicBlock &block : func)
+            numInsts += block.size();
+    }
+    Stats[0] = numDefs;
+    Stats[1] = mod->size() - numDefs;
+    Stats[2] = mod->global_size();
+    Stats[3] = numBlocks;
+    Stats[4] = numInsts;
+}
+
 API_EXPORT(LLVMModuleRef)
 LLVMPY_CloneModule(LLVMModuleRef M) { return LLVMCloneModule(M); }
 
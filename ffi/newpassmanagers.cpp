@@ -0,0 +1,828 @@
+#include "core.h"
+
+#include "llvm-c/TargetMachine.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/PassInstrumentation.h"
+#if LLVM_VERSION_MAJOR > 13
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#if LLVM_VERSION_MAJOR < 14
+typedef PassBuilder::OptimizationLevel OptimizationLevel;
+#endif
+
+// Defined in custom_passes.cpp
+struct RefPruneStats;
+
+typedef RefPruneStats *LLVMPYRefPruneStatsRef;
+
+namespace llvm {
+
+// Defined in custom_passes.cpp
+void addRefPruneNewPasses(FunctionPassManager &FPM, int subpasses,
+                          size_t subgraph_limit, RefPruneStats *stats);
+
+inline TargetMachine *unwrap(LLVMTargetMachineRef TM) {
+    return reinterpret_cast<TargetMachine *>(TM);
+}
+
+} // namespace llvm
+
+/*
+ * A step building a function pipeline.  Function pipelines record their
+ * steps so that they can be rebuilt for other threads.
+ */
+typedef std::function<Error(PassBuilder &, FunctionPassManager &)>
+    FunctionPipelineStep;
+
+/*
+ * One recorded pass execution.  Times are in seconds; the user time is
+ * that of the whole process.
+ */
+struct PassTiming {
+    std::string pass;
+    std::string ir;
+    double wallTime;
+    double userTime;
+    int64_t instructionsBefore;
+    int64_t instructionsAfter;
+};
+
+struct PassTimings {
+    std::vector<PassTiming> records;
+};
+
+typedef PassTimings *LLVMPYPassTimingsRef;
+
+static std::string getIRName(const Any &IR) {
+    if (any_isa<const Module *>(IR))
+        return any_cast<const Module *>(IR)->getModuleIdentifier();
+    if (any_isa<const Function *>(IR))
+        return any_cast<const Function *>(IR)->getName().str();
+    if (any_isa<const LazyCallGraph::SCC *>(IR))
+        return any_cast<const LazyCallGraph::SCC *>(IR)->getName();
+    if (any_isa<const Loop *>(IR))
+        return any_cast<const Loop *>(IR)->getName().str();
+    return "";
+}
+
+static int64_t getInstructionCount(const Any &IR) {
+    if (any_isa<const Module *>(IR))
+        return any_cast<const Module *>(IR)->getInstructionCount();
+    if (any_isa<const Function *>(IR))
+        return any_cast<const Function *>(IR)->getInstructionCount();
+    int64_t count = 0;
+    if (any_isa<const LazyCallGraph::SCC *>(IR)) {
+        for (const LazyCallGraph::Node &N :
+             *any_cast<const LazyCallGraph::SCC *>(IR))
+            count += N.getFunction().getInstructionCount();
+    } else if (any_isa<const Loop *>(IR)) {
+        for (const BasicBlock *BB : any_cast<const Loop *>(IR)->blocks())
+            count += BB->size();
+    }
+    return count;
+}
+
+/*
+ * Records one in *sampleEvery* pass executions, or none if 0.  Pass
+ * managers, adaptors and wrappers aren't recorded, as their time is that
+ * of the passes they run.
+ */
+class PassTimingRecorder {
+  public:
+    unsigned sampleEvery = 0;
+    PassTimings timings;
+
+    void registerCallbacks(PassInstrumentationCallbacks &PIC) {
+#if LLVM_VERSION_MAJOR < 12
+        PIC.registerBeforePassCallback([this](StringRef pass, Any IR) {
+            before(pass, IR);
+            return true;
+        });
+        PIC.registerAfterPassCallback(
+            [this](StringRef pass, Any IR) { after(pass, &IR); });
+        PIC.registerAfterPassInvalidatedCallback(
+            [this](StringRef pass) { after(pass, nullptr); });
+#else
+        PIC.registerBeforeNonSkippedPassCallback(
+            [this](StringRef pass, Any IR) { before(pass, IR); });
+        PIC.registerAfterPassCallback(
+            [this](StringRef pass, Any IR, const PreservedAnalyses &) {
+                after(pass, &IR);
+            });
+        PIC.registerAfterPassInvalidatedCallback(
+            [this](StringRef pass, const PreservedAnalyses &) {
+                after(pass, nullptr);
+            });
+#endif
+    }
+
+  private:
+    struct Running {
+        bool sampled;
+        PassTiming timing;
+        TimeRecord start;
+    };
+
+    uint64_t executions = 0;
+    std::vector<Running> running;
+
+    static bool isRecorded(StringRef pass) {
+        static const char *const special[] = {
+            "PassManager", "PassAdaptor", "AnalysisManagerProxy",
+            "ModuleInlinerWrapperPass", "DevirtSCCRepeatedPass"};
+        for (const char *name : special)
+            if (pass.find(name) != StringRef::npos)
+                return false;
+        return true;
+    }
+
+    void before(StringRef pass, Any IR) {
+        if (!sampleEvery || !isRecorded(pass))
+            return;
+        running.emplace_back();
+        Running &r = running.back();
+        r.sampled = executions++ % sampleEvery == 0;
+        if (!r.sampled)
+            return;
+        r.timing.pass = pass.str();
+        r.timing.ir = getIRName(IR);
+        r.timing.instructionsBefore = getInstructionCount(IR);
+        r.start = TimeRecord::getCurrentTime(true);
+    }
+
+    void after(StringRef pass, const Any *IR) {
+        if (running.empty() || !isRecorded(pass))
+            return;
+        TimeRecord end = TimeRecord::getCurrentTime(false);
+        Running r = std::move(running.back());
+        running.pop_back();
+        if (!r.sampled)
+            return;
+        r.timing.wallTime = end.getWallTime() - r.start.getWallTime();
+        r.timing.userTime = end.getUserTime() - r.start.getUserTime();
+        // The IR unit is gone if the pass invalidated it.
+        r.timing.instructionsAfter = IR ? getInstructionCount(*IR) : 0;
+        timings.records.push_back(std::move(r.timing));
+    }
+};
+
+/*
+ * A PassBuilder with its analysis managers, which cache analysis results
+ * while a pipeline runs, and a pass timing recorder.  The refprune passes it
+ * parses count their pruning in `refpruneStats`, if not NULL.
+ */
+struct PassBuilderState {
+    PassInstrumentationCallbacks PIC;
+    PassTimingRecorder recorder;
+    PassBuilder PB;
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    RefPruneStats *refpruneStats;
+
+    PassBuilderState(TargetMachine *TM, unsigned sampleEvery = 0,
+                     RefPruneStats *stats = nullptr,
+                     TargetLibraryInfoImpl::VectorLibrary vecLib =
+                         TargetLibraryInfoImpl::NoLibrary)
+#if LLVM_VERSION_MAJOR == 12
+        : PB(false, TM, PipelineTuningOptions(), None, &PIC),
+#else
+        : PB(TM, PipelineTuningOptions(), None, &PIC),
+#endif
+          refpruneStats(stats) {
+        recorder.sampleEvery = sampleEvery;
+        recorder.registerCallbacks(PIC);
+        // Registered first, so that PB doesn't register the default one.
+        if (vecLib != TargetLibraryInfoImpl::NoLibrary) {
+            TargetLibraryInfoImpl TLII(TM ? TM->getTargetTriple()
+                                          : Triple(sys::getProcessTriple()));
+            TLII.addVectorizableFunctionsFromVecLib(vecLib);
+            FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+        }
+        PB.registerModuleAnalyses(MAM);
+        PB.registerCGSCCAnalyses(CGAM);
+        PB.registerFunctionAnalyses(FAM);
+        PB.registerLoopAnalyses(LAM);
+        PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+        // Make "refprune" usable in textual pipelines.
+        PB.registerPipelineParsingCallback(
+            [this](StringRef name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                if (name != "refprune")
+                    return false;
+                addRefPruneNewPasses(FPM, /*All*/ 0b1111, 1000, refpruneStats);
+                return true;
+            });
+    }
+};
+
+/*
+ * A new pass manager pipeline, together with the PassBuilder that created
+ * it and the analysis managers caching analysis results while it runs.
+ *
+ * A pipeline either runs on modules (`MPM`) or on functions (`FPM`).
+ */
+struct NewPassManager : PassBuilderState {
+    TargetMachine *TM;
+    bool functionLevel;
+    TargetLibraryInfoImpl::VectorLibrary vecLib;
+    ModulePassManager MPM;
+    FunctionPassManager FPM;
+    std::vector<FunctionPipelineStep> functionSteps;
+
+    NewPassManager(TargetMachine *TM, bool functionLevel, RefPruneStats *stats,
+                   TargetLibraryInfoImpl::VectorLibrary vecLib)
+        : PassBuilderState(TM, 0, stats, vecLib), TM(TM),
+          functionLevel(functionLevel), vecLib(vecLib) {}
+
+    Error addFunctionStep(FunctionPipelineStep step) {
+        if (auto err = step(PB, FPM))
+            return err;
+        functionSteps.push_back(std::move(step));
+        return Error::success();
+    }
+
+    /*
+     * Analysis results are keyed on the addresses of the IR units, which
+     * may be reused once the IR is freed: only keep them during a run.
+     */
+    void clearAnalyses() {
+        LAM.clear();
+        FAM.clear();
+        CGAM.clear();
+        MAM.clear();
+    }
+};
+
+typedef NewPassManager *LLVMPYNewPassManagerRef;
+
+static OptimizationLevel getOptLevel(int opt, int size) {
+    if (size == 1)
+        return OptimizationLevel::Os;
+    if (size >= 2)
+        return OptimizationLevel::Oz;
+    switch (opt) {
+    case 0:
+        return OptimizationLevel::O0;
+    case 1:
+        return OptimizationLevel::O1;
+    case 2:
+        return OptimizationLevel::O2;
+    default:
+        return OptimizationLevel::O3;
+    }
+}
+
+/*
+ * Create a TargetMachine with the same settings as *TM*, for use on another
+ * thread.
+ */
+static std::unique_ptr<TargetMachine> copyTargetMachine(TargetMachine *TM) {
+    if (!TM)
+        return nullptr;
+    return std::unique_ptr<TargetMachine>(TM->getTarget().createTargetMachine(
+        TM->getTargetTriple().str(), TM->getTargetCPU(),
+        TM->getTargetFeatureString(), TM->Options, TM->getRelocationModel(),
+        TM->getCodeModel(), TM->getOptLevel()));
+}
+
+/*
+ * Maps the types of a module parsed back into the context of the module it
+ * was split from onto the types of the latter.  The bitcode reader renames
+ * identified struct types that clash with existing ones, so they are paired
+ * structurally through the globals of both modules, much like IRMover does.
+ * Types that can't be paired are left alone, which is still correct.
+ */
+class ImportedTypeMap : public ValueMapTypeRemapper {
+  public:
+    void pair(Type *src, Type *dst) {
+        if (src == dst || mapped.count(src))
+            return;
+        if (src->getTypeID() != dst->getTypeID() ||
+            src->getNumContainedTypes() != dst->getNumContainedTypes())
+            return;
+        if (auto *st = dyn_cast<StructType>(src)) {
+            auto *dt = cast<StructType>(dst);
+            if (st->isLiteral() != dt->isLiteral() ||
+                st->isPacked() != dt->isPacked() ||
+                st->isOpaque() != dt->isOpaque())
+                return;
+        } else if (auto *at = dyn_cast<ArrayType>(src)) {
+            if (at->getNumElements() !=
+                cast<ArrayType>(dst)->getNumElements())
+                return;
+        } else if (auto *vt = dyn_cast<VectorType>(src)) {
+            if (vt->getElementCount() !=
+                cast<VectorType>(dst)->getElementCount())
+                return;
+        } else if (auto *ft = dyn_cast<FunctionType>(src)) {
+            if (ft->isVarArg() != cast<FunctionType>(dst)->isVarArg())
+                return;
+        }
+        mapped[src] = dst;
+        for (unsigned i = 0; i < src->getNumContainedTypes(); ++i)
+            pair(src->getContainedType(i), dst->getContainedType(i));
+    }
+
+    Type *remapType(Type *src) override {
+        auto it = mapped.find(src);
+        if (it != mapped.end())
+            return it->second;
+        auto *st = dyn_cast<StructType>(src);
+        if (src->getNumContainedTypes() == 0 || (st && !st->isLiteral()))
+            return src;
+
+        SmallVector<Type *, 8> elems;
+        bool changed = false;
+        for (Type *elem : src->subtypes()) {
+            elems.push_back(remapType(elem));
+            changed |= elems.back() != elem;
+        }
+        Type *res = src;
+        if (changed) {
+            if (auto *pt = dyn_cast<PointerType>(src))
+                res = PointerType::get(elems[0], pt->getAddressSpace());
+            else if (auto *at = dyn_cast<ArrayType>(src))
+                res = ArrayType::get(elems[0], at->getNumElements());
+            else if (auto *vt = dyn_cast<VectorType>(src))
+                res = VectorType::get(elems[0], vt->getElementCount());
+            else if (auto *ft = dyn_cast<FunctionType>(src))
+                res = FunctionType::get(elems[0], makeArrayRef(elems).slice(1),
+                                        ft->isVarArg());
+            else if (st)
+                res = StructType::get(src->getContext(), elems,
+                                      st->isPacked());
+        }
+        return mapped[src] = res;
+    }
+
+  private:
+    DenseMap<Type *, Type *> mapped;
+};
+
+/*
+ * The globals of a module at the time it was split.  A partition has the
+ * same globals, under the same names, and may add some declared by the
+ * function passes.  Unnamed globals keep their order.
+ */
+struct ModuleGlobals {
+    StringMap<GlobalValue *> named;
+    std::vector<GlobalVariable *> unnamedGlobals;
+    std::vector<Function *> unnamedFunctions;
+
+    ModuleGlobals(Module &M) {
+        for (GlobalVariable &GV : M.globals())
+            add(GV, unnamedGlobals);
+        for (Function &F : M)
+            add(F, unnamedFunctions);
+    }
+
+    /*
+     * The global of the split module matching *V* of a partition, or NULL
+     * if the passes added *V*.  *Next* counts the unnamed globals seen.
+     */
+    template <typename T>
+    T *find(const T &V, const std::vector<T *> &Unnamed, size_t &Next) const {
+        if (V.hasName())
+            return dyn_cast_or_null<T>(named.lookup(V.getName()));
+        return Next < Unnamed.size() ? Unnamed[Next++] : nullptr;
+    }
+
+  private:
+    template <typename T> void add(T &V, std::vector<T *> &Unnamed) {
+        if (V.hasName())
+            named[V.getName()] = &V;
+        else
+            Unnamed.push_back(&V);
+    }
+};
+
+/*
+ * Replace the bodies of the functions of *M* by those defined in partition
+ * *R*, which lives in the same context.  Function objects are kept, so that
+ * references to them stay valid.
+ */
+static Error importPartition(Module &M, const ModuleGlobals &orig, Module &R) {
+    ValueToValueMapTy VMap;
+    ImportedTypeMap types;
+    std::vector<GlobalVariable *> newGlobals;
+    std::vector<Function *> newFunctions;
+    std::vector<std::pair<Function *, Function *>> bodies;
+
+    size_t unnamed = 0;
+    for (GlobalVariable &GV : R.globals()) {
+        if (GlobalVariable *OGV = orig.find(GV, orig.unnamedGlobals, unnamed)) {
+            VMap[&GV] = OGV;
+            types.pair(GV.getType(), OGV->getType());
+        } else {
+            newGlobals.push_back(&GV);
+        }
+    }
+    unnamed = 0;
+    for (Function &RF : R) {
+        if (Function *F = orig.find(RF, orig.unnamedFunctions, unnamed)) {
+            VMap[&RF] = F;
+            types.pair(RF.getType(), F->getType());
+            if (!RF.isDeclaration())
+                bodies.emplace_back(F, &RF);
+        } else {
+            newFunctions.push_back(&RF);
+        }
+    }
+
+    // Declare what the passes introduced, such as library functions.
+    for (Function *F : newFunctions) {
+        if (!F->isDeclaration())
+            return make_error<StringError>("unexpected new function " +
+                                               F->getName(),
+                                           inconvertibleErrorCode());
+        auto *fty = cast<FunctionType>(types.remapType(F->getFunctionType()));
+        VMap[F] =
+            M.getOrInsertFunction(F->getName(), fty, F->getAttributes())
+                .getCallee();
+    }
+    std::vector<std::pair<GlobalVariable *, GlobalVariable *>> initializers;
+    for (GlobalVariable *GV : newGlobals) {
+        Type *ty = types.remapType(GV->getValueType());
+        if (!GV->hasLocalLinkage() && M.getNamedValue(GV->getName())) {
+            // Already declared by another partition
+            VMap[GV] = M.getOrInsertGlobal(GV->getName(), ty);
+            continue;
+        }
+        auto *NGV = new GlobalVariable(
+            M, ty, GV->isConstant(), GV->getLinkage(), nullptr, GV->getName(),
+            nullptr, GV->getThreadLocalMode(), GV->getAddressSpace());
+        NGV->copyAttributesFrom(GV);
+        VMap[GV] = NGV;
+        if (GV->hasInitializer())
+            initializers.emplace_back(GV, NGV);
+    }
+    for (auto &init : initializers)
+        init.second->setInitializer(MapValue(init.first->getInitializer(),
+                                             VMap, RF_None, &types));
+
+    // Keep the compile units of M rather than adding those of R.
+    bool hadUnits = M.getNamedMetadata("llvm.dbg.cu") != nullptr;
+    auto origUnit = M.debug_compile_units_begin();
+    for (DICompileUnit *CU : R.debug_compile_units()) {
+        if (origUnit == M.debug_compile_units_end())
+            break;
+        VMap.MD()[CU].reset(*origUnit++);
+    }
+
+    for (auto &body : bodies) {
+        Function *F = body.first;
+        Function &RF = *body.second;
+        GlobalValue::LinkageTypes linkage = F->getLinkage();
+        F->deleteBody();
+        F->clearMetadata();
+        auto arg = F->arg_begin();
+        for (Argument &RA : RF.args())
+            VMap[&RA] = &*arg++;
+        SmallVector<ReturnInst *, 8> returns;
+#if LLVM_VERSION_MAJOR < 13
+        CloneFunctionInto(F, &RF, VMap, /*ModuleLevelChanges=*/true, returns,
+                          "", nullptr, &types);
+#else
+        CloneFunctionInto(F, &RF, VMap,
+                          CloneFunctionChangeType::DifferentModule, returns,
+                          "", nullptr, &types);
+#endif
+        F->setLinkage(linkage);
+    }
+    NamedMDNode *units = M.getNamedMetadata("llvm.dbg.cu");
+    if (!hadUnits && units && units->getNumOperands() == 0)
+        M.eraseNamedMetadata(units);
+    return Error::success();
+}
+
+/*
+ * Run the function pipeline of *PM* on all the functions of *M* on
+ * *NumThreads* threads.  Functions are distributed into one partition per
+ * thread, each cloned into its own context and optimized independently,
+ * and the optimized bodies are then swapped back into *M*.  Constant
+ * globals are cloned with their initializers so that passes can fold them.
+ */
+static Expected<bool> runParallel(NewPassManager *PM, Module &M,
+                                  unsigned NumThreads) {
+    std::vector<Function *> defined;
+    for (Function &F : M)
+        if (!F.isDeclaration())
+            defined.push_back(&F);
+
+    // Partitions must have the same globals as M, which cloning doesn't
+    // preserve for aliases; run those modules serially.
+    if (!M.alias_empty() || !M.ifunc_empty() || defined.size() < 2 ||
+        NumThreads == 1) {
+        bool changed = false;
+        for (Function *F : defined)
+            changed |= !PM->FPM.run(*F, PM->FAM).areAllPreserved();
+        PM->clearAnalyses();
+        return changed;
+    }
+
+    // Balance the partitions by instruction count, largest first.
+    unsigned threads =
+        NumThreads ? NumThreads : hardware_concurrency().compute_thread_count();
+    size_t nparts = std::min<size_t>(threads, defined.size());
+    std::stable_sort(defined.begin(), defined.end(),
+                     [](Function *a, Function *b) {
+                         return a->getInstructionCount() >
+                                b->getInstructionCount();
+                     });
+    std::vector<SmallPtrSet<const GlobalValue *, 16>> parts(nparts);
+    std::vector<size_t> load(nparts, 0);
+    for (Function *F : defined) {
+        size_t idx = std::min_element(load.begin(), load.end()) - load.begin();
+        parts[idx].insert(F);
+        load[idx] += F->getInstructionCount() + 1;
+    }
+
+    std::vector<SmallVector<char, 0>> inputs(nparts), outputs(nparts);
+    std::vector<std::unique_ptr<TargetMachine>> tms(nparts);
+    for (size_t i = 0; i < nparts; ++i) {
+        ValueToValueMapTy vmap;
+        auto clone = CloneModule(M, vmap, [&](const GlobalValue *GV) {
+            if (auto *GVar = dyn_cast<GlobalVariable>(GV))
+                return GVar->isConstant();
+            return parts[i].count(GV) > 0;
+        });
+        raw_svector_ostream os(inputs[i]);
+        WriteBitcodeToFile(*clone, os);
+        tms[i] = copyTargetMachine(PM->TM);
+    }
+
+    std::vector<std::string> errors(nparts);
+    std::vector<PassTimings> timings(nparts);
+    {
+        ThreadPool pool(hardware_concurrency(threads));
+        for (size_t i = 0; i < nparts; ++i) {
+            pool.async([&, i] {
+                LLVMContext ctx;
+                auto mod = parseBitcodeFile(
+                    MemoryBufferRef(StringRef(inputs[i].data(),
+                                              inputs[i].size()),
+                                    "partition"),
+                    ctx);
+                if (!mod) {
+                    errors[i] = toString(mod.takeError());
+                    return;
+                }
+                PassBuilderState state(tms[i].get(),
+                                       PM->recorder.sampleEvery,
+                                       PM->refpruneStats, PM->vecLib);
+                FunctionPassManager FPM;
+                for (auto &step : PM->functionSteps) {
+                    if (auto err = step(state.PB, FPM)) {
+                        errors[i] = toString(std::move(err));
+                        return;
+                    }
+                }
+                bool changed = false;
+                for (Function &F : **mod)
+                    if (!F.isDeclaration())
+                        changed |= !FPM.run(F, state.FAM).areAllPreserved();
+                if (changed) {
+                    raw_svector_ostream os(outputs[i]);
+                    WriteBitcodeToFile(**mod, os);
+                }
+                timings[i] = std::move(state.recorder.timings);
+            });
+        }
+        pool.wait();
+    }
+    auto &records = PM->recorder.timings.records;
+    for (auto &part : timings)
+        std::move(part.records.begin(), part.records.end(),
+                  std::back_inserter(records));
+    for (auto &error : errors)
+        if (!error.empty())
+            return make_error<StringError>(error, inconvertibleErrorCode());
+
+    ModuleGlobals orig(M);
+    bool changed = false;
+    for (auto &output : outputs) {
+        if (output.empty())
+            continue;
+        auto R = parseBitcodeFile(
+            MemoryBufferRef(StringRef(output.data(), output.size()),
+                            "partition"),
+            M.getContext());
+        if (!R)
+            return R.takeError();
+        if (auto err = importPartition(M, orig, **R))
+            return err;
+        changed = true;
+    }
+    return changed;
+}
+
+extern "C" {
+
+/*
+ * Create an empty pipeline running on modules or, if *FunctionLevel* is set,
+ * on functions.  *TM* may be NULL; otherwise it is used for target-specific
+ * analyses and must outlive the pipeline.  If *Stats* is not NULL, the
+ * refprune passes of the pipeline count their pruning there; it must outlive
+ * the pipeline too.  Unless *VecLib*, a TargetLibraryInfoImpl::VectorLibrary,
+ * is NoLibrary, the vectorizers may call the functions of that library.
+ */
+API_EXPORT(LLVMPYNewPassManagerRef)
+LLVMPY_CreateNewPassManager(LLVMTargetMachineRef TM, int FunctionLevel,
+                            LLVMPYRefPruneStatsRef Stats, int VecLib) {
+    return new NewPassManager(TM ? unwrap(TM) : nullptr, FunctionLevel, Stats,
+                              TargetLibraryInfoImpl::VectorLibrary(VecLib));
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeNewPassManager(LLVMPYNewPassManagerRef PM) { delete PM; }
+
+/*
+ * Append the default pipeline for -O<OptLevel>, or -Os / -Oz if *SizeLevel*
+ * is 1 / 2.  For function pipelines, this is the function simplification
+ * pipeline.
+ */
+API_EXPORT(void)
+LLVMPY_NewPassManagerAddDefaultPipeline(LLVMPYNewPassManagerRef PM,
+                                        int OptLevel, int SizeLevel) {
+    OptimizationLevel level = getOptLevel(OptLevel, SizeLevel);
+    if (PM->functionLevel) {
+        cantFail(PM->addFunctionStep(
+            [level](PassBuilder &PB, FunctionPassManager &FPM) {
+                if (level != OptimizationLevel::O0)
+                    FPM.addPass(PB.buildFunctionSimplificationPipeline(
+#if LLVM_VERSION_MAJOR < 12
+                        level, PassBuilder::ThinLTOPhase::None));
+#else
+                        level, ThinOrFullLTOPhase::None));
+#endif
+                return Error::success();
+            }));
+    } else if (level == OptimizationLevel::O0) {
+#if LLVM_VERSION_MAJOR < 13
+        PM->MPM.addPass(AlwaysInlinerPass());
+#else
+        PM->MPM.addPass(PM->PB.buildO0DefaultPipeline(level));
+#endif
+    } else {
+        PM->MPM.addPass(PM->PB.buildPerModuleDefaultPipeline(level));
+    }
+}
+
+/*
+ * Parse the textual pipeline *Pipeline*, as accepted by `opt -passes=`, and
+ * append it.  Returns non-zero and sets *OutError* on a parse error.
+ */
+API_EXPORT(int)
+LLVMPY_NewPassManagerAddPipeline(LLVMPYNewPassManagerRef PM,
+                                 const char *Pipeline, const char **OutError) {
+    std::string text(Pipeline);
+    Error err = PM->functionLevel
+                    ? PM->addFunctionStep(
+                          [text](PassBuilder &PB, FunctionPassManager &FPM) {
+                              return PB.parsePassPipeline(FPM, text);
+                          })
+                    : PM->PB.parsePassPipeline(PM->MPM, text);
+    if (err) {
+        *OutError = LLVMPY_CreateString(toString(std::move(err)).c_str());
+        return 1;
+    }
+    return 0;
+}
+
+API_EXPORT(void)
+LLVMPY_NewPassManagerAddRefPrunePass(LLVMPYNewPassManagerRef PM,
+                                     int subpasses, size_t subgraph_limit) {
+    if (PM->functionLevel) {
+        RefPruneStats *stats = PM->refpruneStats;
+        cantFail(PM->addFunctionStep(
+            [=](PassBuilder &PB, FunctionPassManager &FPM) {
+                addRefPruneNewPasses(FPM, subpasses, subgraph_limit, stats);
+                return Error::success();
+            }));
+    } else {
+        FunctionPassManager FPM;
+        addRefPruneNewPasses(FPM, subpasses, subgraph_limit,
+                             PM->refpruneStats);
+        PM->MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+    }
+}
+
+/*
+ * Run a module pipeline on *M*.  Returns non-zero if the module may have
+ * been changed.
+ */
+API_EXPORT(int)
+LLVMPY_RunNewPassManager(LLVMPYNewPassManagerRef PM, LLVMModuleRef M) {
+    PreservedAnalyses PA = PM->MPM.run(*unwrap(M), PM->MAM);
+    PM->clearAnalyses();
+    return !PA.areAllPreserved();
+}
+
+/*
+ * Run a function pipeline on *F*.  Returns non-zero if the function may have
+ * been changed.
+ */
+API_EXPORT(int)
+LLVMPY_RunNewFunctionPassManager(LLVMPYNewPassManagerRef PM,
+                                 LLVMValueRef F) {
+    PreservedAnalyses PA = PM->FPM.run(*unwrap<Function>(F), PM->FAM);
+    PM->clearAnalyses();
+    return !PA.areAllPreserved();
+}
+
+/*
+ * Run a function pipeline on all the functions of *M*, on *NumThreads*
+ * threads or, if 0, as many threads as there are cores.  Returns 1 if the
+ * module may have been changed, 0 if not, and -1 on error.
+ */
+API_EXPORT(int)
+LLVMPY_RunNewFunctionPassManagerParallel(LLVMPYNewPassManagerRef PM,
+                                         LLVMModuleRef M, unsigned NumThreads,
+                                         const char **OutError) {
+    auto changed = runParallel(PM, *unwrap(M), NumThreads);
+    if (!changed) {
+        *OutError =
+            LLVMPY_CreateString(toString(changed.takeError()).c_str());
+        return -1;
+    }
+    return *changed;
+}
+
+/*
+ * Record one in *SampleEvery* of the pass executions of the pipeline, or
+ * stop recording if 0.
+ */
+API_EXPORT(void)
+LLVMPY_NewPassManagerSetTimings(LLVMPYNewPassManagerRef PM,
+                                unsigned SampleEvery) {
+    PM->recorder.sampleEvery = SampleEvery;
+}
+
+/*
+ * Return the pass executions recorded so far and clear them.
+ */
+API_EXPORT(LLVMPYPassTimingsRef)
+LLVMPY_NewPassManagerTakeTimings(LLVMPYNewPassManagerRef PM) {
+    auto *timings = new PassTimings(std::move(PM->recorder.timings));
+    PM->recorder.timings.records.clear();
+    return timings;
+}
+
+API_EXPORT(size_t)
+LLVMPY_PassTimingsSize(LLVMPYPassTimingsRef T) { return T->records.size(); }
+
+/*
+ * Get the record at *Index*.  The strings are owned by *T*.
+ */
+API_EXPORT(void)
+LLVMPY_PassTimingsGet(LLVMPYPassTimingsRef T, size_t Index, const char **Pass,
+                      const char **IR, double *WallTime, double *UserTime,
+                      int64_t *InstructionsBefore,
+                      int64_t *InstructionsAfter) {
+    const PassTiming &timing = T->records[Index];
+    *Pass = timing.pass.c_str();
+    *IR = timing.ir.c_str();
+    *WallTime = timing.wallTime;
+    *UserTime = timing.userTime;
+    *InstructionsBefore = timing.instructionsBefore;
+    *InstructionsAfter = timing.instructionsAfter;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposePassTimings(LLVMPYPassTimingsRef T) { delete T; }
+
+} // end extern "C"
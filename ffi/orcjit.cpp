@@ -0,0 +1,363 @@
+#include "core.h"
+
+#include "llvm-c/TargetMachine.h"
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+/*
+ * An ORC LLJIT instance.  Unlike MCJIT, modules are materialized lazily on
+ * symbol lookup and are tracked by removable resource trackers.
+ *
+ * If `lazy` is set, `lljit` is a LLLazyJIT and modules are further split so
+ * that each function is only compiled when it is first called.
+ */
+struct OrcJIT {
+    std::unique_ptr<orc::LLJIT> lljit;
+    bool lazy;
+
+    orc::LLLazyJIT &lazyJIT() {
+        return *static_cast<orc::LLLazyJIT *>(lljit.get());
+    }
+};
+
+typedef OrcJIT *LLVMPYOrcJITRef;
+
+/*
+ * A handle on the resources (code, data, symbols) of one added module.
+ * Resource trackers are new in LLVM 12; before, modules are added to the
+ * main JITDylib and can't be removed.
+ */
+#if LLVM_VERSION_MAJOR < 12
+typedef orc::JITDylib &ModuleOwner;
+
+struct OrcResourceTracker {};
+#else
+typedef orc::ResourceTrackerSP ModuleOwner;
+
+struct OrcResourceTracker {
+    orc::ResourceTrackerSP tracker;
+};
+#endif
+
+typedef OrcResourceTracker *LLVMPYResourceTrackerRef;
+
+/*
+ * The result of an asynchronous lookup, filled in by whichever thread
+ * completes the lookup.  It doesn't refer to the JIT, so it may outlive it.
+ */
+struct OrcCompileState {
+    std::mutex lock;
+    std::condition_variable cond;
+    bool ready = false;
+    std::string error;
+    std::vector<uint64_t> addresses;
+};
+
+struct OrcCompileFuture {
+    std::shared_ptr<OrcCompileState> state;
+};
+
+typedef OrcCompileFuture *LLVMPYCompileFutureRef;
+
+namespace llvm {
+
+inline TargetMachine *unwrap(LLVMTargetMachineRef TM) {
+    return reinterpret_cast<TargetMachine *>(TM);
+}
+
+} // namespace llvm
+
+/*
+ * Report *err* through *OutError*, consuming it.
+ */
+static void reportError(Error err, const char **OutError) {
+    std::string msg = toString(std::move(err));
+    *OutError = LLVMPY_CreateString(msg.c_str());
+}
+
+/*
+ * ORC compiles each module on its own ThreadSafeContext.  With *MoveContext*,
+ * *M* is the only module of its context, which the ThreadSafeContext takes
+ * over.  Otherwise the context is shared with the caller, and *M* is moved
+ * into a private one by round-tripping its bitcode.  *M* is consumed.
+ */
+static Expected<orc::ThreadSafeModule>
+moveToThreadSafeModule(Module *M, bool MoveContext) {
+    std::unique_ptr<Module> src(M);
+    if (MoveContext) {
+        std::unique_ptr<LLVMContext> ctx(&src->getContext());
+        return orc::ThreadSafeModule(std::move(src), std::move(ctx));
+    }
+    SmallVector<char, 0> buf;
+    raw_svector_ostream os(buf);
+    WriteBitcodeToFile(*src, os);
+
+    auto ctx = std::make_unique<LLVMContext>();
+    auto mod = parseBitcodeFile(
+        MemoryBufferRef(StringRef(buf.data(), buf.size()),
+                        src->getModuleIdentifier()),
+        *ctx);
+    if (!mod)
+        return mod.takeError();
+    return orc::ThreadSafeModule(std::move(*mod), std::move(ctx));
+}
+
+/*
+ * Give *TSM* the data layout of *JIT* if it has none, as LLJIT::addIRModule
+ * does; the compile-on-demand layer is used directly and won't do it.
+ */
+static Error applyDataLayout(OrcJIT *JIT, orc::ThreadSafeModule &TSM) {
+    Module &M = *TSM.getModuleUnlocked();
+    const DataLayout &DL = JIT->lljit->getDataLayout();
+    if (M.getDataLayout().isDefault())
+        M.setDataLayout(DL);
+    if (M.getDataLayout() != DL)
+        return make_error<StringError>(
+            "Added modules have incompatible data layouts: " +
+                M.getDataLayout().getStringRepresentation() + " (module) vs " +
+                DL.getStringRepresentation() + " (jit)",
+            inconvertibleErrorCode());
+    return Error::success();
+}
+
+/*
+ * Add *TSM* to a lazy JIT: its functions are only compiled when called.
+ */
+static Error addLazyModule(OrcJIT *JIT, ModuleOwner Owner,
+                           orc::ThreadSafeModule TSM) {
+    if (auto err = applyDataLayout(JIT, TSM))
+        return err;
+    return JIT->lazyJIT().getCompileOnDemandLayer().add(Owner,
+                                                        std::move(TSM));
+}
+
+/*
+ * With *threads* > 0, materialization is dispatched to a pool of that many
+ * compile threads instead of running on the thread doing the lookup.
+ */
+static Expected<std::unique_ptr<orc::LLJIT>>
+createJIT(orc::JITTargetMachineBuilder jtmb, bool lazy, unsigned threads) {
+    if (lazy) {
+        // The default partitioning only emits the requested functions.
+        auto jit = orc::LLLazyJITBuilder()
+                       .setJITTargetMachineBuilder(std::move(jtmb))
+                       .setNumCompileThreads(threads)
+                       .create();
+        if (!jit)
+            return jit.takeError();
+        return std::unique_ptr<orc::LLJIT>(std::move(*jit));
+    }
+    return orc::LLJITBuilder()
+        .setJITTargetMachineBuilder(std::move(jtmb))
+        .setNumCompileThreads(threads)
+        .create();
+}
+
+extern "C" {
+
+API_EXPORT(LLVMPYOrcJITRef)
+LLVMPY_CreateLLJITCompiler(LLVMTargetMachineRef TM, bool Lazy,
+                           unsigned NumThreads, const char **OutError) {
+    TargetMachine *tm = unwrap(TM);
+
+    // LLJIT creates its own TargetMachine(s); configure them like *TM*.
+    orc::JITTargetMachineBuilder jtmb(tm->getTargetTriple());
+    jtmb.setCPU(tm->getTargetCPU().str());
+    jtmb.addFeatures(
+        SubtargetFeatures(tm->getTargetFeatureString()).getFeatures());
+    jtmb.setRelocationModel(tm->getRelocationModel());
+    jtmb.setCodeModel(tm->getCodeModel());
+    jtmb.setCodeGenOptLevel(tm->getOptLevel());
+    jtmb.setOptions(tm->Options);
+
+    auto lljit = createJIT(std::move(jtmb), Lazy, NumThreads);
+    if (!lljit) {
+        reportError(lljit.takeError(), OutError);
+        return nullptr;
+    }
+
+    // Resolve external symbols from the process and from symbols registered
+    // with LLVMPY_AddSymbol, as MCJIT does.
+    auto generator = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+        (*lljit)->getDataLayout().getGlobalPrefix());
+    if (!generator) {
+        reportError(generator.takeError(), OutError);
+        return nullptr;
+    }
+    (*lljit)->getMainJITDylib().addGenerator(std::move(*generator));
+
+    return new OrcJIT{std::move(*lljit), Lazy};
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeLLJIT(LLVMPYOrcJITRef JIT) { delete JIT; }
+
+/*
+ * Add *M* to the JIT, consuming it, along with its context if *MoveContext*
+ * (see moveToThreadSafeModule).  Returns a resource tracker owning the
+ * module's resources, or NULL on error.
+ */
+API_EXPORT(LLVMPYResourceTrackerRef)
+LLVMPY_LLJITAddModule(LLVMPYOrcJITRef JIT, LLVMModuleRef M, bool MoveContext,
+                      const char **OutError) {
+    auto tsm = moveToThreadSafeModule(unwrap(M), MoveContext);
+    if (!tsm) {
+        reportError(tsm.takeError(), OutError);
+        return nullptr;
+    }
+
+#if LLVM_VERSION_MAJOR < 12
+    ModuleOwner owner = JIT->lljit->getMainJITDylib();
+#else
+    ModuleOwner owner = JIT->lljit->getMainJITDylib().createResourceTracker();
+#endif
+    Error err = JIT->lazy ? addLazyModule(JIT, owner, std::move(*tsm))
+                          : JIT->lljit->addIRModule(owner, std::move(*tsm));
+    if (err) {
+        reportError(std::move(err), OutError);
+        return nullptr;
+    }
+#if LLVM_VERSION_MAJOR < 12
+    return new OrcResourceTracker();
+#else
+    return new OrcResourceTracker{owner};
+#endif
+}
+
+/*
+ * Look up the (unmangled) symbol *Name*, compiling it if needed.  Returns 0
+ * and sets *OutError* if the symbol can't be found or materialized.
+ *
+ * For a lazy JIT, functions resolve to a stub that compiles the function on
+ * its first call.
+ */
+API_EXPORT(uint64_t)
+LLVMPY_LLJITLookup(LLVMPYOrcJITRef JIT, const char *Name,
+                   const char **OutError) {
+    auto sym = JIT->lljit->lookup(Name);
+    if (!sym) {
+        reportError(sym.takeError(), OutError);
+        return 0;
+    }
+    return sym->getAddress();
+}
+
+/*
+ * Start looking up the *Count* symbols in *Names* without waiting for the
+ * result.  With compile threads, the modules defining them are compiled
+ * concurrently; otherwise they are compiled before this returns.
+ */
+API_EXPORT(LLVMPYCompileFutureRef)
+LLVMPY_LLJITCompileAsync(LLVMPYOrcJITRef JIT, const char **Names,
+                         size_t Count) {
+    auto state = std::make_shared<OrcCompileState>();
+
+    orc::SymbolLookupSet symbols;
+    std::vector<orc::SymbolStringPtr> order;
+    for (size_t i = 0; i < Count; ++i) {
+        auto name = JIT->lljit->mangleAndIntern(Names[i]);
+        symbols.add(name);
+        order.push_back(name);
+    }
+
+    auto complete = [state, order](Expected<orc::SymbolMap> result) {
+        std::lock_guard<std::mutex> guard(state->lock);
+        if (result) {
+            for (auto &name : order)
+                state->addresses.push_back((*result)[name].getAddress());
+        } else {
+            state->error = toString(result.takeError());
+        }
+        state->ready = true;
+        state->cond.notify_all();
+    };
+
+    orc::ExecutionSession &ES = JIT->lljit->getExecutionSession();
+    ES.lookup(orc::LookupKind::Static,
+              orc::makeJITDylibSearchOrder(
+                  &JIT->lljit->getMainJITDylib(),
+                  orc::JITDylibLookupFlags::MatchAllSymbols),
+              std::move(symbols), orc::SymbolState::Ready, std::move(complete),
+              orc::NoDependenciesToRegister);
+    return new OrcCompileFuture{state};
+}
+
+API_EXPORT(bool)
+LLVMPY_CompileFutureIsReady(LLVMPYCompileFutureRef F) {
+    std::lock_guard<std::mutex> guard(F->state->lock);
+    return F->state->ready;
+}
+
+/*
+ * Block until the lookup completes, then write the symbol addresses to
+ * *OutAddrs* in the order they were requested.  Returns non-zero and sets
+ * *OutError* on failure.
+ */
+API_EXPORT(int)
+LLVMPY_CompileFutureWait(LLVMPYCompileFutureRef F, uint64_t *OutAddrs,
+                         const char **OutError) {
+    OrcCompileState &state = *F->state;
+    std::unique_lock<std::mutex> guard(state.lock);
+    state.cond.wait(guard, [&state] { return state.ready; });
+    if (!state.error.empty()) {
+        *OutError = LLVMPY_CreateString(state.error.c_str());
+        return 1;
+    }
+    std::copy(state.addresses.begin(), state.addresses.end(), OutAddrs);
+    return 0;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeCompileFuture(LLVMPYCompileFutureRef F) { delete F; }
+
+API_EXPORT(LLVMTargetDataRef)
+LLVMPY_LLJITGetTargetData(LLVMPYOrcJITRef JIT) {
+    return wrap(new DataLayout(JIT->lljit->getDataLayout()));
+}
+
+/*
+ * Remove all code, data and symbols owned by the tracker from the JIT.
+ */
+API_EXPORT(int)
+LLVMPY_LLJITRemoveResourceTracker(LLVMPYResourceTrackerRef RT,
+                                  const char **OutError) {
+#if LLVM_VERSION_MAJOR < 12
+    *OutError = LLVMPY_CreateString("removing modules requires LLVM 12");
+    return 1;
+#else
+    if (auto err = RT->tracker->remove()) {
+        reportError(std::move(err), OutError);
+        return 1;
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Release the handle.  The tracked resources stay in the JIT unless
+ * LLVMPY_LLJITRemoveResourceTracker was called.  Must be called before the
+ * JIT is disposed.
+ */
+API_EXPORT(void)
+LLVMPY_DisposeResourceTracker(LLVMPYResourceTrackerRef RT) { delete RT; }
+
+} // end extern "C"
@@ -1,15 +1,20 @@
+#include <memory>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include "core.h"
 
 #include "llvm-c/Transforms/IPO.h"
 #include "llvm-c/Transforms/Scalar.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/DiagnosticHandler.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/YAMLTraits.h"
 #include "llvm/Support/raw_ostream.h"
@@ -43,6 +48,165 @@
 #include <llvm/Transforms/Utils/UnifyFunctionExitNodes.h>
 using namespace llvm;
 
+/*
+ * Kinds of optimization remarks, as a bitmask.
+ */
+enum RemarkKind {
+    RemarkPassed = 1,
+    RemarkMissed = 2,
+    RemarkAnalysis = 4,
+};
+
+struct RemarkRecord {
+    int kind;
+    std::string pass;
+    std::string name;
+    std::string function;
+    std::string file;
+    unsigned line;
+    unsigned column;
+    std::string message;
+    std::vector<std::pair<std::string, std::string>> args;
+};
+
+class RemarkHandler;
+
+/*
+ * Collects the optimization remarks emitted in a context as records while
+ * installed.  Remarks of other kinds or for passes not matching the filter
+ * are disabled, so that passes don't build them at all.
+ */
+struct RemarkCollector {
+    std::vector<RemarkRecord> records;
+    Regex filter;
+    int kinds;
+    LLVMContext *context = nullptr;
+    // Owned by the context
+    RemarkHandler *handler = nullptr;
+
+    // An empty filter matches all passes.
+    RemarkCollector(const char *filter, int kinds)
+        : filter(*filter ? filter : ".*"), kinds(kinds) {}
+
+    bool isEnabled(int kind, StringRef pass) const {
+        return (kinds & kind) && filter.match(pass);
+    }
+
+    void install(LLVMContext &ctx);
+
+    /*
+     * Restore the handler the context had when this collector was
+     * installed.  Returns false, leaving the collector installed, if
+     * another handler has been installed since.
+     */
+    bool uninstall();
+
+    /*
+     * Stop collecting.  If another handler has been installed since, the
+     * handler of this collector stays in place, but only forwards to the
+     * previous handler.
+     */
+    void detach();
+};
+
+/*
+ * The diagnostic handler of a context with a RemarkCollector installed.
+ * Diagnostics other than remarks, and all of them once the collector is
+ * detached, go to the previous handler.
+ */
+class RemarkHandler : public DiagnosticHandler {
+  public:
+    RemarkCollector *collector;
+    std::unique_ptr<DiagnosticHandler> previous;
+
+    RemarkHandler(RemarkCollector &collector,
+                  std::unique_ptr<DiagnosticHandler> previous)
+        : collector(&collector), previous(std::move(previous)) {}
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        auto *OR = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+        if (!OR || !collector)
+            return previous && previous->handleDiagnostics(DI);
+        if (!OR->isEnabled())
+            return true;
+
+        RemarkRecord rec;
+        rec.kind = OR->isPassed()   ? RemarkPassed
+                   : OR->isMissed() ? RemarkMissed
+                                    : RemarkAnalysis;
+        rec.pass = OR->getPassName();
+        rec.name = OR->getRemarkName().str();
+        rec.function = OR->getFunction().getName().str();
+        DiagnosticLocation loc = OR->getLocation();
+        rec.file = loc.isValid() ? loc.getRelativePath().str() : "";
+        rec.line = loc.isValid() ? loc.getLine() : 0;
+        rec.column = loc.isValid() ? loc.getColumn() : 0;
+        rec.message = OR->getMsg();
+        for (const auto &arg : OR->getArgs())
+            rec.args.emplace_back(arg.Key, arg.Val);
+        collector->records.push_back(std::move(rec));
+        return true;
+    }
+
+    bool isAnalysisRemarkEnabled(StringRef pass) const override {
+        if (!collector)
+            return previous ? previous->isAnalysisRemarkEnabled(pass)
+                            : DiagnosticHandler::isAnalysisRemarkEnabled(pass);
+        return collector->isEnabled(RemarkAnalysis, pass);
+    }
+
+    bool isMissedOptRemarkEnabled(StringRef pass) const override {
+        if (!collector)
+            return previous
+                       ? previous->isMissedOptRemarkEnabled(pass)
+                       : DiagnosticHandler::isMissedOptRemarkEnabled(pass);
+        return collector->isEnabled(RemarkMissed, pass);
+    }
+
+    bool isPassedOptRemarkEnabled(StringRef pass) const override {
+        if (!collector)
+            return previous
+                       ? previous->isPassedOptRemarkEnabled(pass)
+                       : DiagnosticHandler::isPassedOptRemarkEnabled(pass);
+        return collector->isEnabled(RemarkPassed, pass);
+    }
+
+    bool isAnyRemarkEnabled() const override {
+        if (!collector)
+            return previous ? previous->isAnyRemarkEnabled()
+                            : DiagnosticHandler::isAnyRemarkEnabled();
+        return collector->kinds != 0;
+    }
+};
+
+void RemarkCollector::install(LLVMContext &ctx) {
+    context = &ctx;
+    auto h = std::make_unique<RemarkHandler>(*this, ctx.getDiagnosticHandler());
+    handler = h.get();
+    ctx.setDiagnosticHandler(std::move(h));
+}
+
+bool RemarkCollector::uninstall() {
+    if (!context)
+        return true;
+    if (context->getDiagHandlerPtr() != handler)
+        return false;
+    context->setDiagnosticHandler(std::move(handler->previous));
+    context = nullptr;
+    handler = nullptr;
+    return true;
+}
+
+void RemarkCollector::detach() {
+    if (uninstall())
+        return;
+    handler->collector = nullptr;
+    context = nullptr;
+    handler = nullptr;
+}
+
+typedef RemarkCollector *LLVMPYRemarkCollectorRef;
+
 /*
  * Exposed API
  */
@@ -61,6 +225,76 @@ LLVMPY_ReportAndResetTimings(const char **outmsg) {
     *outmsg = LLVMPY_CreateString(os.str().c_str());
 }
 
+/*
+ * Start collecting the optimization remarks of the given *Kinds* emitted in
+ * *C* by passes whose name matches the regular expression *Filter*.
+ * Returns NULL and sets *OutError* if the filter is invalid.
+ */
+API_EXPORT(LLVMPYRemarkCollectorRef)
+LLVMPY_CreateRemarkCollector(LLVMContextRef C, const char *Filter, int Kinds,
+                             const char **OutError) {
+    auto collector = std::make_unique<RemarkCollector>(Filter, Kinds);
+    std::string error;
+    if (!collector->filter.isValid(error)) {
+        *OutError = LLVMPY_CreateString(error.c_str());
+        return nullptr;
+    }
+    collector->install(*unwrap(C));
+    return collector.release();
+}
+
+/*
+ * Stop collecting remarks and restore the previous diagnostic handler.  The
+ * records collected so far remain available.  Returns false, and keeps
+ * collecting, if another diagnostic handler was installed in the context
+ * after *R* and is still installed.
+ */
+API_EXPORT(bool)
+LLVMPY_RemarkCollectorStop(LLVMPYRemarkCollectorRef R) {
+    return R->uninstall();
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeRemarkCollector(LLVMPYRemarkCollectorRef R) {
+    R->detach();
+    delete R;
+}
+
+API_EXPORT(size_t)
+LLVMPY_RemarkCollectorSize(LLVMPYRemarkCollectorRef R) {
+    return R->records.size();
+}
+
+/*
+ * Get the remark at *Index*.  The strings are owned by *R*.
+ */
+API_EXPORT(void)
+LLVMPY_RemarkCollectorGet(LLVMPYRemarkCollectorRef R, size_t Index,
+                          int *Kind, const char **Pass, const char **Name,
+                          const char **Function, const char **File,
+                          unsigned *Line, unsigned *Column,
+                          const char **Message, size_t *NumArgs) {
+    const RemarkRecord &rec = R->records[Index];
+    *Kind = rec.kind;
+    *Pass = rec.pass.c_str();
+    *Name = rec.name.c_str();
+    *Function = rec.function.c_str();
+    *File = rec.file.c_str();
+    *Line = rec.line;
+    *Column = rec.column;
+    *Message = rec.message.c_str();
+    *NumArgs = rec.args.size();
+}
+
+API_EXPORT(void)
+LLVMPY_RemarkCollectorGetArg(LLVMPYRemarkCollectorRef R, size_t Index,
+                             size_t ArgIndex, const char **Key,
+                             const char **Value) {
+    const auto &arg = R->records[Index].args[ArgIndex];
+    *Key = arg.first.c_str();
+    *Value = arg.second.c_str();
+}
+
 API_EXPORT(LLVMPassManagerRef)
 LLVMPY_CreatePassManager() { return LLVMCreatePassManager(); }
 
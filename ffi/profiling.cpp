@@ -0,0 +1,389 @@
+#include "core.h"
+
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/InstrProfWriter.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Instrumentation.h"
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+/*
+ * The counters of a function instrumented by PGOInstrumentationGen, once
+ * lowered by InstrProfiling.
+ */
+struct ProfiledFunction {
+    // The PGO name and CFG hash identifying the function in profiles
+    std::string name;
+    uint64_t hash;
+    // The symbol of the counters
+    std::string counters;
+    uint32_t numCounters;
+    // The number of value profiling sites of each kind
+    uint32_t valueSites[IPVK_Last + 1];
+};
+
+/*
+ * Collects the diagnostics emitted in a context while installed, so that
+ * errors are reported instead of exiting the process.
+ */
+class CollectingDiagnosticHandler : public DiagnosticHandler {
+  public:
+    std::string errors;
+    std::string warnings;
+
+    bool handleDiagnostics(const DiagnosticInfo &DI) override {
+        if (DI.getSeverity() != DS_Error && DI.getSeverity() != DS_Warning)
+            return true;
+        std::string &out = DI.getSeverity() == DS_Error ? errors : warnings;
+        raw_string_ostream os(out);
+        DiagnosticPrinterRawOStream printer(os);
+        DI.print(printer);
+        os << '\n';
+        return true;
+    }
+};
+
+/* A place for the instrumented code to find the runtime hook in the JIT. */
+int ProfileRuntimeHook = 0;
+
+} // end anonymous namespace
+
+struct LLVMPYProfileInstrumentation {
+    std::vector<ProfiledFunction> functions;
+};
+
+typedef LLVMPYProfileInstrumentation *LLVMPYProfileInstrumentationRef;
+
+/*
+ * Profile data of IR-level instrumentation, accumulated from the counters of
+ * instrumented code and from profile files.
+ */
+struct LLVMPYProfileData {
+    InstrProfWriter writer;
+    std::string errors;
+
+    LLVMPYProfileData() {
+#if LLVM_VERSION_MAJOR < 14
+        consumeError(writer.setIsIRLevelProfile(true, false));
+#else
+        consumeError(writer.mergeProfileKind(InstrProfKind::IR));
+#endif
+    }
+
+    void addRecord(NamedInstrProfRecord &&record, uint64_t weight) {
+        writer.addRecord(std::move(record), weight,
+                         [this](Error E) { addError(std::move(E)); });
+    }
+
+    void addError(Error E) { errors += toString(std::move(E)) + "\n"; }
+
+    /* Give the errors since the last call to *OutError*, if any. */
+    int takeErrors(const char **OutError) {
+        if (errors.empty())
+            return 0;
+        *OutError = LLVMPY_CreateString(errors.c_str());
+        errors.clear();
+        return 1;
+    }
+};
+
+typedef LLVMPYProfileData *LLVMPYProfileDataRef;
+
+extern "C" {
+
+/*
+ * Instrument the functions of *M* for IR-level PGO, as clang's
+ * -fprofile-generate does, with their counters lowered to globals by
+ * InstrProfiling, incremented atomically if *Atomic* is set.  Value profiling
+ * is left out, as it needs the profile runtime.  Return the counters of each
+ * function for LLVMPY_ProfileDataAddCounters(), or NULL with an error.
+ */
+API_EXPORT(LLVMPYProfileInstrumentationRef)
+LLVMPY_InstrumentModuleForProfiling(LLVMModuleRef M, bool Atomic,
+                                    const char **OutError) {
+    Module *mod = unwrap(M);
+    if (mod->getNamedGlobal(INSTR_PROF_QUOTE(INSTR_PROF_RAW_VERSION_VAR))) {
+        *OutError = LLVMPY_CreateString("module is already instrumented");
+        return nullptr;
+    }
+    {
+        legacy::PassManager PM;
+        PM.add(createPGOInstrumentationGenLegacyPass());
+        PM.run(*mod);
+    }
+
+    // The name variables of the functions, which InstrProfiling replaces.
+    std::map<std::string, ProfiledFunction> byNameVar;
+    for (Function &F : *mod) {
+        for (auto it = inst_begin(F); it != inst_end(F);) {
+            Instruction &I = *it++;
+            if (auto *inc = dyn_cast<InstrProfIncrementInst>(&I)) {
+                GlobalVariable *nameVar = inc->getName();
+                auto &info = byNameVar[nameVar->getName().str()];
+                info.name = getPGOFuncNameVarInitializer(nameVar).str();
+                info.hash = inc->getHash()->getZExtValue();
+                info.numCounters = inc->getNumCounters()->getZExtValue();
+            } else if (auto *vp = dyn_cast<InstrProfValueProfileInst>(&I)) {
+                auto &info = byNameVar[vp->getName()->getName().str()];
+                uint64_t kind = vp->getValueKind()->getZExtValue();
+                if (kind <= IPVK_Last)
+                    ++info.valueSites[kind];
+                vp->eraseFromParent();
+            }
+        }
+    }
+
+    {
+        InstrProfOptions options;
+        options.Atomic = Atomic;
+        legacy::PassManager PM;
+        PM.add(createInstrProfilingLegacyPass(options));
+        PM.run(*mod);
+    }
+
+    auto *result = new LLVMPYProfileInstrumentation();
+    StringRef namePrefix = getInstrProfNameVarPrefix();
+    for (auto &entry : byNameVar) {
+        ProfiledFunction &info = entry.second;
+        if (!info.numCounters)
+            continue;
+        // As InstrProfiling names the counters
+        std::string counters = (getInstrProfCountersVarPrefix() +
+                                StringRef(entry.first).substr(
+                                    namePrefix.size()))
+                                   .str();
+        GlobalVariable *GV = mod->getNamedGlobal(counters);
+        if (!GV) {
+            counters += "." + std::to_string(info.hash);
+            GV = mod->getNamedGlobal(counters);
+        }
+        if (!GV)
+            continue;
+        // Make the counters of private functions visible to the JIT
+        if (GV->hasLocalLinkage()) {
+            GV->setLinkage(GlobalValue::ExternalLinkage);
+            GV->setVisibility(GlobalValue::HiddenVisibility);
+            GV->setDSOLocal(true);
+        }
+        info.counters = counters;
+        result->functions.push_back(std::move(info));
+    }
+
+    // Where the runtime is registered through a hook, let JITted code find
+    // one; the counters are read directly from memory.
+    StringRef hook = INSTR_PROF_QUOTE(INSTR_PROF_PROFILE_RUNTIME_VAR);
+    if (mod->getNamedGlobal(hook) &&
+        !sys::DynamicLibrary::SearchForAddressOfSymbol(hook.str()))
+        sys::DynamicLibrary::AddSymbol(hook, &ProfileRuntimeHook);
+    return result;
+}
+
+API_EXPORT(void)
+LLVMPY_DisposeProfileInstrumentation(LLVMPYProfileInstrumentationRef I) {
+    delete I;
+}
+
+API_EXPORT(size_t)
+LLVMPY_ProfileInstrumentationSize(LLVMPYProfileInstrumentationRef I) {
+    return I->functions.size();
+}
+
+/*
+ * Give the PGO name of the *Index*-th instrumented function, the symbol of
+ * its counters and their number.  The strings live as long as *I*.
+ */
+API_EXPORT(void)
+LLVMPY_ProfileInstrumentationGet(LLVMPYProfileInstrumentationRef I,
+                                 size_t Index, const char **Name,
+                                 const char **Counters,
+                                 uint32_t *NumCounters) {
+    const ProfiledFunction &info = I->functions[Index];
+    *Name = info.name.c_str();
+    *Counters = info.counters.c_str();
+    *NumCounters = info.numCounters;
+}
+
+API_EXPORT(LLVMPYProfileDataRef)
+LLVMPY_CreateProfileData() { return new LLVMPYProfileData(); }
+
+API_EXPORT(void)
+LLVMPY_DisposeProfileData(LLVMPYProfileDataRef P) { delete P; }
+
+/*
+ * Add the counters of the functions of *I*, at the corresponding
+ * *Addresses*, to *P* with *Weight*, and zero them if *Reset* is set.
+ * Functions at a NULL address are skipped.
+ */
+API_EXPORT(int)
+LLVMPY_ProfileDataAddCounters(LLVMPYProfileDataRef P,
+                              LLVMPYProfileInstrumentationRef I,
+                              const uint64_t *Addresses, uint64_t Weight,
+                              bool Reset, const char **OutError) {
+    for (size_t i = 0; i < I->functions.size(); ++i) {
+        auto *counts = reinterpret_cast<uint64_t *>(Addresses[i]);
+        if (!counts)
+            continue;
+        const ProfiledFunction &info = I->functions[i];
+        NamedInstrProfRecord record(
+            info.name, info.hash,
+            std::vector<uint64_t>(counts, counts + info.numCounters));
+        // Value profiling sites are recorded without data
+        for (uint32_t kind = IPVK_First; kind <= IPVK_Last; ++kind) {
+            for (uint32_t site = 0; site < info.valueSites[kind]; ++site)
+                record.addValueData(kind, site, nullptr, 0, nullptr);
+        }
+        P->addRecord(std::move(record), Weight);
+        if (Reset)
+            std::memset(counts, 0, info.numCounters * sizeof(uint64_t));
+    }
+    return P->takeErrors(OutError);
+}
+
+/* Add the records of *Other* to *P* with *Weight*. */
+API_EXPORT(int)
+LLVMPY_ProfileDataMerge(LLVMPYProfileDataRef P, LLVMPYProfileDataRef Other,
+                        uint64_t Weight, const char **OutError) {
+    for (auto &func : Other->writer.getProfileData()) {
+        for (auto &entry : func.getValue()) {
+            NamedInstrProfRecord record(func.getKey(), entry.first, {});
+            static_cast<InstrProfRecord &>(record) = entry.second;
+            P->addRecord(std::move(record), Weight);
+        }
+    }
+    return P->takeErrors(OutError);
+}
+
+/*
+ * Add the records of the profile file at *Path*, either raw, as written by
+ * programs instrumented for PGO, or indexed, to *P* with *Weight*.
+ */
+API_EXPORT(int)
+LLVMPY_ProfileDataMergeFile(LLVMPYProfileDataRef P, const char *Path,
+                            uint64_t Weight, const char **OutError) {
+    auto reader = InstrProfReader::create(Path);
+    if (!reader) {
+        P->addError(reader.takeError());
+        return P->takeErrors(OutError);
+    }
+#if LLVM_VERSION_MAJOR < 14
+    if (Error E = P->writer.setIsIRLevelProfile(
+            (*reader)->isIRLevelProfile(), (*reader)->hasCSIRLevelProfile())) {
+#else
+    if (Error E = P->writer.mergeProfileKind((*reader)->getProfileKind())) {
+#endif
+        P->addError(std::move(E));
+        return P->takeErrors(OutError);
+    }
+    for (auto &record : **reader)
+        P->addRecord(std::move(record), Weight);
+    if ((*reader)->hasError())
+        P->addError((*reader)->getError());
+    return P->takeErrors(OutError);
+}
+
+/*
+ * Write the indexed profile of *P*, as llvm-profdata merge does, to the file
+ * at *Path*.
+ */
+API_EXPORT(int)
+LLVMPY_ProfileDataWrite(LLVMPYProfileDataRef P, const char *Path,
+                        const char **OutError) {
+    std::error_code EC;
+    raw_fd_ostream os(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        *OutError = LLVMPY_CreateString(EC.message().c_str());
+        return 1;
+    }
+    if (Error E = P->writer.write(os))
+        P->addError(std::move(E));
+    return P->takeErrors(OutError);
+}
+
+/*
+ * Fill up to *Size* counters of the function with the PGO name *Name* in *P*,
+ * and return their number, or -1 if *P* has no record of the function.
+ */
+API_EXPORT(int64_t)
+LLVMPY_ProfileDataGetCounts(LLVMPYProfileDataRef P, const char *Name,
+                            uint64_t *Counts, size_t Size) {
+    auto &data = P->writer.getProfileData();
+    auto it = data.find(Name);
+    if (it == data.end() || it->getValue().empty())
+        return -1;
+    const auto &counts = it->getValue().begin()->second.Counts;
+    std::copy_n(counts.begin(), std::min(Size, counts.size()), Counts);
+    return counts.size();
+}
+
+/*
+ * Annotate *M* with the profile of *P*, as clang's -fprofile-use does: with
+ * branch weights, function entry counts and a profile summary, which guide
+ * the later optimizations.  *M* must be the module as it was instrumented.
+ * The warnings, such as for functions whose CFG changed since, are given in
+ * *OutWarnings*.
+ */
+API_EXPORT(int)
+LLVMPY_ProfileDataApply(LLVMPYProfileDataRef P, LLVMModuleRef M,
+                        const char **OutWarnings, const char **OutError) {
+    // PGOInstrumentationUse only reads profiles from files
+    int FD;
+    SmallString<128> path;
+    if (std::error_code EC = sys::fs::createTemporaryFile(
+            "llvmlite-profile", "profdata", FD, path)) {
+        *OutError = LLVMPY_CreateString(EC.message().c_str());
+        return 1;
+    }
+    {
+        raw_fd_ostream os(FD, /*shouldClose=*/true);
+        if (Error E = P->writer.write(os))
+            P->addError(std::move(E));
+    }
+    if (P->takeErrors(OutError)) {
+        sys::fs::remove(path);
+        return 1;
+    }
+
+    Module *mod = unwrap(M);
+    LLVMContext &ctx = mod->getContext();
+    auto previous = ctx.getDiagnosticHandler();
+    auto handler = std::make_unique<CollectingDiagnosticHandler>();
+    auto *collected = handler.get();
+    ctx.setDiagnosticHandler(std::move(handler));
+    {
+        legacy::PassManager PM;
+        PM.add(createPGOInstrumentationUseLegacyPass(path));
+        PM.run(*mod);
+    }
+    std::string errors = std::move(collected->errors);
+    std::string warnings = std::move(collected->warnings);
+    ctx.setDiagnosticHandler(std::move(previous));
+    sys::fs::remove(path);
+
+    *OutWarnings = LLVMPY_CreateString(warnings.c_str());
+    if (!errors.empty()) {
+        *OutError = LLVMPY_CreateString(errors.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+} // end extern "C"
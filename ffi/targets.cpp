@@ -1,21 +1,41 @@
 #include "core.h"
 #include "llvm-c/Target.h"
 #include "llvm-c/TargetMachine.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/CodeGen/ParallelCG.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalIFunc.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/X86TargetParser.h"
+#include "llvm/Support/raw_ostream.h"
 #if LLVM_VERSION_MAJOR > 13
 #include "llvm/MC/TargetRegistry.h"
 #else
 #include "llvm/Support/TargetRegistry.h"
 #endif
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace llvm {
 
@@ -39,6 +59,211 @@ inline LLVMTargetMachineRef wrap(TargetMachine *TM) {
 
 } // namespace llvm
 
+namespace {
+
+/*
+ * A registry of objects shared by the callers asking for the same
+ * configuration from the same thread, as target machines and data layouts
+ * are not safe to use from several threads at once.  The objects are
+ * reference counted, and the registry holds a reference to each of them
+ * until it is cleared or, as its id may then be reused, their thread exits.
+ */
+template <typename T> class SharedRegistry {
+  public:
+    static SharedRegistry &get() {
+        // Never destroyed, as objects may be released at exit
+        static SharedRegistry *registry = new SharedRegistry();
+        return *registry;
+    }
+
+    /*
+     * Return a new reference to the object for *Config* on this thread,
+     * calling *Create* to make it if there is none.  Returns NULL if
+     * *Create* does.
+     */
+    template <typename CreateFn>
+    T *acquire(const std::string &Config, CreateFn Create) {
+        static thread_local ThreadExit exit(*this);
+        Key key(std::this_thread::get_id(), Config);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = byKey.find(key);
+            if (it != byKey.end()) {
+                ++entries[it->second];
+                return it->second;
+            }
+        }
+        // No other thread can add an object for this key meanwhile
+        T *obj = Create();
+        if (!obj)
+            return nullptr;
+        std::lock_guard<std::mutex> guard(lock);
+        byKey[key] = obj;
+        // One reference for the caller and one for the registry
+        entries[obj] = 2;
+        return obj;
+    }
+
+    /* Drop a reference returned by acquire(). */
+    void release(T *Obj) {
+        std::lock_guard<std::mutex> guard(lock);
+        unref(Obj);
+    }
+
+    /* Drop the registry's references. */
+    void clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &item : byKey)
+            unref(item.second);
+        byKey.clear();
+    }
+
+  private:
+    typedef std::pair<std::thread::id, std::string> Key;
+
+    /* Drops the registry's references for a thread when it exits. */
+    struct ThreadExit {
+        SharedRegistry &registry;
+
+        ThreadExit(SharedRegistry &registry) : registry(registry) {}
+
+        ~ThreadExit() {
+            std::thread::id id = std::this_thread::get_id();
+            std::lock_guard<std::mutex> guard(registry.lock);
+            auto &byKey = registry.byKey;
+            auto it = byKey.lower_bound(Key(id, std::string()));
+            while (it != byKey.end() && it->first.first == id) {
+                registry.unref(it->second);
+                it = byKey.erase(it);
+            }
+        }
+    };
+
+    void unref(T *Obj) {
+        auto it = entries.find(Obj);
+        if (--it->second == 0) {
+            entries.erase(it);
+            delete Obj;
+        }
+    }
+
+    std::mutex lock;
+    std::map<Key, T *> byKey;
+    // The reference count of each object
+    std::map<const T *, size_t> entries;
+};
+
+typedef SharedRegistry<llvm::TargetMachine> SharedTargetMachines;
+typedef SharedRegistry<llvm::DataLayout> SharedTargetData;
+
+#if LLVM_VERSION_MAJOR > 13
+// The x86 features which programs can check the CPU for at run time
+const char *const CheckableX86Features[] = {
+#define X86_FEATURE_COMPAT(ENUM, STR, PRIORITY) STR,
+#include "llvm/Support/X86TargetParser.def"
+};
+
+/*
+ * Return the mask of the features of *CPU* and *Features*, a string of
+ * features such as "+avx2,-fma", in the feature bits of compiler-rt and
+ * libgcc, or set *Error* if *CPU* is unknown.
+ */
+uint64_t getX86FeatureMask(llvm::StringRef CPU, llvm::StringRef Features,
+                           std::string &Error) {
+    using namespace llvm;
+    StringSet<> enabled;
+    if (!CPU.empty()) {
+        if (X86::parseArchX86(CPU) == X86::CK_None) {
+            Error = ("unknown x86 CPU: " + CPU).str();
+            return 0;
+        }
+        SmallVector<StringRef, 32> cpuFeatures;
+        X86::getFeaturesForCPU(CPU, cpuFeatures);
+        for (StringRef feature : cpuFeatures)
+            enabled.insert(feature);
+    }
+    SmallVector<StringRef, 32> items;
+    Features.split(items, ',', -1, false);
+    for (StringRef item : items) {
+        if (item.consume_front("+"))
+            enabled.insert(item);
+        else if (item.consume_front("-"))
+            enabled.erase(item);
+    }
+    SmallVector<StringRef, 32> checkable;
+    for (StringRef feature : CheckableX86Features) {
+        if (enabled.count(feature))
+            checkable.push_back(feature);
+    }
+    return X86::getCpuSupportsMask(checkable);
+}
+
+/*
+ * Emit in *B* the check that the host supports the features of *Mask*, which
+ * must not be 0, using the feature bits set by __cpu_indicator_init(), as
+ * clang does for __builtin_cpu_supports().
+ */
+llvm::Value *emitX86CpuSupports(llvm::IRBuilder<> &B, uint64_t Mask) {
+    using namespace llvm;
+    Module *mod = B.GetInsertBlock()->getModule();
+    Type *i32 = B.getInt32Ty();
+    Value *result = nullptr;
+    if (uint32_t mask1 = Lo_32(Mask)) {
+        auto *modelTy = StructType::get(i32, i32, i32, ArrayType::get(i32, 1));
+        auto *model = cast<GlobalVariable>(
+            mod->getOrInsertGlobal("__cpu_model", modelTy));
+        model->setDSOLocal(true);
+        Value *ptr = B.CreateConstInBoundsGEP2_32(modelTy, model, 0, 3);
+        ptr = B.CreateConstInBoundsGEP2_32(modelTy->getElementType(3), ptr, 0,
+                                           0);
+        Value *bits = B.CreateAlignedLoad(i32, ptr, Align(4));
+        Value *want = B.getInt32(mask1);
+        result = B.CreateICmpEQ(B.CreateAnd(bits, want), want);
+    }
+    if (uint32_t mask2 = Hi_32(Mask)) {
+        auto *features2 = cast<GlobalVariable>(
+            mod->getOrInsertGlobal("__cpu_features2", i32));
+        features2->setDSOLocal(true);
+        Value *bits = B.CreateAlignedLoad(i32, features2, Align(4));
+        Value *want = B.getInt32(mask2);
+        Value *found = B.CreateICmpEQ(B.CreateAnd(bits, want), want);
+        result = result ? B.CreateAnd(result, found) : found;
+    }
+    return result;
+}
+#endif
+
+/*
+ * The vector math libraries TargetLibraryInfo knows the functions of, by the
+ * names of LLVM's -vector-library option, with a function of each library to
+ * look for in the process.
+ */
+struct VectorLibraryInfo {
+    const char *name;
+    llvm::TargetLibraryInfoImpl::VectorLibrary lib;
+    const char *probe;
+    bool (*supports)(const llvm::Triple &);
+};
+
+const VectorLibraryInfo VectorLibraries[] = {
+    {"Accelerate", llvm::TargetLibraryInfoImpl::Accelerate, "vexpf",
+     [](const llvm::Triple &T) { return T.isOSDarwin(); }},
+#if LLVM_VERSION_MAJOR > 11
+    {"Darwin_libsystem_m", llvm::TargetLibraryInfoImpl::DarwinLibSystemM,
+     "_simd_exp_d2", [](const llvm::Triple &T) { return T.isOSDarwin(); }},
+#endif
+#if LLVM_VERSION_MAJOR > 12
+    {"LIBMVEC-X86", llvm::TargetLibraryInfoImpl::LIBMVEC_X86, "_ZGVbN2v_exp",
+     [](const llvm::Triple &T) { return T.isX86() && T.isOSLinux(); }},
+#endif
+    {"MASSV", llvm::TargetLibraryInfoImpl::MASSV, "__expd2",
+     [](const llvm::Triple &T) { return T.isPPC(); }},
+    {"SVML", llvm::TargetLibraryInfoImpl::SVML, "__svml_exp2",
+     [](const llvm::Triple &T) { return T.isX86(); }},
+};
+
+} // end anonymous namespace
+
 extern "C" {
 
 API_EXPORT(void)
@@ -135,6 +360,153 @@ LLVMPY_ABIAlignmentOfElementType(LLVMTargetDataRef TD, LLVMTypeRef Ty) {
     return (long long)LLVMABIAlignmentOfType(TD, llvm::wrap(tp));
 }
 
+/*
+ * Store the ABI size, alignment and number of elements of each of the *N*
+ * struct types of *Types* in *Sizes*, *Alignments* and *NumElements*, and
+ * the offsets of their elements one after the other in *Offsets*, as long as
+ * they fit in its *MaxOffsets* items.  The size of the types which are not
+ * sized structs is set to UINT64_MAX, and they have no elements.  Returns the
+ * number of offsets.
+ */
+API_EXPORT(size_t)
+LLVMPY_GetStructLayouts(LLVMTargetDataRef TD, LLVMTypeRef *Types, size_t N,
+                        uint64_t *Sizes, uint64_t *Alignments,
+                        size_t *NumElements, uint64_t *Offsets,
+                        size_t MaxOffsets) {
+    using namespace llvm;
+    const DataLayout *dl = unwrap(TD);
+    size_t numOffsets = 0;
+    for (size_t i = 0; i < N; ++i) {
+        auto *sty = dyn_cast<StructType>(unwrap(Types[i]));
+        if (!sty || !sty->isSized()) {
+            Sizes[i] = UINT64_MAX;
+            Alignments[i] = 0;
+            NumElements[i] = 0;
+            continue;
+        }
+        const StructLayout *layout = dl->getStructLayout(sty);
+        Sizes[i] = dl->getTypeAllocSize(sty);
+        Alignments[i] = layout->getAlignment().value();
+        NumElements[i] = sty->getNumElements();
+        for (unsigned j = 0, e = sty->getNumElements(); j < e; ++j) {
+            if (numOffsets < MaxOffsets)
+                Offsets[numOffsets] = layout->getElementOffset(j);
+            ++numOffsets;
+        }
+    }
+    return numOffsets;
+}
+
+/*
+ * Turn each of the *NumFunctions* functions named in *Functions* into an
+ * ifunc which, when the program is loaded, resolves to the first of
+ * *NumVariants* clones of the function, compiled for the CPU of *CPUs* and
+ * the features of *Features*, whose features the host supports, or else to
+ * the original function.  Only x86 ELF targets are supported.
+ *
+ * Returns non-zero and sets *OutError* on error, in which case the module is
+ * unchanged.  Requires LLVM 14, whose x86 target parser can map features to
+ * the bits of the CPU model the resolvers check.
+ */
+API_EXPORT(int)
+LLVMPY_MultiversionFunctions(LLVMModuleRef M, const char **Functions,
+                             size_t NumFunctions, const char **CPUs,
+                             const char **Features, size_t NumVariants,
+                             const char **OutError) {
+#if LLVM_VERSION_MAJOR < 14
+    *OutError =
+        LLVMPY_CreateString("function multiversioning requires LLVM 14");
+    return 1;
+#else
+    using namespace llvm;
+    Module *mod = unwrap(M);
+    std::string error;
+    Triple triple(mod->getTargetTriple());
+    if (!triple.isX86() || !triple.isOSBinFormatELF())
+        error = "function multiversioning needs an x86 ELF target, not '" +
+                triple.str() + "'";
+    std::vector<uint64_t> masks;
+    for (size_t i = 0; i < NumVariants && error.empty(); ++i) {
+        masks.push_back(getX86FeatureMask(CPUs[i], Features[i], error));
+        if (error.empty() && !masks.back())
+            error = "variant " + std::to_string(i) +
+                    " has no features the CPU can be checked for";
+    }
+    std::vector<Function *> funcs;
+    for (size_t i = 0; i < NumFunctions && error.empty(); ++i) {
+        Function *func = mod->getFunction(Functions[i]);
+        if (!func || func->isDeclaration())
+            error = std::string("no function defined with name: ") +
+                    Functions[i];
+        funcs.push_back(func);
+    }
+    if (!error.empty()) {
+        *OutError = LLVMPY_CreateString(error.c_str());
+        return 1;
+    }
+
+    FunctionCallee cpuInit = mod->getOrInsertFunction(
+        "__cpu_indicator_init", Type::getVoidTy(mod->getContext()));
+    if (auto *init = dyn_cast<Function>(cpuInit.getCallee()))
+        init->setDSOLocal(true);
+    for (Function *func : funcs) {
+        std::string name = func->getName().str();
+        std::vector<Function *> variants;
+        for (size_t i = 0; i < NumVariants; ++i) {
+            ValueToValueMapTy vmap;
+            Function *variant = CloneFunction(func, vmap);
+            variant->setName(name + "." + std::to_string(i));
+            variant->setLinkage(GlobalValue::InternalLinkage);
+            variant->setVisibility(GlobalValue::DefaultVisibility);
+            if (*CPUs[i])
+                variant->addFnAttr("target-cpu", CPUs[i]);
+            if (*Features[i])
+                variant->addFnAttr("target-features", Features[i]);
+            variants.push_back(variant);
+        }
+
+        auto *resolver = Function::Create(
+            FunctionType::get(func->getType(), false),
+            GlobalValue::InternalLinkage, name + ".resolver", mod);
+        func->setName(name + ".default");
+        auto *ifunc = GlobalIFunc::create(
+            func->getFunctionType(), func->getAddressSpace(),
+            func->getLinkage(), name, resolver, mod);
+        ifunc->setVisibility(func->getVisibility());
+        ifunc->setDLLStorageClass(func->getDLLStorageClass());
+        func->replaceAllUsesWith(ifunc);
+        func->setLinkage(GlobalValue::InternalLinkage);
+        func->setVisibility(GlobalValue::DefaultVisibility);
+        // Recursive calls stay within the variant
+        variants.push_back(func);
+        for (Function *variant : variants) {
+            ifunc->replaceUsesWithIf(variant, [variant](Use &U) {
+                auto *inst = dyn_cast<Instruction>(U.getUser());
+                return inst && inst->getFunction() == variant;
+            });
+        }
+        variants.pop_back();
+
+        // The resolver may run before constructors, hence the explicit
+        // initialization of the feature bits
+        IRBuilder<> builder(
+            BasicBlock::Create(mod->getContext(), "", resolver));
+        builder.CreateCall(cpuInit);
+        for (size_t i = 0; i < NumVariants; ++i) {
+            Value *supported = emitX86CpuSupports(builder, masks[i]);
+            auto *found = BasicBlock::Create(mod->getContext(), "", resolver);
+            auto *next = BasicBlock::Create(mod->getContext(), "", resolver);
+            builder.CreateCondBr(supported, found, next);
+            builder.SetInsertPoint(found);
+            builder.CreateRet(variants[i]);
+            builder.SetInsertPoint(next);
+        }
+        builder.CreateRet(func);
+    }
+    return 0;
+#endif
+}
+
 API_EXPORT(LLVMTargetRef)
 LLVMPY_GetTargetFromTriple(const char *Triple, const char **ErrOut) {
     char *ErrorMessage;
@@ -237,24 +609,101 @@ LLVMPY_SetTargetMachineAsmVerbosity(LLVMTargetMachineRef TM, int verbose) {
     LLVMSetTargetMachineAsmVerbosity(TM, verbose);
 }
 
+/*
+ * Emit *M* to a new memory buffer.  Unlike
+ * LLVMTargetMachineEmitToMemoryBuffer, the output is not copied: the buffer
+ * takes over the vector it was streamed to.
+ */
 API_EXPORT(LLVMMemoryBufferRef)
 LLVMPY_TargetMachineEmitToMemory(LLVMTargetMachineRef TM, LLVMModuleRef M,
                                  int use_object, const char **ErrOut) {
-    LLVMCodeGenFileType filetype = LLVMAssemblyFile;
-    if (use_object)
-        filetype = LLVMObjectFile;
+    using namespace llvm;
+    TargetMachine *tm = unwrap(TM);
+    Module *mod = unwrap(M);
+    CodeGenFileType filetype = use_object ? CGFT_ObjectFile : CGFT_AssemblyFile;
+
+    mod->setDataLayout(tm->createDataLayout());
+
+    SmallVector<char, 0> output;
+    {
+        raw_svector_ostream os(output);
+        legacy::PassManager pm;
+        if (tm->addPassesToEmitFile(pm, os, nullptr, filetype)) {
+            *ErrOut = LLVMPY_CreateString(
+                "TargetMachine can't emit a file of this type");
+            return NULL;
+        }
+        pm.run(*mod);
+    }
+#if LLVM_VERSION_MAJOR < 14
+    return wrap(new SmallVectorMemoryBuffer(std::move(output)));
+#else
+    return wrap(new SmallVectorMemoryBuffer(std::move(output), false));
+#endif
+}
 
-    char *ErrorMessage;
-    LLVMMemoryBufferRef BufOut;
-    int err = LLVMTargetMachineEmitToMemoryBuffer(TM, M, filetype,
-                                                  &ErrorMessage, &BufOut);
-    if (err) {
-        *ErrOut = LLVMPY_CreateString(ErrorMessage);
-        LLVMDisposeMessage(ErrorMessage);
-        return NULL;
+/*
+ * Split *M* into *NumParts* partitions and emit them concurrently, one
+ * thread and one copy of *TM* per partition.  *M* itself is left untouched;
+ * partitions refer to each other's definitions, local symbols being
+ * externalized with hidden visibility, so the outputs must be linked
+ * together.  *OutBufs* receives *NumParts* buffers, some of which may hold
+ * empty objects.  Returns non-zero and sets *ErrOut* on error.
+ */
+API_EXPORT(int)
+LLVMPY_TargetMachineEmitSplit(LLVMTargetMachineRef TM, LLVMModuleRef M,
+                              int use_object, unsigned NumParts,
+                              LLVMMemoryBufferRef *OutBufs,
+                              const char **ErrOut) {
+    using namespace llvm;
+    TargetMachine *tm = unwrap(TM);
+    CodeGenFileType filetype = use_object ? CGFT_ObjectFile : CGFT_AssemblyFile;
+
+    // Check the file type upfront: splitCodeGen() aborts on failure.
+    {
+        legacy::PassManager pm;
+        raw_null_ostream os;
+        if (tm->addPassesToEmitFile(pm, os, nullptr, filetype)) {
+            *ErrOut = LLVMPY_CreateString(
+                "TargetMachine can't emit a file of this type");
+            return 1;
+        }
     }
 
-    return BufOut;
+    std::vector<SmallVector<char, 0>> outputs(NumParts);
+    std::vector<std::unique_ptr<raw_svector_ostream>> streams;
+    std::vector<raw_pwrite_stream *> oss;
+    for (auto &out : outputs) {
+        streams.push_back(std::make_unique<raw_svector_ostream>(out));
+        oss.push_back(streams.back().get());
+    }
+
+    auto factory = [tm]() {
+        return std::unique_ptr<TargetMachine>(
+            tm->getTarget().createTargetMachine(
+                tm->getTargetTriple().str(), tm->getTargetCPU(),
+                tm->getTargetFeatureString(), tm->Options,
+                tm->getRelocationModel(), tm->getCodeModel(),
+                tm->getOptLevel()));
+    };
+
+    // Splitting externalizes local symbols, so work on a copy.
+    std::unique_ptr<Module> clone = CloneModule(*unwrap(M));
+#if LLVM_VERSION_MAJOR < 12
+    splitCodeGen(std::move(clone), oss, {}, factory, filetype);
+#else
+    splitCodeGen(*clone, oss, {}, factory, filetype);
+#endif
+
+    streams.clear();
+    for (unsigned i = 0; i < NumParts; ++i)
+#if LLVM_VERSION_MAJOR < 14
+        OutBufs[i] = wrap(new SmallVectorMemoryBuffer(std::move(outputs[i])));
+#else
+        OutBufs[i] = wrap(
+            new SmallVectorMemoryBuffer(std::move(outputs[i]), false));
+#endif
+    return 0;
 }
 
 API_EXPORT(LLVMTargetDataRef)
@@ -263,11 +712,105 @@ LLVMPY_CreateTargetMachineData(LLVMTargetMachineRef TM) {
         new llvm::DataLayout(llvm::unwrap(TM)->createDataLayout()));
 }
 
+/*
+ * Return a reference to the target machine shared by the callers asking for
+ * the same configuration, as for LLVMPY_CreateTargetMachine(), from this
+ * thread.  It must be released with LLVMPY_ReleaseSharedTargetMachine().
+ */
+API_EXPORT(LLVMTargetMachineRef)
+LLVMPY_GetSharedTargetMachine(LLVMTargetRef T, const char *Triple,
+                              const char *CPU, const char *Features,
+                              int OptLevel, const char *RelocModel,
+                              const char *CodeModel, int PrintMC, int JIT,
+                              const char *ABIName) {
+    std::string config;
+    llvm::raw_string_ostream os(config);
+    os << llvm::unwrap(T)->getName() << '\0' << Triple << '\0' << CPU << '\0'
+       << Features << '\0' << OptLevel << '\0' << RelocModel << '\0'
+       << CodeModel << '\0' << PrintMC << '\0' << JIT << '\0' << ABIName;
+    os.flush();
+    return llvm::wrap(SharedTargetMachines::get().acquire(config, [&]() {
+        return llvm::unwrap(LLVMPY_CreateTargetMachine(T, Triple, CPU, Features,
+                                                       OptLevel, RelocModel,
+                                                       CodeModel, PrintMC, JIT,
+                                                       ABIName));
+    }));
+}
+
+API_EXPORT(void)
+LLVMPY_ReleaseSharedTargetMachine(LLVMTargetMachineRef TM) {
+    SharedTargetMachines::get().release(llvm::unwrap(TM));
+}
+
+/*
+ * Return a reference to the data layout of string *StringRep* shared by its
+ * callers from this thread.  It must be released with
+ * LLVMPY_ReleaseSharedTargetData().
+ */
+API_EXPORT(LLVMTargetDataRef)
+LLVMPY_GetSharedTargetData(const char *StringRep) {
+    return llvm::wrap(SharedTargetData::get().acquire(
+        StringRep, [&]() { return new llvm::DataLayout(StringRep); }));
+}
+
+API_EXPORT(void)
+LLVMPY_ReleaseSharedTargetData(LLVMTargetDataRef TD) {
+    SharedTargetData::get().release(llvm::unwrap(TD));
+}
+
+/*
+ * Drop the shared target machines and data layouts, which are destroyed once
+ * their last reference is released.
+ */
+API_EXPORT(void)
+LLVMPY_ClearSharedTargets() {
+    SharedTargetMachines::get().clear();
+    SharedTargetData::get().clear();
+}
+
 API_EXPORT(void)
 LLVMPY_AddAnalysisPasses(LLVMTargetMachineRef TM, LLVMPassManagerRef PM) {
     LLVMAddAnalysisPasses(TM, PM);
 }
 
+/*
+ * Add to *PM* the library information of *TM*'s target, with the vectorized
+ * functions of the vector library *VecLib*, a
+ * TargetLibraryInfoImpl::VectorLibrary.
+ */
+API_EXPORT(void)
+LLVMPY_AddTargetLibraryInfo(LLVMTargetMachineRef TM, LLVMPassManagerRef PM,
+                            int VecLib) {
+    using namespace llvm;
+    TargetLibraryInfoImpl TLII(unwrap(TM)->getTargetTriple());
+    TLII.addVectorizableFunctionsFromVecLib(
+        TargetLibraryInfoImpl::VectorLibrary(VecLib));
+    unwrap(PM)->add(new TargetLibraryInfoWrapperPass(TLII));
+}
+
+/*
+ * Fill the names and TargetLibraryInfoImpl::VectorLibrary values of up to
+ * *Size* vector libraries, with whether they have functions for *Triple* and
+ * whether they are loaded in the process, and return the number of vector
+ * libraries.
+ */
+API_EXPORT(size_t)
+LLVMPY_GetVectorLibraries(const char *TripleStr, const char **Names, int *Ids,
+                          int *Supported, int *Loaded, size_t Size) {
+    using namespace llvm;
+    Triple triple(TripleStr);
+    size_t count = sizeof(VectorLibraries) / sizeof(VectorLibraries[0]);
+    for (size_t i = 0; i < std::min(count, Size); ++i) {
+        const VectorLibraryInfo &info = VectorLibraries[i];
+        Names[i] = info.name;
+        Ids[i] = info.lib;
+        Supported[i] = info.supports(triple);
+        Loaded[i] = sys::DynamicLibrary::SearchForAddressOfSymbol(
+                        info.probe) != nullptr;
+    }
+    return count;
+}
+
 API_EXPORT(const void *)
 LLVMPY_GetBufferStart(LLVMMemoryBufferRef MB) { return LLVMGetBufferStart(MB); }
 
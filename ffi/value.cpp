@@ -1,5 +1,6 @@
 #include "core.h"
 #include "llvm-c/Core.h"
+#include <cstring>
 #include <string>
 
 #include <iostream>
@@ -432,4 +433,120 @@ LLVMPY_GetOpcodeName(LLVMValueRef Val) {
     return LLVMPY_CreateString("");
 }
 
+/*
+ * Bulk introspection.  Each of the following fills caller-provided arrays
+ * for a whole function, block or list of values in a single call, rather
+ * than one element per call as the iterators above do; the arrays are sized
+ * with the matching count.
+ */
+
+API_EXPORT(size_t)
+LLVMPY_CountBlocks(LLVMValueRef F) {
+    return llvm::unwrap<llvm::Function>(F)->size();
+}
+
+API_EXPORT(void)
+LLVMPY_GetBlocks(LLVMValueRef F, LLVMValueRef *Blocks) {
+    using namespace llvm;
+    for (BasicBlock &block : *unwrap<Function>(F))
+        *Blocks++ = wrap(static_cast<Value *>(&block));
+}
+
+/*
+ * Count the instructions of a function or block.
+ */
+API_EXPORT(size_t)
+LLVMPY_CountInstructions(LLVMValueRef V) {
+    using namespace llvm;
+    Value *val = unwrap(V);
+    if (auto *func = dyn_cast<Function>(val))
+        return func->getInstructionCount();
+    return cast<BasicBlock>(val)->size();
+}
+
+/*
+ * Get the instructions of a function or block, in order, with their opcodes
+ * and, for a function, the index of their block.  *Opcodes* and
+ * *BlockIndices* may be NULL.
+ */
+API_EXPORT(void)
+LLVMPY_GetInstructions(LLVMValueRef V, LLVMValueRef *Insts, unsigned *Opcodes,
+                       size_t *BlockIndices) {
+    using namespace llvm;
+    size_t blockIndex = 0;
+    auto getBlock = [&](BasicBlock &block) {
+        for (Instruction &inst : block) {
+            *Insts++ = wrap(&inst);
+            if (Opcodes)
+                *Opcodes++ = inst.getOpcode();
+            if (BlockIndices)
+                *BlockIndices++ = blockIndex;
+        }
+        ++blockIndex;
+    };
+    Value *val = unwrap(V);
+    if (auto *func = dyn_cast<Function>(val)) {
+        for (BasicBlock &block : *func)
+            getBlock(block);
+    } else {
+        getBlock(*cast<BasicBlock>(val));
+    }
+}
+
+/*
+ * Count the operands of the *N* instructions *Insts*.
+ */
+API_EXPORT(size_t)
+LLVMPY_CountOperands(const LLVMValueRef *Insts, size_t N) {
+    size_t count = 0;
+    for (size_t i = 0; i < N; ++i)
+        count += llvm::unwrap<llvm::User>(Insts[i])->getNumOperands();
+    return count;
+}
+
+/*
+ * Get the operands of the *N* instructions *Insts* back to back; those of
+ * Insts[i] start at *Offsets*[i], which has N + 1 entries.
+ */
+API_EXPORT(void)
+LLVMPY_GetOperands(const LLVMValueRef *Insts, size_t N,
+                   LLVMValueRef *Operands, size_t *Offsets) {
+    using namespace llvm;
+    size_t count = 0;
+    for (size_t i = 0; i < N; ++i) {
+        Offsets[i] = count;
+        for (Use &op : unwrap<User>(Insts[i])->operands())
+            Operands[count++] = wrap(op.get());
+    }
+    Offsets[N] = count;
+}
+
+/*
+ * Set the lengths of the names of the *N* values *Values* in *Lengths* and,
+ * if *Buf* isn't NULL, write the names back to back to it.  Returns their
+ * total length.
+ */
+API_EXPORT(size_t)
+LLVMPY_GetValueNames(const LLVMValueRef *Values, size_t N, char *Buf,
+                     size_t *Lengths) {
+    size_t total = 0;
+    for (size_t i = 0; i < N; ++i) {
+        llvm::StringRef name = llvm::unwrap(Values[i])->getName();
+        Lengths[i] = name.size();
+        if (Buf)
+            memcpy(Buf + total, name.data(), name.size());
+        total += name.size();
+    }
+    return total;
+}
+
+/*
+ * The name of the opcode *Opcode*, as returned by LLVMPY_GetInstructions.
+ * The string is static.
+ */
+API_EXPORT(const char *)
+LLVMPY_GetOpcodeNameOf(unsigned Opcode) {
+    return llvm::Instruction::getOpcodeName(Opcode);
+}
+
 } // end extern "C"
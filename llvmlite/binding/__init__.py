@@ -5,12 +5,17 @@ from .dylib import *
 from .executionengine import *
 from .initfini import *
 from .linker import *
+from .memorybuffer import *
 from .module import *
+from .irlowering import *
 from .options import *
 from .passmanagers import *
+from .newpassmanagers import *
+from .profiling import *
 from .targets import *
 from .transforms import *
 from .value import *
 from .analysis import *
 from .object_file import *
+from .orcjit import *
 from .context import *
\ No newline at end of file
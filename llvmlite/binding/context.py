@@ -1,3 +1,5 @@
+import weakref
+
 from llvmlite.binding import ffi
 
 
@@ -12,12 +14,24 @@ def get_global_context():
 class ContextRef(ffi.ObjectRef):
     def __init__(self, context_ptr):
         super(ContextRef, self).__init__(context_ptr)
+        # The ModuleRefs created in this context
+        self._modules = weakref.WeakSet()
+
+    def _only_holds(self, module):
+        """
+        Whether *module* is the only open module of this context, which can
+        then be handed over with it.
+        """
+        return all(mod is module or mod.closed for mod in self._modules)
 
     def _dispose(self):
         ffi.lib.LLVMPY_ContextDispose(self)
 
 
 class GlobalContextRef(ContextRef):
+    def _only_holds(self, module):
+        return False
+
     def _dispose(self):
         pass
 
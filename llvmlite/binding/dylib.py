@@ -1,4 +1,4 @@
-from ctypes import c_void_p, c_char_p, c_bool, POINTER
+from ctypes import c_void_p, c_char_p, c_bool, c_size_t, POINTER
 
 from llvmlite.binding import ffi
 from llvmlite.binding.common import _encode_string
@@ -20,6 +20,30 @@ def add_symbol(name, address):
     ffi.lib.LLVMPY_AddSymbol(_encode_string(name), c_void_p(address))
 
 
+def add_symbols(symbols):
+    """
+    Register the addresses of many global symbols at once, as add_symbol()
+    does.  *symbols* is a mapping of names to addresses or an iterable of
+    (name, address) pairs.
+    """
+    names, addresses = _symbol_arrays(symbols)
+    ffi.lib.LLVMPY_AddSymbols(names, addresses, len(names))
+
+
+def _symbol_arrays(symbols):
+    """
+    Return the ctypes arrays of the names and addresses of *symbols*.
+    """
+    if hasattr(symbols, 'items'):
+        symbols = symbols.items()
+    symbols = list(symbols)
+    names = (c_char_p * len(symbols))(
+        *[_encode_string(name) for name, _ in symbols])
+    addresses = (c_void_p * len(symbols))(
+        *[address for _, address in symbols])
+    return names, addresses
+
+
 def load_library_permanently(filename):
     """
     Load an external library
@@ -38,6 +62,12 @@ ffi.lib.LLVMPY_AddSymbol.argtypes = [
     c_void_p,
 ]
 
+ffi.lib.LLVMPY_AddSymbols.argtypes = [
+    POINTER(c_char_p),
+    POINTER(c_void_p),
+    c_size_t,
+]
+
 ffi.lib.LLVMPY_SearchAddressOfSymbol.argtypes = [c_char_p]
 ffi.lib.LLVMPY_SearchAddressOfSymbol.restype = c_void_p
 
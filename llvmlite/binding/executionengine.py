@@ -1,22 +1,30 @@
-from ctypes import (POINTER, c_char_p, c_bool, c_void_p,
-                    c_int, c_uint64, c_size_t, CFUNCTYPE, string_at, cast,
-                    py_object, Structure)
+from ctypes import (POINTER, c_char, c_char_p, c_bool, c_void_p,
+                    c_int, c_uint64, c_size_t, c_ssize_t, CFUNCTYPE,
+                    PYFUNCTYPE, string_at, cast, byref, py_object, pythonapi,
+                    Structure)
+import sys
 
 from llvmlite.binding import ffi, targets, object_file
+from llvmlite.binding.dylib import _symbol_arrays
+from llvmlite.binding.common import _encode_string
 
 
 # Just check these weren't optimized out of the DLL.
 ffi.lib.LLVMPY_LinkInMCJIT
 
 
-def create_mcjit_compiler(module, target_machine):
+def create_mcjit_compiler(module, target_machine, memory_pool=None):
     """
     Create a MCJIT ExecutionEngine from the given *module* and
-    *target_machine*.
+    *target_machine*.  If *memory_pool* is given, a :class:`MemoryPool`,
+    the engine's code and data are allocated from it.
     """
+    module.materialize_all()
+    # The engine owns its target machine, so can't use a shared one
+    target_machine = target_machine._unshared()
     with ffi.OutputString() as outerr:
         engine = ffi.lib.LLVMPY_CreateMCJITCompiler(
-            module, target_machine, outerr)
+            module, target_machine, memory_pool, outerr)
         if not engine:
             raise RuntimeError(str(outerr))
 
@@ -24,6 +32,14 @@ def create_mcjit_compiler(module, target_machine):
     return ExecutionEngine(engine, module=module)
 
 
+def create_memory_pool(slab_size=2 * 1024 * 1024, huge_pages=False):
+    """
+    Create a :class:`MemoryPool` of slabs of *slab_size* bytes, backed by
+    huge pages where supported if *huge_pages* is true.
+    """
+    return MemoryPool(ffi.lib.LLVMPY_CreateMemoryPool(slab_size, huge_pages))
+
+
 def check_jit_execution():
     """
     Check the system allows execution of in-memory JITted functions.
@@ -51,6 +67,7 @@ class ExecutionEngine(ffi.ObjectRef):
         """
         self._modules = set([module])
         self._td = None
+        self._perf_events = set()
         module._owned = True
         ffi.ObjectRef.__init__(self, ptr)
 
@@ -74,12 +91,22 @@ class ExecutionEngine(ffi.ObjectRef):
         # XXX unused?
         ffi.lib.LLVMPY_AddGlobalMapping(self, gv, addr)
 
+    def add_symbols(self, symbols):
+        """
+        Define symbols for the code of this engine only, resolved before
+        those of the process.  *symbols* is a mapping of names to addresses
+        or an iterable of (name, address) pairs.
+        """
+        names, addresses = _symbol_arrays(symbols)
+        ffi.lib.LLVMPY_AddGlobalMappings(self, names, addresses, len(names))
+
     def add_module(self, module):
         """
         Ownership of module is transferred to the execution engine
         """
         if module in self._modules:
             raise KeyError("module already added to this engine")
+        module.materialize_all()
         ffi.lib.LLVMPY_AddModule(self, module)
         module._owned = True
         self._modules.add(module)
@@ -135,6 +162,25 @@ class ExecutionEngine(ffi.ObjectRef):
         ret = ffi.lib.LLVMPY_EnableJITEvents(self)
         return ret
 
+    def enable_perf_events(self, perf_map=True, jitdump=False):
+        """
+        Report the code compiled from now on to ``perf``: if *perf_map* is
+        true, as entries of ``/tmp/perf-<pid>.map``, which is only supported
+        on Linux, and if *jitdump* is true, as jitdump records including the
+        code.  Return whether all the requested reports are enabled.
+        """
+        supported = not perf_map or sys.platform.startswith('linux')
+        perf_map = (perf_map and supported
+                    and 'perf_map' not in self._perf_events)
+        jitdump = jitdump and 'jitdump' not in self._perf_events
+        ret = ffi.lib.LLVMPY_EnablePerfEvents(self, perf_map, jitdump)
+        ret = ret and supported
+        if perf_map:
+            self._perf_events.add('perf_map')
+        if jitdump and ret:
+            self._perf_events.add('jitdump')
+        return ret
+
     def _find_module_ptr(self, module_ptr):
         """
         Find the ModuleRef corresponding to the given pointer.
@@ -155,11 +201,21 @@ class ExecutionEngine(ffi.ObjectRef):
 
         ffi.lib.LLVMPY_MCJITAddObjectFile(self, obj_file)
 
-    def set_object_cache(self, notify_func=None, getbuffer_func=None):
+    def set_object_cache(self, notify_func=None, getbuffer_func=None,
+                         copy_notify=True):
         """
         Set the object cache "notifyObjectCompiled" and "getBuffer"
         callbacks to the given Python functions.
+
+        If *copy_notify* is false, *notify_func* is passed a read-only
+        memoryview of the engine's own buffer instead of a bytes copy; it is
+        only valid during the call.
+
+        A buffer returned by *getbuffer_func* (e.g. bytes, a bytearray or an
+        mmap, read-only or not) is used in place without copying, and stays
+        exported until the engine is closed.
         """
+        self._object_cache_copy_notify = copy_notify
         self._object_cache_notify = notify_func
         self._object_cache_getbuffer = getbuffer_func
         # Lifetime of the object cache is managed by us.
@@ -168,6 +224,28 @@ class ExecutionEngine(ffi.ObjectRef):
         # cycles.
         ffi.lib.LLVMPY_SetObjectCache(self, self._object_cache)
 
+    def set_disk_object_cache(self, path, max_size=0):
+        """
+        Cache compiled objects in the directory *path*, which may be shared
+        by several processes.  If *max_size* is non-zero, the least recently
+        used objects are removed to keep the directory under *max_size*
+        bytes, when the cache is set and at most once a minute after
+        writes.  This replaces any object cache set previously.
+
+        Objects are keyed on the module's bitcode and the settings of the
+        engine's target machine.  Note the bitcode includes the names of
+        struct types, which LLVM renames on a clash within a context.
+
+        Return a :class:`DiskObjectCache`, which is owned by the engine.
+        """
+        with ffi.OutputString() as outerr:
+            ptr = ffi.lib.LLVMPY_CreateDiskObjectCache(
+                self, _encode_string(path), max_size, outerr)
+            if not ptr:
+                raise RuntimeError(str(outerr))
+        self._object_cache = DiskObjectCache(ptr, path)
+        return self._object_cache
+
     def _raw_object_cache_notify(self, data):
         """
         Low-level notify hook.
@@ -177,7 +255,11 @@ class ExecutionEngine(ffi.ObjectRef):
         module_ptr = data.contents.module_ptr
         buf_ptr = data.contents.buf_ptr
         buf_len = data.contents.buf_len
-        buf = string_at(buf_ptr, buf_len)
+        if self._object_cache_copy_notify:
+            buf = string_at(buf_ptr, buf_len)
+        else:
+            buf = memoryview((c_char * buf_len).from_address(buf_ptr))
+            buf = buf.toreadonly()
         module = self._find_module_ptr(module_ptr)
         if module is None:
             # The LLVM EE should only give notifications for modules
@@ -201,10 +283,17 @@ class ExecutionEngine(ffi.ObjectRef):
                                "for unknown module %s" % (module_ptr,))
 
         buf = self._object_cache_getbuffer(module)
-        if buf is not None:
-            # Create a copy, which will be freed by the caller
-            data[0].buf_ptr = ffi.lib.LLVMPY_CreateByteString(buf, len(buf))
-            data[0].buf_len = len(buf)
+        if buf is None:
+            return
+        # Borrow the memory through the buffer protocol, which read-only
+        # exporters such as ACCESS_READ mmaps support too
+        try:
+            view = _PyBuffer.get(buf)
+        except BufferError:
+            # Non-contiguous buffers are copied
+            view = _PyBuffer.get(bytes(memoryview(buf)))
+        # The engine calls the release hook once it is done with the buffer
+        _ObjectCacheData.pin(data[0], view)
 
     def _dispose(self):
         # The modules will be cleaned up by the EE
@@ -232,6 +321,78 @@ class _ObjectCacheRef(ffi.ObjectRef):
         self._capi.LLVMPY_DisposeObjectCache(self)
 
 
+class DiskObjectCache(ffi.ObjectRef):
+    """
+    An on-disk object cache created by
+    :meth:`ExecutionEngine.set_disk_object_cache`.
+    """
+
+    def __init__(self, ptr, path):
+        self.path = path
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def _stats(self):
+        hits = c_uint64()
+        misses = c_uint64()
+        ffi.lib.LLVMPY_GetDiskObjectCacheStats(self, byref(hits),
+                                               byref(misses))
+        return hits.value, misses.value
+
+    @property
+    def hits(self):
+        """
+        The number of modules loaded from the cache.
+        """
+        return self._stats()[0]
+
+    @property
+    def misses(self):
+        """
+        The number of modules that had to be compiled.
+        """
+        return self._stats()[1]
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeDiskObjectCache(self)
+
+
+class MemoryPool(ffi.ObjectRef):
+    """
+    A pool of memory slabs shared by the execution engines created with it,
+    which return their slabs to the pool when disposed.
+    """
+
+    def _stats(self):
+        reserved = c_uint64()
+        in_use = c_uint64()
+        ffi.lib.LLVMPY_GetMemoryPoolStats(self, byref(reserved),
+                                          byref(in_use))
+        return reserved.value, in_use.value
+
+    @property
+    def reserved(self):
+        """
+        The size of the slabs mapped by the pool, in bytes.
+        """
+        return self._stats()[0]
+
+    @property
+    def in_use(self):
+        """
+        The size of the slabs used by execution engines, in bytes.
+        """
+        return self._stats()[1]
+
+    def trim(self):
+        """
+        Unmap the slabs not used by any execution engine.
+        """
+        ffi.lib.LLVMPY_TrimMemoryPool(self)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeMemoryPool(self)
+
+
 # ============================================================================
 # FFI
 
@@ -239,6 +400,7 @@ class _ObjectCacheRef(ffi.ObjectRef):
 ffi.lib.LLVMPY_CreateMCJITCompiler.argtypes = [
     ffi.LLVMModuleRef,
     ffi.LLVMTargetMachineRef,
+    ffi.LLVMMemoryPoolRef,
     POINTER(c_char_p),
 ]
 ffi.lib.LLVMPY_CreateMCJITCompiler.restype = ffi.LLVMExecutionEngineRef
@@ -259,6 +421,11 @@ ffi.lib.LLVMPY_AddGlobalMapping.argtypes = [ffi.LLVMExecutionEngineRef,
                                             ffi.LLVMValueRef,
                                             c_void_p]
 
+ffi.lib.LLVMPY_AddGlobalMappings.argtypes = [ffi.LLVMExecutionEngineRef,
+                                             POINTER(c_char_p),
+                                             POINTER(c_void_p),
+                                             c_size_t]
+
 ffi.lib.LLVMPY_FinalizeObject.argtypes = [ffi.LLVMExecutionEngineRef]
 
 ffi.lib.LLVMPY_GetExecutionEngineTargetData.argtypes = [
@@ -281,19 +448,83 @@ ffi.lib.LLVMPY_GetGlobalValueAddress.argtypes = [
 ]
 ffi.lib.LLVMPY_GetGlobalValueAddress.restype = c_uint64
 
+ffi.lib.LLVMPY_EnablePerfEvents.argtypes = [ffi.LLVMExecutionEngineRef,
+                                            c_bool, c_bool]
+ffi.lib.LLVMPY_EnablePerfEvents.restype = c_bool
+
 ffi.lib.LLVMPY_MCJITAddObjectFile.argtypes = [
     ffi.LLVMExecutionEngineRef,
     ffi.LLVMObjectFileRef
 ]
 
 
+class _PyBuffer(Structure):
+    """
+    A Py_buffer, holding an export of an object's memory until released.
+    """
+    _fields_ = [
+        ('buf', c_void_p),
+        ('obj', c_void_p),
+        ('len', c_ssize_t),
+        ('itemsize', c_ssize_t),
+        ('readonly', c_int),
+        ('ndim', c_int),
+        ('format', c_char_p),
+        ('shape', POINTER(c_ssize_t)),
+        ('strides', POINTER(c_ssize_t)),
+        ('suboffsets', POINTER(c_ssize_t)),
+        ('internal', c_void_p),
+    ]
+
+    @classmethod
+    def get(cls, obj):
+        view = cls()
+        _PyObject_GetBuffer(obj, byref(view), _PyBUF_SIMPLE)
+        return view
+
+    def release(self):
+        _PyBuffer_Release(byref(self))
+
+
+_PyBUF_SIMPLE = 0
+_PyObject_GetBuffer = PYFUNCTYPE(c_int, py_object, POINTER(_PyBuffer), c_int)(
+    ('PyObject_GetBuffer', pythonapi))
+_PyBuffer_Release = PYFUNCTYPE(None, POINTER(_PyBuffer))(
+    ('PyBuffer_Release', pythonapi))
+
+
+_ObjectCacheReleaseFunc = CFUNCTYPE(None, c_void_p)
+
+
 class _ObjectCacheData(Structure):
     _fields_ = [
         ('module_ptr', ffi.LLVMModuleRef),
         ('buf_ptr', c_void_p),
         ('buf_len', c_size_t),
+        ('buf_release', _ObjectCacheReleaseFunc),
+        ('buf_owner', c_void_p),
     ]
 
+    # Views of the buffers lent to MCJIT, keyed by their address
+    _pinned = {}
+
+    @classmethod
+    def pin(cls, data, view):
+        # The same buffer may be returned by several getbuffer calls.
+        views = cls._pinned.setdefault(view.buf, [])
+        views.append(view)
+        data.buf_ptr = view.buf
+        data.buf_len = view.len
+        data.buf_release = _release_c_hook
+        data.buf_owner = view.buf
+
+    @classmethod
+    def _release(cls, ptr):
+        views = cls._pinned[ptr]
+        views.pop().release()
+        if not views:
+            del cls._pinned[ptr]
+
 
 _ObjectCacheNotifyFunc = CFUNCTYPE(None, py_object,
                                    POINTER(_ObjectCacheData))
@@ -303,6 +534,7 @@ _ObjectCacheGetBufferFunc = CFUNCTYPE(None, py_object,
 # XXX The ctypes function wrappers are created at the top-level, otherwise
 # there are issues when creating CFUNCTYPEs in child processes on CentOS 5
 # 32 bits.
+_release_c_hook = _ObjectCacheReleaseFunc(_ObjectCacheData._release)
 _notify_c_hook = _ObjectCacheNotifyFunc(
     ExecutionEngine._raw_object_cache_notify)
 _getbuffer_c_hook = _ObjectCacheGetBufferFunc(
@@ -320,3 +552,30 @@ ffi.lib.LLVMPY_SetObjectCache.argtypes = [ffi.LLVMExecutionEngineRef,
 
 ffi.lib.LLVMPY_CreateByteString.restype = c_void_p
 ffi.lib.LLVMPY_CreateByteString.argtypes = [c_void_p, c_size_t]
+
+ffi.lib.LLVMPY_CreateDiskObjectCache.argtypes = [ffi.LLVMExecutionEngineRef,
+                                                 c_char_p,
+                                                 c_uint64,
+                                                 POINTER(c_char_p)]
+ffi.lib.LLVMPY_CreateDiskObjectCache.restype = ffi.LLVMDiskObjectCacheRef
+
+ffi.lib.LLVMPY_DisposeDiskObjectCache.argtypes = [ffi.LLVMDiskObjectCacheRef]
+
+ffi.lib.LLVMPY_GetDiskObjectCacheStats.argtypes = [
+    ffi.LLVMDiskObjectCacheRef,
+    POINTER(c_uint64),
+    POINTER(c_uint64),
+]
+
+ffi.lib.LLVMPY_CreateMemoryPool.argtypes = [c_size_t, c_bool]
+ffi.lib.LLVMPY_CreateMemoryPool.restype = ffi.LLVMMemoryPoolRef
+
+ffi.lib.LLVMPY_DisposeMemoryPool.argtypes = [ffi.LLVMMemoryPoolRef]
+
+ffi.lib.LLVMPY_TrimMemoryPool.argtypes = [ffi.LLVMMemoryPoolRef]
+
+ffi.lib.LLVMPY_GetMemoryPoolStats.argtypes = [
+    ffi.LLVMMemoryPoolRef,
+    POINTER(c_uint64),
+    POINTER(c_uint64),
+]
@@ -19,6 +19,10 @@ LLVMTypeRef = _make_opaque_ref("LLVMType")
 LLVMExecutionEngineRef = _make_opaque_ref("LLVMExecutionEngine")
 LLVMPassManagerBuilderRef = _make_opaque_ref("LLVMPassManagerBuilder")
 LLVMPassManagerRef = _make_opaque_ref("LLVMPassManager")
+LLVMRemarkCollectorRef = _make_opaque_ref("LLVMRemarkCollector")
+LLVMNewPassManagerRef = _make_opaque_ref("LLVMNewPassManager")
+LLVMPassTimingsRef = _make_opaque_ref("LLVMPassTimings")
+LLVMRefPruneStatsRef = _make_opaque_ref("LLVMRefPruneStats")
 LLVMTargetDataRef = _make_opaque_ref("LLVMTargetData")
 LLVMTargetLibraryInfoRef = _make_opaque_ref("LLVMTargetLibraryInfo")
 LLVMTargetRef = _make_opaque_ref("LLVMTarget")
@@ -34,8 +38,15 @@ LLVMInstructionsIterator = _make_opaque_ref("LLVMInstructionsIterator")
 LLVMOperandsIterator = _make_opaque_ref("LLVMOperandsIterator")
 LLVMTypesIterator = _make_opaque_ref("LLVMTypesIterator")
 LLVMObjectCacheRef = _make_opaque_ref("LLVMObjectCache")
+LLVMDiskObjectCacheRef = _make_opaque_ref("LLVMDiskObjectCache")
+LLVMMemoryPoolRef = _make_opaque_ref("LLVMMemoryPool")
+LLVMProfileInstrumentationRef = _make_opaque_ref("LLVMProfileInstrumentation")
+LLVMProfileDataRef = _make_opaque_ref("LLVMProfileData")
 LLVMObjectFileRef = _make_opaque_ref("LLVMObjectFile")
 LLVMSectionIteratorRef = _make_opaque_ref("LLVMSectionIterator")
+LLVMOrcJITRef = _make_opaque_ref("LLVMOrcJIT")
+LLVMResourceTrackerRef = _make_opaque_ref("LLVMResourceTracker")
+LLVMCompileFutureRef = _make_opaque_ref("LLVMCompileFuture")
 
 
 class _LLVMLock:
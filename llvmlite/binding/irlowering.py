@@ -0,0 +1,849 @@
+"""
+Lowering of llvmlite.ir modules to LLVM modules without going through
+their textual representation.
+"""
+
+import struct
+from array import array
+from ctypes import POINTER, c_char_p, c_int64, c_size_t
+from itertools import accumulate
+
+from llvmlite import ir
+from llvmlite.ir import instructions as _instr
+from llvmlite.binding import ffi
+from llvmlite.binding.context import get_global_context
+from llvmlite.binding.module import ModuleRef, parse_assembly
+
+
+def lower_module(module, context=None):
+    """
+    Create a :class:`ModuleRef` from the :class:`llvmlite.ir.Module`
+    *module*, as ``parse_assembly(str(module), context)`` would, but
+    without formatting and parsing its textual IR.  Constructs that can't
+    be lowered directly, such as debug information, fall back to the
+    textual IR.
+    """
+    if context is None:
+        context = get_global_context()
+    try:
+        return _lower_module(module, context)
+    except (_Unsupported, RuntimeError):
+        # Let the assembly parser handle it, or report the error
+        return parse_assembly(str(module), context)
+
+
+class _Unsupported(Exception):
+    """
+    Raised when the module uses a construct that is only handled by the
+    textual IR.
+    """
+
+
+def _lower_module(module, context):
+    """
+    Lower *module* to a new :class:`ModuleRef`.  _Unsupported is raised if it
+    can't be encoded, and RuntimeError if LLVM rejects it.
+    """
+    enc = _Encoder()
+    enc.encode_module(module)
+    ops = array('q', enc.ops)
+    offsets = array('q', accumulate(map(len, enc.string_data), initial=0))
+    data = b''.join(enc.string_data)
+    with ffi.OutputString() as outerr:
+        ptr = ffi.lib.LLVMPY_LowerModule(
+            context, _array_pointer(ops), len(ops), data,
+            _array_pointer(offsets), len(enc.string_data), b'<string>',
+            outerr)
+        if not ptr:
+            raise RuntimeError(str(outerr))
+    return ModuleRef(ptr, context)
+
+
+def _array_pointer(arr):
+    return (c_int64 * len(arr)).from_buffer(arr)
+
+
+# Commands of the op stream, as defined in ffi/irlowering.cpp
+
+_CMD_TYPE_VOID = 1
+_CMD_TYPE_LABEL = 2
+_CMD_TYPE_METADATA = 3
+_CMD_TYPE_INT = 4
+_CMD_TYPE_HALF = 5
+_CMD_TYPE_FLOAT = 6
+_CMD_TYPE_DOUBLE = 7
+_CMD_TYPE_POINTER = 8
+_CMD_TYPE_FUNCTION = 9
+_CMD_TYPE_VECTOR = 10
+_CMD_TYPE_ARRAY = 11
+_CMD_TYPE_STRUCT = 12
+_CMD_TYPE_NAMED_STRUCT = 13
+_CMD_STRUCT_BODY = 14
+
+_CMD_CONST_INT = 20
+_CMD_CONST_FP = 21
+_CMD_CONST_NULL = 22
+_CMD_CONST_UNDEF = 23
+_CMD_CONST_STRING = 24
+_CMD_CONST_AGGREGATE = 25
+_CMD_CONST_TEXT = 26
+_CMD_CONST_METADATA = 27
+_CMD_CONST_INLINE_ASM = 28
+
+_CMD_MD_NODE = 40
+_CMD_NAMED_MD = 41
+
+_CMD_MODULE = 50
+_CMD_GLOBAL_VAR = 51
+_CMD_FUNCTION = 52
+_CMD_GLOBAL_INIT = 53
+_CMD_GLOBAL_MD = 54
+_CMD_FUNCTION_ATTRS = 55
+_CMD_FUNCTION_BODY = 56
+_CMD_BLOCK = 57
+_CMD_FORWARD = 58
+_CMD_END_BODY = 59
+
+_CMD_INST_BINOP = 70
+_CMD_INST_FNEG = 71
+_CMD_INST_CAST = 72
+_CMD_INST_ICMP = 73
+_CMD_INST_FCMP = 74
+_CMD_INST_SELECT = 75
+_CMD_INST_LOAD = 76
+_CMD_INST_STORE = 77
+_CMD_INST_ALLOCA = 78
+_CMD_INST_GEP = 79
+_CMD_INST_PHI = 80
+_CMD_INST_CALL = 81
+_CMD_INST_INVOKE = 82
+_CMD_INST_RET = 83
+_CMD_INST_BR = 84
+_CMD_INST_CONDBR = 85
+_CMD_INST_SWITCH = 86
+_CMD_INST_INDIRECTBR = 87
+_CMD_INST_UNREACHABLE = 88
+_CMD_INST_RESUME = 89
+_CMD_INST_EXTRACTELEMENT = 90
+_CMD_INST_INSERTELEMENT = 91
+_CMD_INST_SHUFFLEVECTOR = 92
+_CMD_INST_EXTRACTVALUE = 93
+_CMD_INST_INSERTVALUE = 94
+_CMD_INST_ATOMICRMW = 95
+_CMD_INST_CMPXCHG = 96
+_CMD_INST_FENCE = 97
+_CMD_INST_LANDINGPAD = 98
+_CMD_INST_MD = 99
+
+# Kinds of value references
+_TAG_LOCAL = 0
+_TAG_GLOBAL = 1
+_TAG_CONST = 2
+
+# Metadata operand kinds
+_MD_NULL = 0
+_MD_NODE = 1
+_MD_STRING = 2
+_MD_VALUE = 3
+
+_FLAGS = {
+    'reassoc': 0x1,
+    'nnan': 0x2,
+    'ninf': 0x4,
+    'nsz': 0x8,
+    'arcp': 0x10,
+    'contract': 0x20,
+    'afn': 0x40,
+    'fast': 0x7f,
+    'nuw': 0x100,
+    'nsw': 0x200,
+    'exact': 0x400,
+}
+
+_BINOPS = frozenset(['add', 'fadd', 'sub', 'fsub', 'mul', 'fmul', 'udiv',
+                     'sdiv', 'fdiv', 'urem', 'srem', 'frem', 'shl', 'lshr',
+                     'ashr', 'and', 'or', 'xor'])
+
+_TAIL_KINDS = {'': 0, 'tail': 1, 'musttail': 2, 'notail': 3}
+
+# Linkages accepted by the assembly parser for function declarations and
+# definitions
+_DECLARATION_LINKAGES = frozenset(['', 'external', 'extern_weak'])
+_DEFINITION_LINKAGES = frozenset(['', 'external', 'private', 'internal',
+                                  'available_externally', 'linkonce',
+                                  'linkonce_odr', 'weak', 'weak_odr'])
+
+_FP_TYPES = {
+    ir.HalfType: (_CMD_TYPE_HALF, ir.types._as_half),
+    ir.FloatType: (_CMD_TYPE_FLOAT, ir.types._as_float),
+    ir.DoubleType: (_CMD_TYPE_DOUBLE, float),
+}
+
+_SIMPLE_TYPES = {
+    ir.VoidType: _CMD_TYPE_VOID,
+    ir.LabelType: _CMD_TYPE_LABEL,
+    ir.MetaDataType: _CMD_TYPE_METADATA,
+}
+
+_INT64_MIN = -2 ** 63
+_UINT64_LIMIT = 2 ** 64
+
+
+def _plain_string(text):
+    """
+    Check that *text*, which the textual IR quotes without escaping it, has
+    the same meaning in both representations.
+    """
+    if '"' in text or '\\' in text:
+        raise _Unsupported(text)
+    return text
+
+
+def _flags(flags):
+    bits = 0
+    for flag in flags:
+        try:
+            bits |= _FLAGS[flag]
+        except KeyError:
+            raise _Unsupported(flag)
+    return bits
+
+
+def _align(align):
+    # 0 stands for the default alignment of the type
+    if align is None:
+        return 0
+    if not isinstance(align, int) or align <= 0:
+        raise _Unsupported(align)
+    return align
+
+
+class _Encoder(object):
+    """
+    Encode an ir.Module to the op stream decoded by ffi/irlowering.cpp.
+
+    Types, constants and metadata are encoded when first used; operands are
+    therefore encoded before the command using them is appended.
+    """
+
+    def __init__(self):
+        self.ops = []
+        self.string_data = []
+        self._strings = {}
+        self._type_ids = {}
+        self._type_names = {}
+        # Value references by id() of the ir values
+        self._refs = {}
+        # Constant references by command, as LLVM uniques constants anyway
+        self._const_refs = {}
+        self._md_ids = {}
+        self._nconsts = 0
+        self._nglobals = 0
+        # The function being encoded
+        self._blocks = None
+        self._pending = None
+
+    def _string(self, text):
+        sid = self._strings.get(text)
+        if sid is None:
+            sid = self._strings[text] = len(self.string_data)
+            if isinstance(text, str):
+                self.string_data.append(text.encode('utf8'))
+            else:
+                self.string_data.append(bytes(text))
+        return sid
+
+    #
+    # Types
+    #
+
+    def _type(self, ty):
+        tid = self._type_ids.get(id(ty))
+        if tid is None:
+            # Equal types are distinct objects, identified by their IR
+            tid = self._type_names.get(str(ty))
+            if tid is None:
+                tid = self._new_type(ty)
+            self._type_ids[id(ty)] = tid
+        return tid
+
+    def _add_type(self, ty, cmd):
+        self.ops.extend(cmd)
+        tid = self._type_names[str(ty)] = len(self._type_names)
+        self._type_ids[id(ty)] = tid
+        return tid
+
+    def _new_type(self, ty):
+        cls = type(ty)
+        if cls is ir.IntType:
+            return self._add_type(ty, (_CMD_TYPE_INT, ty.width))
+        if cls in _FP_TYPES:
+            return self._add_type(ty, (_FP_TYPES[cls][0],))
+        if cls in _SIMPLE_TYPES:
+            return self._add_type(ty, (_SIMPLE_TYPES[cls],))
+        if cls is ir.PointerType:
+            pointee = self._type(ty.pointee)
+            return self._add_type(ty, (_CMD_TYPE_POINTER, pointee,
+                                       ty.addrspace))
+        if cls is ir.FunctionType:
+            ret = self._type(ty.return_type)
+            args = [self._type(arg) for arg in ty.args]
+            return self._add_type(ty, [_CMD_TYPE_FUNCTION, ret,
+                                       int(ty.var_arg), len(args)] + args)
+        if cls is ir.VectorType or cls is ir.ArrayType:
+            cmd = _CMD_TYPE_VECTOR if cls is ir.VectorType else _CMD_TYPE_ARRAY
+            elem = self._type(ty.element)
+            return self._add_type(ty, (cmd, elem, ty.count))
+        if cls is ir.LiteralStructType:
+            elems = [self._type(elem) for elem in ty.elements]
+            return self._add_type(ty, [_CMD_TYPE_STRUCT, int(ty.packed),
+                                       len(elems)] + elems)
+        if cls is ir.IdentifiedStructType:
+            # Declared first, so that its body can refer to it
+            tid = self._add_type(ty, (_CMD_TYPE_NAMED_STRUCT,
+                                      self._string(ty.name)))
+            if not ty.is_opaque:
+                elems = [self._type(elem) for elem in ty.elements]
+                self.ops.extend([_CMD_STRUCT_BODY, tid, int(ty.packed),
+                                 len(elems)] + elems)
+            return tid
+        raise _Unsupported(ty)
+
+    #
+    # Values
+    #
+
+    def _value(self, val):
+        ref = self._refs.get(id(val))
+        if ref is None:
+            return self._new_constant(val)
+        if not ref & 3 and id(val) in self._pending:
+            # A local used before being defined
+            self.ops.extend((_CMD_FORWARD, ref >> 2, self._type(val.type)))
+            self._pending.discard(id(val))
+        return ref
+
+    def _add_constant(self, val, cmd):
+        cmd = tuple(cmd)
+        ref = self._const_refs.get(cmd)
+        if ref is None:
+            self.ops.extend(cmd)
+            ref = self._const_refs[cmd] = (self._nconsts << 2) | _TAG_CONST
+            self._nconsts += 1
+        if val is not None:
+            self._refs[id(val)] = ref
+        return ref
+
+    def _new_constant(self, val):
+        cls = type(val)
+        if cls is ir.Constant:
+            return self._add_constant(val, self._constant(val))
+        if cls is ir.FormattedConstant:
+            return self._text_constant(val)
+        if cls is ir.MetaDataArgument:
+            wrapped = self._value(val.wrapped_value)
+            return self._add_constant(val, (_CMD_CONST_METADATA, _MD_VALUE,
+                                            wrapped))
+        if cls is ir.MDValue or cls is ir.MetaDataString:
+            return self._add_constant(val, (_CMD_CONST_METADATA,)
+                                      + self._md_operand(val))
+        if cls is _instr.InlineAsm:
+            return self._add_constant(val, (
+                _CMD_CONST_INLINE_ASM, self._type(val.function_type),
+                self._string(_plain_string(val.asm)),
+                self._string(_plain_string(val.constraint)),
+                int(bool(val.side_effect))))
+        # Globals of other modules, blocks used as values, debug info...
+        raise _Unsupported(val)
+
+    def _text_constant(self, val):
+        # Parsed from its textual IR, which refers to other values by name
+        return self._add_constant(val, self._constant_text(val))
+
+    def _constant(self, val):
+        ty = val.type
+        cls = type(ty)
+        tid = self._type(ty)
+        const = val.constant
+        if const is None:
+            if cls is ir.MetaDataType:
+                raise _Unsupported(val)
+            return (_CMD_CONST_NULL, tid)
+        if const is ir.Undefined:
+            return (_CMD_CONST_UNDEF, tid)
+        if cls is ir.IntType:
+            if type(const) in (int, bool):
+                return self._int_constant(tid, int(const))
+        elif cls in _FP_TYPES:
+            if type(const) in (int, float):
+                value = _FP_TYPES[cls][1](const)
+                bits, = struct.unpack('q', struct.pack('d', value))
+                return (_CMD_CONST_FP, tid, bits)
+        elif isinstance(const, bytearray):
+            if (cls is ir.ArrayType and ty.element == ir.IntType(8) and
+                    ty.count == len(const)):
+                return (_CMD_CONST_STRING, tid, self._string(bytes(const)))
+        elif (isinstance(const, (list, tuple)) and
+              cls in (ir.ArrayType, ir.VectorType, ir.LiteralStructType,
+                      ir.IdentifiedStructType)):
+            elems = [self._value(elem) for elem in const]
+            return [_CMD_CONST_AGGREGATE, tid, len(elems)] + elems
+        return self._constant_text(val)
+
+    def _constant_text(self, val):
+        text = '{0} {1}'.format(val.type, val.get_reference())
+        return (_CMD_CONST_TEXT, self._type(val.type), self._string(text))
+
+    def _int_constant(self, tid, value):
+        if _INT64_MIN <= value < 0:
+            return (_CMD_CONST_INT, tid, value, 1)
+        if 0 <= value < _UINT64_LIMIT:
+            if value >= 2 ** 63:
+                value -= _UINT64_LIMIT
+            return (_CMD_CONST_INT, tid, value, 0)
+        raise _Unsupported(value)
+
+    def _block(self, block):
+        try:
+            return self._blocks[id(block)]
+        except KeyError:
+            raise _Unsupported(block)
+
+    #
+    # Metadata
+    #
+
+    def _md_operand(self, op):
+        cls = type(op)
+        if cls is ir.MDValue:
+            try:
+                return (_MD_NODE, self._md_ids[id(op)])
+            except KeyError:
+                raise _Unsupported(op)
+        if cls is ir.MetaDataString:
+            return (_MD_STRING, self._string(op.string))
+        if isinstance(op.type, ir.MetaDataType):
+            if cls is ir.Constant and op.constant is None:
+                return (_MD_NULL,)
+            raise _Unsupported(op)
+        return (_MD_VALUE, self._value(op))
+
+    def _node(self, md):
+        try:
+            return self._md_ids[id(md)]
+        except KeyError:
+            raise _Unsupported(md)
+
+    def _encode_metadata(self, module):
+        for md in module.metadata:
+            if type(md) is not ir.MDValue:
+                # Debug information
+                raise _Unsupported(md)
+            operands = []
+            for op in md.operands:
+                operands.extend(self._md_operand(op))
+            self.ops.extend([_CMD_MD_NODE, len(md.operands)] + operands)
+            self._md_ids[id(md)] = len(self._md_ids)
+
+    def _attach_metadata(self, cmd, metadata):
+        for kind, md in metadata.items():
+            self.ops.extend(cmd + (self._string(kind), self._node(md)))
+
+    #
+    # Module structure
+    #
+
+    def encode_module(self, module):
+        self.ops.extend((_CMD_MODULE,
+                         self._string(_plain_string(module.triple)),
+                         self._string(_plain_string(module.data_layout))))
+        globals_ = list(module.globals.values())
+        for gv in globals_:
+            self._declare(gv)
+        self._encode_metadata(module)
+        for gv in globals_:
+            gid = self._refs[id(gv)] >> 2
+            if type(gv) is ir.GlobalVariable:
+                init = self._initializer(gv)
+                if init is not None:
+                    self.ops.extend((_CMD_GLOBAL_INIT, gid, init))
+            else:
+                if gv.metadata and not gv.blocks:
+                    # Rejected by the assembly parser
+                    raise _Unsupported(gv)
+                self._function_attributes(gid, gv)
+            self._attach_metadata((_CMD_GLOBAL_MD, gid), gv.metadata)
+        for gv in globals_:
+            if type(gv) is ir.Function and gv.blocks:
+                self._function_body(gv)
+        for name, nmd in module.namedmetadata.items():
+            nodes = [self._node(md) for md in nmd.operands]
+            self.ops.extend([_CMD_NAMED_MD, self._string(name), len(nodes)]
+                            + nodes)
+
+    def _declare(self, gv):
+        cls = type(gv)
+        name = self._string(gv.name)
+        section = self._string(_plain_string(gv.section))
+        if cls is ir.GlobalVariable:
+            linkage = self._global_linkage(gv)
+            cmd = (_CMD_GLOBAL_VAR, name, self._type(gv.value_type),
+                   gv.addrspace, int(bool(gv.global_constant)),
+                   self._string(linkage), self._string(gv.storage_class),
+                   int(bool(gv.unnamed_addr)), _align(gv.align), section)
+        elif cls is ir.Function:
+            linkages = (_DEFINITION_LINKAGES if gv.blocks
+                        else _DECLARATION_LINKAGES)
+            if gv.linkage not in linkages:
+                raise _Unsupported(gv.linkage)
+            cmd = (_CMD_FUNCTION, name, self._type(gv.ftype),
+                   self._string(gv.linkage),
+                   self._string(gv.calling_convention), section)
+        else:
+            raise _Unsupported(gv)
+        self.ops.extend(cmd)
+        self._refs[id(gv)] = (self._nglobals << 2) | _TAG_GLOBAL
+        self._nglobals += 1
+
+    def _global_linkage(self, gv):
+        # Mirror GlobalVariable.descr(): the text omits the linkage of
+        # definitions by default
+        linkage = gv.linkage
+        if not linkage and gv.initializer is None:
+            linkage = 'external'
+        if gv.storage_class and linkage in ('private', 'internal'):
+            raise _Unsupported(gv.storage_class)
+        return linkage
+
+    def _initializer(self, gv):
+        if gv.linkage in ('external', 'extern_weak') or (
+                not gv.linkage and gv.initializer is None):
+            if gv.initializer is not None:
+                raise _Unsupported(gv)
+            return None
+        init = gv.initializer
+        if init is None:
+            return self._add_constant(None, (_CMD_CONST_UNDEF,
+                                             self._type(gv.value_type)))
+        if init.type != gv.value_type:
+            raise _Unsupported(init)
+        return self._value(init)
+
+    def _attributes(self, attrs):
+        names = [self._string(attr) for attr in attrs]
+        if isinstance(attrs, ir.values.ArgumentAttributes):
+            extra = (_align(attrs.align or None), attrs.dereferenceable,
+                     attrs.dereferenceable_or_null)
+        else:
+            extra = (0, 0, 0)
+        return [len(names)] + names + list(extra)
+
+    def _function_attributes(self, gid, fn):
+        attrs = fn.attributes
+        rattrs = fn.return_value.attributes
+        args = [(i, arg.attributes) for i, arg in enumerate(fn.args)
+                if arg.attributes._to_list()]
+        if not (attrs or rattrs._to_list() or args):
+            return
+        # As in Function.descr_prototype(), alignstack and the personality
+        # are only given with other function attributes
+        alignstack = attrs.alignstack if attrs else 0
+        personality = attrs.personality if attrs else None
+        cmd = [_CMD_FUNCTION_ATTRS, gid] + self._attributes(attrs)
+        cmd.append(alignstack)
+        if personality:
+            cmd.extend((1, self._value(personality)))
+        else:
+            cmd.append(0)
+        cmd.extend(self._attributes(rattrs))
+        cmd.append(len(args))
+        for i, arg_attrs in args:
+            cmd.append(i)
+            cmd.extend(self._attributes(arg_attrs))
+        self.ops.extend(cmd)
+
+    def _function_body(self, fn):
+        gid = self._refs[id(fn)] >> 2
+        refs = self._refs
+        string = self._string
+        ops = self.ops
+        locals_ = [id(arg) for arg in fn.args]
+        for block in fn.blocks:
+            locals_.extend(map(id, block.instructions))
+        for index, key in enumerate(locals_):
+            refs[key] = index << 2
+        pending = set(locals_[len(fn.args):])
+        self._blocks = {id(block): i for i, block in enumerate(fn.blocks)}
+        self._pending = pending
+
+        cmd = [_CMD_FUNCTION_BODY, gid, len(fn.args)]
+        cmd.extend(string(arg.name) for arg in fn.args)
+        cmd.append(len(fn.blocks))
+        cmd.extend(string(block.name) for block in fn.blocks)
+        ops.extend(cmd)
+
+        for i, block in enumerate(fn.blocks):
+            ops.extend((_CMD_BLOCK, i))
+            for instr in block.instructions:
+                encode = _ENCODERS.get(type(instr))
+                if encode is None:
+                    raise _Unsupported(instr)
+                if type(instr.type) is ir.VoidType:
+                    name = -1
+                else:
+                    name = string(instr.name)
+                cmd = encode(self, instr, name)
+                # From now on, the instruction can be referred to directly
+                pending.discard(id(instr))
+                ops.extend(cmd)
+                if instr.metadata:
+                    self._attach_metadata((_CMD_INST_MD,), instr.metadata)
+        ops.append(_CMD_END_BODY)
+        # Locals can't be referred to from other functions
+        for key in locals_:
+            del refs[key]
+        self._blocks = None
+        self._pending = None
+
+    #
+    # Instructions
+    #
+
+    def _generic(self, instr, name):
+        ops = [self._value(op) for op in instr.operands]
+        flags = _flags(instr.flags)
+        if instr.opname in _BINOPS and len(ops) == 2:
+            return (_CMD_INST_BINOP, name, self._string(instr.opname), flags,
+                    ops[0], ops[1])
+        if instr.opname == 'fneg' and len(ops) == 1:
+            return (_CMD_INST_FNEG, name, flags, ops[0])
+        raise _Unsupported(instr)
+
+    def _cast(self, instr, name):
+        val, = instr.operands
+        return (_CMD_INST_CAST, name, self._string(instr.opname),
+                self._value(val), self._type(instr.type))
+
+    def _icmp(self, instr, name):
+        lhs, rhs = instr.operands
+        return (_CMD_INST_ICMP, name, self._string(instr.op),
+                self._value(lhs), self._value(rhs))
+
+    def _fcmp(self, instr, name):
+        lhs, rhs = instr.operands
+        return (_CMD_INST_FCMP, name, self._string(instr.op),
+                _flags(instr.flags), self._value(lhs), self._value(rhs))
+
+    def _select(self, instr, name):
+        cond, lhs, rhs = instr.operands
+        return (_CMD_INST_SELECT, name, _flags(instr.flags),
+                self._value(cond), self._value(lhs), self._value(rhs))
+
+    def _load(self, instr, name):
+        ptr, = instr.operands
+        return (_CMD_INST_LOAD, name, self._type(instr.type), self._value(ptr),
+                _align(instr.align), -1)
+
+    def _store(self, instr, name):
+        val, ptr = instr.operands
+        return (_CMD_INST_STORE, name, self._value(val), self._value(ptr),
+                _align(instr.align), -1)
+
+    def _load_atomic(self, instr, name):
+        if instr.align is None:
+            raise _Unsupported(instr)
+        ptr, = instr.operands
+        return (_CMD_INST_LOAD, name, self._type(instr.type), self._value(ptr),
+                _align(instr.align), self._string(instr.ordering))
+
+    def _store_atomic(self, instr, name):
+        if instr.align is None:
+            raise _Unsupported(instr)
+        val, ptr = instr.operands
+        return (_CMD_INST_STORE, name, self._value(val), self._value(ptr),
+                _align(instr.align), self._string(instr.ordering))
+
+    def _alloca(self, instr, name):
+        count = self._value(instr.operands[0]) if instr.operands else -1
+        return (_CMD_INST_ALLOCA, name, self._type(instr.type.pointee), count,
+                _align(instr.align))
+
+    def _gep(self, instr, name):
+        ptr = instr.pointer
+        indices = [self._value(idx) for idx in instr.indices]
+        return [_CMD_INST_GEP, name, int(bool(instr.inbounds)),
+                self._type(ptr.type.pointee), self._value(ptr),
+                len(indices)] + indices
+
+    def _phi(self, instr, name):
+        cmd = [_CMD_INST_PHI, name, self._type(instr.type),
+               _flags(instr.flags), len(instr.incomings)]
+        for val, block in instr.incomings:
+            cmd.extend((self._value(val), self._block(block)))
+        return cmd
+
+    def _call_operands(self, instr):
+        callee = instr.callee
+        args = [self._value(arg) for arg in instr.args]
+        cmd = [self._type(callee.function_type), self._value(callee),
+               len(args)]
+        cmd.extend(args)
+        cmd.append(self._string(instr.cconv or ''))
+        cmd.append(_flags(instr.fastmath))
+        cmd.extend(self._attributes(instr.attributes))
+        cmd.append(len(instr.arg_attributes))
+        for i, attrs in instr.arg_attributes.items():
+            cmd.append(i)
+            cmd.extend(self._attributes(attrs))
+        return cmd
+
+    def _call(self, instr, name):
+        try:
+            tail = _TAIL_KINDS[instr.tail]
+        except KeyError:
+            raise _Unsupported(instr.tail)
+        return ([_CMD_INST_CALL, name] + self._call_operands(instr)
+                + [tail])
+
+    def _invoke(self, instr, name):
+        return ([_CMD_INST_INVOKE, name] + self._call_operands(instr)
+                + [self._block(instr.normal_to), self._block(instr.unwind_to)])
+
+    def _ret(self, instr, name):
+        if instr.operands:
+            return (_CMD_INST_RET, name, 1, self._value(instr.operands[0]))
+        return (_CMD_INST_RET, name, 0)
+
+    def _branch(self, instr, name):
+        target, = instr.operands
+        if instr.opname == 'br':
+            return (_CMD_INST_BR, name, self._block(target))
+        if instr.opname == 'resume':
+            return (_CMD_INST_RESUME, name, self._value(target))
+        raise _Unsupported(instr)
+
+    def _cbranch(self, instr, name):
+        cond, iftrue, iffalse = instr.operands
+        return (_CMD_INST_CONDBR, name, self._value(cond),
+                self._block(iftrue), self._block(iffalse))
+
+    def _switch(self, instr, name):
+        cmd = [_CMD_INST_SWITCH, name, self._value(instr.value),
+               self._block(instr.default), len(instr.cases)]
+        for val, block in instr.cases:
+            cmd.extend((self._value(val), self._block(block)))
+        return cmd
+
+    def _indirectbr(self, instr, name):
+        dests = [self._block(block) for block in instr.destinations]
+        return [_CMD_INST_INDIRECTBR, name, self._value(instr.address),
+                len(dests)] + dests
+
+    def _unreachable(self, instr, name):
+        return (_CMD_INST_UNREACHABLE, name)
+
+    def _resume(self, instr, name):
+        val, = instr.operands
+        return (_CMD_INST_RESUME, name, self._value(val))
+
+    def _extract_element(self, instr, name):
+        vector, index = instr.operands
+        return (_CMD_INST_EXTRACTELEMENT, name, self._value(vector),
+                self._value(index))
+
+    def _insert_element(self, instr, name):
+        vector, value, index = instr.operands
+        return (_CMD_INST_INSERTELEMENT, name, self._value(vector),
+                self._value(value), self._value(index))
+
+    def _shuffle_vector(self, instr, name):
+        ops = [self._value(op) for op in instr.operands]
+        return [_CMD_INST_SHUFFLEVECTOR, name] + ops
+
+    def _extract_value(self, instr, name):
+        indices = list(instr.indices)
+        return [_CMD_INST_EXTRACTVALUE, name, self._value(instr.aggregate),
+                len(indices)] + indices
+
+    def _insert_value(self, instr, name):
+        indices = list(instr.indices)
+        return [_CMD_INST_INSERTVALUE, name, self._value(instr.aggregate),
+                self._value(instr.value), len(indices)] + indices
+
+    def _atomic_rmw(self, instr, name):
+        ptr, val = instr.operands
+        return (_CMD_INST_ATOMICRMW, name, self._string(instr.operation),
+                self._value(ptr), self._value(val),
+                self._string(instr.ordering))
+
+    def _cmpxchg(self, instr, name):
+        ptr, cmp, val = instr.operands
+        return (_CMD_INST_CMPXCHG, name, self._value(ptr), self._value(cmp),
+                self._value(val), self._string(instr.ordering),
+                self._string(instr.failordering))
+
+    def _fence(self, instr, name):
+        scope = instr.targetscope
+        if scope is not None:
+            scope = self._string(_plain_string(scope))
+        else:
+            scope = -1
+        return (_CMD_INST_FENCE, name, self._string(instr.ordering), scope)
+
+    def _landingpad(self, instr, name):
+        cmd = [_CMD_INST_LANDINGPAD, name, self._type(instr.type),
+               int(bool(instr.cleanup)), len(instr.clauses)]
+        for clause in instr.clauses:
+            cmd.extend((int(isinstance(clause, _instr.FilterClause)),
+                        self._value(clause.value)))
+        return cmd
+
+
+_ENCODERS = {
+    _instr.Instruction: _Encoder._generic,
+    _instr.CastInstr: _Encoder._cast,
+    _instr.ICMPInstr: _Encoder._icmp,
+    _instr.FCMPInstr: _Encoder._fcmp,
+    _instr.SelectInstr: _Encoder._select,
+    _instr.LoadInstr: _Encoder._load,
+    _instr.StoreInstr: _Encoder._store,
+    _instr.LoadAtomicInstr: _Encoder._load_atomic,
+    _instr.StoreAtomicInstr: _Encoder._store_atomic,
+    _instr.AllocaInstr: _Encoder._alloca,
+    _instr.GEPInstr: _Encoder._gep,
+    _instr.PhiInstr: _Encoder._phi,
+    _instr.CallInstr: _Encoder._call,
+    _instr.InvokeInstr: _Encoder._invoke,
+    _instr.Ret: _Encoder._ret,
+    _instr.Branch: _Encoder._branch,
+    _instr.ConditionalBranch: _Encoder._cbranch,
+    _instr.SwitchInstr: _Encoder._switch,
+    _instr.IndirectBranch: _Encoder._indirectbr,
+    _instr.Unreachable: _Encoder._unreachable,
+    _instr.Resume: _Encoder._resume,
+    _instr.ExtractElement: _Encoder._extract_element,
+    _instr.InsertElement: _Encoder._insert_element,
+    _instr.ShuffleVector: _Encoder._shuffle_vector,
+    _instr.ExtractValue: _Encoder._extract_value,
+    _instr.InsertValue: _Encoder._insert_value,
+    _instr.AtomicRMW: _Encoder._atomic_rmw,
+    _instr.CmpXchg: _Encoder._cmpxchg,
+    _instr.Fence: _Encoder._fence,
+    _instr.LandingPadInstr: _Encoder._landingpad,
+}
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_LowerModule.argtypes = [
+    ffi.LLVMContextRef,
+    POINTER(c_int64),
+    c_size_t,
+    c_char_p,
+    POINTER(c_int64),
+    c_size_t,
+    c_char_p,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LowerModule.restype = ffi.LLVMModuleRef
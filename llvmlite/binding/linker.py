@@ -1,20 +1,49 @@
-from ctypes import c_int, c_char_p, POINTER
+from ctypes import c_bool, c_int, c_char_p, c_size_t, POINTER
 from llvmlite.binding import ffi
 
 
-def link_modules(dst, src):
+def link_modules(dst, src, only_needed=False):
     with ffi.OutputString() as outerr:
-        err = ffi.lib.LLVMPY_LinkModules(dst, src, outerr)
+        err = ffi.lib.LLVMPY_LinkModules(dst, src, only_needed, outerr)
         # The underlying module was destroyed
         src.detach()
         if err:
             raise RuntimeError(str(outerr))
 
 
+def _link_modules_batch(dst, srcs, only_needed=False, internalize=False):
+    """
+    Link the modules of *srcs* into *dst* in order, in a single call.  All
+    of *srcs* are consumed, even on error.
+    """
+    arr = (ffi.LLVMModuleRef * len(srcs))(*[src._ptr for src in srcs])
+    with ffi.OutputString() as outerr:
+        err = ffi.lib.LLVMPY_LinkModulesBatch(dst, arr, len(srcs),
+                                              only_needed, internalize,
+                                              outerr)
+        # The underlying modules were destroyed
+        for src in srcs:
+            src.detach()
+        if err:
+            raise RuntimeError(str(outerr))
+
+
 ffi.lib.LLVMPY_LinkModules.argtypes = [
     ffi.LLVMModuleRef,
     ffi.LLVMModuleRef,
+    c_bool,
     POINTER(c_char_p),
 ]
 
 ffi.lib.LLVMPY_LinkModules.restype = c_int
+
+ffi.lib.LLVMPY_LinkModulesBatch.argtypes = [
+    ffi.LLVMModuleRef,
+    POINTER(ffi.LLVMModuleRef),
+    c_size_t,
+    c_bool,
+    c_bool,
+    POINTER(c_char_p),
+]
+
+ffi.lib.LLVMPY_LinkModulesBatch.restype = c_size_t
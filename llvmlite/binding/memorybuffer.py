@@ -0,0 +1,72 @@
+import weakref
+from ctypes import c_size_t, c_ubyte, c_void_p, string_at
+
+from llvmlite.binding import ffi
+
+
+def _make_view(owner, address, size):
+    """
+    Return a read-only memoryview of the *size* bytes at *address*, which
+    keeps *owner* alive for as long as the view exists.
+    """
+    arr = (c_ubyte * size).from_address(address or 0)
+    arr._owner = owner
+    return arr, memoryview(arr).cast('B').toreadonly()
+
+
+class MemoryBuffer(ffi.ObjectRef):
+    """
+    A block of memory owned by LLVM, such as serialized bitcode or emitted
+    object code.  Its contents can be accessed without being copied through
+    :meth:`view`, or copied to a bytes object with ``bytes()``.
+    """
+
+    def __init__(self, ptr):
+        self._views = []
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def __len__(self):
+        return ffi.lib.LLVMPY_GetBufferSize(self)
+
+    def view(self):
+        """
+        Return a read-only memoryview of the contents.  The buffer can't be
+        closed while views of it exist.
+        """
+        self._check_open()
+        arr, view = _make_view(self, ffi.lib.LLVMPY_GetBufferStart(self),
+                               len(self))
+        self._views.append(weakref.ref(arr))
+        return view
+
+    def __buffer__(self, flags):
+        return self.view()
+
+    def __bytes__(self):
+        self._check_open()
+        return string_at(ffi.lib.LLVMPY_GetBufferStart(self), len(self))
+
+    def _check_open(self):
+        if self._closed:
+            raise RuntimeError("MemoryBuffer already closed")
+
+    def close(self):
+        if any(ref() is not None for ref in self._views):
+            raise BufferError("MemoryBuffer has views which must be "
+                              "released first")
+        ffi.ObjectRef.close(self)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeMemoryBuffer(self)
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_GetBufferStart.argtypes = [ffi.LLVMMemoryBufferRef]
+ffi.lib.LLVMPY_GetBufferStart.restype = c_void_p
+
+ffi.lib.LLVMPY_GetBufferSize.argtypes = [ffi.LLVMMemoryBufferRef]
+ffi.lib.LLVMPY_GetBufferSize.restype = c_size_t
+
+ffi.lib.LLVMPY_DisposeMemoryBuffer.argtypes = [ffi.LLVMMemoryBufferRef]
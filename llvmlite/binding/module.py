@@ -1,11 +1,28 @@
+import hashlib
+from collections import namedtuple
 from ctypes import (c_char_p, byref, POINTER, c_bool, create_string_buffer,
-                    c_size_t, string_at)
+                    c_int, c_int64, c_size_t, c_ubyte, c_uint, py_object,
+                    string_at)
 
 from llvmlite.binding import ffi
-from llvmlite.binding.linker import link_modules
+from llvmlite.binding.linker import link_modules, _link_modules_batch
+from llvmlite.binding.memorybuffer import MemoryBuffer
 from llvmlite.binding.common import _decode_string, _encode_string
-from llvmlite.binding.value import ValueRef, TypeRef
-from llvmlite.binding.context import get_global_context
+from llvmlite.binding.value import (ValueRef, TypeRef, _write_ir,
+                                    _WriteIRFunc, _opcode_name,
+                                    get_value_names)
+from llvmlite.binding.context import create_context, get_global_context
+
+
+ModuleSummary = namedtuple('ModuleSummary',
+                           ('functions opcodes call_graph'))
+
+FunctionSummary = namedtuple('FunctionSummary',
+                             ('name blocks instructions calls'))
+
+ModuleStats = namedtuple('ModuleStats',
+                         ('functions declarations global_variables '
+                          'blocks instructions'))
 
 
 def parse_assembly(llvmir, context=None):
@@ -26,42 +43,110 @@ def parse_assembly(llvmir, context=None):
     return mod
 
 
-def parse_bitcode(bitcode, context=None):
+def parse_bitcode(bitcode, context=None, lazy=False):
     """
     Create Module from a LLVM *bitcode* (a bytes object).
+
+    If *lazy* is true, function bodies are only deserialized when needed:
+    by :meth:`ModuleRef.link_in`, for the functions it links in, by
+    :meth:`ValueRef.materialize`, or all at once by operations on the whole
+    module, see :meth:`ModuleRef.materialize_all`.
     """
     if context is None:
         context = get_global_context()
     buf = c_char_p(bitcode)
     bufsize = len(bitcode)
+    parse = (ffi.lib.LLVMPY_ParseBitcodeLazy if lazy
+             else ffi.lib.LLVMPY_ParseBitcode)
     with ffi.OutputString() as errmsg:
-        mod = ModuleRef(ffi.lib.LLVMPY_ParseBitcode(
-            context, buf, bufsize, errmsg), context)
+        mod = ModuleRef(parse(context, buf, bufsize, errmsg), context)
         if errmsg:
             mod.close()
             raise RuntimeError(
                 "LLVM bitcode parsing error\n{0}".format(errmsg))
+    mod._lazy = lazy
     return mod
 
 
+def parse_modules(buffers, context=None, link=False):
+    """
+    Create Modules from the sequence *buffers*, each a LLVM IR string or a
+    bytes object holding LLVM bitcode or IR, in a single call into LLVM.
+    A list of modules is returned or, if *link* is true, the modules are
+    linked into the first one, which is returned.
+    """
+    if context is None:
+        context = get_global_context()
+    mods = _parse_modules(buffers, [context] * len(buffers), 1)
+    if not link:
+        return mods
+    if not mods:
+        raise ValueError("no module to link into")
+    dst, srcs = mods[0], mods[1:]
+    _link_modules_batch(dst, srcs)
+    return dst
+
+
+def parse_modules_parallel(buffers, num_threads=0):
+    """
+    As :func:`parse_modules`, but each module is created in a new context,
+    which allows them to be parsed concurrently on *num_threads* threads,
+    or one per core if 0.  A list of modules is returned.
+    """
+    contexts = [create_context() for _ in buffers]
+    return _parse_modules(buffers, contexts, num_threads)
+
+
+def _parse_modules(buffers, contexts, num_threads):
+    bufs = [_encode_string(b) if isinstance(b, str) else bytes(b)
+            for b in buffers]
+    n = len(bufs)
+    strbufs = (c_char_p * n)(*bufs)
+    sizes = (c_size_t * n)(*[len(b) for b in bufs])
+    ctxs = (ffi.LLVMContextRef * n)(*[c._ptr for c in contexts])
+    ptrs = (ffi.LLVMModuleRef * n)()
+    with ffi.OutputString() as errmsg:
+        if ffi.lib.LLVMPY_ParseModules(ctxs, strbufs, sizes, n, num_threads,
+                                       ptrs, errmsg):
+            raise RuntimeError(str(errmsg))
+    return [ModuleRef(ptr, ctx) for ptr, ctx in zip(ptrs, contexts)]
+
+
 class ModuleRef(ffi.ObjectRef):
     """
     A reference to a LLVM module.
     """
+    # Whether function bodies may remain to be materialized
+    _lazy = False
 
     def __init__(self, module_ptr, context):
         super(ModuleRef, self).__init__(module_ptr)
         self._context = context
+        context._modules.add(self)
 
     def __str__(self):
+        self.materialize_all()
         with ffi.OutputString() as outstr:
             ffi.lib.LLVMPY_PrintModuleToString(self, outstr)
             return str(outstr)
 
+    def write_ir(self, file):
+        """
+        Write the module's LLVM IR, as ``str()`` returns it, to *file*
+        without holding it all in memory.  *file* is a file descriptor, a
+        file object backed by one, which is flushed first, or any object
+        with a ``write`` method, which receives UTF-8 bytes or, for an
+        :class:`io.TextIOBase`, strings.
+        """
+        self.materialize_all()
+        _write_ir(self, file, ffi.lib.LLVMPY_PrintModuleToFD,
+                  ffi.lib.LLVMPY_PrintModuleToCallback)
+
     def as_bitcode(self):
         """
         Return the module's LLVM bitcode, as a bytes object.
         """
+        self.materialize_all()
         ptr = c_char_p(None)
         size = c_size_t(-1)
         ffi.lib.LLVMPY_WriteBitcodeToString(self, byref(ptr), byref(size))
@@ -73,9 +158,61 @@ class ModuleRef(ffi.ObjectRef):
         finally:
             ffi.lib.LLVMPY_DisposeString(ptr)
 
+    def as_bitcode_buffer(self):
+        """
+        Return the module's LLVM bitcode as a :class:`MemoryBuffer`, which
+        unlike :meth:`as_bitcode` doesn't copy it.
+        """
+        self.materialize_all()
+        return MemoryBuffer(ffi.lib.LLVMPY_WriteBitcodeToMemoryBuffer(self))
+
+    def fingerprint(self):
+        """
+        Return the SHA-256 of the module's bitcode as a hexadecimal string,
+        computed without copying the bitcode out of LLVM from LLVM 13 on.
+        """
+        self.materialize_all()
+        digest = (c_ubyte * 32)()
+        if not ffi.lib.LLVMPY_GetModuleFingerprint(self, digest):
+            return hashlib.sha256(self.as_bitcode()).hexdigest()
+        return bytes(digest).hex()
+
+    @property
+    def stats(self):
+        """
+        A :class:`ModuleStats` of the module's numbers of functions, global
+        variables, blocks and instructions, counted in a single call.
+        """
+        self.materialize_all()
+        stats = (c_int64 * 5)()
+        ffi.lib.LLVMPY_GetModuleStats(self, stats)
+        return ModuleStats(*stats)
+
+    def as_ir_buffer(self):
+        """
+        Return the module's LLVM IR text, as ``str()`` does, as a
+        :class:`MemoryBuffer` of UTF-8 bytes.
+        """
+        self.materialize_all()
+        return MemoryBuffer(ffi.lib.LLVMPY_PrintModuleToMemoryBuffer(self))
+
     def _dispose(self):
         self._capi.LLVMPY_DisposeModule(self)
 
+    def materialize_all(self):
+        """
+        Deserialize the function bodies of a module parsed lazily with
+        :func:`parse_bitcode` that haven't been yet.  This is done
+        automatically before operations on the whole module, such as
+        printing it, optimizing it or adding it to a JIT.
+        """
+        if not self._lazy:
+            return
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_MaterializeAll(self, outerr):
+                raise RuntimeError(str(outerr))
+        self._lazy = False
+
     def get_function(self, name):
         """
         Get a ValueRef pointing to the function named *name*.
@@ -110,6 +247,7 @@ class ModuleRef(ffi.ObjectRef):
         """
         Verify the module IR's correctness.  RuntimeError is raised on error.
         """
+        self.materialize_all()
         with ffi.OutputString() as outmsg:
             if ffi.lib.LLVMPY_VerifyModule(self, outmsg):
                 raise RuntimeError(str(outmsg))
@@ -164,14 +302,33 @@ class ModuleRef(ffi.ObjectRef):
                                  create_string_buffer(
                                      strrep.encode('utf8')))
 
-    def link_in(self, other, preserve=False):
+    def link_in(self, other, preserve=False, only_needed=False):
         """
         Link the *other* module into this one.  The *other* module will
         be destroyed unless *preserve* is true.
+
+        If *only_needed* is true, only the definitions of *other* that are
+        used by this module are linked in.  If *other* was parsed lazily,
+        the bodies of the other functions are then never deserialized.
         """
         if preserve:
             other = other.clone()
-        link_modules(self, other)
+        link_modules(self, other, only_needed)
+
+    def link_in_modules(self, others, only_needed=False, internalize=False):
+        """
+        Link the modules of the sequence *others* into this one in order, in
+        a single call.  The modules of *others* are all destroyed, even on
+        error.
+
+        If *only_needed* is true, only the definitions used by this module,
+        or by those linked in from the previous modules, are linked in.  If
+        *internalize* is true, the definitions linked in are then given
+        internal linkage, so that the optimizer can inline or drop them.
+        """
+        others = list(others)
+        if others:
+            _link_modules_batch(self, others, only_needed, internalize)
 
     @property
     def global_variables(self):
@@ -195,6 +352,56 @@ class ModuleRef(ffi.ObjectRef):
         it = ffi.lib.LLVMPY_ModuleFunctionsIter(self)
         return _FunctionsIterator(it, dict(module=self))
 
+    def get_functions(self):
+        """
+        Return a list of this module's functions, as :attr:`functions`
+        yields them, obtained in a single call.
+        """
+        ptrs = (ffi.LLVMValueRef * ffi.lib.LLVMPY_CountFunctions(self))()
+        ffi.lib.LLVMPY_GetFunctions(self, ptrs)
+        parents = dict(module=self)
+        return [ValueRef(ptr, 'function', parents) for ptr in ptrs]
+
+    def get_global_variables(self):
+        """
+        Return a list of this module's global variables, as
+        :attr:`global_variables` yields them, obtained in a single call.
+        """
+        n = ffi.lib.LLVMPY_CountGlobalVariables(self)
+        ptrs = (ffi.LLVMValueRef * n)()
+        ffi.lib.LLVMPY_GetGlobalVariables(self, ptrs)
+        parents = dict(module=self)
+        return [ValueRef(ptr, 'global', parents) for ptr in ptrs]
+
+    def summary(self):
+        """
+        Return a :class:`ModuleSummary` of this module, gathered in a single
+        walk of its instructions.
+        """
+        self.materialize_all()
+        funcs = self.get_functions()
+        n = len(funcs)
+        stats = (c_int64 * (3 * n))()
+        opcode_counts = (c_int64 * ffi.lib.LLVMPY_GetNumOpcodes())()
+        max_edges = 4 * n
+        while True:
+            edges = (c_int64 * (3 * max_edges))()
+            num_edges = ffi.lib.LLVMPY_GetModuleSummary(
+                self, stats, opcode_counts, edges, max_edges)
+            if num_edges <= max_edges:
+                break
+            max_edges = num_edges
+        names = get_value_names(funcs)
+        functions = [FunctionSummary(name, *stats[3 * i:3 * i + 3])
+                     for i, name in enumerate(names)]
+        opcodes = {_opcode_name(opcode): count
+                   for opcode, count in enumerate(opcode_counts) if count}
+        call_graph = {name: {} for name in names}
+        for i in range(num_edges):
+            caller, callee, count = edges[3 * i:3 * i + 3]
+            call_graph[names[caller]][names[callee]] = count
+        return ModuleSummary(functions, opcodes, call_graph)
+
     @property
     def struct_types(self):
         """
@@ -205,6 +412,7 @@ class ModuleRef(ffi.ObjectRef):
         return _TypesIterator(it, dict(module=self))
 
     def clone(self):
+        self.materialize_all()
         return ModuleRef(ffi.lib.LLVMPY_CloneModule(self), self._context)
 
 
@@ -285,6 +493,24 @@ ffi.lib.LLVMPY_ParseBitcode.argtypes = [ffi.LLVMContextRef,
                                         POINTER(c_char_p)]
 ffi.lib.LLVMPY_ParseBitcode.restype = ffi.LLVMModuleRef
 
+ffi.lib.LLVMPY_ParseBitcodeLazy.argtypes = [ffi.LLVMContextRef,
+                                            c_char_p, c_size_t,
+                                            POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseBitcodeLazy.restype = ffi.LLVMModuleRef
+
+ffi.lib.LLVMPY_MaterializeAll.argtypes = [ffi.LLVMModuleRef,
+                                          POINTER(c_char_p)]
+ffi.lib.LLVMPY_MaterializeAll.restype = c_int
+
+ffi.lib.LLVMPY_ParseModules.argtypes = [POINTER(ffi.LLVMContextRef),
+                                        POINTER(c_char_p),
+                                        POINTER(c_size_t),
+                                        c_size_t,
+                                        c_uint,
+                                        POINTER(ffi.LLVMModuleRef),
+                                        POINTER(c_char_p)]
+ffi.lib.LLVMPY_ParseModules.restype = c_size_t
+
 ffi.lib.LLVMPY_DisposeModule.argtypes = [ffi.LLVMModuleRef]
 
 ffi.lib.LLVMPY_PrintModuleToString.argtypes = [ffi.LLVMModuleRef,
@@ -293,6 +519,24 @@ ffi.lib.LLVMPY_WriteBitcodeToString.argtypes = [ffi.LLVMModuleRef,
                                                 POINTER(c_char_p),
                                                 POINTER(c_size_t)]
 
+ffi.lib.LLVMPY_PrintModuleToFD.argtypes = [ffi.LLVMModuleRef, c_int,
+                                           POINTER(c_char_p)]
+ffi.lib.LLVMPY_PrintModuleToFD.restype = c_int
+
+ffi.lib.LLVMPY_PrintModuleToCallback.argtypes = [ffi.LLVMModuleRef,
+                                                 _WriteIRFunc, py_object]
+ffi.lib.LLVMPY_PrintModuleToCallback.restype = c_int
+
+ffi.lib.LLVMPY_WriteBitcodeToMemoryBuffer.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_WriteBitcodeToMemoryBuffer.restype = ffi.LLVMMemoryBufferRef
+
+ffi.lib.LLVMPY_GetModuleFingerprint.argtypes = [ffi.LLVMModuleRef,
+                                                POINTER(c_ubyte)]
+ffi.lib.LLVMPY_GetModuleFingerprint.restype = c_bool
+
+ffi.lib.LLVMPY_PrintModuleToMemoryBuffer.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_PrintModuleToMemoryBuffer.restype = ffi.LLVMMemoryBufferRef
+
 ffi.lib.LLVMPY_GetNamedFunction.argtypes = [ffi.LLVMModuleRef,
                                             c_char_p]
 ffi.lib.LLVMPY_GetNamedFunction.restype = ffi.LLVMValueRef
@@ -337,6 +581,30 @@ ffi.lib.LLVMPY_FunctionsIterNext.restype = ffi.LLVMValueRef
 ffi.lib.LLVMPY_TypesIterNext.argtypes = [ffi.LLVMTypesIterator]
 ffi.lib.LLVMPY_TypesIterNext.restype = ffi.LLVMTypeRef
 
+ffi.lib.LLVMPY_CountFunctions.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_CountFunctions.restype = c_size_t
+
+ffi.lib.LLVMPY_GetFunctions.argtypes = [ffi.LLVMModuleRef,
+                                        POINTER(ffi.LLVMValueRef)]
+
+ffi.lib.LLVMPY_CountGlobalVariables.argtypes = [ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_CountGlobalVariables.restype = c_size_t
+
+ffi.lib.LLVMPY_GetGlobalVariables.argtypes = [ffi.LLVMModuleRef,
+                                              POINTER(ffi.LLVMValueRef)]
+
+ffi.lib.LLVMPY_GetNumOpcodes.restype = c_uint
+
+ffi.lib.LLVMPY_GetModuleSummary.argtypes = [ffi.LLVMModuleRef,
+                                            POINTER(c_int64),
+                                            POINTER(c_int64),
+                                            POINTER(c_int64),
+                                            c_size_t]
+ffi.lib.LLVMPY_GetModuleSummary.restype = c_size_t
+
+ffi.lib.LLVMPY_GetModuleStats.argtypes = [ffi.LLVMModuleRef,
+                                          POINTER(c_int64)]
+
 ffi.lib.LLVMPY_CloneModule.argtypes = [ffi.LLVMModuleRef]
 ffi.lib.LLVMPY_CloneModule.restype = ffi.LLVMModuleRef
 
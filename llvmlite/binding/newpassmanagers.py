@@ -0,0 +1,271 @@
+from collections import namedtuple
+from ctypes import (POINTER, byref, c_char_p, c_double, c_int, c_int64,
+                    c_size_t, c_uint)
+
+from llvmlite.binding import ffi
+from llvmlite.binding.common import _decode_string, _encode_string
+from llvmlite.binding.passmanagers import (RefPruneSubpasses,
+                                           _RefPruneCounters)
+from llvmlite.binding.targets import _get_vector_library_id
+
+
+PassTiming = namedtuple('PassTiming',
+                        ('pass_name ir_name wall_time user_time '
+                         'instructions_before instructions_after'))
+
+
+def create_new_module_pass_manager(target_machine=None, vector_library=None):
+    """
+    Create an empty :class:`NewModulePassManager`.  If given,
+    *target_machine* is used for target-specific analyses and must outlive
+    the pass manager.  If *vector_library* is given, the name of one of
+    get_vector_libraries(), the vectorizers may call its functions.
+    """
+    return NewModulePassManager(target_machine, vector_library)
+
+
+def create_new_function_pass_manager(target_machine=None,
+                                     vector_library=None):
+    """
+    Create an empty :class:`NewFunctionPassManager`.  If given,
+    *target_machine* is used for target-specific analyses and must outlive
+    the pass manager.  If *vector_library* is given, the name of one of
+    get_vector_libraries(), the vectorizers may call its functions.
+    """
+    return NewFunctionPassManager(target_machine, vector_library)
+
+
+class NewPassManager(ffi.ObjectRef):
+    """
+    A pipeline of the new LLVM pass manager.  Analysis results are shared by
+    all the passes of a run and are discarded at its end.
+    """
+    _function_level = False
+
+    def __init__(self, target_machine=None, vector_library=None):
+        vector_library_id = 0
+        stats = None
+        try:
+            if vector_library is not None:
+                vector_library_id = _get_vector_library_id(vector_library)
+            stats = _RefPruneCounters()
+            ptr = ffi.lib.LLVMPY_CreateNewPassManager(
+                target_machine, int(self._function_level), stats,
+                vector_library_id)
+            ffi.ObjectRef.__init__(self, ptr)
+        except BaseException:
+            # The pass manager wasn't created; don't dispose of it on close
+            if stats is not None:
+                stats.close()
+            self._closed = True
+            raise
+        self._tm = target_machine
+        self._refprune_stats = stats
+
+    def add_default_pipeline(self, opt_level=2, size_level=0):
+        """
+        Append LLVM's default pipeline for the given optimization level
+        (0-3) or, if *size_level* is 1 or 2, for -Os or -Oz.
+        """
+        if not 0 <= opt_level <= 3:
+            raise ValueError("opt_level must be between 0 and 3")
+        if not 0 <= size_level <= 2:
+            raise ValueError("size_level must be between 0 and 2")
+        ffi.lib.LLVMPY_NewPassManagerAddDefaultPipeline(self, opt_level,
+                                                        size_level)
+
+    def add_pipeline(self, pipeline):
+        """
+        Parse the textual *pipeline*, in the syntax of ``opt -passes=``, and
+        append it.  The reference count pruning passes are available as
+        ``refprune``.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_NewPassManagerAddPipeline(
+                    self, _encode_string(pipeline), outerr):
+                raise ValueError(str(outerr))
+
+    def add_refprune_pass(self, subpasses_flags=RefPruneSubpasses.ALL,
+                          subgraph_limit=1000):
+        """
+        Append the Numba specific reference count pruning passes; see
+        :meth:`PassManager.add_refprune_pass`.
+        """
+        iflags = RefPruneSubpasses(subpasses_flags)
+        ffi.lib.LLVMPY_NewPassManagerAddRefPrunePass(self, iflags,
+                                                     subgraph_limit)
+
+    def get_refprune_stats(self, reset=False):
+        """
+        Return a :class:`PruneStats` of the pruning done by the refprune
+        passes of this pipeline, including those of textual pipelines and of
+        parallel runs, since it was created or last reset.  If *reset* is
+        true, the statistics are reset to zero as they are read.
+        """
+        return self._refprune_stats.get(reset)
+
+    def enable_timings(self, sample_every=1):
+        """
+        Record a :class:`PassTiming` for one in *sample_every* of the pass
+        executions of subsequent runs.
+        """
+        if sample_every < 1:
+            raise ValueError("sample_every must be at least 1")
+        ffi.lib.LLVMPY_NewPassManagerSetTimings(self, sample_every)
+
+    def disable_timings(self):
+        """
+        Stop recording pass executions.
+        """
+        ffi.lib.LLVMPY_NewPassManagerSetTimings(self, 0)
+
+    def take_timings(self):
+        """
+        Return the list of :class:`PassTiming` recorded so far, in the order
+        the passes completed, and clear it.
+        """
+        timings = ffi.lib.LLVMPY_NewPassManagerTakeTimings(self)
+        try:
+            pass_name = c_char_p()
+            ir_name = c_char_p()
+            wall_time = c_double()
+            user_time = c_double()
+            before = c_int64()
+            after = c_int64()
+            res = []
+            for i in range(ffi.lib.LLVMPY_PassTimingsSize(timings)):
+                ffi.lib.LLVMPY_PassTimingsGet(timings, i, byref(pass_name),
+                                              byref(ir_name),
+                                              byref(wall_time),
+                                              byref(user_time),
+                                              byref(before), byref(after))
+                res.append(PassTiming(_decode_string(pass_name.value),
+                                      _decode_string(ir_name.value),
+                                      wall_time.value, user_time.value,
+                                      before.value, after.value))
+            return res
+        finally:
+            ffi.lib.LLVMPY_DisposePassTimings(timings)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeNewPassManager(self)
+        self._refprune_stats.close()
+
+
+class NewModulePassManager(NewPassManager):
+
+    def run(self, module):
+        """
+        Run the pipeline on *module*.  Returns True if it may have been
+        changed.
+        """
+        module.materialize_all()
+        return bool(ffi.lib.LLVMPY_RunNewPassManager(self, module))
+
+
+class NewFunctionPassManager(NewPassManager):
+    _function_level = True
+
+    def run(self, function):
+        """
+        Run the pipeline on *function*.  Returns True if it may have been
+        changed.
+        """
+        function.materialize()
+        return bool(ffi.lib.LLVMPY_RunNewFunctionPassManager(self, function))
+
+    def run_parallel(self, module, num_threads=0):
+        """
+        Run the pipeline on all the functions defined in *module*, on
+        *num_threads* threads or, if 0, one per core.  Returns True if the
+        module may have been changed.
+
+        The functions are split into one partition per thread, each
+        optimized in a private copy of the module, and the optimized bodies
+        are then moved back into *module*; :class:`ValueRef` objects for its
+        functions and globals remain valid.  Only constant globals are
+        visible to the passes, which don't see the other partitions, as if
+        the functions had been optimized one at a time.
+        """
+        module.materialize_all()
+        with ffi.OutputString() as outerr:
+            res = ffi.lib.LLVMPY_RunNewFunctionPassManagerParallel(
+                self, module, num_threads, outerr)
+            if res < 0:
+                raise RuntimeError(str(outerr))
+        return bool(res)
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_CreateNewPassManager.argtypes = [ffi.LLVMTargetMachineRef,
+                                                c_int,
+                                                ffi.LLVMRefPruneStatsRef,
+                                                c_int]
+ffi.lib.LLVMPY_CreateNewPassManager.restype = ffi.LLVMNewPassManagerRef
+
+ffi.lib.LLVMPY_DisposeNewPassManager.argtypes = [ffi.LLVMNewPassManagerRef]
+
+ffi.lib.LLVMPY_NewPassManagerAddDefaultPipeline.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    c_int,
+    c_int,
+]
+
+ffi.lib.LLVMPY_NewPassManagerAddPipeline.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    c_char_p,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_NewPassManagerAddPipeline.restype = c_int
+
+ffi.lib.LLVMPY_NewPassManagerAddRefPrunePass.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    c_int,
+    c_size_t,
+]
+
+ffi.lib.LLVMPY_RunNewPassManager.argtypes = [ffi.LLVMNewPassManagerRef,
+                                             ffi.LLVMModuleRef]
+ffi.lib.LLVMPY_RunNewPassManager.restype = c_int
+
+ffi.lib.LLVMPY_RunNewFunctionPassManager.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    ffi.LLVMValueRef,
+]
+ffi.lib.LLVMPY_RunNewFunctionPassManager.restype = c_int
+
+ffi.lib.LLVMPY_RunNewFunctionPassManagerParallel.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    ffi.LLVMModuleRef,
+    c_uint,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_RunNewFunctionPassManagerParallel.restype = c_int
+
+ffi.lib.LLVMPY_NewPassManagerSetTimings.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+    c_uint,
+]
+
+ffi.lib.LLVMPY_NewPassManagerTakeTimings.argtypes = [
+    ffi.LLVMNewPassManagerRef,
+]
+ffi.lib.LLVMPY_NewPassManagerTakeTimings.restype = ffi.LLVMPassTimingsRef
+
+ffi.lib.LLVMPY_PassTimingsSize.argtypes = [ffi.LLVMPassTimingsRef]
+ffi.lib.LLVMPY_PassTimingsSize.restype = c_size_t
+
+ffi.lib.LLVMPY_PassTimingsGet.argtypes = [
+    ffi.LLVMPassTimingsRef,
+    c_size_t,
+    POINTER(c_char_p),
+    POINTER(c_char_p),
+    POINTER(c_double),
+    POINTER(c_double),
+    POINTER(c_int64),
+    POINTER(c_int64),
+]
+
+ffi.lib.LLVMPY_DisposePassTimings.argtypes = [ffi.LLVMPassTimingsRef]
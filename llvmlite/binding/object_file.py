@@ -1,6 +1,7 @@
 from llvmlite.binding import ffi
-from ctypes import (c_bool, c_char_p, c_char, c_size_t, string_at, c_uint64,
-                    POINTER)
+from llvmlite.binding.memorybuffer import _make_view
+from ctypes import (c_bool, c_char_p, c_size_t, string_at, c_uint64,
+                    c_void_p)
 
 
 class SectionIteratorRef(ffi.ObjectRef):
@@ -19,6 +20,16 @@ class SectionIteratorRef(ffi.ObjectRef):
     def data(self):
         return string_at(ffi.lib.LLVMPY_GetSectionContents(self), self.size())
 
+    def data_view(self):
+        """
+        Return a read-only memoryview of the section contents, without
+        copying them.  The view keeps the object file alive.
+        """
+        _, view = _make_view(self._object_file,
+                             ffi.lib.LLVMPY_GetSectionContents(self),
+                             self.size())
+        return view
+
     def is_end(self, object_file):
         return ffi.lib.LLVMPY_IsSectionIteratorAtEnd(object_file, self)
 
@@ -42,6 +53,7 @@ class ObjectFileRef(ffi.ObjectRef):
 
     def sections(self):
         it = SectionIteratorRef(ffi.lib.LLVMPY_GetSections(self))
+        it._object_file = self
         while not it.is_end(self):
             yield it
             it.next()
@@ -76,7 +88,7 @@ ffi.lib.LLVMPY_GetSectionAddress.argtypes = [ffi.LLVMSectionIteratorRef]
 ffi.lib.LLVMPY_GetSectionAddress.restype = c_uint64
 
 ffi.lib.LLVMPY_GetSectionContents.argtypes = [ffi.LLVMSectionIteratorRef]
-ffi.lib.LLVMPY_GetSectionContents.restype = POINTER(c_char)
+ffi.lib.LLVMPY_GetSectionContents.restype = c_void_p
 
 ffi.lib.LLVMPY_IsSectionText.argtypes = [ffi.LLVMSectionIteratorRef]
 ffi.lib.LLVMPY_IsSectionText.restype = c_bool
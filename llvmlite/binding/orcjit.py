@@ -0,0 +1,255 @@
+import weakref
+from ctypes import (POINTER, byref, c_bool, c_char_p, c_int, c_size_t, c_uint,
+                    c_uint64)
+
+from llvmlite.binding import ffi, targets
+from llvmlite.binding.common import _encode_string
+
+
+def create_lljit_compiler(target_machine, lazy=False, num_threads=0):
+    """
+    Create an ORC LLJIT engine configured like the given *target_machine*.
+    The target machine is only used as a template and remains owned by the
+    caller.
+
+    If *lazy* is true, each function is only compiled when it is first
+    called, through a stub; looking up a symbol doesn't compile anything.
+
+    If *num_threads* is non-zero, modules are compiled on a pool of that many
+    background threads; see :meth:`LLJIT.compile_async`.
+    """
+    with ffi.OutputString() as outerr:
+        jit = ffi.lib.LLVMPY_CreateLLJITCompiler(target_machine, c_bool(lazy),
+                                                 num_threads, outerr)
+        if not jit:
+            raise RuntimeError(str(outerr))
+    return LLJIT(jit)
+
+
+class LLJIT(ffi.ObjectRef):
+    """
+    An ORC-based JIT engine.  Code for an added module is only generated
+    when one of its symbols is first looked up, and the resources of each
+    module can be released individually through its :class:`ResourceTracker`.
+    """
+
+    def __init__(self, ptr):
+        self._td = None
+        self._trackers = weakref.WeakSet()
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def add_module(self, module, move_context=False):
+        """
+        Add *module* for code generation and return a :class:`ResourceTracker`
+        for its resources.  The module is consumed and must not be used
+        afterwards.
+
+        If *move_context* is true, the module's context, which must hold no
+        other open module, is handed over to the engine along with it, and
+        must not be used afterwards either.  Otherwise the module is copied
+        into a new context, which costs a bitcode round trip.
+        """
+        if module._owned:
+            raise ValueError("module is owned by another object")
+        context = module._context
+        if move_context and not context._only_holds(module):
+            raise ValueError("the context of the module must be moved with "
+                             "it, but is global or has other modules")
+        module.materialize_all()
+        with ffi.OutputString() as outerr:
+            ptr = ffi.lib.LLVMPY_LLJITAddModule(self, module, move_context,
+                                                outerr)
+            # The underlying module, and maybe its context, were moved into
+            # the JIT
+            module.detach()
+            if move_context:
+                context.detach()
+            if not ptr:
+                raise RuntimeError(str(outerr))
+        tracker = ResourceTracker(ptr, self)
+        self._trackers.add(tracker)
+        return tracker
+
+    def lookup(self, name):
+        """
+        Return the address of the symbol *name* as an integer, compiling
+        the module that defines it if needed.  RuntimeError is raised if the
+        symbol can't be found.
+
+        For a lazy JIT, the address of a function is that of a stub which
+        compiles the function on its first call.
+        """
+        with ffi.OutputString() as outerr:
+            addr = ffi.lib.LLVMPY_LLJITLookup(self, _encode_string(name),
+                                              outerr)
+            if outerr:
+                raise RuntimeError(str(outerr))
+        return addr
+
+    def compile_async(self, names):
+        """
+        Start looking up the symbols in *names*, compiling the modules that
+        define them, and return a :class:`CompileFuture` for their addresses.
+
+        With compile threads, the modules are compiled concurrently in the
+        background and this returns immediately; otherwise they are compiled
+        before this returns.
+        """
+        names = list(names)
+        arr = (c_char_p * len(names))(*[_encode_string(n) for n in names])
+        ptr = ffi.lib.LLVMPY_LLJITCompileAsync(self, arr, len(names))
+        return CompileFuture(ptr, names)
+
+    def get_function_address(self, name):
+        """
+        Return the address of the function named *name* as an integer.
+        """
+        return self.lookup(name)
+
+    def get_global_value_address(self, name):
+        """
+        Return the address of the global value named *name* as an integer.
+        """
+        return self.lookup(name)
+
+    @property
+    def target_data(self):
+        """
+        The TargetData for this JIT.
+        """
+        if self._td is None:
+            self._td = targets.TargetData(
+                ffi.lib.LLVMPY_LLJITGetTargetData(self))
+        return self._td
+
+    def _dispose(self):
+        # Resource trackers must be released before the JIT is destroyed.
+        for tracker in list(self._trackers):
+            tracker.close()
+        self._trackers.clear()
+        if self._td is not None:
+            self._td.close()
+        self._capi.LLVMPY_DisposeLLJIT(self)
+
+
+class ResourceTracker(ffi.ObjectRef):
+    """
+    Tracks the resources of a module added to a :class:`LLJIT`.
+    """
+
+    def __init__(self, ptr, jit):
+        self._jit = jit
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def remove(self):
+        """
+        Remove the code, data and symbols of the tracked module from the JIT.
+        Addresses obtained from it become invalid.
+
+        With a lazy JIT, the call-through stubs of the module are not
+        reclaimed and its symbols can't be defined again in the same JIT.
+        RuntimeError is raised with LLVM 11, which can't remove modules.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_LLJITRemoveResourceTracker(self, outerr):
+                raise RuntimeError(str(outerr))
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeResourceTracker(self)
+
+
+class CompileFuture(ffi.ObjectRef):
+    """
+    The pending result of :meth:`LLJIT.compile_async`.
+    """
+
+    def __init__(self, ptr, names):
+        self._names = names
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def done(self):
+        """
+        Whether the lookup has completed, successfully or not.
+        """
+        return ffi.lib.LLVMPY_CompileFutureIsReady(self)
+
+    def result(self):
+        """
+        Wait for the lookup to complete and return a dict mapping each
+        requested name to its address.  RuntimeError is raised if any of the
+        symbols can't be found or compiled.
+
+        The binding's lock isn't held while waiting, so that other threads
+        can keep using LLVM in the meantime.  The future must not be closed
+        concurrently.
+        """
+        addrs = (c_uint64 * len(self._names))()
+        err = c_char_p()
+        # The wait only touches the future's own state, which is synchronized
+        # with the compile threads in C++
+        if ffi.lib._lib.LLVMPY_CompileFutureWait(self, addrs, byref(err)):
+            with ffi.OutputString(init=err) as outerr:
+                raise RuntimeError(str(outerr))
+        return dict(zip(self._names, addrs))
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeCompileFuture(self)
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_CreateLLJITCompiler.argtypes = [
+    ffi.LLVMTargetMachineRef,
+    c_bool,
+    c_uint,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_CreateLLJITCompiler.restype = ffi.LLVMOrcJITRef
+
+ffi.lib.LLVMPY_DisposeLLJIT.argtypes = [ffi.LLVMOrcJITRef]
+
+ffi.lib.LLVMPY_LLJITAddModule.argtypes = [
+    ffi.LLVMOrcJITRef,
+    ffi.LLVMModuleRef,
+    c_bool,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITAddModule.restype = ffi.LLVMResourceTrackerRef
+
+ffi.lib.LLVMPY_LLJITLookup.argtypes = [
+    ffi.LLVMOrcJITRef,
+    c_char_p,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITLookup.restype = c_uint64
+
+ffi.lib.LLVMPY_LLJITCompileAsync.argtypes = [
+    ffi.LLVMOrcJITRef,
+    POINTER(c_char_p),
+    c_size_t,
+]
+ffi.lib.LLVMPY_LLJITCompileAsync.restype = ffi.LLVMCompileFutureRef
+
+ffi.lib.LLVMPY_CompileFutureIsReady.argtypes = [ffi.LLVMCompileFutureRef]
+ffi.lib.LLVMPY_CompileFutureIsReady.restype = c_bool
+
+ffi.lib.LLVMPY_CompileFutureWait.argtypes = [
+    ffi.LLVMCompileFutureRef,
+    POINTER(c_uint64),
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_CompileFutureWait.restype = c_int
+
+ffi.lib.LLVMPY_DisposeCompileFuture.argtypes = [ffi.LLVMCompileFutureRef]
+
+ffi.lib.LLVMPY_LLJITGetTargetData.argtypes = [ffi.LLVMOrcJITRef]
+ffi.lib.LLVMPY_LLJITGetTargetData.restype = ffi.LLVMTargetDataRef
+
+ffi.lib.LLVMPY_LLJITRemoveResourceTracker.argtypes = [
+    ffi.LLVMResourceTrackerRef,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_LLJITRemoveResourceTracker.restype = c_int
+
+ffi.lib.LLVMPY_DisposeResourceTracker.argtypes = [ffi.LLVMResourceTrackerRef]
@@ -1,10 +1,12 @@
-from ctypes import c_bool, c_char_p, c_int, c_size_t, c_uint, Structure, byref
+from ctypes import (c_bool, c_char_p, c_int, c_size_t, c_uint, Structure,
+                    byref, POINTER)
 from collections import namedtuple
 from enum import IntFlag
 from llvmlite.binding import ffi
 import os
 from tempfile import mkstemp
-from llvmlite.binding.common import _encode_string
+from llvmlite.binding.common import _decode_string, _encode_string
+from llvmlite.binding.context import get_global_context
 
 _prunestats = namedtuple('PruneStats',
                          ('basicblock diamond fanout fanout_raise'))
@@ -56,6 +58,32 @@ def dump_refprune_stats(printout=False):
                       stats.fanout_raise)
 
 
+def reset_refprune_stats():
+    """ Reset the refop pruning statistics returned by
+    :func:`dump_refprune_stats` to zero.
+    """
+    ffi.lib.LLVMPY_ResetRefPruneStats()
+
+
+class _RefPruneCounters(ffi.ObjectRef):
+    """ The refop pruning statistics of the passes of one pass manager.  The
+    counters are updated atomically and may be shared by passes running on
+    several threads.
+    """
+
+    def __init__(self):
+        ffi.ObjectRef.__init__(self, ffi.lib.LLVMPY_CreateRefPruneStats())
+
+    def get(self, reset=False):
+        stats = _c_PruneStats(0, 0, 0, 0)
+        ffi.lib.LLVMPY_GetRefPruneStats(self, byref(stats), c_bool(reset))
+        return PruneStats(stats.basicblock, stats.diamond, stats.fanout,
+                          stats.fanout_raise)
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeRefPruneStats(self)
+
+
 def set_time_passes(enable):
     """Enable or disable the pass timers.
 
@@ -84,6 +112,110 @@ def report_and_reset_timings():
         return str(buf)
 
 
+class RemarkKind(IntFlag):
+    PASSED   = 0b001    # noqa: E221
+    MISSED   = 0b010    # noqa: E221
+    ANALYSIS = 0b100
+    ALL = PASSED | MISSED | ANALYSIS
+
+
+Remark = namedtuple('Remark', ('kind pass_name name function file line '
+                               'column message args'))
+
+
+def collect_remarks(context=None, remarks_filter='', kinds=RemarkKind.ALL):
+    """Start collecting the optimization remarks emitted in *context*
+    (the global context by default) in memory.
+
+    Parameters
+    ----------
+    context : llvmlite.binding.ContextRef; optional
+        The context of the modules being optimized.
+    remarks_filter : str; optional
+        A regular expression that the name of the pass emitting a remark
+        must match.  Other remarks are never built.
+    kinds : RemarkKind; optional
+        The kinds of remarks to collect.
+
+    Returns
+    -------
+    res : RemarkCollector
+        Collects remarks until stopped; use it as a context manager to
+        collect the remarks of the enclosed passes.
+    """
+    if context is None:
+        context = get_global_context()
+    with ffi.OutputString() as outerr:
+        ptr = ffi.lib.LLVMPY_CreateRemarkCollector(
+            context, _encode_string(remarks_filter), int(RemarkKind(kinds)),
+            outerr)
+        if not ptr:
+            raise ValueError(str(outerr))
+    return RemarkCollector(ptr, context)
+
+
+class RemarkCollector(ffi.ObjectRef):
+    """Collects optimization remarks as :class:`Remark` records.  Exiting
+    a ``with`` block stops the collection but keeps the records.
+    """
+
+    def __init__(self, ptr, context):
+        self._context = context
+        ffi.ObjectRef.__init__(self, ptr)
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.stop()
+
+    def stop(self):
+        """Stop collecting remarks.  Collectors of the same context must be
+        stopped in the reverse order of their creation: RuntimeError is
+        raised, and the collection goes on, if a collector created later
+        is still collecting.
+        """
+        if not ffi.lib.LLVMPY_RemarkCollectorStop(self):
+            raise RuntimeError("remark collectors must be stopped in the "
+                               "reverse order of their creation")
+
+    @property
+    def remarks(self):
+        """The list of remarks collected so far, in emission order.
+        """
+        kind = c_int()
+        pass_name = c_char_p()
+        name = c_char_p()
+        function = c_char_p()
+        file = c_char_p()
+        message = c_char_p()
+        line = c_uint()
+        column = c_uint()
+        nargs = c_size_t()
+        key = c_char_p()
+        value = c_char_p()
+        res = []
+        for i in range(ffi.lib.LLVMPY_RemarkCollectorSize(self)):
+            ffi.lib.LLVMPY_RemarkCollectorGet(
+                self, i, byref(kind), byref(pass_name), byref(name),
+                byref(function), byref(file), byref(line), byref(column),
+                byref(message), byref(nargs))
+            args = []
+            for j in range(nargs.value):
+                ffi.lib.LLVMPY_RemarkCollectorGetArg(self, i, j, byref(key),
+                                                     byref(value))
+                args.append((_decode_string(key.value),
+                             _decode_string(value.value)))
+            res.append(Remark(RemarkKind(kind.value),
+                              _decode_string(pass_name.value),
+                              _decode_string(name.value),
+                              _decode_string(function.value),
+                              _decode_string(file.value), line.value,
+                              column.value, _decode_string(message.value),
+                              args))
+        return res
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeRemarkCollector(self)
+
+
 def create_module_pass_manager():
     return ModulePassManager()
 
@@ -98,14 +230,20 @@ class RefPruneSubpasses(IntFlag):
     FANOUT       = 0b0100    # noqa: E221
     FANOUT_RAISE = 0b1000
     ALL = PER_BB | DIAMOND | FANOUT | FANOUT_RAISE
+    # Run the enabled subpasses with the worklist pruner
+    WORKLIST     = 0b10000   # noqa: E221
 
 
 class PassManager(ffi.ObjectRef):
     """PassManager
     """
+    _refprune_stats = None
 
     def _dispose(self):
         self._capi.LLVMPY_DisposePassManager(self)
+        # The refprune passes of the pass manager count into these.
+        if self._refprune_stats is not None:
+            self._refprune_stats.close()
 
     def add_aa_eval_pass(self):
         """
@@ -644,15 +782,36 @@ class PassManager(ffi.ObjectRef):
         Parameters
         ----------
         subpasses_flags : RefPruneSubpasses
-            A bitmask to control the subpasses to be enabled.
+            A bitmask to control the subpasses to be enabled.  With
+            ``RefPruneSubpasses.WORKLIST``, the subpasses are run by a
+            worklist pruner that indexes the refops once instead of
+            rescanning the function until no more pruning happens, which is
+            much faster on functions with many refops.
         subgraph_limit : int
             Limit the fanout pruners to working on a subgraph no bigger than
             this number of basic-blocks to avoid spending too much time in very
             large graphs. Default is 1000. Subject to change in future
             versions.
+
+        The pruning done by the pass is counted both in the process-wide
+        statistics of :func:`dump_refprune_stats` and in those of this pass
+        manager, see :meth:`get_refprune_stats`.
         """
         iflags = RefPruneSubpasses(subpasses_flags)
-        ffi.lib.LLVMPY_AddRefPrunePass(self, iflags, subgraph_limit)
+        if self._refprune_stats is None:
+            self._refprune_stats = _RefPruneCounters()
+        ffi.lib.LLVMPY_AddRefPrunePass(self, iflags, subgraph_limit,
+                                       self._refprune_stats)
+
+    def get_refprune_stats(self, reset=False):
+        """Return a :class:`PruneStats` of the pruning done by the refprune
+        passes of this pass manager, across all its runs since it was created
+        or last reset.  If *reset* is true, the statistics are reset to zero
+        as they are read.
+        """
+        if self._refprune_stats is None:
+            return PruneStats(0, 0, 0, 0)
+        return self._refprune_stats.get(reset)
 
 
 class ModulePassManager(PassManager):
@@ -678,6 +837,7 @@ class ModulePassManager(PassManager):
         remarks_filter : str; optional
             The filter that should be applied to the remarks output.
         """
+        module.materialize_all()
         if remarks_file is None:
             return ffi.lib.LLVMPY_RunPassManager(self, module)
         else:
@@ -913,4 +1073,43 @@ ffi.lib.LLVMPY_AddTypeBasedAliasAnalysisPass.argtypes = [ffi.LLVMPassManagerRef]
 ffi.lib.LLVMPY_AddBasicAliasAnalysisPass.argtypes = [ffi.LLVMPassManagerRef]
 
 ffi.lib.LLVMPY_AddRefPrunePass.argtypes = [ffi.LLVMPassManagerRef, c_int,
-                                           c_size_t]
+                                           c_size_t, ffi.LLVMRefPruneStatsRef]
+
+ffi.lib.LLVMPY_CreateRefPruneStats.restype = ffi.LLVMRefPruneStatsRef
+
+ffi.lib.LLVMPY_DisposeRefPruneStats.argtypes = [ffi.LLVMRefPruneStatsRef]
+
+ffi.lib.LLVMPY_GetRefPruneStats.argtypes = [ffi.LLVMRefPruneStatsRef,
+                                            POINTER(_c_PruneStats), c_bool]
+
+ffi.lib.LLVMPY_CreateRemarkCollector.argtypes = [ffi.LLVMContextRef,
+                                                 c_char_p,
+                                                 c_int,
+                                                 POINTER(c_char_p)]
+ffi.lib.LLVMPY_CreateRemarkCollector.restype = ffi.LLVMRemarkCollectorRef
+
+ffi.lib.LLVMPY_RemarkCollectorStop.argtypes = [ffi.LLVMRemarkCollectorRef]
+ffi.lib.LLVMPY_RemarkCollectorStop.restype = c_bool
+
+ffi.lib.LLVMPY_DisposeRemarkCollector.argtypes = [ffi.LLVMRemarkCollectorRef]
+
+ffi.lib.LLVMPY_RemarkCollectorSize.argtypes = [ffi.LLVMRemarkCollectorRef]
+ffi.lib.LLVMPY_RemarkCollectorSize.restype = c_size_t
+
+ffi.lib.LLVMPY_RemarkCollectorGet.argtypes = [ffi.LLVMRemarkCollectorRef,
+                                              c_size_t,
+                                              POINTER(c_int),
+                                              POINTER(c_char_p),
+                                              POINTER(c_char_p),
+                                              POINTER(c_char_p),
+                                              POINTER(c_char_p),
+                                              POINTER(c_uint),
+                                              POINTER(c_uint),
+                                              POINTER(c_char_p),
+                                              POINTER(c_size_t)]
+
+ffi.lib.LLVMPY_RemarkCollectorGetArg.argtypes = [ffi.LLVMRemarkCollectorRef,
+                                                 c_size_t,
+                                                 c_size_t,
+                                                 POINTER(c_char_p),
+                                                 POINTER(c_char_p)]
@@ -0,0 +1,200 @@
+from collections import namedtuple
+from ctypes import (POINTER, byref, c_bool, c_char_p, c_int64, c_uint32,
+                    c_uint64, c_size_t)
+
+from llvmlite.binding import ffi
+from llvmlite.binding.common import _decode_string, _encode_string
+
+
+ProfiledFunction = namedtuple('ProfiledFunction',
+                              'name counters num_counters')
+
+
+def instrument_module(module, atomic=False):
+    """
+    Instrument the functions of *module* for profile-guided optimization,
+    with counters incremented atomically if *atomic* is true.  Return a
+    ProfileInstrumentation locating the counters of the module once it is
+    compiled.
+    """
+    with ffi.OutputString() as outerr:
+        ptr = ffi.lib.LLVMPY_InstrumentModuleForProfiling(module, atomic,
+                                                          outerr)
+        if not ptr:
+            raise RuntimeError(str(outerr))
+    return ProfileInstrumentation(ptr)
+
+
+def create_profile_data():
+    """
+    Create an empty ProfileData.
+    """
+    return ProfileData(ffi.lib.LLVMPY_CreateProfileData())
+
+
+def load_profile_data(path):
+    """
+    Create a ProfileData with the profile in the file at *path*.
+    """
+    profile = create_profile_data()
+    profile.merge_file(path)
+    return profile
+
+
+class ProfileInstrumentation(ffi.ObjectRef):
+    """
+    The counters of the functions of a module instrumented by
+    instrument_module().
+    """
+
+    @property
+    def functions(self):
+        """
+        A list of ProfiledFunction, one per instrumented function.
+        """
+        name = c_char_p()
+        counters = c_char_p()
+        num_counters = c_uint32()
+        functions = []
+        for i in range(ffi.lib.LLVMPY_ProfileInstrumentationSize(self)):
+            ffi.lib.LLVMPY_ProfileInstrumentationGet(
+                self, i, byref(name), byref(counters), byref(num_counters))
+            functions.append(ProfiledFunction(_decode_string(name.value),
+                                              _decode_string(counters.value),
+                                              num_counters.value))
+        return functions
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeProfileInstrumentation(self)
+
+
+class ProfileData(ffi.ObjectRef):
+    """
+    IR-level profile data, accumulated from the counters of instrumented
+    code and from profile files, to optimize modules with.
+    """
+
+    def add_counters(self, instrumentation, engine, weight=1, reset=True):
+        """
+        Add the counters of *instrumentation*, the ProfileInstrumentation of
+        a module compiled by *engine*, to this profile with *weight*, and
+        zero them if *reset* is true, so that the next call only adds the
+        counts since.
+        """
+        functions = instrumentation.functions
+        addresses = (c_uint64 * len(functions))(
+            *[engine.get_global_value_address(func.counters)
+              for func in functions])
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_ProfileDataAddCounters(
+                    self, instrumentation, addresses, weight, reset, outerr):
+                raise RuntimeError(str(outerr))
+
+    def merge(self, other, weight=1):
+        """
+        Add the records of the ProfileData *other* with *weight*.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_ProfileDataMerge(self, other, weight, outerr):
+                raise RuntimeError(str(outerr))
+
+    def merge_file(self, path, weight=1):
+        """
+        Add the records of the profile file at *path* with *weight*.  The
+        file may be raw, as written by programs instrumented for PGO, or
+        indexed, as written by write() and ``llvm-profdata merge``.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_ProfileDataMergeFile(
+                    self, _encode_string(path), weight, outerr):
+                raise RuntimeError(str(outerr))
+
+    def write(self, path):
+        """
+        Write this profile to *path* as an indexed profile, which clang's
+        ``-fprofile-use`` can read.
+        """
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_ProfileDataWrite(self, _encode_string(path),
+                                               outerr):
+                raise RuntimeError(str(outerr))
+
+    def get_counts(self, name):
+        """
+        Return the list of counters of the function with the PGO name
+        *name*, or None if this profile has no record of it.
+        """
+        name = _encode_string(name)
+        count = ffi.lib.LLVMPY_ProfileDataGetCounts(self, name, None, 0)
+        if count < 0:
+            return None
+        counts = (c_uint64 * count)()
+        ffi.lib.LLVMPY_ProfileDataGetCounts(self, name, counts, count)
+        return list(counts)
+
+    def apply(self, module):
+        """
+        Annotate *module*, which must be as it was when instrumented, with
+        this profile, to guide its optimization.  Return a list of warnings,
+        such as for functions whose control flow changed since.
+        """
+        with ffi.OutputString() as outwarn, ffi.OutputString() as outerr:
+            failed = ffi.lib.LLVMPY_ProfileDataApply(self, module, outwarn,
+                                                     outerr)
+            if failed:
+                raise RuntimeError(str(outerr))
+            return str(outwarn).splitlines()
+
+    def _dispose(self):
+        self._capi.LLVMPY_DisposeProfileData(self)
+
+
+# ============================================================================
+# FFI
+
+ffi.lib.LLVMPY_InstrumentModuleForProfiling.argtypes = [
+    ffi.LLVMModuleRef, c_bool, POINTER(c_char_p)]
+ffi.lib.LLVMPY_InstrumentModuleForProfiling.restype = \
+    ffi.LLVMProfileInstrumentationRef
+
+ffi.lib.LLVMPY_DisposeProfileInstrumentation.argtypes = [
+    ffi.LLVMProfileInstrumentationRef]
+
+ffi.lib.LLVMPY_ProfileInstrumentationSize.argtypes = [
+    ffi.LLVMProfileInstrumentationRef]
+ffi.lib.LLVMPY_ProfileInstrumentationSize.restype = c_size_t
+
+ffi.lib.LLVMPY_ProfileInstrumentationGet.argtypes = [
+    ffi.LLVMProfileInstrumentationRef, c_size_t, POINTER(c_char_p),
+    POINTER(c_char_p), POINTER(c_uint32)]
+
+ffi.lib.LLVMPY_CreateProfileData.restype = ffi.LLVMProfileDataRef
+
+ffi.lib.LLVMPY_DisposeProfileData.argtypes = [ffi.LLVMProfileDataRef]
+
+ffi.lib.LLVMPY_ProfileDataAddCounters.argtypes = [
+    ffi.LLVMProfileDataRef, ffi.LLVMProfileInstrumentationRef,
+    POINTER(c_uint64), c_uint64, c_bool, POINTER(c_char_p)]
+ffi.lib.LLVMPY_ProfileDataAddCounters.restype = c_bool
+
+ffi.lib.LLVMPY_ProfileDataMerge.argtypes = [
+    ffi.LLVMProfileDataRef, ffi.LLVMProfileDataRef, c_uint64,
+    POINTER(c_char_p)]
+ffi.lib.LLVMPY_ProfileDataMerge.restype = c_bool
+
+ffi.lib.LLVMPY_ProfileDataMergeFile.argtypes = [
+    ffi.LLVMProfileDataRef, c_char_p, c_uint64, POINTER(c_char_p)]
+ffi.lib.LLVMPY_ProfileDataMergeFile.restype = c_bool
+
+ffi.lib.LLVMPY_ProfileDataWrite.argtypes = [
+    ffi.LLVMProfileDataRef, c_char_p, POINTER(c_char_p)]
+ffi.lib.LLVMPY_ProfileDataWrite.restype = c_bool
+
+ffi.lib.LLVMPY_ProfileDataGetCounts.argtypes = [
+    ffi.LLVMProfileDataRef, c_char_p, POINTER(c_uint64), c_size_t]
+ffi.lib.LLVMPY_ProfileDataGetCounts.restype = c_int64
+
+ffi.lib.LLVMPY_ProfileDataApply.argtypes = [
+    ffi.LLVMProfileDataRef, ffi.LLVMModuleRef, POINTER(c_char_p),
+    POINTER(c_char_p)]
+ffi.lib.LLVMPY_ProfileDataApply.restype = c_bool
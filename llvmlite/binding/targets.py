@@ -1,9 +1,12 @@
+from collections import namedtuple
+import functools
 import os
-from ctypes import (POINTER, c_char_p, c_longlong, c_int, c_size_t,
-                    c_void_p, string_at)
+from ctypes import (POINTER, c_char_p, c_longlong, c_int, c_uint, c_uint64,
+                    c_size_t, c_void_p, cast)
 
 from llvmlite.binding import ffi
 from llvmlite.binding.common import _decode_string, _encode_string
+from llvmlite.binding.memorybuffer import MemoryBuffer
 
 
 def get_process_triple():
@@ -106,18 +109,38 @@ def get_object_format(triple=None):
     return _object_formats[res]
 
 
-def create_target_data(layout):
+StructLayout = namedtuple('StructLayout', ('size alignment offsets'))
+
+
+def create_target_data(layout, shared=False):
     """
     Create a TargetData instance for the given *layout* string.
+
+    If *shared* is true, return the instance shared by all the callers
+    asking for *layout* from the current thread, which is only parsed once.
     """
+    if shared:
+        td = TargetData(ffi.lib.LLVMPY_GetSharedTargetData(
+            _encode_string(layout)))
+        td._shared = True
+        return td
     return TargetData(ffi.lib.LLVMPY_CreateTargetData(_encode_string(layout)))
 
 
+def clear_shared_targets():
+    """
+    Drop the shared target machines and target data, which are destroyed
+    once no longer in use.
+    """
+    ffi.lib.LLVMPY_ClearSharedTargets()
+
+
 class TargetData(ffi.ObjectRef):
     """
     A TargetData provides structured access to a data layout.
     Use :func:`create_target_data` to create instances.
     """
+    _shared = False
 
     def __str__(self):
         if self._closed:
@@ -127,7 +150,10 @@ class TargetData(ffi.ObjectRef):
             return str(out)
 
     def _dispose(self):
-        self._capi.LLVMPY_DisposeTargetData(self)
+        if self._shared:
+            self._capi.LLVMPY_ReleaseSharedTargetData(self)
+        else:
+            self._capi.LLVMPY_DisposeTargetData(self)
 
     def get_abi_size(self, ty):
         """
@@ -147,6 +173,52 @@ class TargetData(ffi.ObjectRef):
                              "type?".format(position, str(ty)))
         return offset
 
+    def get_struct_layout(self, ty):
+        """
+        Get the :class:`StructLayout` of the struct type *ty*.
+        """
+        return self.get_struct_layouts([ty])[0]
+
+    def get_struct_layouts(self, types):
+        """
+        Get the :class:`StructLayout` of each of the struct *types*, which
+        are computed in a single call.
+        """
+        # Types are unique in their context, so are identified by address
+        keys = [cast(ty._ptr, c_void_p).value for ty in types]
+        unique = {}
+        for key, ty in zip(keys, types):
+            unique.setdefault(key, ty)
+        layouts = dict(zip(unique,
+                           self._compute_struct_layouts(list(unique.values()))))
+        return [layouts[key] for key in keys]
+
+    def _compute_struct_layouts(self, types):
+        n = len(types)
+        arr = (ffi.LLVMTypeRef * n)(*[ty._ptr for ty in types])
+        sizes = (c_uint64 * n)()
+        alignments = (c_uint64 * n)()
+        num_elements = (c_size_t * n)()
+        max_offsets = 8 * n
+        while True:
+            offsets = (c_uint64 * max_offsets)()
+            num_offsets = ffi.lib.LLVMPY_GetStructLayouts(
+                self, arr, n, sizes, alignments, num_elements, offsets,
+                max_offsets)
+            if num_offsets <= max_offsets:
+                break
+            max_offsets = num_offsets
+        layouts = []
+        start = 0
+        for i, ty in enumerate(types):
+            if sizes[i] == 2 ** 64 - 1:
+                raise ValueError("Not a sized struct type: %s" % (ty,))
+            end = start + num_elements[i]
+            layouts.append(StructLayout(sizes[i], alignments[i],
+                                        tuple(offsets[start:end])))
+            start = end
+        return layouts
+
     def get_pointee_abi_size(self, ty):
         """
         Get ABI size of pointee type of LLVM pointer type *ty*.
@@ -218,7 +290,8 @@ class Target(ffi.ObjectRef):
 
     def create_target_machine(self, cpu='', features='',
                               opt=2, reloc='default', codemodel='jitdefault',
-                              printmc=False, jit=False, abiname=''):
+                              printmc=False, jit=False, abiname='',
+                              shared=False):
         """
         Create a new TargetMachine for this target and the given options.
 
@@ -233,6 +306,10 @@ class Target(ffi.ObjectRef):
 
         The `abiname` option specifies the ABI. RISC-V targets with hard-float
         needs to pass the ABI name to LLVM.
+
+        The `shared` option returns the TargetMachine shared by all the
+        callers asking for the same target and options from the current
+        thread, which is only created once.
         """
         assert 0 <= opt <= 3
         assert reloc in RELOC
@@ -243,32 +320,58 @@ class Target(ffi.ObjectRef):
         # Note we still want to produce regular COFF files in AOT mode.
         if os.name == 'nt' and codemodel == 'jitdefault':
             triple += '-elf'
-        tm = ffi.lib.LLVMPY_CreateTargetMachine(self,
-                                                _encode_string(triple),
-                                                _encode_string(cpu),
-                                                _encode_string(features),
-                                                opt,
-                                                _encode_string(reloc),
-                                                _encode_string(codemodel),
-                                                int(printmc),
-                                                int(jit),
-                                                _encode_string(abiname),
-                                                )
+        if shared:
+            create = ffi.lib.LLVMPY_GetSharedTargetMachine
+        else:
+            create = ffi.lib.LLVMPY_CreateTargetMachine
+        tm = create(self,
+                    _encode_string(triple),
+                    _encode_string(cpu),
+                    _encode_string(features),
+                    opt,
+                    _encode_string(reloc),
+                    _encode_string(codemodel),
+                    int(printmc),
+                    int(jit),
+                    _encode_string(abiname),
+                    )
         if tm:
-            return TargetMachine(tm)
+            tm = TargetMachine(tm)
         else:
             raise RuntimeError("Cannot create target machine")
+        if shared:
+            tm._shared = True
+            tm._template = functools.partial(
+                self.create_target_machine, cpu=cpu, features=features,
+                opt=opt, reloc=reloc, codemodel=codemodel, printmc=printmc,
+                jit=jit, abiname=abiname)
+        return tm
 
 
 class TargetMachine(ffi.ObjectRef):
+    _shared = False
 
     def _dispose(self):
-        self._capi.LLVMPY_DisposeTargetMachine(self)
+        if self._shared:
+            self._capi.LLVMPY_ReleaseSharedTargetMachine(self)
+        else:
+            self._capi.LLVMPY_DisposeTargetMachine(self)
+
+    def _unshared(self):
+        """
+        Return this target machine, or a new one like it if it is shared.
+        """
+        return self._template() if self._shared else self
 
-    def add_analysis_passes(self, pm):
+    def add_analysis_passes(self, pm, vector_library=None):
         """
         Register analysis passes for this target machine with a pass manager.
+        If *vector_library* is given, the name of one of
+        get_vector_libraries(), the vectorizers may call its functions.
         """
+        if vector_library is not None:
+            ffi.lib.LLVMPY_AddTargetLibraryInfo(
+                self, pm, _get_vector_library_id(vector_library))
         ffi.lib.LLVMPY_AddAnalysisPasses(self, pm)
 
     def set_asm_verbosity(self, verbose):
@@ -276,6 +379,8 @@ class TargetMachine(ffi.ObjectRef):
         Set whether this target machine will emit assembly with human-readable
         comments describing control flow, debug information, and so on.
         """
+        if self._shared:
+            raise ValueError("shared target machines can't be modified")
         ffi.lib.LLVMPY_SetTargetMachineAsmVerbosity(self, verbose)
 
     def emit_object(self, module):
@@ -285,6 +390,13 @@ class TargetMachine(ffi.ObjectRef):
         """
         return self._emit_to_memory(module, use_object=True)
 
+    def emit_object_buffer(self, module):
+        """
+        Like :meth:`emit_object`, but return the object code as a
+        :class:`MemoryBuffer`, which doesn't copy it.
+        """
+        return self._emit_to_buffer(module, use_object=True)
+
     def emit_assembly(self, module):
         """
         Return the raw assembler of the module, as a string.
@@ -293,6 +405,34 @@ class TargetMachine(ffi.ObjectRef):
         """
         return _decode_string(self._emit_to_memory(module, use_object=False))
 
+    def emit_objects(self, module, num_parts):
+        """
+        Split the module into *num_parts* partitions and compile them in
+        parallel, one thread per partition.  Returns a list of *num_parts*
+        byte strings of object code, which must all be linked together:
+        the partitions refer to each other's symbols, including formerly
+        internal ones that are made hidden.  The module is not modified.
+        """
+        return self._emit_split(module, num_parts, use_object=True)
+
+    def _emit_split(self, module, num_parts, use_object=True):
+        if num_parts < 1:
+            raise ValueError("num_parts must be at least 1")
+        module.materialize_all()
+        mbs = (ffi.LLVMMemoryBufferRef * num_parts)()
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_TargetMachineEmitSplit(self, module,
+                                                     int(use_object),
+                                                     num_parts, mbs, outerr):
+                raise RuntimeError(str(outerr))
+
+        bufs = [MemoryBuffer(mb) for mb in mbs]
+        try:
+            return [bytes(buf) for buf in bufs]
+        finally:
+            for buf in bufs:
+                buf.close()
+
     def _emit_to_memory(self, module, use_object=False):
         """Returns bytes of object code of the module.
 
@@ -301,19 +441,18 @@ class TargetMachine(ffi.ObjectRef):
         use_object : bool
             Emit object code or (if False) emit assembly code.
         """
+        with self._emit_to_buffer(module, use_object) as buf:
+            return bytes(buf)
+
+    def _emit_to_buffer(self, module, use_object=False):
+        module.materialize_all()
         with ffi.OutputString() as outerr:
             mb = ffi.lib.LLVMPY_TargetMachineEmitToMemory(self, module,
                                                           int(use_object),
                                                           outerr)
             if not mb:
                 raise RuntimeError(str(outerr))
-
-        bufptr = ffi.lib.LLVMPY_GetBufferStart(mb)
-        bufsz = ffi.lib.LLVMPY_GetBufferSize(mb)
-        try:
-            return string_at(bufptr, bufsz)
-        finally:
-            ffi.lib.LLVMPY_DisposeMemoryBuffer(mb)
+        return MemoryBuffer(mb)
 
     @property
     def target_data(self):
@@ -326,6 +465,71 @@ class TargetMachine(ffi.ObjectRef):
             return str(out)
 
 
+def multiversion_functions(module, functions, variants):
+    """
+    Compile the *functions* of *module*, a sequence of names, for each of
+    *variants*, a sequence of ``(cpu, features)`` pairs in order of
+    preference, and dispatch calls to the first variant the host supports
+    when the program is loaded, or else to the original function.
+    Only x86 ELF targets are supported, with LLVM 14.
+    """
+    module.materialize_all()
+    functions = [_encode_string(name) for name in functions]
+    cpus = [_encode_string(cpu) for cpu, _ in variants]
+    features = [_encode_string(feats) for _, feats in variants]
+    with ffi.OutputString() as outerr:
+        if ffi.lib.LLVMPY_MultiversionFunctions(
+                module, (c_char_p * len(functions))(*functions),
+                len(functions), (c_char_p * len(cpus))(*cpus),
+                (c_char_p * len(features))(*features), len(variants),
+                outerr):
+            raise RuntimeError(str(outerr))
+
+
+VectorLibrary = namedtuple('VectorLibrary', 'name supported loaded')
+
+
+def get_vector_libraries(triple=None):
+    """
+    Return a list of VectorLibrary for the vector math libraries whose
+    functions the vectorizers can call, with whether the library has
+    functions for *triple*, or the process triple, and whether it is
+    loaded in the process.
+    """
+    if triple is None:
+        triple = get_process_triple()
+    return [VectorLibrary(name, supported, loaded)
+            for name, _, supported, loaded in _get_vector_libraries(triple)]
+
+
+def _get_vector_libraries(triple):
+    triple = _encode_string(triple)
+    count = ffi.lib.LLVMPY_GetVectorLibraries(triple, None, None, None, None,
+                                              0)
+    names = (c_char_p * count)()
+    ids = (c_int * count)()
+    supported = (c_int * count)()
+    loaded = (c_int * count)()
+    ffi.lib.LLVMPY_GetVectorLibraries(triple, names, ids, supported, loaded,
+                                      count)
+    return [(_decode_string(names[i]), ids[i], bool(supported[i]),
+             bool(loaded[i]))
+            for i in range(count)]
+
+
+def _get_vector_library_id(name):
+    """
+    Return the TargetLibraryInfoImpl::VectorLibrary value of the vector
+    library *name*.
+    """
+    ids = {lib[0]: lib[1] for lib in _get_vector_libraries('')}
+    try:
+        return ids[name]
+    except KeyError:
+        raise ValueError("unknown vector library %r, expected one of %s"
+                         % (name, ", ".join(sorted(ids))))
+
+
 def has_svml():
     """
     Returns True if SVML was enabled at FFI support compile time.
@@ -354,6 +558,34 @@ ffi.lib.LLVMPY_GetTripleObjectFormat.restype = c_int
 ffi.lib.LLVMPY_CreateTargetData.argtypes = [c_char_p]
 ffi.lib.LLVMPY_CreateTargetData.restype = ffi.LLVMTargetDataRef
 
+ffi.lib.LLVMPY_GetStructLayouts.argtypes = [
+    ffi.LLVMTargetDataRef,
+    POINTER(ffi.LLVMTypeRef),
+    c_size_t,
+    POINTER(c_uint64),
+    POINTER(c_uint64),
+    POINTER(c_size_t),
+    POINTER(c_uint64),
+    c_size_t,
+]
+ffi.lib.LLVMPY_GetStructLayouts.restype = c_size_t
+
+ffi.lib.LLVMPY_MultiversionFunctions.argtypes = [
+    ffi.LLVMModuleRef,
+    POINTER(c_char_p),
+    c_size_t,
+    POINTER(c_char_p),
+    POINTER(c_char_p),
+    c_size_t,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_MultiversionFunctions.restype = c_int
+
+ffi.lib.LLVMPY_GetSharedTargetData.argtypes = [c_char_p]
+ffi.lib.LLVMPY_GetSharedTargetData.restype = ffi.LLVMTargetDataRef
+
+ffi.lib.LLVMPY_ReleaseSharedTargetData.argtypes = [ffi.LLVMTargetDataRef]
+
 ffi.lib.LLVMPY_CopyStringRepOfTargetData.argtypes = [
     ffi.LLVMTargetDataRef,
     POINTER(c_char_p),
@@ -412,6 +644,13 @@ ffi.lib.LLVMPY_CreateTargetMachine.argtypes = [
 ]
 ffi.lib.LLVMPY_CreateTargetMachine.restype = ffi.LLVMTargetMachineRef
 
+ffi.lib.LLVMPY_GetSharedTargetMachine.argtypes = \
+    ffi.lib.LLVMPY_CreateTargetMachine.argtypes
+ffi.lib.LLVMPY_GetSharedTargetMachine.restype = ffi.LLVMTargetMachineRef
+
+ffi.lib.LLVMPY_ReleaseSharedTargetMachine.argtypes = [
+    ffi.LLVMTargetMachineRef]
+
 ffi.lib.LLVMPY_DisposeTargetMachine.argtypes = [ffi.LLVMTargetMachineRef]
 
 ffi.lib.LLVMPY_GetTargetMachineTriple.argtypes = [ffi.LLVMTargetMachineRef,
@@ -425,6 +664,22 @@ ffi.lib.LLVMPY_AddAnalysisPasses.argtypes = [
     ffi.LLVMPassManagerRef,
 ]
 
+ffi.lib.LLVMPY_AddTargetLibraryInfo.argtypes = [
+    ffi.LLVMTargetMachineRef,
+    ffi.LLVMPassManagerRef,
+    c_int,
+]
+
+ffi.lib.LLVMPY_GetVectorLibraries.argtypes = [
+    c_char_p,
+    POINTER(c_char_p),
+    POINTER(c_int),
+    POINTER(c_int),
+    POINTER(c_int),
+    c_size_t,
+]
+ffi.lib.LLVMPY_GetVectorLibraries.restype = c_size_t
+
 ffi.lib.LLVMPY_TargetMachineEmitToMemory.argtypes = [
     ffi.LLVMTargetMachineRef,
     ffi.LLVMModuleRef,
@@ -433,13 +688,15 @@ ffi.lib.LLVMPY_TargetMachineEmitToMemory.argtypes = [
 ]
 ffi.lib.LLVMPY_TargetMachineEmitToMemory.restype = ffi.LLVMMemoryBufferRef
 
-ffi.lib.LLVMPY_GetBufferStart.argtypes = [ffi.LLVMMemoryBufferRef]
-ffi.lib.LLVMPY_GetBufferStart.restype = c_void_p
-
-ffi.lib.LLVMPY_GetBufferSize.argtypes = [ffi.LLVMMemoryBufferRef]
-ffi.lib.LLVMPY_GetBufferSize.restype = c_size_t
-
-ffi.lib.LLVMPY_DisposeMemoryBuffer.argtypes = [ffi.LLVMMemoryBufferRef]
+ffi.lib.LLVMPY_TargetMachineEmitSplit.argtypes = [
+    ffi.LLVMTargetMachineRef,
+    ffi.LLVMModuleRef,
+    c_int,
+    c_uint,
+    POINTER(ffi.LLVMMemoryBufferRef),
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_TargetMachineEmitSplit.restype = c_int
 
 ffi.lib.LLVMPY_CreateTargetMachineData.argtypes = [
     ffi.LLVMTargetMachineRef,
@@ -1,5 +1,9 @@
-from ctypes import POINTER, c_char_p, c_int, c_size_t, c_uint, c_bool, c_void_p
+from ctypes import (POINTER, CFUNCTYPE, c_char_p, c_int, c_size_t, c_uint,
+                    c_bool, c_void_p, create_string_buffer, py_object,
+                    string_at)
+import codecs
 import enum
+import io
 
 from llvmlite.binding import ffi
 from llvmlite.binding.common import _decode_string, _encode_string
@@ -77,6 +81,8 @@ class TypeRef(ffi.ObjectRef):
 class ValueRef(ffi.ObjectRef):
     """A weak reference to a LLVM value.
     """
+    # The opcode name of an instruction, when obtained along with it
+    _opcode = None
 
     def __init__(self, ptr, kind, parents):
         self._kind = kind
@@ -88,6 +94,14 @@ class ValueRef(ffi.ObjectRef):
             ffi.lib.LLVMPY_PrintValueToString(self, outstr)
             return str(outstr)
 
+    def write_ir(self, file):
+        """
+        Write the IR of this value, as ``str()`` returns it, to *file*; see
+        :meth:`ModuleRef.write_ir`.
+        """
+        _write_ir(self, file, ffi.lib.LLVMPY_PrintValueToFD,
+                  ffi.lib.LLVMPY_PrintValueToCallback)
+
     @property
     def module(self):
         """
@@ -214,6 +228,29 @@ class ValueRef(ffi.ObjectRef):
                              % (self._kind,))
         return ffi.lib.LLVMPY_IsDeclaration(self)
 
+    @property
+    def is_materializable(self):
+        """
+        Whether this global value, from a module parsed lazily, has a body
+        that hasn't been deserialized yet; see :meth:`materialize`.
+        """
+        if not (self.is_global or self.is_function):
+            raise ValueError('expected global or function value, got %s'
+                             % (self._kind,))
+        return ffi.lib.LLVMPY_IsMaterializable(self)
+
+    def materialize(self):
+        """
+        Deserialize the body of this global value if it is materializable.
+        RuntimeError is raised on error.
+        """
+        if not (self.is_global or self.is_function):
+            raise ValueError('expected global or function value, got %s'
+                             % (self._kind,))
+        with ffi.OutputString() as outerr:
+            if ffi.lib.LLVMPY_MaterializeGlobal(self, outerr):
+                raise RuntimeError(str(outerr))
+
     @property
     def attributes(self):
         """
@@ -297,8 +334,60 @@ class ValueRef(ffi.ObjectRef):
         if not self.is_instruction:
             raise ValueError('expected instruction value, got %s'
                              % (self._kind,))
+        if self._opcode is not None:
+            return self._opcode
         return ffi.ret_string(ffi.lib.LLVMPY_GetOpcodeName(self))
 
+    def get_blocks(self):
+        """
+        Return a list of this function's blocks, as :attr:`blocks` yields
+        them, obtained in a single call.
+        """
+        if not self.is_function:
+            raise ValueError('expected function value, got %s' % (self._kind,))
+        n = ffi.lib.LLVMPY_CountBlocks(self)
+        ptrs = (ffi.LLVMValueRef * n)()
+        ffi.lib.LLVMPY_GetBlocks(self, ptrs)
+        parents = self._parents.copy()
+        parents.update(function=self)
+        return [ValueRef(ptr, 'block', parents) for ptr in ptrs]
+
+    def get_instructions(self):
+        """
+        Return a list of the instructions of this function or block, in
+        order, obtained in a single call along with their opcodes.
+        """
+        if self.is_function:
+            blocks = self.get_blocks()
+        elif self.is_block:
+            blocks = [self]
+        else:
+            raise ValueError('expected function or block value, got %s'
+                             % (self._kind,))
+        n = ffi.lib.LLVMPY_CountInstructions(self)
+        ptrs = (ffi.LLVMValueRef * n)()
+        opcodes = (c_uint * n)()
+        block_indices = (c_size_t * n)()
+        ffi.lib.LLVMPY_GetInstructions(self, ptrs, opcodes, block_indices)
+        block_parents = []
+        for block in blocks:
+            parents = block._parents.copy()
+            parents.update(block=block)
+            block_parents.append(parents)
+        insts = []
+        for ptr, opcode, index in zip(ptrs, opcodes, block_indices):
+            inst = ValueRef(ptr, 'instruction', block_parents[index])
+            inst._opcode = _opcode_name(opcode)
+            insts.append(inst)
+        return insts
+
+    def get_operands(self):
+        """
+        Return a list of this instruction's operands, as :attr:`operands`
+        yields them, obtained in a single call.
+        """
+        return get_operand_lists([self])[0]
+
 
 class _ValueIterator(ffi.ObjectRef):
 
@@ -403,6 +492,122 @@ class _OperandsIterator(_ValueIterator):
         return ffi.lib.LLVMPY_OperandsIterNext(self)
 
 
+class _IRWriter:
+    """
+    Forwards the chunks of printed IR to a file object, decoding them for a
+    text file.
+    """
+
+    def __init__(self, file):
+        self.file = file
+        if isinstance(file, io.TextIOBase):
+            self.decoder = codecs.getincrementaldecoder('utf-8')()
+        else:
+            self.decoder = None
+        self.error = None
+
+    def write(self, data, size):
+        try:
+            chunk = string_at(data, size)
+            if self.decoder is not None:
+                chunk = self.decoder.decode(chunk)
+            self.file.write(chunk)
+            return 0
+        except BaseException as e:
+            self.error = e
+            return 1
+
+
+def _value_array(values):
+    return (ffi.LLVMValueRef * len(values))(*[v._ptr for v in values])
+
+
+def get_operand_lists(instructions):
+    """
+    Return the list of operands of each of *instructions*, a sequence of
+    instruction :class:`ValueRef`, obtained in a single call.
+    """
+    for inst in instructions:
+        if not inst.is_instruction:
+            raise ValueError('expected instruction value, got %s'
+                             % (inst._kind,))
+    insts = _value_array(instructions)
+    n = len(insts)
+    ptrs = (ffi.LLVMValueRef * ffi.lib.LLVMPY_CountOperands(insts, n))()
+    offsets = (c_size_t * (n + 1))()
+    ffi.lib.LLVMPY_GetOperands(insts, n, ptrs, offsets)
+    lists = []
+    for i, inst in enumerate(instructions):
+        parents = inst._parents.copy()
+        parents.update(instruction=inst)
+        lists.append([ValueRef(ptr, 'operand', parents)
+                      for ptr in ptrs[offsets[i]:offsets[i + 1]]])
+    return lists
+
+
+def get_value_names(values):
+    """
+    Return the names of *values*, a sequence of :class:`ValueRef`, obtained
+    in a single call.
+    """
+    arr = _value_array(values)
+    n = len(arr)
+    lengths = (c_size_t * n)()
+    size = ffi.lib.LLVMPY_GetValueNames(arr, n, None, lengths)
+    buf = create_string_buffer(size)
+    ffi.lib.LLVMPY_GetValueNames(arr, n, buf, lengths)
+    data = buf.raw
+    names = []
+    start = 0
+    for length in lengths:
+        names.append(_decode_string(data[start:start + length]))
+        start += length
+    return names
+
+
+# Opcode names by LLVM opcode number
+_opcode_names = {}
+
+
+def _opcode_name(opcode):
+    name = _opcode_names.get(opcode)
+    if name is None:
+        name = _decode_string(ffi.lib.LLVMPY_GetOpcodeNameOf(opcode))
+        _opcode_names[opcode] = name
+    return name
+
+
+def _write_ir(obj, file, print_to_fd, print_to_callback):
+    """
+    Print *obj* to *file*: an integer file descriptor, a file object with a
+    file descriptor or any other object with a ``write`` method.
+    """
+    if isinstance(file, int):
+        fd = file
+    else:
+        try:
+            fd = file.fileno()
+        except (AttributeError, OSError, ValueError):
+            fd = None
+        else:
+            # Don't let buffered data end up after the IR
+            file.flush()
+    if fd is not None:
+        with ffi.OutputString() as outerr:
+            if print_to_fd(obj, fd, outerr):
+                raise OSError(str(outerr))
+        return
+    writer = _IRWriter(file)
+    if print_to_callback(obj, _write_ir_hook, writer):
+        raise writer.error
+
+
+_WriteIRFunc = CFUNCTYPE(c_int, py_object, c_void_p, c_size_t)
+
+# Created at the top-level like the object cache hooks, see executionengine.
+_write_ir_hook = _WriteIRFunc(_IRWriter.write)
+
+
 # FFI
 
 ffi.lib.LLVMPY_PrintValueToString.argtypes = [
@@ -410,6 +615,20 @@ ffi.lib.LLVMPY_PrintValueToString.argtypes = [
     POINTER(c_char_p)
 ]
 
+ffi.lib.LLVMPY_PrintValueToFD.argtypes = [
+    ffi.LLVMValueRef,
+    c_int,
+    POINTER(c_char_p),
+]
+ffi.lib.LLVMPY_PrintValueToFD.restype = c_int
+
+ffi.lib.LLVMPY_PrintValueToCallback.argtypes = [
+    ffi.LLVMValueRef,
+    _WriteIRFunc,
+    py_object,
+]
+ffi.lib.LLVMPY_PrintValueToCallback.restype = c_int
+
 ffi.lib.LLVMPY_GetGlobalParent.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_GetGlobalParent.restype = ffi.LLVMModuleRef
 
@@ -458,6 +677,13 @@ ffi.lib.LLVMPY_AddFunctionAttr.argtypes = [ffi.LLVMValueRef, c_uint]
 ffi.lib.LLVMPY_IsDeclaration.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_IsDeclaration.restype = c_int
 
+ffi.lib.LLVMPY_IsMaterializable.argtypes = [ffi.LLVMValueRef]
+ffi.lib.LLVMPY_IsMaterializable.restype = c_bool
+
+ffi.lib.LLVMPY_MaterializeGlobal.argtypes = [ffi.LLVMValueRef,
+                                             POINTER(c_char_p)]
+ffi.lib.LLVMPY_MaterializeGlobal.restype = c_int
+
 ffi.lib.LLVMPY_FunctionAttributesIter.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_FunctionAttributesIter.restype = ffi.LLVMAttributeListIterator
 
@@ -516,3 +742,31 @@ ffi.lib.LLVMPY_OperandsIterNext.restype = ffi.LLVMValueRef
 
 ffi.lib.LLVMPY_GetOpcodeName.argtypes = [ffi.LLVMValueRef]
 ffi.lib.LLVMPY_GetOpcodeName.restype = c_void_p
+
+ffi.lib.LLVMPY_CountBlocks.argtypes = [ffi.LLVMValueRef]
+ffi.lib.LLVMPY_CountBlocks.restype = c_size_t
+
+ffi.lib.LLVMPY_GetBlocks.argtypes = [ffi.LLVMValueRef,
+                                     POINTER(ffi.LLVMValueRef)]
+
+ffi.lib.LLVMPY_CountInstructions.argtypes = [ffi.LLVMValueRef]
+ffi.lib.LLVMPY_CountInstructions.restype = c_size_t
+
+ffi.lib.LLVMPY_GetInstructions.argtypes = [ffi.LLVMValueRef,
+                                           POINTER(ffi.LLVMValueRef),
+                                           POINTER(c_uint),
+                                           POINTER(c_size_t)]
+
+ffi.lib.LLVMPY_CountOperands.argtypes = [POINTER(ffi.LLVMValueRef), c_size_t]
+ffi.lib.LLVMPY_CountOperands.restype = c_size_t
+
+ffi.lib.LLVMPY_GetOperands.argtypes = [POINTER(ffi.LLVMValueRef), c_size_t,
+                                       POINTER(ffi.LLVMValueRef),
+                                       POINTER(c_size_t)]
+
+ffi.lib.LLVMPY_GetValueNames.argtypes = [POINTER(ffi.LLVMValueRef), c_size_t,
+                                         c_char_p, POINTER(c_size_t)]
+ffi.lib.LLVMPY_GetValueNames.restype = c_size_t
+
+ffi.lib.LLVMPY_GetOpcodeNameOf.argtypes = [c_uint]
+ffi.lib.LLVMPY_GetOpcodeNameOf.restype = c_char_p
@@ -2,15 +2,19 @@ import ctypes
 from ctypes import CFUNCTYPE, c_int
 from ctypes.util import find_library
 import gc
+import hashlib
+import io
 import locale
+import mmap
 import os
 import platform
 import re
 import subprocess
 import sys
+import threading
 import unittest
 from contextlib import contextmanager
-from tempfile import mkstemp
+from tempfile import mkstemp, TemporaryDirectory
 
 from llvmlite import ir
 from llvmlite import binding as llvm
@@ -63,6 +67,50 @@ asm_sum2 = r"""
     }}
     """
 
+asm_sum_twice = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+
+    define i32 @sum(i32 %.1, i32 %.2) {{
+      %.3 = add i32 %.1, %.2
+      ret i32 %.3
+    }}
+
+    define i32 @sum_twice(i32 %.1, i32 %.2) {{
+      %.3 = call i32 @sum(i32 %.1, i32 %.2)
+      %.4 = mul i32 %.3, 2
+      ret i32 %.4
+    }}
+    """
+
+asm_parallel_opt = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+    %struct.pair = type {{ i32, i32 }}
+
+    @pair = constant %struct.pair {{ i32 3, i32 4 }}
+
+    define internal i32 @first(%struct.pair* %.1) {{
+      %.2 = getelementptr %struct.pair, %struct.pair* %.1, i32 0, i32 0
+      %.3 = load i32, i32* %.2
+      ret i32 %.3
+    }}
+
+    define i32 @second() {{
+      %.1 = getelementptr %struct.pair, %struct.pair* @pair, i32 0, i32 1
+      %.2 = load i32, i32* %.1
+      %.3 = add i32 %.2, 0
+      ret i32 %.3
+    }}
+
+    define i32 @total() {{
+      %.1 = call i32 @first(%struct.pair* @pair)
+      %.2 = call i32 @second()
+      %.3 = add i32 %.1, %.2
+      ret i32 %.3
+    }}
+    """
+
 asm_mul = r"""
     ; ModuleID = '<string>'
     target triple = "{triple}"
@@ -96,6 +144,53 @@ asm_verification_fail = r"""
     }}
     """
 
+asm_lazy_lib = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+
+    define internal i32 @helper(i32 %.1) {{
+      %.2 = add i32 %.1, 1
+      ret i32 %.2
+    }}
+
+    define i32 @used(i32 %.1) {{
+      %.2 = call i32 @helper(i32 %.1)
+      ret i32 %.2
+    }}
+
+    define i32 @unused(i32 %.1) {{
+      ret i32 %.1
+    }}
+    """
+
+asm_lazy_user = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+
+    declare i32 @used(i32 %.1)
+
+    define i32 @user(i32 %.1) {{
+      %.2 = call i32 @used(i32 %.1)
+      ret i32 %.2
+    }}
+    """
+
+asm_lazy_lib_user = r"""
+    ; ModuleID = '<string>'
+    target triple = "{triple}"
+
+    declare i32 @used(i32 %.1)
+
+    define i32 @indirect(i32 %.1) {{
+      %.2 = call i32 @used(i32 %.1)
+      ret i32 %.2
+    }}
+
+    define i32 @unused2(i32 %.1) {{
+      ret i32 %.1
+    }}
+    """
+
 asm_sum_declare = r"""
     ; ModuleID = '<string>'
     target triple = "{triple}"
@@ -104,6 +199,18 @@ asm_sum_declare = r"""
     """
 
 
+asm_call_callback = r"""
+    target triple = "{triple}"
+
+    declare i32 @__llvmlite_callback(i32)
+
+    define i32 @call_callback(i32 %x) {{
+      %r = call i32 @__llvmlite_callback(i32 %x)
+      ret i32 %r
+    }}
+    """
+
+
 asm_double_locale = r"""
     ; ModuleID = '<string>'
     target triple = "{triple}"
@@ -342,6 +449,67 @@ declare i8* @a_arg0_return_func(i8* returned, i32*)
 """
 
 
+asm_vexp = r"""
+    target triple = "{triple}"
+
+    declare double @exp(double)
+
+    define void @vexp(double* noalias %a, double* noalias %b, i64 %n) {{
+    entry:
+      %c = icmp sgt i64 %n, 0
+      br i1 %c, label %loop, label %exit
+    loop:
+      %i = phi i64 [0, %entry], [%i1, %loop]
+      %p = getelementptr inbounds double, double* %a, i64 %i
+      %x = load double, double* %p
+      %y = call fast double @exp(double %x)
+      %q = getelementptr inbounds double, double* %b, i64 %i
+      store double %y, double* %q
+      %i1 = add nsw i64 %i, 1
+      %d = icmp eq i64 %i1, %n
+      br i1 %d, label %exit, label %loop
+    exit:
+      ret void
+    }}
+    """
+
+
+asm_collatz = r"""
+    target triple = "{triple}"
+
+    define internal i64 @step(i64 %x) {{
+      %odd = and i64 %x, 1
+      %c = icmp eq i64 %odd, 0
+      br i1 %c, label %even, label %odd_{variant}
+    even:
+      %h = lshr i64 %x, 1
+      ret i64 %h
+    odd_a:
+      %t = mul i64 %x, 3
+      %t1 = add i64 %t, 1
+      ret i64 %t1
+    odd_b:
+      br label %odd_a
+    }}
+
+    define i64 @collatz(i64 %n) {{
+    entry:
+      br label %loop
+    loop:
+      %x = phi i64 [%n, %entry], [%y, %body]
+      %k = phi i64 [0, %entry], [%k1, %body]
+      %done = icmp ule i64 %x, 1
+      br i1 %done, label %exit, label %body
+    body:
+      %y = call i64 @step(i64 %x)
+      %k1 = add i64 %k, 1
+      br label %loop
+    exit:
+      ret i64 %k
+    }}
+    """
+
+
 # This produces the following output from objdump:
 #
 # $ objdump -D 632.elf
@@ -570,6 +738,12 @@ class TestMisc(BaseTest):
         addr = llvm.address_of_symbol("__foobar")
         self.assertIs(addr, None)
 
+    def test_dylib_add_symbols(self):
+        llvm.add_symbols({"__xyzzy_a": 1234, "__xyzzy_b": 5678})
+        llvm.add_symbols([("__xyzzy_a", 4321)])
+        self.assertEqual(llvm.address_of_symbol("__xyzzy_a"), 4321)
+        self.assertEqual(llvm.address_of_symbol("__xyzzy_b"), 5678)
+
     def test_get_default_triple(self):
         triple = llvm.get_default_triple()
         self.assertIsInstance(triple, str)
@@ -658,6 +832,10 @@ class TestMisc(BaseTest):
         got = str(m)
         # Changing the locale should not affect the LLVM IR
         self.assertEqual(expect, got)
+        # Nor streaming it, which doesn't reset the locale
+        out = io.StringIO()
+        m.write_ir(out)
+        self.assertEqual(expect, out.getvalue())
 
     def test_no_accidental_warnings(self):
         code = "from llvmlite import binding"
@@ -673,6 +851,42 @@ class TestModuleRef(BaseTest):
         s = str(mod).strip()
         self.assertTrue(s.startswith('; ModuleID ='), s)
 
+    def test_write_ir(self):
+        mod = self.module()
+        expected = str(mod)
+        # Through a file descriptor
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, 'ir.ll')
+            with open(path, 'w') as f:
+                f.write('; header\n')
+                mod.write_ir(f)
+            with open(path) as f:
+                self.assertEqual(f.read(), '; header\n' + expected)
+        # Through a callback
+        bytes_out = io.BytesIO()
+        mod.write_ir(bytes_out)
+        self.assertEqual(bytes_out.getvalue().decode('utf-8'), expected)
+        text_out = io.StringIO()
+        mod.write_ir(text_out)
+        self.assertEqual(text_out.getvalue(), expected)
+
+    def test_write_ir_error(self):
+        mod = self.module()
+
+        class Failing:
+            def write(self, data):
+                raise ZeroDivisionError
+
+        with self.assertRaises(ZeroDivisionError):
+            mod.write_ir(Failing())
+        r, w = os.pipe()
+        os.close(r)
+        try:
+            with self.assertRaises(OSError):
+                mod.write_ir(w)
+        finally:
+            os.close(w)
+
     def test_close(self):
         mod = self.module()
         str(mod)
@@ -783,6 +997,62 @@ class TestModuleRef(BaseTest):
         self.assertEqual(len(funcs), 1)
         self.assertEqual(funcs[0].name, "sum")
 
+    def test_get_functions(self):
+        mod = self.module(asm_lazy_lib)
+        funcs = mod.get_functions()
+        self.assertEqual([f.name for f in funcs],
+                         [f.name for f in mod.functions])
+        self.assertTrue(all(f.is_function for f in funcs))
+        self.assertIs(funcs[0].module, mod)
+        self.assertEqual(llvm.get_value_names(funcs),
+                         ["helper", "used", "unused"])
+
+    def test_get_global_variables(self):
+        mod = self.module()
+        globs = mod.get_global_variables()
+        self.assertEqual([g.name for g in globs],
+                         [g.name for g in mod.global_variables])
+        self.assertTrue(all(g.is_global for g in globs))
+
+    def test_summary(self):
+        mod = self.module(asm_lazy_lib)
+        summary = mod.summary()
+        self.assertEqual(summary.functions, [
+            llvm.FunctionSummary("helper", 1, 2, 0),
+            llvm.FunctionSummary("used", 1, 2, 1),
+            llvm.FunctionSummary("unused", 1, 1, 0),
+        ])
+        self.assertEqual(summary.opcodes, {"add": 1, "call": 1, "ret": 3})
+        self.assertEqual(summary.call_graph, {
+            "helper": {}, "used": {"helper": 1}, "unused": {}})
+
+    def test_fingerprint(self):
+        # Named struct types are renamed when parsed again in a context
+        # defining them, hence the fresh contexts
+        def fingerprint(asm=asm_sum):
+            return self.module(asm, llvm.create_context()).fingerprint()
+
+        fp = fingerprint()
+        self.assertRegex(fp, r'^[0-9a-f]{64}$')
+        self.assertEqual(fingerprint(), fp)
+        self.assertNotEqual(fingerprint(asm_sum2), fp)
+        mod = self.module(context=llvm.create_context())
+        mod.get_function("sum").linkage = llvm.Linkage.internal
+        self.assertNotEqual(mod.fingerprint(), fp)
+        # Lazily parsed modules are materialized first
+        bitcode = self.module(context=llvm.create_context()).as_bitcode()
+        lazy = llvm.parse_bitcode(bitcode, llvm.create_context(), lazy=True)
+        self.assertEqual(lazy.fingerprint(), fp)
+        self.assertEqual(hashlib.sha256(bitcode).hexdigest(), fp)
+
+    def test_stats(self):
+        mod = self.module(asm_lazy_lib)
+        self.assertEqual(mod.stats, llvm.ModuleStats(3, 0, 0, 3, 5))
+        mod = self.module(asm_sum_declare)
+        self.assertEqual(mod.stats, llvm.ModuleStats(0, 1, 0, 0, 0))
+        lazy = llvm.parse_bitcode(self.module().as_bitcode(), lazy=True)
+        self.assertEqual(lazy.stats, llvm.ModuleStats(1, 0, 4, 1, 3))
+
     def test_structs(self):
         mod = self.module()
         it = mod.struct_types
@@ -835,6 +1105,30 @@ class TestModuleRef(BaseTest):
         self.assertTrue(bc.startswith(bitcode_magic) or
                         bc.startswith(bitcode_wrapper_magic))
 
+    def test_as_bitcode_buffer(self):
+        mod = self.module()
+        buf = mod.as_bitcode_buffer()
+        self.assertIsInstance(buf, llvm.MemoryBuffer)
+        self.assertEqual(bytes(buf), mod.as_bitcode())
+        self.assertEqual(len(buf), len(mod.as_bitcode()))
+        view = buf.view()
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.tobytes(), mod.as_bitcode())
+        # The buffer can't be freed under the view
+        with self.assertRaises(BufferError):
+            buf.close()
+        view.release()
+        buf.close()
+        # A view keeps its buffer alive
+        view = mod.as_bitcode_buffer().view()
+        gc.collect()
+        self.assertEqual(view.tobytes(), mod.as_bitcode())
+
+    def test_as_ir_buffer(self):
+        mod = self.module()
+        with mod.as_ir_buffer() as buf:
+            self.assertEqual(bytes(buf).decode('utf-8'), str(mod))
+
     def test_parse_bitcode_error(self):
         with self.assertRaises(RuntimeError) as cm:
             llvm.parse_bitcode(b"")
@@ -858,6 +1152,101 @@ class TestModuleRef(BaseTest):
         mod.get_function("sum")
         mod.get_global_variable("glob")
 
+    def test_parse_bitcode_lazy(self):
+        bc = self.module(context=llvm.create_context()).as_bitcode()
+        mod = llvm.parse_bitcode(bc, llvm.create_context(), lazy=True)
+        fn = mod.get_function("sum")
+        self.assertTrue(fn.is_materializable)
+        self.assertFalse(fn.is_declaration)
+        fn.materialize()
+        self.assertFalse(fn.is_materializable)
+        self.assertEqual(len(list(fn.blocks)), 1)
+        # Operations on the whole module materialize it
+        self.assertEqual(mod.as_bitcode(), bc)
+
+    def test_link_in_lazy(self):
+        lib = llvm.parse_assembly(asm_lazy_lib.format(
+            triple=llvm.get_default_triple()), llvm.create_context())
+        bc = lib.as_bitcode()
+        context = llvm.create_context()
+        lib = llvm.parse_bitcode(bc, context, lazy=True)
+        self.assertTrue(lib.get_function("unused").is_materializable)
+        dest = self.module(asm_lazy_user, context=context)
+        dest.link_in(lib, only_needed=True)
+        self.assertEqual(sorted(f.name for f in dest.functions),
+                         ["helper", "used", "user"])
+        dest.verify()
+        self.assertFalse(dest.get_function("used").is_declaration)
+
+    def test_link_in_modules(self):
+        context = llvm.create_context()
+        libs = []
+        for asm in (asm_lazy_lib_user, asm_lazy_lib):
+            bc = self.module(asm, context=llvm.create_context()).as_bitcode()
+            libs.append(llvm.parse_bitcode(bc, context, lazy=True))
+        dest = self.module(asm_lazy_user.replace("@used", "@indirect"),
+                           context=context)
+        dest.link_in_modules(libs, only_needed=True, internalize=True)
+        dest.verify()
+        self.assertEqual(sorted(f.name for f in dest.functions),
+                         ["helper", "indirect", "used", "user"])
+        self.assertEqual(dest.get_function("user").linkage,
+                         llvm.Linkage.external)
+        for name in ("helper", "indirect", "used"):
+            self.assertEqual(dest.get_function(name).linkage,
+                             llvm.Linkage.internal)
+        with self.assertRaises(ctypes.ArgumentError):
+            libs[0].get_function("indirect")
+
+        context = llvm.create_context()
+        dest = self.module(context=context)
+        dest.link_in_modules([self.module(asm_mul, context=context)])
+        self.assertEqual(sorted(f.name for f in dest.functions),
+                         ["mul", "sum"])
+        self.assertEqual(dest.get_function("mul").linkage,
+                         llvm.Linkage.external)
+        dest.link_in_modules([])
+        with self.assertRaises(RuntimeError) as cm:
+            dest.link_in_modules([self.module(asm_sum2, context=context)])
+        self.assertIn("symbol multiply defined", str(cm.exception))
+
+    def test_parse_modules(self):
+        triple = llvm.get_default_triple()
+        bc = self.module(context=llvm.create_context()).as_bitcode()
+        ir = asm_mul.format(triple=triple)
+        context = llvm.create_context()
+        mods = llvm.parse_modules([bc, ir, ir.encode()], context)
+        self.assertEqual(len(mods), 3)
+        self.assertEqual(mods[0].as_bitcode(), bc)
+        self.assertEqual([f.name for f in mods[1].functions], ["mul"])
+        self.assertEqual([f.name for f in mods[2].functions], ["mul"])
+
+        mod = llvm.parse_modules([bc, ir], context, link=True)
+        self.assertEqual(sorted(f.name for f in mod.functions),
+                         ["mul", "sum"])
+
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.parse_modules([bc, asm_sum2.format(triple=triple)],
+                               link=True)
+        self.assertIn("symbol multiply defined", str(cm.exception))
+
+    def test_parse_modules_error(self):
+        ir = asm_mul.format(triple=llvm.get_default_triple())
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.parse_modules([ir, asm_parse_error])
+        self.assertIn("LLVM IR parsing error", str(cm.exception))
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.parse_modules_parallel([ir, b"BC\xc0\xde"])
+        self.assertIn("LLVM bitcode parsing error", str(cm.exception))
+
+    def test_parse_modules_parallel(self):
+        bc = self.module(context=llvm.create_context()).as_bitcode()
+        mods = llvm.parse_modules_parallel([bc] * 8, num_threads=4)
+        self.assertEqual(len(mods), 8)
+        self.assertEqual(len({id(m._context) for m in mods}), 8)
+        for mod in mods:
+            self.assertEqual(mod.as_bitcode(), bc)
+
     def test_cloning(self):
         m = self.module()
         cloned = m.clone()
@@ -1049,6 +1438,104 @@ class JITTestMixin(object):
         self.assertEqual(len(notifies), 0)
         self.assertEqual(len(getbuffers), 1)
 
+    def test_object_cache_notify_no_copy(self):
+        objects = []
+
+        def notify(mod, buf):
+            self.assertIsInstance(buf, memoryview)
+            self.assertTrue(buf.readonly)
+            objects.append(bytes(buf))
+
+        ee = self.jit(self.module())
+        ee.set_object_cache(notify, copy_notify=False)
+        self.get_sum(ee)
+        self.assertEqual(len(objects), 1)
+        self.assertGreater(len(objects[0]), 0)
+
+    def test_object_cache_getbuffer_no_copy(self):
+        objects = []
+
+        def notify(mod, buf):
+            objects.append(buf)
+
+        ee = self.jit(self.module())
+        ee.set_object_cache(notify)
+        self.get_sum(ee)
+        self.assertEqual(len(objects), 1)
+
+        fd, path = mkstemp()
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(objects[0])
+            with open(path, 'rb') as f:
+                mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+            # Buffers, read-only ones included, are lent to the engine
+            # until it is closed.
+            for buf in (bytearray(objects[0]), objects[0],
+                        memoryview(objects[0]), mm):
+                ee = self.jit(self.module(asm_mul))
+                ee.set_object_cache(notify, lambda mod: buf)
+                cfunc = self.get_sum(ee)
+                self.assertEqual(cfunc(2, -5), -3)
+                if isinstance(buf, bytearray):
+                    # The buffer is exported and can't be resized
+                    with self.assertRaises(BufferError):
+                        buf.append(0)
+                elif buf is mm:
+                    # The mapping is borrowed, not copied, so it can't
+                    # be unmapped
+                    with self.assertRaises(BufferError):
+                        mm.close()
+                ee.close()
+                if isinstance(buf, bytearray):
+                    buf.append(0)
+            mm.close()
+        finally:
+            os.unlink(path)
+        self.assertEqual(len(objects), 1)
+
+    def test_disk_object_cache(self):
+        with TemporaryDirectory() as path:
+            def run():
+                # As in a new process: the module's named types must not be
+                # renamed by a clash with those of a previous module.
+                context = llvm.create_context()
+                ee = self.jit(self.module(context=context))
+                cache = ee.set_disk_object_cache(path)
+                self.assertEqual(self.get_sum(ee)(2, -5), -3)
+                stats = cache.hits, cache.misses
+                ee.close()
+                return stats
+
+            self.assertEqual(run(), (0, 1))
+            files = os.listdir(path)
+            self.assertEqual(len(files), 1)
+            self.assertEqual(run(), (1, 0))
+            self.assertEqual(os.listdir(path), files)
+
+            # A different module gets its own entry
+            ee = self.jit(self.module(asm_mul))
+            cache = ee.set_disk_object_cache(path)
+            self.get_sum(ee, "mul")
+            self.assertEqual((cache.hits, cache.misses), (0, 1))
+            self.assertEqual(len(os.listdir(path)), 2)
+
+    def test_disk_object_cache_max_size(self):
+        with TemporaryDirectory() as path:
+            ee = self.jit(self.module())
+            ee.set_disk_object_cache(path, max_size=1)
+            self.get_sum(ee)
+            # A temporary file left behind by a crashed writer
+            with open(os.path.join(path, "llvmcache-stale.tmp"), "wb") as f:
+                f.write(b"xx")
+            # Opening the cache prunes it, and the budget is too small to
+            # keep anything
+            ee = self.jit(self.module())
+            ee.set_disk_object_cache(path, max_size=1)
+            self.assertEqual([f for f in os.listdir(path)
+                              if f.startswith("llvmcache-")], [])
+
 
 class JITWithTMTestMixin(JITTestMixin):
 
@@ -1075,6 +1562,13 @@ class JITWithTMTestMixin(JITTestMixin):
             # Sanity check
             self.assertIn(b"ELF", code_object[:10])
 
+    def test_emit_object_buffer(self):
+        target_machine = self.target_machine(jit=False)
+        mod = self.module()
+        with target_machine.emit_object_buffer(mod) as buf:
+            self.assertIsInstance(buf, llvm.MemoryBuffer)
+            self.assertEqual(bytes(buf), target_machine.emit_object(mod))
+
 
 class TestMCJit(BaseTest, JITWithTMTestMixin):
     """
@@ -1086,6 +1580,292 @@ class TestMCJit(BaseTest, JITWithTMTestMixin):
             target_machine = self.target_machine(jit=True)
         return llvm.create_mcjit_compiler(mod, target_machine)
 
+    @unittest.skipUnless(sys.platform.startswith('linux'),
+                         "perf maps are only written on Linux")
+    def test_perf_map(self):
+        path = "/tmp/perf-%d.map" % os.getpid()
+        existed = os.path.exists(path)
+        start = os.path.getsize(path) if existed else 0
+        if not existed:
+            self.addCleanup(os.remove, path)
+        ee = self.jit(self.module())
+        self.assertTrue(ee.enable_perf_events())
+        # Enabling again doesn't duplicate the entries
+        self.assertTrue(ee.enable_perf_events())
+        addr = ee.get_function_address("sum")
+        with open(path) as f:
+            f.seek(start)
+            entries = [line.split() for line in f]
+        self.assertEqual(len(entries), 1)
+        self.assertEqual(int(entries[0][0], 16), addr)
+        self.assertGreater(int(entries[0][1], 16), 0)
+        self.assertEqual(entries[0][2], "sum")
+
+    def test_symbols(self):
+        callback_type = CFUNCTYPE(c_int, c_int)
+        add_one = callback_type(lambda x: x + 1)
+        add_two = callback_type(lambda x: x + 2)
+
+        def call(symbols=None):
+            mod = self.module(asm_call_callback)
+            ee = self.jit(mod)
+            if symbols is not None:
+                ee.add_symbols(symbols)
+            ee.finalize_object()
+            cfunc = callback_type(ee.get_function_address("call_callback"))
+            return ee, cfunc(40)
+
+        llvm.add_symbol("__llvmlite_callback",
+                        ctypes.cast(add_one, ctypes.c_void_p).value)
+        ee, result = call()
+        self.assertEqual(result, 41)
+        # Symbols resolved by earlier engines are redefined
+        llvm.add_symbols({"__llvmlite_callback":
+                          ctypes.cast(add_two, ctypes.c_void_p).value})
+        ee, result = call()
+        self.assertEqual(result, 42)
+        # Symbols of an engine come first
+        ee, result = call([("__llvmlite_callback",
+                            ctypes.cast(add_one, ctypes.c_void_p).value)])
+        self.assertEqual(result, 41)
+
+    def test_memory_pool(self):
+        pool = llvm.create_memory_pool(slab_size=1 << 16)
+        self.assertEqual((pool.reserved, pool.in_use), (0, 0))
+
+        def run():
+            ee = llvm.create_mcjit_compiler(self.module(),
+                                            self.target_machine(jit=True),
+                                            memory_pool=pool)
+            self.assertEqual(self.get_sum(ee)(2, -5), -3)
+            # Sections of a module added after finalization go to new pages
+            ee.add_module(self.module(asm_mul))
+            self.assertEqual(self.get_sum(ee, "mul")(2, -5), -10)
+            glob = c_int.from_address(ee.get_global_value_address(
+                "mul_glob"))
+            glob.value = 42
+            return ee
+
+        ee = run()
+        reserved = pool.reserved
+        self.assertGreater(reserved, 0)
+        self.assertEqual(pool.in_use, reserved)
+        ee.close()
+        self.assertEqual((pool.reserved, pool.in_use), (reserved, 0))
+        # The slabs of disposed engines are reused
+        ee = run()
+        self.assertEqual((pool.reserved, pool.in_use), (reserved, reserved))
+        ee.close()
+        pool.trim()
+        self.assertEqual((pool.reserved, pool.in_use), (0, 0))
+
+    def test_memory_pool_huge_pages(self):
+        pool = llvm.create_memory_pool(huge_pages=True)
+        ee = llvm.create_mcjit_compiler(self.module(),
+                                        self.target_machine(jit=True),
+                                        memory_pool=pool)
+        # The engine keeps the pool alive
+        pool.close()
+        self.assertEqual(self.get_sum(ee)(2, -5), -3)
+        ee.close()
+
+    def anon_huge_pages(self, addr):
+        """
+        The kB of transparent huge pages backing the mapping that holds
+        *addr*, from /proc/self/smaps.
+        """
+        with open('/proc/self/smaps') as f:
+            inside = False
+            for line in f:
+                m = re.match(r'([0-9a-f]+)-([0-9a-f]+) ', line)
+                if m:
+                    start, end = (int(x, 16) for x in m.groups())
+                    inside = start <= addr < end
+                elif inside and line.startswith('AnonHugePages:'):
+                    return int(line.split()[1])
+        self.fail("no mapping holds %#x" % addr)
+
+    @unittest.skipUnless(sys.platform.startswith('linux'), "Linux only")
+    def test_memory_pool_huge_pages_backing(self):
+        try:
+            with open('/sys/kernel/mm/transparent_hugepage/enabled') as f:
+                thp = f.read()
+        except OSError:
+            self.skipTest("transparent huge pages are unsupported")
+        if '[never]' in thp:
+            self.skipTest("transparent huge pages are disabled")
+        pool = llvm.create_memory_pool(huge_pages=True)
+        ee = llvm.create_mcjit_compiler(self.module(),
+                                        self.target_machine(jit=True),
+                                        memory_pool=pool)
+        ee.finalize_object()
+        addr = ee.get_function_address("sum")
+        # Making the code executable must not split its huge page
+        self.assertGreaterEqual(self.anon_huge_pages(addr), 2048)
+        ee.close()
+        pool.close()
+
+
+class TestOrcLLJIT(BaseTest):
+    """
+    Test JIT engines created with create_lljit_compiler().
+    """
+    lazy = False
+
+    def jit(self, *mods, num_threads=0):
+        jit = llvm.create_lljit_compiler(self.target_machine(jit=True),
+                                         lazy=self.lazy,
+                                         num_threads=num_threads)
+        trackers = [jit.add_module(mod) for mod in mods]
+        return jit, trackers
+
+    def get_sum(self, jit, func_name="sum"):
+        cfptr = jit.get_function_address(func_name)
+        self.assertTrue(cfptr)
+        return CFUNCTYPE(c_int, c_int, c_int)(cfptr)
+
+    def test_run_code(self):
+        jit, _ = self.jit(self.module())
+        with jit:
+            self.assertEqual(self.get_sum(jit)(2, -5), -3)
+
+    def test_add_module_consumes(self):
+        mod = self.module()
+        jit, _ = self.jit(mod)
+        self.assertTrue(mod.closed)
+        jit.close()
+
+    def test_add_owned_module(self):
+        mod = self.module()
+        ee = llvm.create_mcjit_compiler(mod, self.target_machine(jit=True))
+        jit, _ = self.jit()
+        with self.assertRaises(ValueError):
+            jit.add_module(mod)
+        jit.close()
+        ee.close()
+
+    def test_add_module_move_context(self):
+        context = llvm.create_context()
+        mod = self.module(context=context)
+        other = self.module(asm_mul, context=context)
+        jit, _ = self.jit()
+        with jit:
+            # The context has another module
+            with self.assertRaises(ValueError):
+                jit.add_module(mod, move_context=True)
+            other.close()
+            jit.add_module(mod, move_context=True)
+            self.assertTrue(mod.closed)
+            self.assertTrue(context.closed)
+            self.assertEqual(self.get_sum(jit)(2, -5), -3)
+            with self.assertRaises(ValueError):
+                jit.add_module(self.module(asm_mul), move_context=True)
+
+    def test_multiple_modules(self):
+        jit, _ = self.jit(self.module(), self.module(asm_mul))
+        self.assertEqual(self.get_sum(jit)(2, -5), -3)
+        self.assertEqual(self.get_sum(jit, "mul")(2, -5), -10)
+        self.assertTrue(jit.get_global_value_address("mul_glob"))
+
+    def test_lookup_missing_symbol(self):
+        jit, _ = self.jit(self.module())
+        with self.assertRaises(RuntimeError) as raises:
+            jit.lookup("no_such_symbol")
+        self.assertIn("no_such_symbol", str(raises.exception))
+
+    @unittest.skipIf(llvm.llvm_version_info[0] < 12,
+                     "removing modules requires LLVM 12")
+    def test_remove_module(self):
+        jit, (tracker,) = self.jit(self.module())
+        self.assertEqual(self.get_sum(jit)(2, -5), -3)
+        tracker.remove()
+        with self.assertRaises(RuntimeError):
+            jit.lookup("sum")
+        # The symbol can be defined again
+        jit.add_module(self.module(asm_sum2))
+        self.assertEqual(self.get_sum(jit)(2, -5), -3)
+
+    def test_close_with_live_trackers(self):
+        jit, trackers = self.jit(self.module(), self.module(asm_mul))
+        jit.close()
+        for tracker in trackers:
+            self.assertTrue(tracker.closed)
+
+    def test_target_data(self):
+        jit, _ = self.jit()
+        td = jit.target_data
+        self.assertIs(jit.target_data, td)
+        self.assertEqual(str(td), str(self.target_machine(jit=True)
+                                      .target_data))
+        jit.close()
+
+    def test_call_between_functions(self):
+        jit, _ = self.jit(self.module(asm_sum_twice))
+        self.assertEqual(self.get_sum(jit, "sum_twice")(2, -5), -6)
+        self.assertEqual(self.get_sum(jit)(2, -5), -3)
+
+    def test_compile_async(self):
+        for num_threads in (0, 2):
+            jit, _ = self.jit(self.module(), self.module(asm_mul),
+                              num_threads=num_threads)
+            with jit:
+                fut = jit.compile_async(["sum", "mul"])
+                addrs = fut.result()
+                self.assertTrue(fut.done())
+                self.assertEqual(sorted(addrs), ["mul", "sum"])
+                sum_ = CFUNCTYPE(c_int, c_int, c_int)(addrs["sum"])
+                mul = CFUNCTYPE(c_int, c_int, c_int)(addrs["mul"])
+                self.assertEqual(sum_(2, -5), -3)
+                self.assertEqual(mul(2, -5), -10)
+                fut.close()
+
+    def test_compile_async_result_unlocked(self):
+        jit, _ = self.jit(self.module(), num_threads=2)
+        with jit:
+            fut = jit.compile_async(["sum"])
+            results = []
+            # Waiting mustn't need the lock held by other binding calls
+            with ffi.lib._lock:
+                waiter = threading.Thread(
+                    target=lambda: results.append(fut.result()))
+                waiter.start()
+                waiter.join(timeout=60)
+                blocked = waiter.is_alive()
+            waiter.join()
+            self.assertFalse(blocked)
+            self.assertEqual(list(results[0]), ["sum"])
+            fut.close()
+
+    def test_compile_async_missing_symbol(self):
+        jit, _ = self.jit(self.module(), num_threads=2)
+        with jit:
+            fut = jit.compile_async(["sum", "foobar"])
+            with self.assertRaises(RuntimeError) as cm:
+                fut.result()
+            self.assertIn("foobar", str(cm.exception))
+            fut.close()
+
+
+class TestOrcLLLazyJIT(TestOrcLLJIT):
+    """
+    Test JIT engines created with create_lljit_compiler(lazy=True).
+    """
+    lazy = True
+
+    @unittest.skipIf(llvm.llvm_version_info[0] < 12,
+                     "removing modules requires LLVM 12")
+    def test_remove_module(self):
+        jit, (tracker,) = self.jit(self.module())
+        self.assertEqual(self.get_sum(jit)(2, -5), -3)
+        tracker.remove()
+        with self.assertRaises(RuntimeError):
+            jit.lookup("sum")
+        # The stubs of a removed module are not reclaimed, so its symbols
+        # can't be defined again.
+        jit.add_module(self.module(asm_sum2))
+        with self.assertRaises(RuntimeError):
+            jit.lookup("sum")
+
 
 class TestValueRef(BaseTest):
 
@@ -1094,6 +1874,13 @@ class TestValueRef(BaseTest):
         glob = mod.get_global_variable("glob")
         self.assertEqual(str(glob), "@glob = global i32 0")
 
+    def test_write_ir(self):
+        mod = self.module()
+        fn = mod.get_function("sum")
+        out = io.StringIO()
+        fn.write_ir(out)
+        self.assertEqual(out.getvalue(), str(fn))
+
     def test_name(self):
         mod = self.module()
         glob = mod.get_global_variable("glob")
@@ -1268,6 +2055,39 @@ class TestValueRef(BaseTest):
         self.assertEqual(operands[1].name, '.2')
         self.assertEqual(str(operands[1].type), 'i32')
 
+    def test_bulk_introspection(self):
+        func = self.module().get_function('sum')
+        blocks = func.get_blocks()
+        self.assertEqual(len(blocks), 1)
+        self.assertTrue(blocks[0].is_block)
+        self.assertIs(blocks[0].function, func)
+
+        insts = func.get_instructions()
+        expected = list(blocks[0].instructions)
+        self.assertEqual([str(i) for i in insts], [str(i) for i in expected])
+        self.assertEqual([i.opcode for i in insts], ['add', 'add', 'ret'])
+        self.assertTrue(all(i.is_instruction for i in insts))
+        self.assertTrue(insts[0].block.is_block)
+        self.assertIs(insts[0].block.function, func)
+        self.assertEqual([str(i) for i in blocks[0].get_instructions()],
+                         [str(i) for i in expected])
+        self.assertEqual(llvm.get_value_names(insts), ['.3', '.4', ''])
+
+        operands = insts[0].get_operands()
+        self.assertEqual([str(op) for op in operands],
+                         [str(op) for op in insts[0].operands])
+        self.assertTrue(all(op.is_operand for op in operands))
+        self.assertIs(operands[0].instruction, insts[0])
+        self.assertEqual([len(ops) for ops in llvm.get_operand_lists(insts)],
+                         [2, 2, 1])
+
+        with self.assertRaises(ValueError):
+            insts[0].get_blocks()
+        with self.assertRaises(ValueError):
+            insts[0].get_instructions()
+        with self.assertRaises(ValueError):
+            func.get_operands()
+
     def test_function_attributes(self):
         mod = self.module(asm_attributes)
         for func in mod.functions:
@@ -1351,6 +2171,42 @@ class TestTargetData(BaseTest):
         self.assertEqual(td.get_element_offset(struct_type, 0), 0)
         self.assertEqual(td.get_element_offset(struct_type, 1), 8)
 
+    def test_get_struct_layouts(self):
+        td = self.target_data()
+        mod = self.module(r"""
+            %mixed = type {{ i8, i32, i64, i16 }}
+            %packed = type <{{ i8, i32 }}>
+            @m = global %mixed zeroinitializer
+            @p = global %packed zeroinitializer
+            """)
+        mixed = mod.get_global_variable("m").type.element_type
+        packed = mod.get_global_variable("p").type.element_type
+        struct = self.glob("glob_struct").type.element_type
+        layouts = td.get_struct_layouts([mixed, packed, struct, mixed])
+        self.assertEqual(layouts, [
+            llvm.StructLayout(24, 8, (0, 4, 8, 16)),
+            llvm.StructLayout(5, 1, (0, 1)),
+            llvm.StructLayout(24, 8, (0, 8)),
+            llvm.StructLayout(24, 8, (0, 4, 8, 16)),
+        ])
+        self.assertEqual(td.get_struct_layout(packed), layouts[1])
+        self.assertEqual(td.get_element_offset(mixed, 3), 16)
+        with self.assertRaises(ValueError):
+            td.get_struct_layout(self.glob().type)
+
+    def test_shared(self):
+        layout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+        td = llvm.create_target_data(layout, shared=True)
+        other = llvm.create_target_data(layout, shared=True)
+        self.assertEqual(ctypes.addressof(td._ptr.contents),
+                         ctypes.addressof(other._ptr.contents))
+        td.close()
+        self.assertEqual(str(other), layout)
+        llvm.clear_shared_targets()
+        glob = self.glob("glob_struct")
+        self.assertEqual(other.get_abi_size(glob.type.element_type), 24)
+        other.close()
+
 
 class TestTargetMachine(BaseTest):
 
@@ -1359,6 +2215,112 @@ class TestTargetMachine(BaseTest):
         pm = llvm.create_module_pass_manager()
         tm.add_analysis_passes(pm)
 
+    @unittest.skipIf(llvm.llvm_version_info[0] < 13,
+                     "LIBMVEC-X86 requires LLVM 13")
+    def test_get_vector_libraries(self):
+        libs = {lib.name: lib
+                for lib in llvm.get_vector_libraries("x86_64-pc-linux-gnu")}
+        self.assertIn("SVML", libs)
+        self.assertTrue(libs["LIBMVEC-X86"].supported)
+        self.assertFalse(libs["Accelerate"].supported)
+        libs = {lib.name: lib
+                for lib in llvm.get_vector_libraries("arm64-apple-macosx")}
+        self.assertTrue(libs["Accelerate"].supported)
+        self.assertFalse(libs["LIBMVEC-X86"].supported)
+        for lib in llvm.get_vector_libraries():
+            self.assertIsInstance(lib.loaded, bool)
+
+    @unittest.skipUnless(platform.machine().startswith('x86'), "only on x86")
+    @unittest.skipIf(llvm.llvm_version_info[0] < 13,
+                     "LIBMVEC-X86 requires LLVM 13")
+    def test_vector_library(self):
+        triple = "x86_64-unknown-linux-gnu"
+        tm = llvm.Target.from_triple(triple).create_target_machine(opt=3)
+
+        def vectorized(vector_library, new_pm):
+            mod = llvm.parse_assembly(asm_vexp.format(triple=triple))
+            if new_pm:
+                pm = llvm.create_new_module_pass_manager(tm, vector_library)
+                pm.add_default_pipeline(3)
+            else:
+                pm = llvm.create_module_pass_manager()
+                tm.add_analysis_passes(pm, vector_library)
+                pmb = llvm.create_pass_manager_builder()
+                pmb.opt_level = 3
+                pmb.loop_vectorize = True
+                pmb.populate(pm)
+            pm.run(mod)
+            return "_ZGVbN2v_exp" in str(mod)
+
+        for new_pm in (False, True):
+            self.assertFalse(vectorized(None, new_pm))
+            self.assertTrue(vectorized("LIBMVEC-X86", new_pm))
+        with self.assertRaises(ValueError):
+            tm.add_analysis_passes(llvm.create_module_pass_manager(), "vml")
+        # The failed pass managers are discarded cleanly
+        unraisable = []
+        old_hook = sys.unraisablehook
+        sys.unraisablehook = unraisable.append
+        try:
+            with self.assertRaises(ValueError):
+                llvm.create_new_function_pass_manager(tm, "vml")
+            with self.assertRaises(ctypes.ArgumentError):
+                llvm.create_new_module_pass_manager(object())
+            gc.collect()
+        finally:
+            sys.unraisablehook = old_hook
+        self.assertEqual(unraisable, [])
+
+    def test_shared(self):
+        target = llvm.Target.from_default_triple()
+
+        def address(tm):
+            return ctypes.addressof(tm._ptr.contents)
+
+        tm = target.create_target_machine(shared=True)
+        same = target.create_target_machine(shared=True)
+        self.assertEqual(address(same), address(tm))
+        other = target.create_target_machine(opt=3, shared=True)
+        self.assertNotEqual(address(other), address(tm))
+        with self.assertRaises(ValueError):
+            tm.set_asm_verbosity(True)
+
+        # Each thread gets its own instance
+        addresses = []
+        thread = threading.Thread(target=lambda: addresses.append(
+            address(target.create_target_machine(shared=True))))
+        thread.start()
+        thread.join()
+        self.assertNotEqual(addresses, [address(tm)])
+
+        # Instances are not handed out again once their thread has exited,
+        # even to a new thread with the same id
+        kept = []
+
+        def keep():
+            kept.append(target.create_target_machine(shared=True))
+
+        for _ in range(4):
+            thread = threading.Thread(target=keep)
+            thread.start()
+            thread.join()
+        self.assertEqual(len({address(t) for t in kept}), len(kept))
+        for t in kept:
+            t.close()
+
+        # Engines get their own copy, which they own
+        ee = llvm.create_mcjit_compiler(self.module(), tm)
+        self.assertFalse(tm._owned)
+        ee.close()
+        same.close()
+        llvm.clear_shared_targets()
+        self.assertIn("sum", tm.emit_assembly(self.module()))
+        tm.close()
+        other.close()
+        fresh = target.create_target_machine(shared=True)
+        self.assertIn("sum", fresh.emit_assembly(self.module()))
+        fresh.close()
+
     def test_target_data_from_tm(self):
         tm = self.target_machine(jit=False)
         td = tm.target_data
@@ -1535,6 +2497,69 @@ class TestModulePassManager(BaseTest, PassManagerTestMixin):
         self.assertIn("Passed", remarks)
         self.assertIn("inlineme", remarks)
 
+    def test_collect_remarks(self):
+        pm = self.pm()
+        pm.add_function_inlining_pass(0)
+        self.pmb().populate(pm)
+        mod = self.module(asm_inlineasm3)
+        with llvm.collect_remarks(remarks_filter="inline") as collector:
+            self.assertTrue(pm.run(mod))
+        remarks = collector.remarks
+        self.assertTrue(remarks)
+        remark = remarks[0]
+        self.assertIsInstance(remark, llvm.Remark)
+        self.assertEqual(remark.kind, llvm.RemarkKind.MISSED)
+        self.assertEqual(remark.pass_name, "inline")
+        self.assertEqual(remark.name, "NeverInline")
+        self.assertEqual(remark.function, "foo")
+        self.assertEqual((remark.file, remark.line, remark.column),
+                         ("test.c", 4, 5))
+        self.assertIn("noinline function attribute", remark.message)
+        self.assertIn(("Callee", "inlineme"), remark.args)
+
+        # Stopped collectors don't see remarks
+        pm.run(self.module(asm_inlineasm3))
+        self.assertEqual(len(collector.remarks), len(remarks))
+        collector.close()
+
+    def test_collect_remarks_filter(self):
+        pm = self.pm()
+        pm.add_function_inlining_pass(70)
+        self.pmb().populate(pm)
+        with llvm.collect_remarks(remarks_filter="nothing") as collector:
+            pm.run(self.module(asm_inlineasm2))
+        self.assertEqual(collector.remarks, [])
+        with llvm.collect_remarks(kinds=llvm.RemarkKind.MISSED) as collector:
+            pm.run(self.module(asm_inlineasm2))
+        self.assertNotIn(llvm.RemarkKind.PASSED,
+                         [r.kind for r in collector.remarks])
+        with self.assertRaises(ValueError):
+            llvm.collect_remarks(remarks_filter="(")
+
+    def test_collect_remarks_nested(self):
+        pm = self.pm()
+        pm.add_function_inlining_pass(0)
+        self.pmb().populate(pm)
+        outer = llvm.collect_remarks(remarks_filter="inline")
+        inner = llvm.collect_remarks(remarks_filter="inline")
+        with self.assertRaises(RuntimeError):
+            outer.stop()
+        pm.run(self.module(asm_inlineasm3))
+        self.assertTrue(inner.remarks)
+        inner.stop()
+        pm.run(self.module(asm_inlineasm3))
+        self.assertTrue(outer.remarks)
+        outer.stop()
+
+        # A collector disposed of out of order leaves the others working
+        outer = llvm.collect_remarks(remarks_filter="inline")
+        inner = llvm.collect_remarks(remarks_filter="inline")
+        outer.close()
+        pm.run(self.module(asm_inlineasm3))
+        self.assertTrue(inner.remarks)
+        inner.stop()
+        inner.close()
+
 
 class TestFunctionPassManager(BaseTest, PassManagerTestMixin):
 
@@ -1607,6 +2632,114 @@ class TestFunctionPassManager(BaseTest, PassManagerTestMixin):
         self.assertIn("licm", remarks)
 
 
+class TestNewModulePassManager(BaseTest):
+
+    def pm(self):
+        return llvm.create_new_module_pass_manager(
+            self.target_machine(jit=False))
+
+    def test_default_pipeline(self):
+        for opt_level, size_level in [(0, 0), (1, 0), (2, 0), (3, 0),
+                                      (2, 1), (2, 2)]:
+            pm = self.pm()
+            pm.add_default_pipeline(opt_level, size_level)
+            mod = self.module()
+            changed = pm.run(mod)
+            mod.verify()
+            fn = str(mod.get_function("sum"))
+            if opt_level == 0:
+                self.assertIn("%.4", fn)
+            else:
+                self.assertTrue(changed)
+                self.assertNotIn("%.4", fn)
+
+    def test_bad_opt_level(self):
+        pm = self.pm()
+        with self.assertRaises(ValueError):
+            pm.add_default_pipeline(4)
+        with self.assertRaises(ValueError):
+            pm.add_default_pipeline(2, 3)
+
+    def test_pipeline(self):
+        pm = llvm.create_new_module_pass_manager()
+        pm.add_pipeline("function(instcombine),globaldce")
+        mod = self.module()
+        self.assertTrue(pm.run(mod))
+        self.assertNotIn("%.4", str(mod.get_function("sum")))
+        # Running again on an optimized module changes nothing, and
+        # analyses from the previous run aren't reused.
+        self.assertFalse(pm.run(mod))
+
+    def test_bad_pipeline(self):
+        pm = self.pm()
+        with self.assertRaises(ValueError) as cm:
+            pm.add_pipeline("function(nosuchpass)")
+        self.assertIn("nosuchpass", str(cm.exception))
+
+    def test_refprune(self):
+        asm = """
+            declare void @NRT_incref(i8* %ptr)
+            declare void @NRT_decref(i8* %ptr)
+
+            define void @main(i8* %ptr) {{
+                call void @NRT_incref(i8* %ptr)
+                call void @NRT_decref(i8* %ptr)
+                ret void
+            }}
+            """
+        for add in (lambda pm: pm.add_refprune_pass(),
+                    lambda pm: pm.add_pipeline("function(refprune)")):
+            pm = self.pm()
+            add(pm)
+            mod = self.module(asm)
+            self.assertTrue(pm.run(mod))
+            self.assertNotIn("call", str(mod.get_function("main")))
+
+
+class TestNewFunctionPassManager(BaseTest):
+
+    def pm(self):
+        return llvm.create_new_function_pass_manager(
+            self.target_machine(jit=False))
+
+    def test_default_pipeline(self):
+        pm = self.pm()
+        pm.add_default_pipeline(2)
+        mod = self.module()
+        fn = mod.get_function("sum")
+        self.assertTrue(pm.run(fn))
+        self.assertNotIn("%.4", str(fn))
+
+    def test_pipeline(self):
+        pm = self.pm()
+        pm.add_pipeline("instcombine,refprune")
+        mod = self.module()
+        fn = mod.get_function("sum")
+        self.assertTrue(pm.run(fn))
+        self.assertNotIn("%.4", str(fn))
+        with self.assertRaises(ValueError):
+            pm.add_pipeline("globaldce")
+
+    def test_run_parallel(self):
+        pm = self.pm()
+        pm.add_default_pipeline(2)
+        mod = self.module(asm_parallel_opt)
+        total = mod.get_function("total")
+        self.assertTrue(pm.run_parallel(mod, num_threads=2))
+        mod.verify()
+        # Existing references stay valid, and struct types aren't duplicated
+        self.assertIn("tail call i32 @second()", str(total))
+        self.assertEqual([t.name for t in mod.struct_types], ["struct.pair"])
+        self.assertIn("ret i32 4", str(mod.get_function("second")))
+        self.assertNotIn("add", str(mod.get_function("second")))
+        self.assertNotIn("llvm.dbg.cu", str(mod))
+
+        ee = llvm.create_mcjit_compiler(mod, self.target_machine(jit=True))
+        cfunc = ctypes.CFUNCTYPE(ctypes.c_int32)(
+            ee.get_function_address("total"))
+        self.assertEqual(cfunc(), 7)
+
+
 class TestPasses(BaseTest, PassManagerTestMixin):
 
     def pm(self):
@@ -1762,6 +2895,95 @@ class TestTypeParsing(BaseTest):
             gv.initializer = ir.Constant(typ, [1])
 
 
+class TestLowerModule(BaseTest):
+
+    def lowered_module(self):
+        mod = ir.Module(context=ir.Context())
+        mod.triple = llvm.get_default_triple()
+        i32 = ir.IntType(32)
+        dbl = ir.DoubleType()
+        node = mod.context.get_identified_type("node")
+        node.set_body(i32, node.as_pointer())
+        gv = ir.GlobalVariable(mod, node, "head")
+        gv.initializer = ir.Constant(node, [1, node.as_pointer()(None)])
+        gv.align = 8
+        msg = ir.GlobalVariable(mod, ir.ArrayType(ir.IntType(8), 3), "msg")
+        msg.initializer = ir.Constant(msg.value_type, bytearray(b"hi\0"))
+        msg.global_constant = True
+        msg.linkage = "private"
+        addr = ir.GlobalVariable(mod, ir.IntType(64), "addr")
+        addr.initializer = gv.ptrtoint(ir.IntType(64))
+        ext = ir.Function(mod, ir.FunctionType(dbl, [dbl]), "ext")
+        ext.attributes.add("nounwind")
+
+        fn = ir.Function(mod, ir.FunctionType(dbl, [i32, i32.as_pointer()]),
+                         "loop")
+        fn.args[1].attributes.add("nocapture")
+        entry = fn.append_basic_block("entry")
+        body = fn.append_basic_block("body")
+        exit = fn.append_basic_block("exit")
+        builder = ir.IRBuilder(entry)
+        builder.branch(body)
+        builder.position_at_end(body)
+        i = builder.phi(i32, "i")
+        acc = builder.phi(dbl, "acc")
+        ptr = builder.gep(fn.args[1], [i], inbounds=True, name="ptr")
+        val = builder.load(ptr, "val", align=4)
+        conv = builder.sitofp(val, dbl, "conv")
+        acc2 = builder.fadd(acc, conv, "acc2", flags=["fast"])
+        builder.atomic_rmw("add", ptr, val, "monotonic", "old")
+        call = builder.call(ext, [acc2], "call", tail=True)
+        call.set_metadata("annotation",
+                          mod.add_metadata([ir.MetaDataString(mod, "x")]))
+        i2 = builder.add(i, i32(1), "i2", flags=["nsw"])
+        done = builder.icmp_signed(">=", i2, fn.args[0], "done")
+        builder.cbranch(done, exit, body)
+        # Incoming values defined after the phis
+        i.add_incoming(i32(0), entry)
+        i.add_incoming(i2, body)
+        acc.add_incoming(dbl(0.0), entry)
+        acc.add_incoming(call, body)
+        builder.position_at_end(exit)
+        builder.ret(acc2)
+        mod.add_named_metadata("names", [i32(42)])
+        return mod
+
+    def test_lower_module(self):
+        mod = self.lowered_module()
+        expected = str(llvm.parse_assembly(str(mod), llvm.create_context()))
+        context = llvm.create_context()
+        # Without falling back to the textual IR
+        lowered = llvm.irlowering._lower_module(mod, context)
+        self.assertEqual(str(lowered), expected)
+        lowered.verify()
+        self.assertEqual(str(llvm.lower_module(mod)), expected)
+
+    def test_lower_module_fallback(self):
+        mod = self.lowered_module()
+        # Block addresses are only handled by the textual IR
+        fn = ir.Function(mod, ir.FunctionType(ir.VoidType(), []), "jump")
+        entry = fn.append_basic_block("entry")
+        target = fn.append_basic_block("target")
+        builder = ir.IRBuilder(entry)
+        br = builder.branch_indirect(ir.BlockAddress(fn, target))
+        br.add_destination(target)
+        builder.position_at_end(target)
+        builder.ret_void()
+        with self.assertRaises(llvm.irlowering._Unsupported):
+            llvm.irlowering._lower_module(mod, llvm.create_context())
+        expected = str(llvm.parse_assembly(str(mod), llvm.create_context()))
+        lowered = llvm.lower_module(mod, llvm.create_context())
+        self.assertEqual(str(lowered), expected)
+
+    def test_lower_module_error(self):
+        mod = ir.Module()
+        fn = ir.Function(mod, ir.FunctionType(ir.VoidType(), []), "decl")
+        fn.set_metadata("something", mod.add_metadata([]))
+        with self.assertRaises(RuntimeError) as cm:
+            llvm.lower_module(mod)
+        self.assertIn("LLVM IR parsing error", str(cm.exception))
+
+
 class TestGlobalConstructors(TestMCJit):
     def test_global_ctors_dtors(self):
         # test issue #303
@@ -1853,6 +3075,115 @@ class TestInlineAsm(BaseTest):
         self.assertIn('nop', asm)
 
 
+@unittest.skipUnless(platform.machine().startswith('x86'), "only on x86")
+@unittest.skipIf(llvm.llvm_version_info[0] < 14,
+                 "function multiversioning requires LLVM 14")
+class TestMultiversion(BaseTest):
+
+    def module(self, asm=asm_lazy_lib, triple="x86_64-unknown-linux-gnu"):
+        return llvm.parse_assembly(asm.format(triple=triple))
+
+    def test_multiversion_functions(self):
+        mod = self.module()
+        llvm.multiversion_functions(mod, ["helper", "unused"], [
+            ("skylake-avx512", ""), ("", "+avx2,+fma")])
+        mod.verify()
+        ir = str(mod)
+        self.assertIn("@helper = internal ifunc i32 (i32), "
+                      "i32 (i32)* ()* @helper.resolver", ir)
+        self.assertIn("@unused = ifunc", ir)
+        for name in ("helper.0", "helper.1", "helper.default",
+                     "unused.0", "unused.1", "unused.default"):
+            self.assertEqual(mod.get_function(name).linkage,
+                             llvm.Linkage.internal)
+        self.assertIn('"target-cpu"="skylake-avx512"', ir)
+        self.assertIn('"target-features"="+avx2,+fma"', ir)
+        # Callers go through the dispatch
+        self.assertIn("call i32 @helper(i32 %.1)", ir)
+        self.assertIn("call void @__cpu_indicator_init()", ir)
+        tm = llvm.Target.from_triple(mod.triple).create_target_machine(
+            reloc="pic", codemodel="default")
+        self.assertTrue(tm.emit_object(mod))
+
+    def test_errors(self):
+        with self.assertRaisesRegex(RuntimeError, "x86 ELF target"):
+            llvm.multiversion_functions(
+                self.module(triple="x86_64-apple-macosx10.15"), ["used"],
+                [("haswell", "")])
+        with self.assertRaisesRegex(RuntimeError, "no function defined"):
+            llvm.multiversion_functions(self.module(), ["missing"],
+                                        [("haswell", "")])
+        with self.assertRaisesRegex(RuntimeError, "unknown x86 CPU"):
+            llvm.multiversion_functions(self.module(), ["used"],
+                                        [("not-a-cpu", "")])
+        with self.assertRaisesRegex(RuntimeError, "no features"):
+            llvm.multiversion_functions(self.module(), ["used"],
+                                        [("", "+cx16")])
+
+
+class TestProfiling(BaseTest):
+
+    def module(self, variant="a"):
+        return llvm.parse_assembly(asm_collatz.format(
+            triple=llvm.get_process_triple(), variant=variant))
+
+    def run_collatz(self, mod, n=27):
+        tm = self.target_machine(jit=True)
+        ee = llvm.create_mcjit_compiler(mod, tm)
+        ee.finalize_object()
+        cfunc = CFUNCTYPE(ctypes.c_int64, ctypes.c_int64)(
+            ee.get_function_address("collatz"))
+        self.assertEqual(cfunc(n), 111)
+        return ee
+
+    def test_profile(self):
+        mod = self.module()
+        instrumentation = llvm.instrument_module(mod)
+        mod.verify()
+        funcs = {f.name: f for f in instrumentation.functions}
+        self.assertEqual(sorted(funcs), ["<string>:step", "collatz"])
+        self.assertEqual(funcs["collatz"].num_counters, 2)
+
+        ee = self.run_collatz(mod)
+        profile = llvm.create_profile_data()
+        profile.add_counters(instrumentation, ee)
+        self.assertEqual(profile.get_counts("collatz"), [111, 1])
+        self.assertEqual(profile.get_counts("<string>:step"), [70, 41])
+        self.assertIsNone(profile.get_counts("sum"))
+        # The counters were reset
+        profile.add_counters(instrumentation, ee, weight=2)
+        self.assertEqual(profile.get_counts("collatz"), [111, 1])
+
+        with TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "collatz.profdata")
+            profile.write(path)
+            loaded = llvm.load_profile_data(path)
+        loaded.merge(profile, weight=2)
+        self.assertEqual(loaded.get_counts("collatz"), [333, 3])
+
+        fresh = self.module()
+        self.assertEqual(profile.apply(fresh), [])
+        fresh.verify()
+        ir = str(fresh)
+        self.assertIn('!"ProfileSummary"', ir)
+        self.assertIn('!{!"branch_weights", i32 70, i32 41}', ir)
+        self.assertIn('!{!"function_entry_count", i64 1}', ir)
+
+        changed = self.module(variant="b")
+        warnings = profile.apply(changed)
+        self.assertEqual(len(warnings), 1)
+        self.assertIn("hash mismatch", warnings[0])
+
+    def test_errors(self):
+        mod = self.module()
+        llvm.instrument_module(mod)
+        with self.assertRaisesRegex(RuntimeError, "already instrumented"):
+            llvm.instrument_module(mod)
+        with TemporaryDirectory() as tmpdir:
+            with self.assertRaises(RuntimeError):
+                llvm.load_profile_data(os.path.join(tmpdir, "missing"))
+
+
 class TestObjectFile(BaseTest):
 
     mod_asm = """
@@ -1882,6 +3213,7 @@ class TestObjectFile(BaseTest):
                 self.assertIsNotNone(s.name())
                 self.assertTrue(s.size() > 0)
                 self.assertTrue(len(s.data()) > 0)
+                self.assertEqual(s.data_view().tobytes(), s.data())
                 self.assertIsNotNone(s.address())
                 self.assertTrue(last_address < s.address())
                 last_address = s.address()
@@ -1904,6 +3236,26 @@ class TestObjectFile(BaseTest):
 
         self.assertEqual(sum_twice(2, 3), 10)
 
+    def test_emit_objects(self):
+        target_machine = self.target_machine(jit=False)
+        mod = self.module(asm_sum_twice)
+        mod.get_function("sum").linkage = "internal"
+        before = str(mod)
+        objs = target_machine.emit_objects(mod, 2)
+        self.assertEqual(len(objs), 2)
+        self.assertEqual(str(mod), before)
+
+        jit = llvm.create_mcjit_compiler(self.module(self.mod_asm),
+                                         target_machine)
+        for obj in objs:
+            jit.add_object_file(llvm.ObjectFileRef.from_data(obj))
+        sum_twice = CFUNCTYPE(c_int, c_int, c_int)(
+            jit.get_function_address("sum_twice"))
+        self.assertEqual(sum_twice(2, 3), 10)
+
+        with self.assertRaises(ValueError):
+            target_machine.emit_objects(mod, 0)
+
     def test_add_object_file_from_filesystem(self):
         target_machine = self.target_machine(jit=False)
         mod = self.module()
@@ -1965,6 +3317,47 @@ class TestTimePasses(BaseTest):
         # Returns empty str if no data is collected
         self.assertFalse(llvm.report_and_reset_timings())
 
+    def test_new_pass_manager_timings(self):
+        pm = llvm.create_new_module_pass_manager()
+        pm.add_pipeline("function(instcombine),globaldce")
+        self.assertEqual(pm.take_timings(), [])
+        pm.enable_timings()
+        pm.run(self.module())
+        timings = pm.take_timings()
+        self.assertEqual([t.pass_name for t in timings],
+                         ["InstCombinePass", "GlobalDCEPass"])
+        instcombine, globaldce = timings
+        self.assertEqual(instcombine.ir_name, "sum")
+        self.assertEqual(instcombine.instructions_before, 3)
+        self.assertEqual(instcombine.instructions_after, 2)
+        self.assertEqual(globaldce.ir_name, "<string>")
+        for t in timings:
+            self.assertIsInstance(t, llvm.PassTiming)
+            self.assertGreaterEqual(t.wall_time, 0)
+            self.assertGreaterEqual(t.user_time, 0)
+        self.assertEqual(pm.take_timings(), [])
+
+        # Sampling
+        pm.enable_timings(sample_every=2)
+        for i in range(3):
+            pm.run(self.module())
+        self.assertEqual(len(pm.take_timings()), 3)
+        with self.assertRaises(ValueError):
+            pm.enable_timings(0)
+
+        pm.disable_timings()
+        pm.run(self.module())
+        self.assertEqual(pm.take_timings(), [])
+
+    def test_parallel_timings(self):
+        pm = llvm.create_new_function_pass_manager()
+        pm.add_pipeline("instcombine")
+        pm.enable_timings()
+        pm.run_parallel(self.module(asm_parallel_opt), num_threads=2)
+        timings = pm.take_timings()
+        self.assertEqual(sorted(t.ir_name for t in timings),
+                         ["first", "second", "total"])
+
 
 class TestLLVMLockCallbacks(BaseTest):
     def test_lock_callbacks(self):
@@ -1,3 +1,4 @@
+import threading
 import unittest
 from llvmlite import ir
 from llvmlite import binding as llvm
@@ -158,6 +159,33 @@ class TestRefPrunePass(TestCase):
         locals()[name] = case
 
 
+class TestRefPrunePassNewPM(TestRefPrunePass):
+    """
+    Same as TestRefPrunePass, using the new pass manager.
+    """
+
+    def apply_refprune(self, irmod):
+        mod = llvm.parse_assembly(str(irmod))
+        pm = llvm.create_new_module_pass_manager()
+        pm.add_refprune_pass()
+        pm.run(mod)
+        return mod
+
+
+class TestRefPrunePassWorklist(TestRefPrunePass):
+    """
+    Same as TestRefPrunePass, using the worklist pruner.
+    """
+
+    def apply_refprune(self, irmod):
+        mod = llvm.parse_assembly(str(irmod))
+        pm = llvm.ModulePassManager()
+        pm.add_refprune_pass(llvm.RefPruneSubpasses.ALL |
+                             llvm.RefPruneSubpasses.WORKLIST)
+        pm.run(mod)
+        return mod
+
+
 class BaseTestByIR(TestCase):
     refprune_bitmask = 0
 
@@ -345,6 +373,28 @@ bb_D:
         mod, stats = self.check(self.per_diamond_5)
         self.assertEqual(stats.diamond, 4)
 
+    per_diamond_6 = r"""
+define void @main(i8* %ptr, i8* %other) {
+bb_A:
+    call void @NRT_incref(i8* %ptr)
+    br label %bb_B
+bb_B:
+    call void @NRT_incref(i8* %other)
+    br label %bb_C
+bb_C:
+    call void @NRT_decref(i8* %other)
+    br label %bb_D
+bb_D:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_per_diamond_6(self):
+        # The outer pair can only be pruned once the inner one is
+        mod, stats = self.check(self.per_diamond_6)
+        self.assertEqual(stats.diamond, 4)
+
 
 class TestFanout(BaseTestByIR):
     """More complex cases are tested in TestRefPrunePass
@@ -416,6 +466,88 @@ bb_C:
         mod, stats = self.check(self.fanout_3, subgraph_limit=1)
         self.assertEqual(stats.fanout, 0)
 
+    # The increfs of %ptr_b fail, those of %ptr_a don't
+    fanout_4 = r"""
+define void @main(i8* %ptr_a, i8* %ptr_b, i1 %cond) {
+bb_A:
+    call void @NRT_incref(i8* %ptr_b)
+    call void @NRT_incref(i8* %ptr_a)
+    br i1 %cond, label %bb_B, label %bb_C
+bb_B:
+    call void @NRT_decref(i8* %ptr_a)
+    ret void
+bb_C:
+    call void @NRT_decref(i8* %ptr_a)
+    call void @NRT_decref(i8* %ptr_b)
+    ret void
+}
+"""
+
+    def test_fanout_4(self):
+        mod, stats = self.check(self.fanout_4)
+        self.assertEqual(stats.fanout, 3)
+        self.assertIn("call void @NRT_incref(i8* %ptr_b)", str(mod))
+        self.assertNotIn("call void @NRT_incref(i8* %ptr_a)", str(mod))
+
+    # The paths to the decrefs may be arbitrarily long
+    fanout_5 = r"""
+define void @main(i8* %ptr, i1 %cond) {
+bb_A:
+    call void @NRT_incref(i8* %ptr)
+    br i1 %cond, label %bb_0, label %bb_C
+bb_0:
+    br label %bb_1
+bb_1:
+    br label %bb_2
+bb_2:
+    br label %bb_3
+bb_3:
+    br label %bb_4
+bb_4:
+    br label %bb_5
+bb_5:
+    br label %bb_6
+bb_6:
+    br label %bb_7
+bb_7:
+    br label %bb_8
+bb_8:
+    br label %bb_9
+bb_9:
+    br label %bb_10
+bb_10:
+    br label %bb_11
+bb_11:
+    br label %bb_12
+bb_12:
+    br label %bb_13
+bb_13:
+    br label %bb_14
+bb_14:
+    br label %bb_15
+bb_15:
+    br label %bb_16
+bb_16:
+    br label %bb_17
+bb_17:
+    br label %bb_18
+bb_18:
+    br label %bb_19
+bb_19:
+    br label %bb_20
+bb_20:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+bb_C:
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def test_fanout_5(self):
+        mod, stats = self.check(self.fanout_5)
+        self.assertEqual(stats.fanout, 3)
+
 
 class TestFanoutRaise(BaseTestByIR):
     refprune_bitmask = llvm.RefPruneSubpasses.FANOUT_RAISE
@@ -522,5 +654,127 @@ common.ret:
         self.assertEqual(stats.fanout_raise, 2)
 
 
+class TestPerBBWorklist(TestPerBB):
+    refprune_bitmask = (llvm.RefPruneSubpasses.PER_BB |
+                        llvm.RefPruneSubpasses.WORKLIST)
+
+
+class TestDiamondWorklist(TestDiamond):
+    refprune_bitmask = (llvm.RefPruneSubpasses.DIAMOND |
+                        llvm.RefPruneSubpasses.WORKLIST)
+
+
+class TestFanoutWorklist(TestFanout):
+    refprune_bitmask = (llvm.RefPruneSubpasses.FANOUT |
+                        llvm.RefPruneSubpasses.WORKLIST)
+
+
+class TestFanoutRaiseWorklist(TestFanoutRaise):
+    refprune_bitmask = (llvm.RefPruneSubpasses.FANOUT_RAISE |
+                        llvm.RefPruneSubpasses.WORKLIST)
+
+
+class TestRefPruneStats(BaseTestByIR):
+    refprune_bitmask = llvm.RefPruneSubpasses.ALL
+
+    stats_ir = r"""
+define void @main(i8* %ptr) {
+    call void @NRT_incref(i8* %ptr)
+    call void @NRT_decref(i8* %ptr)
+    ret void
+}
+"""
+
+    def run_pm(self, pm):
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}")
+        pm.run(mod)
+
+    def test_global_stats(self):
+        pm = llvm.ModulePassManager()
+        pm.add_refprune_pass(self.refprune_bitmask)
+        before = llvm.dump_refprune_stats()
+        self.run_pm(pm)
+        after = llvm.dump_refprune_stats()
+        self.assertEqual(after - before, pm.get_refprune_stats())
+        llvm.reset_refprune_stats()
+        self.assertEqual(llvm.dump_refprune_stats(),
+                         llvm.PruneStats(0, 0, 0, 0))
+
+    def test_matches_global_stats(self):
+        # The statistics of a pass manager are those check() reports
+        for case, ir in [(TestPerBB, TestPerBB.per_bb_ir_1),
+                         (TestDiamond, TestDiamond.per_diamond_1),
+                         (TestFanout, TestFanout.fanout_1),
+                         (TestFanoutRaise, TestFanoutRaise.fanout_raise_1)]:
+            mod = llvm.parse_assembly(f"{self.prologue}\n{ir}")
+            pm = llvm.ModulePassManager()
+            pm.add_refprune_pass(case.refprune_bitmask)
+            before = llvm.dump_refprune_stats()
+            pm.run(mod)
+            after = llvm.dump_refprune_stats()
+            self.assertEqual(pm.get_refprune_stats(), after - before)
+            self.assertNotEqual(pm.get_refprune_stats(),
+                                llvm.PruneStats(0, 0, 0, 0))
+
+    def test_per_pass_manager(self):
+        pm1 = llvm.ModulePassManager()
+        pm1.add_refprune_pass(self.refprune_bitmask)
+        pm2 = llvm.ModulePassManager()
+        pm2.add_refprune_pass(self.refprune_bitmask)
+        self.assertEqual(pm1.get_refprune_stats(),
+                         llvm.PruneStats(0, 0, 0, 0))
+        self.run_pm(pm1)
+        self.run_pm(pm1)
+        self.assertEqual(pm1.get_refprune_stats().basicblock, 4)
+        self.assertEqual(pm2.get_refprune_stats().basicblock, 0)
+        self.assertEqual(pm1.get_refprune_stats(reset=True).basicblock, 4)
+        self.assertEqual(pm1.get_refprune_stats().basicblock, 0)
+
+    def test_new_pass_manager(self):
+        pm = llvm.create_new_module_pass_manager()
+        pm.add_refprune_pass(self.refprune_bitmask)
+        pm.add_pipeline('function(refprune)')
+        self.run_pm(pm)
+        self.assertEqual(pm.get_refprune_stats().basicblock, 2)
+
+        fpm = llvm.create_new_function_pass_manager()
+        fpm.add_pipeline('refprune')
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}\n"
+                                  f"{self.stats_ir.replace('main', 'aux')}")
+        fpm.run(mod.get_function('main'))
+        self.assertEqual(fpm.get_refprune_stats(reset=True).basicblock, 2)
+        # The passes of the partitions count into the same statistics
+        mod = llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}\n"
+                                  f"{self.stats_ir.replace('main', 'aux')}")
+        fpm.run_parallel(mod, num_threads=2)
+        self.assertEqual(fpm.get_refprune_stats().basicblock, 4)
+
+    def test_threads(self):
+        nthreads = 4
+        nruns = 20
+        pms = [llvm.ModulePassManager() for _ in range(nthreads)]
+        for pm in pms:
+            pm.add_refprune_pass(self.refprune_bitmask)
+        mods = [[llvm.parse_assembly(f"{self.prologue}\n{self.stats_ir}",
+                                     context=llvm.create_context())
+                 for _ in range(nruns)] for _ in range(nthreads)]
+
+        def run(pm, mods):
+            for mod in mods:
+                pm.run(mod)
+
+        before = llvm.dump_refprune_stats()
+        threads = [threading.Thread(target=run, args=args)
+                   for args in zip(pms, mods)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        after = llvm.dump_refprune_stats()
+        for pm in pms:
+            self.assertEqual(pm.get_refprune_stats().basicblock, 2 * nruns)
+        self.assertEqual((after - before).basicblock, 2 * nruns * nthreads)
+
+
 if __name__ == '__main__':
     unittest.main()